@@ -910,7 +910,12 @@ void UpdateEntryCommand::Doit(const CUUID &entry_uuid,
 {
   ItemListIter pos = m_pcomInt->Find(entry_uuid);
   if (pos != m_pcomInt->GetEntryEndIter()) {
-    if (ftype != CItemData::PASSWORD)
+    if (ftype == CItemData::GROUP || ftype == CItemData::TITLE ||
+        ftype == CItemData::USER) {
+      m_pcomInt->RemoveFromGTUIndex(pos->second);
+      pos->second.SetFieldValue(ftype, value);
+      m_pcomInt->AddToGTUIndex(pos->second);
+    } else if (ftype != CItemData::PASSWORD)
       pos->second.SetFieldValue(ftype, value);
     else {
       time_t tttoldXtime;
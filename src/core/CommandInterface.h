@@ -75,6 +75,10 @@ class CommandInterface {
 
   virtual void AddChangedNodes(const StringX &path) = 0;
   virtual void AddChangedEmptyGroups(const StringX &path) = 0;
+
+  // Used when an entry's group, title or user is changed in place
+  virtual void AddToGTUIndex(const CItemData &ci) = 0;
+  virtual void RemoveFromGTUIndex(const CItemData &ci) = 0;
   
   virtual const CItemData *GetBaseEntry(const CItemData *pAliasOrSC) const = 0;
   virtual const ItemMMap &GetBase2AliasesMmap() const = 0;
@@ -549,9 +549,7 @@ int PWScore::WriteXMLFile(const StringX &filename,
     ofs << "\"" << endl;
   }
 
-  CUUID huuid(*m_hdr.m_file_uuid.GetARep(), true); // true to print canonically
-
-  ofs << "Database_uuid=\"" << huuid << "\"" << endl;
+  ofs << "Database_uuid=\"" << m_hdr.m_file_uuid.Canonical() << "\"" << endl;
   ofs << "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"" << endl;
   ofs << "xsi:noNamespaceSchemaLocation=\"pwsafe.xsd\">" << endl;
   ofs << endl;
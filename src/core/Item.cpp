@@ -17,26 +17,81 @@
 #include "os/env.h"
 
 #include <vector>
+#include <memory>
+
+namespace {
+  /**
+   * Fields of all CItems are protected by a single BlowFish, keyed with a
+   * random session key on first use. Setting up a BlowFish is expensive
+   * (~4KB of S-boxes plus the key schedule), so doing it per item made
+   * large databases slow to sort/search and costly in memory.
+   */
+  const BlowFish &GetSessionFish()
+  {
+    static const std::unique_ptr<BlowFish> session_fish([] {
+        unsigned char key[32];
+        PWSrand::GetInstance()->GetRandomData(key, sizeof(key));
+        BlowFish *retval = BlowFish::MakeBlowFish(key, sizeof(key));
+        trashMemory(key, sizeof(key));
+        return retval;
+      }());
+    return *session_fish;
+  }
+
+  /**
+   * Fish handed to CItemField by CItem: the session BlowFish with the
+   * item's tweak XORed in before and after each block.
+   * Cheap enough to build on the stack for each field access.
+   */
+  class ItemFish : public Fish
+  {
+  public:
+    explicit ItemFish(const unsigned char *tweak)
+      : m_bf(GetSessionFish()), m_tweak(tweak) {}
+    unsigned int GetBlockSize() const {return BlowFish::BLOCKSIZE;}
+
+    void Encrypt(const unsigned char *pt, unsigned char *ct) const
+    {
+      unsigned char tmp[BlowFish::BLOCKSIZE];
+      for (unsigned int i = 0; i < BlowFish::BLOCKSIZE; i++)
+        tmp[i] = pt[i] ^ m_tweak[i];
+      m_bf.Encrypt(tmp, ct);
+      for (unsigned int i = 0; i < BlowFish::BLOCKSIZE; i++)
+        ct[i] ^= m_tweak[i];
+      trashMemory(tmp, sizeof(tmp));
+    }
+
+    void Decrypt(const unsigned char *ct, unsigned char *pt) const
+    {
+      unsigned char tmp[BlowFish::BLOCKSIZE];
+      for (unsigned int i = 0; i < BlowFish::BLOCKSIZE; i++)
+        tmp[i] = ct[i] ^ m_tweak[i];
+      m_bf.Decrypt(tmp, pt);
+      for (unsigned int i = 0; i < BlowFish::BLOCKSIZE; i++)
+        pt[i] ^= m_tweak[i];
+      trashMemory(tmp, sizeof(tmp));
+    }
+
+  private:
+    const BlowFish &m_bf;
+    const unsigned char *m_tweak;
+  };
+}
 
 CItem::CItem()
 {
-  PWSrand::GetInstance()->GetRandomData( m_key, sizeof(m_key) );
+  PWSrand::GetInstance()->GetRandomData(m_tweak, sizeof(m_tweak));
 }
 
 CItem::CItem(const CItem &that) :
   m_fields(that.m_fields),
   m_URFL(that.m_URFL)
 {
-  memcpy(m_key, that.m_key, sizeof(m_key));
+  memcpy(m_tweak, that.m_tweak, sizeof(m_tweak));
 }
 
 CItem::~CItem()
 {
-  delete m_blowfish;
-  // Following protects against possible use-after-delete
-  // bug, since new BF will be created, rather than
-  // using one with trashed values
-  m_blowfish = nullptr;
 }
 
 CItem& CItem::operator=(const CItem &that)
@@ -45,29 +100,19 @@ CItem& CItem::operator=(const CItem &that)
     m_fields = that.m_fields;
     m_URFL = that.m_URFL;
 
-    memcpy(m_key, that.m_key, sizeof(m_key));
-    delete m_blowfish;
-    m_blowfish = nullptr;
+    memcpy(m_tweak, that.m_tweak, sizeof(m_tweak));
   }
   return *this;
 }
 
-bool CItem::CompareFields(const CItemField &fthis,
-                          const CItem &that, const CItemField &fthat) const
+template <class F>
+bool CItem::CompareFields(const F &fthis, const CItem &that, const F &fthat) const
 {
   if (fthis.GetLength() != fthat.GetLength() ||
       fthis.GetType() != fthat.GetType())
     return false;
-  size_t flength = fthis.GetLength() + BlowFish::BLOCKSIZE;
-  auto *dthis = new unsigned char[flength];
-  auto *dthat = new unsigned char[flength];
-  GetField(fthis, dthis, flength);
-  flength = fthis.GetLength() + BlowFish::BLOCKSIZE; // GetField updates length, reset
-  that.GetField(fthat, dthat, flength);
-  bool retval = (memcmp(dthis, dthat, flength) == 0);
-  trashMemory(dthis, flength); trashMemory(dthis, flength);
-  delete[] dthis; delete[] dthat;
-  return retval;
+  const ItemFish fishthis(m_tweak), fishthat(that.m_tweak);
+  return CItemFieldView(fthis, &fishthis) == CItemFieldView(fthat, &fishthat);
 }
 
 bool CItem::operator==(const CItem &that) const
@@ -80,15 +125,11 @@ bool CItem::operator==(const CItem &that) const
      * encrypted with different keys, making byte-wise
      * field comparisons infeasible.
      */
-    FieldConstIter ithis, ithat;
-    for (ithis = m_fields.begin(), ithat = that.m_fields.begin();
-         ithis != m_fields.end();
-         ithis++, ithat++) {
+    FieldConstIter ithis = m_fields.begin(), ithat = that.m_fields.begin();
+    for (; ithis != m_fields.end(); ++ithis, ++ithat) {
       if (ithis->first != ithat->first)
         return false;
-      const CItemField &fthis = ithis->second;
-      const CItemField &fthat = ithat->second;
-      if (!CompareFields(fthis, that, fthat))
+      if (!CompareFields(ithis->second, that, ithat->second))
         return false;
     } // for m_fields
   } else
@@ -123,14 +164,20 @@ size_t CItem::GetSize() const
   return length;
 }
 
-BlowFish *CItem::MakeBlowFish() const
+ulong64 CItem::GetFingerprint() const
 {
-  // Creating a BlowFish object's relatively expensive, so we use
-  // the singleton design pattern for the life of the CItem object
-  if(!m_blowfish) {
-    m_blowfish = BlowFish::MakeBlowFish(m_key, sizeof(m_key));
+  ulong64 h = 0xcbf29ce484222325ULL; // FNV offset basis
+
+  for (FieldConstIter fiter = m_fields.begin(); fiter != m_fields.end(); fiter++) {
+    h = (h ^ static_cast<ulong64>(fiter->first)) * 0x100000001b3ULL;
+    fiter->second.Fingerprint(h);
   }
-  return m_blowfish;
+
+  for (auto ufiter = m_URFL.begin();
+       ufiter != m_URFL.end(); ufiter++)
+    ufiter->Fingerprint(h);
+
+  return h;
 }
 
 void CItem::SetUnknownField(unsigned char type,
@@ -143,7 +190,8 @@ void CItem::SetUnknownField(unsigned char type,
   **/
 
   CItemField unkrfe(type);
-  unkrfe.Set(ufield, length, MakeBlowFish());
+  const ItemFish fish(m_tweak);
+  unkrfe.Set(ufield, length, &fish);
   m_URFL.push_back(unkrfe);
 }
 
@@ -169,22 +217,14 @@ void CItem::Clear()
 
 void CItem::SetField(int ft, const unsigned char *value, size_t length)
 {
-  if (length != 0) {
-    m_fields[ft].Set(value, length,
-                     MakeBlowFish(),
-                     static_cast<unsigned char>(ft));
-  } else
-    m_fields.erase(ft);
+  const ItemFish fish(m_tweak);
+  m_fields.Set(ft, value, length, &fish); // erases if length == 0
 }
 
 void CItem::SetField(int ft, const StringX &value)
 {
-  if (!value.empty()) {
-    m_fields[ft].Set(value,
-                     MakeBlowFish(),
-                     static_cast<unsigned char>(ft));
-  } else
-    m_fields.erase(ft);
+  const ItemFish fish(m_tweak);
+  m_fields.Set(ft, value, &fish); // erases if value's empty
 }
 
 static bool pull_string(StringX &str,
@@ -196,14 +236,12 @@ static bool pull_string(StringX &str,
    * PWS_CP_ACP is either set externally or via the --CP_ACP argv
    *
    * We use a static variable purely for efficiency, as this won't change
-   * over the course of the program.
+   * over the course of the program. Its initialization is thread-safe, as
+   * records may be parsed off the main thread (see PWScore::ReadFile).
    */
 
-  static int cp_acp = -1;
-  if (cp_acp == -1) {
-    cp_acp = pws_os::getenv("PWS_CP_ACP", false).empty() ? 0 : 1;
-  }
-  CUTF8Conv utf8conv(cp_acp != 0);
+  static const bool cp_acp = !pws_os::getenv("PWS_CP_ACP", false).empty();
+  CUTF8Conv utf8conv(cp_acp);
   std::vector<unsigned char> v(data, (data + len));
   v.push_back(0); // null terminate for FromUTF8.
   bool utf8status = utf8conv.FromUTF8(&v[0], len, str);
@@ -246,22 +284,49 @@ bool CItem::SetTimeField(int ft, const unsigned char *value,
 void CItem::GetField(const CItemField &field,
                      unsigned char *value, size_t &length) const
 {
-  field.Get(value, length, MakeBlowFish());
+  const ItemFish fish(m_tweak);
+  field.Get(value, length, &fish);
+}
+
+void CItem::GetField(const FieldMap::Field &field,
+                     unsigned char *value, size_t &length) const
+{
+  const ItemFish fish(m_tweak);
+  field.Get(value, length, &fish);
 }
 
 StringX CItem::GetField(const int ft) const
 {
+  StringX retval;
   auto fiter = m_fields.find(ft);
-  return fiter == m_fields.end() ? _T("") : GetField(fiter->second);
+  if (fiter != m_fields.end()) {
+    const ItemFish fish(m_tweak);
+    fiter->second.Get(retval, &fish);
+  }
+  return retval;
 }
 
 StringX CItem::GetField(const CItemField &field) const
 {
   StringX retval;
-  field.Get(retval, MakeBlowFish());
+  const ItemFish fish(m_tweak);
+  field.Get(retval, &fish);
   return retval;
 }
 
+void CItem::ViewField(int ft, Viewer viewer, void *f) const
+{
+  auto fiter = m_fields.find(ft);
+  if (fiter != m_fields.end()) {
+    const ItemFish fish(m_tweak);
+    const CItemFieldView view(fiter->second, &fish);
+    viewer(f, view);
+  } else {
+    const CItemFieldView view;
+    viewer(f, view);
+  }
+}
+
 void CItem::GetTime(int whichtime, time_t &t) const
 {
   auto fiter = m_fields.find(whichtime);
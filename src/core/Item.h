@@ -30,7 +30,7 @@
  * accessor. This encryption is orthogonal to the encryption of data on disk.
  *
  * Since the number of fields is relatively large and evolves over time, we
- * keep them in a map that's keyed on their type. For convenience, setters
+ * keep them in a CItemFieldStore, keyed on their type. For convenience, setters
  * and getters can be defined in derived classes. These also convert the
  * raw bytes (stored encrypted) to/from the relevant representation, e.g.,
  * string, time, etc.
@@ -40,8 +40,6 @@
  *
 */
 
-class BlowFish;
-
 class CItem
 {
 public:
@@ -151,10 +149,22 @@ public:
   size_t GetSize() const;
   void GetSize(size_t &isize) const {isize = GetSize();}
 
+  // Cheap way to tell whether an item's changed: unchanged items keep their
+  // fingerprint, but as fields are hashed as stored (i.e., encrypted),
+  // setting a field to the same value again changes it.
+  ulong64 GetFingerprint() const;
+
+  // Calls f(const CItemFieldView &) with the plaintext of field ft (empty if
+  // it's not set), so that it can be compared, hashed or searched without
+  // copying it to a StringX. The view's only valid during the call, e.g.:
+  //   bool same;
+  //   item.ViewField(CItem::TITLE, [&](const CItemFieldView &v) {same = v == title;});
+  template <typename F>
+  void ViewField(int ft, F f) const {ViewField(ft, &CallViewer<F>, &f);}
+
 protected:
-  typedef std::map<int, CItemField> FieldMap;
+  typedef CItemFieldStore FieldMap;
   typedef FieldMap::const_iterator FieldConstIter;
-  typedef FieldMap::iterator FieldIter;
 
   FieldMap   m_fields;
 
@@ -168,13 +178,15 @@ protected:
 
   void GetField(const CItemField &field, unsigned char *value,
                 size_t &length) const;
+  void GetField(const FieldMap::Field &field, unsigned char *value,
+                size_t &length) const;
   StringX GetField(int ft) const;
   StringX GetField(const CItemField &field) const;
 
   void SetTime(int whichtime, time_t t);
   void GetTime(int whichtime, time_t &t) const;
 
-  bool IsFieldSet(int ft) const {return m_fields.find(ft) != m_fields.end();}
+  bool IsFieldSet(int ft) const {return m_fields.count(ft) != 0;}
 
   void GetUnknownField(unsigned char &type, size_t &length,
                        unsigned char * &pdata, const CItemField &item) const;
@@ -184,18 +196,20 @@ protected:
   {return type >= START_ATT && type < LAST_ATT;}
 
 private:
-  // Helper function for operator==
-  bool CompareFields(const CItemField &fthis,
-                     const CItem &that, const CItemField &fthat) const;
-
-  // Create local Encryption/Decryption object
-  BlowFish *MakeBlowFish() const;
+  typedef void (*Viewer)(void *f, const CItemFieldView &view);
+  template <typename F>
+  static void CallViewer(void *f, const CItemFieldView &view) {(*static_cast<F *>(f))(view);}
+  void ViewField(int ft, Viewer viewer, void *f) const;
 
-  // random key for storing stuff in memory
-  // We need to keep the key because it's easier to copy
-  // than the BlowFish object for copy c'tor and assignment
-  unsigned char m_key[32];
-  mutable BlowFish *m_blowfish = nullptr;
+  // Helper function for operator==
+  template <class F>
+  bool CompareFields(const F &fthis, const CItem &that, const F &fthat) const;
+
+  // Random per-item tweak for storing stuff in memory.
+  // All items share one session BlowFish (see Item.cpp), so this is
+  // what keeps equal fields in different items from encrypting alike.
+  // Copied by copy c'tor and assignment along with the fields.
+  unsigned char m_tweak[8];
 };
 
 #endif /* __ITEM_H */
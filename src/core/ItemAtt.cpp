@@ -11,6 +11,8 @@
 #include "ItemAtt.h"
 #include "crypto/BlowFish.h"
 #include "crypto/TwoFish.h"
+#include "crypto/hmac.h"
+#include "crypto/sha256.h"
 #include "PWSrand.h"
 #include "PWSfile.h"
 #include "PWSfileV4.h"
@@ -26,25 +28,41 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <vector>
+
 using namespace std;
 using pws_os::CUUID;
 
+namespace {
+  // Attachments whose content is yet to be loaded, see PrepareToReplace()
+  std::mutex lazyMutex;
+  std::set<CItemAtt *> lazyAtts;
+
+  // Content's read this much at a time
+  const size_t CONTENT_CHUNK = 64 * 1024;
+}
+
 //-----------------------------------------------------------------------------
 // Constructors
 
 CItemAtt::CItemAtt()
-  : m_entrystatus(ES_CLEAN), m_offset(-1L), m_refcount(0)
+  : m_entrystatus(ES_CLEAN), m_offset(-1L), m_refcount(0), m_contentLength(0)
 {
 }
 
 CItemAtt::CItemAtt(const CItemAtt &that) :
   CItem(that), m_entrystatus(that.m_entrystatus),
-  m_offset(that.m_offset), m_refcount(that.m_refcount)
+  m_offset(-1L), m_refcount(that.m_refcount), m_contentLength(0)
 {
+  SetSource(that.m_source, that.m_offset, that.m_contentLength);
 }
 
 CItemAtt::~CItemAtt()
 {
+  SetSource(nullptr, -1L, 0);
 }
 
 CItemAtt& CItemAtt::operator=(const CItemAtt &that)
@@ -52,17 +70,22 @@ CItemAtt& CItemAtt::operator=(const CItemAtt &that)
   if (this != &that) { // Check for self-assignment
     CItem::operator=(that);
     m_entrystatus = that.m_entrystatus;
-    m_offset = that.m_offset;
     m_refcount = that.m_refcount;
+    SetSource(that.m_source, that.m_offset, that.m_contentLength);
   }
   return *this;
 }
 
 bool CItemAtt::operator==(const CItemAtt &that) const
 {
+  // Content that's yet to be loaded is identified by its keys and HMAC,
+  // which are compared along with the other fields, so there's no need to
+  // read it. One that's loaded isn't taken to equal one that's not.
   return (m_entrystatus == that.m_entrystatus &&
           m_offset == that.m_offset &&
           m_refcount == that.m_refcount &&
+          (m_source == nullptr) == (that.m_source == nullptr) &&
+          m_contentLength == that.m_contentLength &&
           CItem::operator==(that));
 }
 
@@ -112,9 +135,241 @@ void CItemAtt::SetCTime(time_t t)
 
 void CItemAtt::SetContent(const unsigned char *content, size_t clen)
 {
+  DropSource();
   SetField(CONTENT, content, clen);
 }
 
+CItemAtt::ContentSource::ContentSource(const stringT &fname, const PWSFileSig &fsig)
+  : filename(fname), sig(new PWSFileSig(fsig)), spool(nullptr)
+{
+}
+
+CItemAtt::ContentSource::ContentSource(std::FILE *fp) : spool(fp)
+{
+}
+
+CItemAtt::ContentSource::~ContentSource()
+{
+  if (spool != nullptr)
+    fclose(spool);
+}
+
+std::FILE *CItemAtt::ContentSource::Open() const
+{
+  ASSERT(spool == nullptr);
+  for (const stringT &fname : {filename, previous}) {
+    if (fname.empty())
+      continue;
+    std::FILE *fd = pws_os::FOpen(fname, _T("rb"));
+    if (fd == nullptr)
+      continue;
+    if (PWSFileSig(fd) == *sig)
+      return fd;
+    fclose(fd); // replaced, its content's not what we're after
+  }
+  return nullptr;
+}
+
+void CItemAtt::SetSource(const ContentSourcePtr &source, long offset, size_t len)
+{
+  if ((m_source == nullptr) != (source == nullptr)) {
+    std::lock_guard<std::mutex> guard(lazyMutex);
+    if (source != nullptr)
+      lazyAtts.insert(this);
+    else
+      lazyAtts.erase(this);
+  }
+  m_source = source;
+  m_offset = (source != nullptr) ? offset : -1L;
+  m_contentLength = (source != nullptr) ? len : 0;
+}
+
+void CItemAtt::DropSource()
+{
+  ClearField(ATTIV);
+  ClearField(ATTEK);
+  ClearField(ATTAK);
+  ClearField(CONTENTHMAC);
+  SetSource(nullptr, -1L, 0);
+}
+
+bool CItemAtt::GetKeyField(FieldType ft, unsigned char *key, size_t len) const
+{
+  auto fiter = m_fields.find(ft);
+  if (fiter == m_fields.end() || fiter->second.GetLength() != len)
+    return false;
+
+  size_t flength = fiter->second.GetSize();
+  std::vector<unsigned char> value(flength);
+  CItem::GetField(fiter->second, value.data(), flength);
+  memcpy(key, value.data(), len);
+  trashMemory(value.data(), value.size());
+  return true;
+}
+
+int CItemAtt::ReadContent(const ContentSink &sink) const
+{
+  ASSERT(m_source != nullptr);
+  const unsigned int BS = TwoFish::BLOCKSIZE;
+  unsigned char IV[TwoFish::BLOCKSIZE];
+  unsigned char EK[PWSfileV4::KLEN];
+  unsigned char AK[PWSfileV4::KLEN];
+  unsigned char expected_digest[SHA256::HASHLEN];
+
+  if (!GetKeyField(ATTIV, IV, sizeof(IV)) || !GetKeyField(ATTEK, EK, sizeof(EK)) ||
+      !GetKeyField(ATTAK, AK, sizeof(AK)) ||
+      !GetKeyField(CONTENTHMAC, expected_digest, sizeof(expected_digest))) {
+    trashMemory(EK, sizeof(EK));
+    trashMemory(AK, sizeof(AK));
+    return PWSfile::FAILURE;
+  }
+
+  // A spool's shared by the attachment's copies, so one at a time
+  std::unique_lock<std::mutex> spoolLock(m_source->spoolMutex, std::defer_lock);
+  std::FILE *fd = m_source->spool;
+  long offset = m_offset;
+  if (fd != nullptr) {
+    spoolLock.lock();
+    offset = 0; // it's all this attachment's
+  } else {
+    fd = m_source->Open();
+  }
+
+  int status = PWSfile::SUCCESS;
+  if (fd == nullptr)
+    status = PWSfile::CANT_OPEN_FILE;
+  else if (fseek(fd, offset, SEEK_SET) != 0)
+    status = PWSfile::READ_FAIL;
+
+  TwoFish fish(EK, sizeof(EK));
+  trashMemory(EK, sizeof(EK));
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+  hmac.Init(AK, sizeof(AK));
+  trashMemory(AK, sizeof(AK));
+
+  std::vector<unsigned char> ct, pt;
+  try { // sink may throw, e.g., on write error
+    size_t ctleft = ((m_contentLength + BS - 1) / BS) * BS; // as written
+    size_t ptleft = m_contentLength;
+    if (status == PWSfile::SUCCESS) {
+      ct.resize(std::min(ctleft, CONTENT_CHUNK));
+      pt.resize(ct.size());
+    }
+    while (status == PWSfile::SUCCESS && ctleft > 0) {
+      const size_t n = std::min(ctleft, ct.size());
+      if (fread(ct.data(), n, 1, fd) != 1) {
+        status = PWSfile::READ_FAIL;
+        break;
+      }
+      cbcdecrypt(ct.data(), pt.data(), n, &fish, IV);
+      const size_t ptn = std::min(ptleft, n);
+      hmac.Update(pt.data(), static_cast<unsigned long>(ptn));
+      sink(ct.data(), n, pt.data(), ptn);
+      ctleft -= n;
+      ptleft -= ptn;
+    }
+  } catch (...) {
+    trashMemory(pt.data(), pt.size());
+    if (fd != m_source->spool)
+      fclose(fd);
+    throw;
+  }
+  trashMemory(pt.data(), pt.size());
+  if (fd != nullptr && fd != m_source->spool)
+    fclose(fd);
+
+  unsigned char calculated_digest[SHA256::HASHLEN];
+  hmac.Final(calculated_digest);
+  if (status == PWSfile::SUCCESS &&
+      memcmp(expected_digest, calculated_digest, sizeof(calculated_digest)) != 0)
+    status = PWSfile::BAD_DIGEST;
+  return status;
+}
+
+int CItemAtt::LoadContent()
+{
+  if (m_source == nullptr)
+    return PWSfile::SUCCESS;
+
+  const size_t len = m_contentLength;
+  std::vector<unsigned char> content(len);
+  size_t pos = 0;
+  const int status = ReadContent([&content, &pos](const unsigned char *, size_t,
+                                                  const unsigned char *pt, size_t ptlen)
+                                 {
+                                   memcpy(content.data() + pos, pt, ptlen);
+                                   pos += ptlen;
+                                 });
+  if (status == PWSfile::SUCCESS) {
+    DropSource();
+    CItem::SetField(CONTENT, content.data(), len);
+  }
+  trashMemory(content.data(), content.size());
+  return status;
+}
+
+bool CItemAtt::IsContentAvailable() const
+{
+  if (m_source == nullptr || m_source->spool != nullptr)
+    return true;
+  std::FILE *fd = m_source->Open();
+  if (fd == nullptr)
+    return false;
+  fclose(fd);
+  return true;
+}
+
+void CItemAtt::PrepareToReplace(const stringT &filename, ContentOffsets &written)
+{
+  // The file may have been moved already (see ContentMoved()), so also
+  // whatever shares a source with what's being written
+  std::set<const ContentSource *> sources;
+  std::map<std::pair<const ContentSource *, long>, long> moved;
+  for (const auto &w : written)
+    if (w.first->m_source != nullptr && w.first->m_source->spool == nullptr) {
+      sources.insert(w.first->m_source.get());
+      if (w.second >= 0)
+        moved[std::make_pair(w.first->m_source.get(), w.first->m_offset)] = w.second;
+    }
+
+  std::vector<CItemAtt *> others;
+  {
+    std::lock_guard<std::mutex> guard(lazyMutex);
+    for (auto *att : lazyAtts) {
+      if (written.find(att) != written.end())
+        continue;
+      auto iter = moved.find(std::make_pair(att->m_source.get(), att->m_offset));
+      if (iter != moved.end())
+        written[att] = iter->second; // same content, now there
+      else if (sources.find(att->m_source.get()) != sources.end() ||
+               att->m_source->filename == filename)
+        others.push_back(att);
+    }
+  }
+
+  // Those that can't (corrupt content) stay as they are
+  for (auto *att : others)
+    att->LoadContent();
+}
+
+void CItemAtt::Replaced(const stringT &filename, const ContentOffsets &written)
+{
+  auto source = std::make_shared<ContentSource>(filename, PWSFileSig(filename));
+  for (const auto &w : written)
+    if (w.second >= 0)
+      w.first->SetSource(source, w.second, w.first->m_contentLength);
+}
+
+void CItemAtt::ContentMoved(const stringT &from, const stringT &to)
+{
+  std::lock_guard<std::mutex> guard(lazyMutex);
+  for (auto *att : lazyAtts)
+    if (att->m_source->filename == from) {
+      att->m_source->previous = from;
+      att->m_source->filename = to;
+    }
+}
+
 StringX CItemAtt::GetTime(int whichtime, PWSUtil::TMC result_format) const
 {
   time_t t;
@@ -125,6 +380,9 @@ StringX CItemAtt::GetTime(int whichtime, PWSUtil::TMC result_format) const
 
 size_t CItemAtt::GetContentLength() const
 {
+  if (m_source != nullptr)
+    return m_contentLength;
+
   auto fiter = m_fields.find(CONTENT);
 
   if (fiter != m_fields.end())
@@ -135,6 +393,10 @@ size_t CItemAtt::GetContentLength() const
 
 size_t CItemAtt::GetContentSize() const
 {
+  if (m_source != nullptr) // as if it were loaded, see CItemField::GetSize()
+    return ((m_contentLength + BlowFish::BLOCKSIZE - 1) / BlowFish::BLOCKSIZE) *
+           BlowFish::BLOCKSIZE;
+
   auto fiter = m_fields.find(CONTENT);
 
   if (fiter != m_fields.end())
@@ -150,6 +412,22 @@ bool CItemAtt::GetContent(unsigned char *content, size_t csize) const
   if (!HasContent() || csize < GetContentSize())
     return false;
 
+  if (m_source != nullptr) {
+    size_t pos = 0;
+    const int status = ReadContent([content, &pos](const unsigned char *, size_t,
+                                                   const unsigned char *pt, size_t ptlen)
+                                   {
+                                     memcpy(content + pos, pt, ptlen);
+                                     pos += ptlen;
+                                   });
+    if (status != PWSfile::SUCCESS) {
+      trashMemory(content, csize);
+      return false;
+    }
+    memset(content + pos, 0, GetContentSize() - pos);
+    return true;
+  }
+
   GetField(m_fields.find(CONTENT)->second, content, csize);
   return true;
 }
@@ -174,23 +452,17 @@ int CItemAtt::Import(const stringT &fname)
     return PWScore::MAX_SIZE_EXCEEDED;
   }
 
-  auto *data = new unsigned char[flen];
-  if (data == nullptr)
-    return PWScore::FAILURE;
-
-  size_t nread = fread(data, flen, 1, fhandle);
-  if (nread != 1) {
-    pws_os::FClose(fhandle, false);
-    status = PWScore::READ_FAIL;
-    goto done;
+  if (flen == 0) {
+    const unsigned char none = 0;
+    SetContent(&none, 0);
+  } else {
+    status = ImportContent(fhandle, flen);
   }
 
-  if (pws_os::FClose(fhandle, true) != 0) {
+  if (pws_os::FClose(fhandle, false) != 0 && status == PWScore::SUCCESS)
     status = PWScore::READ_FAIL;
-    goto done;
-  }
-
-  SetField(CONTENT, data, flen);
+  if (status != PWScore::SUCCESS)
+    return status;
 
   // derive the file's path and name
   pws_os::splitpath(fname, sdrive, sdir, sfname, sextn);
@@ -210,12 +482,76 @@ int CItemAtt::Import(const stringT &fname)
     CItem::SetField(FILEATIME, buf, sizeof(buf));
   } else {
     ASSERT(0);
-    goto done;
   }
 
- done:
-  trashMemory(data, flen);
-  delete[] data;
+  return status;
+}
+
+int CItemAtt::ImportContent(std::FILE *fhandle, size_t flen)
+{
+  /**
+   * Encrypt the content as Write() would, with its own keys, into a spool
+   * that we then treat as the file the content was read from. The HMAC's
+   * calculated as we go, so there's a single pass over the content, and
+   * only a chunk of it's ever in memory.
+   */
+  const unsigned int BS = TwoFish::BLOCKSIZE;
+  std::FILE *spool = std::tmpfile();
+  if (spool == nullptr)
+    return PWScore::FAILURE;
+  auto source = std::make_shared<ContentSource>(spool);
+
+  unsigned char IV[TwoFish::BLOCKSIZE], cbcbuffer[TwoFish::BLOCKSIZE];
+  unsigned char EK[PWSfileV4::KLEN];
+  unsigned char AK[PWSfileV4::KLEN];
+  PWSrand::GetInstance()->GetRandomData(IV, sizeof(IV));
+  PWSrand::GetInstance()->GetRandomData(EK, sizeof(EK));
+  PWSrand::GetInstance()->GetRandomData(AK, sizeof(AK));
+  memcpy(cbcbuffer, IV, sizeof(IV));
+
+  TwoFish fish(EK, sizeof(EK));
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+  hmac.Init(AK, sizeof(AK));
+
+  int status = PWScore::SUCCESS;
+  std::vector<unsigned char> buf(std::min(((flen + BS - 1) / BS) * BS, CONTENT_CHUNK));
+  for (size_t left = flen; left > 0; ) {
+    const size_t n = std::min(left, buf.size());
+    if (fread(buf.data(), n, 1, fhandle) != 1) {
+      status = PWScore::READ_FAIL;
+      break;
+    }
+    hmac.Update(buf.data(), static_cast<unsigned long>(n));
+    size_t blen = n;
+    if (n % BS != 0) { // last block padded with randomness, as _writecbcRest()
+      blen = ((n + BS - 1) / BS) * BS;
+      PWSrand::GetInstance()->GetRandomData(buf.data() + n, blen - n);
+    }
+    cbcencrypt(buf.data(), buf.data(), blen, &fish, cbcbuffer);
+    if (fwrite(buf.data(), blen, 1, spool) != 1) {
+      status = PWScore::WRITE_FAIL;
+      break;
+    }
+    left -= n;
+  }
+  trashMemory(buf.data(), buf.size());
+
+  unsigned char digest[SHA256::HASHLEN];
+  hmac.Final(digest);
+  if (status == PWScore::SUCCESS && fflush(spool) != 0)
+    status = PWScore::WRITE_FAIL;
+
+  if (status == PWScore::SUCCESS) {
+    DropSource();
+    ClearField(CONTENT);
+    CItem::SetField(ATTIV, IV, sizeof(IV));
+    CItem::SetField(ATTEK, EK, sizeof(EK));
+    CItem::SetField(ATTAK, AK, sizeof(AK));
+    CItem::SetField(CONTENTHMAC, digest, sizeof(digest));
+    SetSource(source, 0L, flen);
+  }
+  trashMemory(EK, sizeof(EK));
+  trashMemory(AK, sizeof(AK));
   return status;
 }
 
@@ -224,12 +560,32 @@ int CItemAtt::Export(const stringT &fname) const
   int status = PWScore::SUCCESS;
 
   ASSERT(!fname.empty());
-  ASSERT(IsFieldSet(CONTENT));
+  ASSERT(HasContent());
   // fail safely @runtime:
-  if (!IsFieldSet(CONTENT))
+  if (!HasContent())
     return PWScore::FAILURE;
 
-  const CItemField &field = m_fields.find(CONTENT)->second;
+  if (m_source != nullptr) { // straight from the database to the file
+    std::FILE *fhandle = pws_os::FOpen(fname, L"wb");
+    if (!fhandle)
+      return PWScore::CANT_OPEN_FILE;
+    bool written = true;
+    status = ReadContent([fhandle, &written](const unsigned char *, size_t,
+                                             const unsigned char *pt, size_t ptlen)
+                         {
+                           if (written && ptlen > 0 && fwrite(pt, ptlen, 1, fhandle) != 1)
+                             written = false;
+                         });
+    if (fclose(fhandle) != 0)
+      written = false;
+    if (status == PWScore::SUCCESS && !written)
+      status = PWScore::WRITE_FAIL;
+    if (status != PWScore::SUCCESS) // don't leave what didn't check out
+      pws_os::DeleteAFile(fname);
+    return status;
+  }
+
+  const FieldMap::Field field = m_fields.find(CONTENT)->second;
   std::FILE *fhandle = pws_os::FOpen(fname, L"wb");
   if (!fhandle)
     return PWScore::CANT_OPEN_FILE;
@@ -321,7 +677,7 @@ int CItemAtt::Read(PWSfile *in)
   unsigned char EK[PWSfileV4::KLEN] = {0};
   unsigned char AK[PWSfileV4::KLEN] = {0};
 
-  unsigned char *content = nullptr;
+  long content_offset = -1L;
   size_t content_len = 0;
   unsigned char expected_digest[SHA256::HASHLEN] = {0};
 
@@ -329,6 +685,7 @@ int CItemAtt::Read(PWSfile *in)
   size_t utf8Len = 0;
 
   Clear();
+  SetSource(nullptr, -1L, 0);
 
   do {
     fieldLen = static_cast<signed long>(in->ReadField(type, utf8,
@@ -379,16 +736,11 @@ int CItemAtt::Read(PWSfile *in)
           goto exit;
         content_len = static_cast<size_t>(getInt32(utf8));
 
-        TwoFish fish(EK, sizeof(EK));
-        trashMemory(EK, sizeof(EK));
-        const unsigned int BS = fish.GetBlockSize();
-
+        // Content's left where it is until needed, see ReadContent()
         auto *in4 = dynamic_cast<PWSfileV4 *>(in);
         ASSERT(in4 != nullptr);
-        size_t nread = in4->ReadContent(&fish, IV, content, content_len);
-        // nread should be content_len rounded up to nearest BS:
-        ASSERT(nread == (content_len/BS + 1)*BS);
-        if (nread != (content_len/BS + 1)*BS) {
+        content_offset = in4->SkipContent(content_len);
+        if (content_offset < 0) {
           status = PWSfile::READ_FAIL;
           goto exit;
         }
@@ -410,47 +762,33 @@ int CItemAtt::Read(PWSfile *in)
       } // switch {type)
     } // if (fieldLen > 0)
 
-    if (utf8 != nullptr) {
-      trashMemory(utf8, utf8Len * sizeof(utf8[0]));
-      delete[] utf8; utf8 = nullptr; utf8Len = 0;
-    }
+    utf8 = nullptr; utf8Len = 0; // owned and wiped by in
   } while (type != END && fieldLen > 0 && --emergencyExit > 0);
 
   // Post-field read processing:
   // - Ensure we have all we need
-  // - Check HMAC
-  // - Set Content field
+  // - Note where the content is and how to decrypt and verify it
   // - Clean-up
 
   if (gotContent && gotAK && gotHMAC) {
-    unsigned char calculated_digest[SHA256::HASHLEN] = {0};
-    HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
-
-    hmac.Init(AK, sizeof(AK));
-    trashMemory(AK, sizeof(AK));
-    
-    // calculate HMAC
-    hmac.Update(content, static_cast<unsigned long>(content_len));
-    hmac.Final(calculated_digest);
-
-    if (memcmp(expected_digest, calculated_digest,
-               sizeof(calculated_digest)) == 0) {
-      SetField(CONTENT, content, content_len);
-      status = PWSfile::SUCCESS;
-    } else {
-      status = PWSfile::BAD_DIGEST;
-    }
+    CItem::SetField(ATTIV, IV, sizeof(IV));
+    CItem::SetField(ATTEK, EK, sizeof(EK));
+    CItem::SetField(ATTAK, AK, sizeof(AK));
+    CItem::SetField(CONTENTHMAC, expected_digest, sizeof(expected_digest));
+    SetSource(dynamic_cast<PWSfileV4 *>(in)->GetContentSource(),
+              content_offset, content_len);
+    status = PWSfile::SUCCESS;
   } else {
     status = PWSfile::READ_FAIL;
   }
 
  exit:
-  trashMemory(content, content_len);
-  delete[] content;
-  delete[] utf8; // if here via goto exit
+  trashMemory(EK, sizeof(EK));
+  trashMemory(AK, sizeof(AK));
 
   if (numread > 0) {
-    m_offset = in->GetOffset();
+    if (m_source == nullptr)
+      m_offset = in->GetOffset();
     return status;
   } else
     return PWSfile::READ_FAIL;
@@ -461,7 +799,7 @@ size_t CItemAtt::WriteIfSet(FieldType ft, PWSfile *out, bool isUTF8) const
   auto fiter = m_fields.find(ft);
   size_t retval = 0;
   if (fiter != m_fields.end()) {
-    const CItemField &field = fiter->second;
+    const FieldMap::Field &field = fiter->second;
     ASSERT(!field.IsEmpty());
     size_t flength = field.GetLength() + BlowFish::BLOCKSIZE;
     auto *pdata = new unsigned char[flength];
@@ -493,11 +831,14 @@ size_t CItemAtt::WriteIfSet(FieldType ft, PWSfile *out, bool isUTF8) const
   return retval;
 }
 
-int CItemAtt::Write(PWSfile *out) const
+int CItemAtt::Write(PWSfile *out, long *pContentOffset, bool bDeferCopy) const
 {
   int status = PWSfile::SUCCESS;
   uuid_array_t att_uuid;
 
+  if (pContentOffset != nullptr)
+    *pContentOffset = -1L;
+
   ASSERT(HasUUID());
   GetUUID(att_uuid);
 
@@ -515,14 +856,48 @@ int CItemAtt::Write(PWSfile *out) const
 
   auto fiter = m_fields.find(CONTENT);
   // XXX TBD - fail if no content, as this is a mandatory field
-  if (fiter != m_fields.end()) {
+  if (m_source != nullptr) {
+    // Not loaded: copy the ciphertext as is, with the same keys,
+    // verifying it as we go
+    auto *out4 = dynamic_cast<PWSfileV4 *>(out);
+    ASSERT(out4 != nullptr);
+
+    unsigned char IV[TwoFish::BLOCKSIZE];
+    unsigned char EK[PWSfileV4::KLEN];
+    unsigned char AK[PWSfileV4::KLEN];
+    unsigned char digest[SHA256::HASHLEN];
+    if (!GetKeyField(ATTIV, IV, sizeof(IV)) || !GetKeyField(ATTEK, EK, sizeof(EK)) ||
+        !GetKeyField(ATTAK, AK, sizeof(AK)) ||
+        !GetKeyField(CONTENTHMAC, digest, sizeof(digest))) {
+      trashMemory(EK, sizeof(EK));
+      trashMemory(AK, sizeof(AK));
+      return PWSfile::FAILURE;
+    }
+    const long offset = out4->StartContent(IV, EK, AK, m_contentLength);
+    trashMemory(EK, sizeof(EK));
+    trashMemory(AK, sizeof(AK));
+    if (bDeferCopy) {
+      out4->ReserveContent(m_contentLength);
+    } else {
+      status = ReadContent([out4](const unsigned char *ct, size_t ctlen,
+                                  const unsigned char *, size_t)
+                           {
+                             out4->WriteContentBlocks(ct, ctlen);
+                           });
+      if (status != PWSfile::SUCCESS)
+        return status;
+    }
+    out4->EndContent(digest);
+    if (pContentOffset != nullptr)
+      *pContentOffset = offset;
+  } else if (fiter != m_fields.end()) {
     auto *out4 = dynamic_cast<PWSfileV4 *>(out);
     ASSERT(out4 != nullptr);
 
     size_t clength = fiter->second.GetLength() + BlowFish::BLOCKSIZE;
     auto *content = new unsigned char[clength];
     CItem::GetField(fiter->second, content, clength);
-    out4->WriteContentFields(content, clength);
+    out4->WriteContentFields(content, fiter->second.GetLength());
     trashMemory(content, clength);
     delete[] content;
   }
@@ -535,6 +910,26 @@ int CItemAtt::Write(PWSfile *out) const
   return status;
 }
 
+int CItemAtt::CopyContent(std::FILE *fd, long offset) const
+{
+  ASSERT(m_source != nullptr);
+  if (m_source == nullptr)
+    return PWSfile::FAILURE;
+  if (fseek(fd, offset, SEEK_SET) != 0)
+    return PWSfile::WRITE_FAIL;
+
+  bool written = true;
+  const int status = ReadContent([fd, &written](const unsigned char *ct, size_t ctlen,
+                                                const unsigned char *, size_t)
+                                 {
+                                   if (written && fwrite(ct, ctlen, 1, fd) != 1)
+                                     written = false;
+                                 });
+  if (status == PWSfile::SUCCESS && !written)
+    return PWSfile::WRITE_FAIL;
+  return status;
+}
+
 bool CItemAtt::Matches(const stringT &stValue, int iObject,
   int iFunction) const
 {
@@ -18,6 +18,11 @@
 #include "StringX.h"
 
 #include <time.h> // for time_t
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 
 //-----------------------------------------------------------------------------
 
@@ -34,6 +39,7 @@
 
 class BlowFish;
 class PWSfile;
+class PWSFileSig;
 
 class CItemAtt : public CItem
 {
@@ -51,13 +57,59 @@ public:
 
   ~CItemAtt();
 
+  // Read() leaves V4 content in the file, noting where it is (see
+  // GetOffset()), its keys and its HMAC. It's read, decrypted and verified
+  // when needed (GetContent(), Export(), Write()), from the file as given
+  // by a ContentSource shared by the attachments read from that file.
+  // Import() likewise encrypts what it reads, a chunk at a time, into an
+  // anonymous temporary file (spool), so that neither needs memory in
+  // proportion to the content's size. A file's signature is kept, so that
+  // content's only read from the file as it was, not one that's since
+  // replaced it (e.g., saved by another instance or a sync client).
+  struct ContentSource {
+    ContentSource(const stringT &fname, const PWSFileSig &fsig);
+    explicit ContentSource(std::FILE *fp);
+    ~ContentSource();
+    std::FILE *Open() const; // the file, if it's still as it was, else nullptr
+    stringT filename;
+    stringT previous; // tried if filename's gone, e.g., a backup restored
+    std::unique_ptr<PWSFileSig> sig; // of the file, as read from
+    std::FILE *spool; // closed (and so deleted) with the source
+    std::mutex spoolMutex; // one reader at a time
+  private:
+    ContentSource(const ContentSource &) = delete;
+    ContentSource &operator=(const ContentSource &) = delete;
+  };
+  typedef std::shared_ptr<ContentSource> ContentSourcePtr;
+
   int Read(PWSfile *in);
-  int Write(PWSfile *out) const;
+  // If pContentOffset isn't null, it's set to where content that's yet to
+  // be loaded has been copied to, -1 if there was none. If bDeferCopy, it's
+  // not copied, just given room, and it's up to the caller to CopyContent()
+  // there, e.g., on another thread.
+  int Write(PWSfile *out, long *pContentOffset = nullptr, bool bDeferCopy = false) const;
+  int CopyContent(std::FILE *fd, long offset) const; // verifying it
 
   int Import(const stringT &fname);
   int Export(const stringT &fname) const;
 
-  bool HasContent() const {return IsFieldSet(CONTENT);}
+  bool HasContent() const {return IsFieldSet(CONTENT) || m_source != nullptr;}
+  int LoadContent(); // from the file, if not yet loaded
+  // False if content that's yet to be loaded no longer can be, as the
+  // file it's in has been removed or replaced since it was read
+  bool IsContentAvailable() const;
+
+  // For PWScore, when a database file's being replaced by one in which the
+  // attachments in written have their content at the given offsets:
+  // PrepareToReplace() adds to written other copies of those (e.g., kept
+  // for Undo) that are yet to load the same content, has any other
+  // attachments whose content is in the file load it while they still can,
+  // and Replaced() points those in written at the new file.
+  typedef std::map<CItemAtt *, long> ContentOffsets;
+  static void PrepareToReplace(const stringT &filename, ContentOffsets &written);
+  static void Replaced(const stringT &filename, const ContentOffsets &written);
+  // Content that's been moved along with its file, e.g., to a backup
+  static void ContentMoved(const stringT &from, const stringT &to);
 
   // Convenience: Get the name associated with FieldType
   static stringT FieldName(FieldType ft);
@@ -137,9 +189,21 @@ private:
   bool SetField(unsigned char type, const unsigned char *data, size_t len);
   size_t WriteIfSet(FieldType ft, PWSfile *out, bool isUTF8) const;
 
+  // Reads content that's yet to be loaded a chunk at a time, handing each
+  // chunk's ciphertext (whole blocks) and plaintext to sink, and verifies it
+  typedef std::function<void(const unsigned char *ct, size_t ctlen,
+                             const unsigned char *pt, size_t ptlen)> ContentSink;
+  int ReadContent(const ContentSink &sink) const;
+  int ImportContent(std::FILE *fhandle, size_t flen);
+  bool GetKeyField(FieldType ft, unsigned char *key, size_t len) const;
+  void SetSource(const ContentSourcePtr &source, long offset, size_t len);
+  void DropSource(); // and the keys, e.g., content's been replaced
+
   EntryStatus m_entrystatus;
-  long m_offset; // location on file, for lazy evaluation
+  long m_offset; // location of content on file, for lazy evaluation
   unsigned m_refcount; // how many CItemData objects refer to this?
+  ContentSourcePtr m_source; // nullptr unless content's yet to be loaded
+  size_t m_contentLength; // ditto
 };
 #endif /* __ITEMATT_H */
 //-----------------------------------------------------------------------------
@@ -172,20 +172,13 @@ int CItemData::Read(PWSfile *in)
         }
       } else if (IsItemAttField(type)) {
         // Allow rewind and retry
-        if (utf8 != nullptr) {
-          trashMemory(utf8, utf8Len * sizeof(utf8[0]));
-          delete[] utf8;
-        }
         return static_cast<int>(-numread);
       } else if (type != END) { // unknown field
         SetUnknownField(type, utf8Len, utf8);
       }
     } // if (fieldLen > 0)
 
-    if (utf8 != nullptr) {
-      trashMemory(utf8, utf8Len * sizeof(utf8[0]));
-      delete[] utf8; utf8 = nullptr; utf8Len = 0;
-    }
+    // utf8 is owned and wiped by in
   } while (type != END && fieldLen > 0 && --emergencyExit > 0);
 
   if (numread > 0) {
@@ -213,7 +206,7 @@ size_t CItemData::WriteIfSet(FieldType ft, PWSfile *out, bool isUTF8) const
   auto fiter = m_fields.find(ft);
   size_t retval = 0;
   if (fiter != m_fields.end()) {
-    const CItemField &field = fiter->second;
+    const FieldMap::Field &field = fiter->second;
     ASSERT(!field.IsEmpty());
     size_t flength = field.GetLength() + BlowFish::BLOCKSIZE;
     auto *pdata = new unsigned char[flength];
@@ -418,7 +411,7 @@ StringX CItemData::GetFieldValue(FieldType ft) const
     {
       uuid_array_t uuid_array = {0};
       GetUUID(uuid_array);
-      str = CUUID(uuid_array, true);
+      str = CUUID(uuid_array);
       break;
     }
     case NOTES:        /* 0x05 */
@@ -468,7 +461,7 @@ StringX CItemData::GetFieldValue(FieldType ft) const
     {
       uuid_array_t uuid_array = { 0 };
       GetUUID(uuid_array, ft);
-      str = CUUID(uuid_array, true);
+      str = CUUID(uuid_array);
       break;
     }
     default:
@@ -1696,8 +1689,18 @@ bool CItemData::Matches(const stringT &stValue, int iObject,
     case SYMBOLS:
     case POLICYNAME:
     case AUTOTYPE:
-      sx_Object = GetField(ft);
-      break;
+    {
+      // Matched where it's decrypted, rather than copied out
+      bool retval = false;
+      ViewField(ft, [&retval, &stValue, iFunction](const CItemFieldView &view) {
+          if (iFunction == PWSMatch::MR_PRESENT || iFunction == PWSMatch::MR_NOTPRESENT)
+            retval = PWSMatch::Match(view.GetLength() != 0, iFunction);
+          else
+            retval = PWSMatch::Match(stValue.c_str(), stValue.length(),
+                                     view.GetText(), view.GetTextLength(), iFunction);
+        });
+      return retval;
+    }
     case GROUPTITLE:
       sx_Object = GetGroup() + TCHAR('.') + GetTitle();
       break;
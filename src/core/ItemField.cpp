@@ -8,18 +8,157 @@
 /// \file ItemField.cpp
 //-----------------------------------------------------------------------------
 
-#include <math.h>
-
 #include "ItemField.h"
 #include "Util.h"
 #include "crypto/Fish.h"
 #include "PWSrand.h"
 #include "os/funcwrap.h"
+#include "os/mem.h"
+#include "os/pws_tchar.h"
+
+#include <algorithm>
+#include <bitset>
+
+namespace {
+  //Returns the number of bytes of 8 byte blocks needed to store 'size' bytes
+  size_t BlockSize(size_t size)
+  {
+    return ((size + 7) / 8) * 8;
+  }
+
+  // Encrypts length > 0 bytes of value into BlockSize(length) bytes of data.
+  // Goes a block at a time, so only the last, padded block needs copying.
+  void EncryptField(const unsigned char *value, size_t length,
+                    unsigned char *data, const Fish *bf)
+  {
+    const size_t whole = length - length % 8;
+    size_t x;
+    for (x = 0; x < whole; x += 8)
+      bf->Encrypt(value + x, data + x);
+
+    if (x < length) {
+      unsigned char block[8];
+      memcpy(block, value + x, length - x);
+      //Fill the unused characters in with random stuff
+      PWSrand::GetInstance()->GetRandomData(block + (length - x),
+                                            static_cast<unsigned long>(8 - (length - x)));
+      bf->Encrypt(block, data + x);
+      trashMemory(block, sizeof(block));
+    }
+  }
+
+  // See CItemField::Get(unsigned char *, size_t &, const Fish *)
+  void DecryptField(const unsigned char *data, size_t dlength,
+                    unsigned char *value, size_t &length, const Fish *bf)
+  {
+    if (dlength == 0) {
+      value[0] = TCHAR('\0');
+      length = 0;
+    } else { // we have data to decrypt, straight into value
+      size_t BlockLength = BlockSize(dlength);
+      ASSERT(length >= BlockLength);
+
+      for (size_t x = 0; x < BlockLength; x += 8)
+        bf->Decrypt(data + x, value + x);
+
+      memset(value + dlength, 0, BlockLength - dlength);
+      length = dlength;
+    }
+  }
+
+  void DecryptField(const unsigned char *data, size_t dlength,
+                    StringX &value, const Fish *bf)
+  {
+    if (dlength == 0) {
+      value = _T("");
+    } else { // we have data to decrypt, straight into value
+      // Blocks hold whole TCHARs, so the padding fits in a TCHAR or two
+      const size_t BlockLength = BlockSize(dlength);
+      value.resize(BlockLength / sizeof(TCHAR));
+      auto *pt = reinterpret_cast<unsigned char *>(&value[0]);
+
+      for (size_t x = 0; x < BlockLength; x += 8)
+        bf->Decrypt(data + x, pt + x);
+
+      trashMemory(pt + dlength, BlockLength - dlength);
+      value.resize(dlength / sizeof(TCHAR));
+    }
+  }
+
+  /*
+   * Per-thread scratch memory for CItemFieldViews, locked in memory.
+   * Views are scoped, so it's handed out as a stack: each view takes the
+   * next free bytes, and gives them back, wiped, when it goes.
+   * It only grows when nothing's been handed out.
+   */
+  class Scratch
+  {
+  public:
+    enum {MIN_SIZE = 1024, MAX_SIZE = 64 * 1024};
+    Scratch() : m_buf(nullptr), m_size(0), m_used(0) {}
+    ~Scratch() {Free();}
+
+    unsigned char *Take(size_t n)
+    {
+      if (m_used + n > m_size) {
+        if (m_used != 0 || n > MAX_SIZE)
+          return nullptr;
+        size_t size = MIN_SIZE;
+        while (size < n)
+          size *= 2;
+        Free();
+        m_buf = new unsigned char[size];
+        m_size = size;
+        pws_os::mlock(m_buf, m_size);
+      }
+      unsigned char *retval = m_buf + m_used;
+      m_used += n;
+      return retval;
+    }
+
+    void Give(unsigned char *p, size_t n)
+    {
+      ASSERT(p + n == m_buf + m_used); // last taken, first given
+      trashMemory(p, n);
+      m_used -= n;
+    }
+
+  private:
+    void Free()
+    {
+      if (m_buf != nullptr) {
+        pws_os::munlock(m_buf, m_size);
+        delete[] m_buf;
+        m_buf = nullptr;
+      }
+      m_size = 0;
+    }
+
+    unsigned char *m_buf;
+    size_t m_size, m_used;
+  };
+
+  thread_local Scratch tls_scratch;
+
+  void FingerprintField(ulong64 &h, unsigned char type, size_t length,
+                        const unsigned char *data)
+  {
+    // FNV-1a, a word rather than a byte at a time: data is whole blocks
+    const ulong64 prime = 0x100000001b3ULL;
+    h = (h ^ type) * prime;
+    h = (h ^ length) * prime;
+    const size_t n = BlockSize(length);
+    for (size_t i = 0; i + sizeof(ulong64) <= n; i += sizeof(ulong64)) {
+      ulong64 w;
+      memcpy(&w, data + i, sizeof(w));
+      h = (h ^ w) * prime;
+    }
+  }
+}
 
-//Returns the number of bytes of 8 byte blocks needed to store 'size' bytes
 size_t CItemField::GetBlockSize(size_t size) const
 {
-  return static_cast<size_t>(ceil(static_cast<double>(size) / 8.0)) * 8;
+  return BlockSize(size);
 }
 
 CItemField::CItemField(const CItemField &that)
@@ -78,20 +217,7 @@ void CItemField::Set(const unsigned char* value, size_t length,
       m_Length = 0; // at least keep structure consistent
       return;
     }
-
-    auto *tempmem = new unsigned char[BlockLength];
-    // invariant: BlockLength >= plainlength
-    memcpy_s(tempmem, BlockLength, value, m_Length);
-
-    //Fill the unused characters in with random stuff
-    PWSrand::GetInstance()->GetRandomData(tempmem + m_Length, static_cast<unsigned long>(BlockLength - m_Length));
-
-    //Do the actual encryption
-    for (size_t x = 0; x < BlockLength; x += 8)
-      bf->Encrypt(tempmem + x, m_Data + x);
-
-    trashMemory(tempmem, BlockLength);
-    delete[] tempmem;
+    EncryptField(value, m_Length, m_Data, bf);
   }
   if (type != 0xff)
     m_Type = type;
@@ -116,24 +242,7 @@ void CItemField::Get(unsigned char *value, size_t &length, const Fish *bf) const
   * Out: size of data stored: m_Length (No trailing zero!)
   * if In < BlockLength, assertion is triggered (no way to handle gracefully)
   */
-  if (m_Length == 0) {
-    value[0] = TCHAR('\0');
-    length = 0;
-  } else { // we have data to decrypt
-    size_t BlockLength = GetBlockSize(m_Length);
-    ASSERT(length >= BlockLength);
-    auto *tempmem = new unsigned char[BlockLength];
-
-    size_t x;
-    for (x = 0; x < BlockLength; x += 8)
-      bf->Decrypt(m_Data + x, tempmem + x);
-
-    for (x = 0; x < BlockLength; x++)
-      value[x] = (x < m_Length) ? tempmem[x] : 0;
-
-    length = m_Length;
-    delete [] tempmem;
-  }
+  DecryptField(m_Data, m_Length, value, length, bf);
 }
 
 void CItemField::Get(StringX &value, const Fish *bf) const
@@ -142,23 +251,256 @@ void CItemField::Get(StringX &value, const Fish *bf) const
   ASSERT((m_Length == 0 && m_Data == nullptr) ||
          (m_Length > 0 && m_Data != nullptr && m_Length % sizeof(TCHAR) == 0));
 
-  if (m_Length == 0) {
-    value = _T("");
-  } else { // we have data to decrypt
-    size_t BlockLength = GetBlockSize(m_Length);
-    auto *tempmem = new unsigned char[BlockLength];
-    TCHAR *pt = reinterpret_cast<TCHAR *>(tempmem);
-    size_t x;
+  DecryptField(m_Data, m_Length, value, bf);
+}
+
+void CItemField::Fingerprint(ulong64 &h) const
+{
+  FingerprintField(h, m_Type, m_Length, m_Data);
+}
 
-    // decrypt block by block
-    for (x = 0; x < BlockLength; x += 8)
-      bf->Decrypt(m_Data + x, tempmem + x);
+//-----------------------------------------------------------------------------
+// CItemFieldStore
+
+size_t CItemFieldStore::Field::GetSize() const
+{
+  return BlockSize(m_Length);
+}
+
+void CItemFieldStore::Field::Get(unsigned char *value, size_t &length, const Fish *bf) const
+{
+  DecryptField(m_Data, m_Length, value, length, bf);
+}
+
+void CItemFieldStore::Field::Get(StringX &value, const Fish *bf) const
+{
+  ASSERT(m_Length % sizeof(TCHAR) == 0);
+  DecryptField(m_Data, m_Length, value, bf);
+}
 
-    // copy to value TCHAR by TCHAR
-    for (x = 0; x < m_Length/sizeof(TCHAR); x++)
-      value += pt[x];
+void CItemFieldStore::Field::Fingerprint(ulong64 &h) const
+{
+  FingerprintField(h, m_Type, m_Length, m_Data);
+}
 
-    trashMemory(tempmem, BlockLength);
-    delete [] tempmem;
+void CItemFieldStore::const_iterator::Seek(int ft)
+{
+  // Skip a word at a time past unset types
+  while (ft < NTYPES) {
+    const ulong64 bits = m_store->m_Present[ft / WORDBITS] >> (ft % WORDBITS);
+    if (bits == 0) {
+      ft = (ft / WORDBITS + 1) * WORDBITS;
+      continue;
+    }
+    if (bits & 1) {
+      m_value = value_type(ft, m_store->GetField(ft));
+      return;
+    }
+    ft++;
   }
+  m_value = value_type(NTYPES, Field());
+}
+
+CItemFieldStore::CItemFieldStore(const CItemFieldStore &that)
+  : m_Dir(nullptr), m_Count(that.m_Count), m_Used(that.m_Used),
+    m_Capacity(that.m_Used)
+{
+  memcpy(m_Present, that.m_Present, sizeof(m_Present));
+  if (m_Used > 0) {
+    m_Dir = new Entry[m_Used];
+    memcpy(m_Dir, that.m_Dir, m_Used * sizeof(Entry));
+  }
+}
+
+CItemFieldStore &CItemFieldStore::operator=(const CItemFieldStore &that)
+{
+  if (this != &that) {
+    if (m_Capacity < that.m_Used) {
+      auto *dir = new Entry[that.m_Used];
+      delete[] m_Dir;
+      m_Dir = dir;
+      m_Capacity = that.m_Used;
+    }
+    memcpy(m_Present, that.m_Present, sizeof(m_Present));
+    if (that.m_Used > 0)
+      memcpy(m_Dir, that.m_Dir, that.m_Used * sizeof(Entry));
+    m_Count = that.m_Count;
+    m_Used = that.m_Used;
+  }
+  return *this;
+}
+
+size_t CItemFieldStore::Rank(int ft) const
+{
+  size_t n = 0;
+  int i = 0;
+  for (; i < ft / WORDBITS; i++)
+    n += std::bitset<WORDBITS>(m_Present[i]).count();
+  if (ft % WORDBITS != 0)
+    n += std::bitset<WORDBITS>(m_Present[i] << (WORDBITS - ft % WORDBITS)).count();
+  return n;
+}
+
+CItemFieldStore::Field CItemFieldStore::GetField(int ft) const
+{
+  ASSERT(IsSet(ft));
+  const Entry &e = m_Dir[Rank(ft)];
+  const Entry *blocks = m_Dir + m_Count + e.offset;
+  return Field(static_cast<unsigned char>(ft), e.length,
+               reinterpret_cast<const unsigned char *>(blocks));
+}
+
+void CItemFieldStore::Reserve(size_t units)
+{
+  if (units <= m_Capacity)
+    return;
+  // Fields are mostly set one after the other as they're read,
+  // so grow geometrically
+  const size_t capacity = std::max(units, m_Capacity + m_Capacity / 2);
+  auto *dir = new Entry[capacity];
+  if (m_Used > 0)
+    memcpy(dir, m_Dir, m_Used * sizeof(Entry));
+  delete[] m_Dir;
+  m_Dir = dir;
+  m_Capacity = capacity;
+}
+
+void CItemFieldStore::Reset()
+{
+  memset(m_Present, 0, sizeof(m_Present));
+  m_Count = m_Used = 0;
+}
+
+void CItemFieldStore::Set(int ft, const unsigned char *value, size_t length,
+                          const Fish *bf)
+{
+  ASSERT(ft >= 0 && ft < NTYPES);
+  ASSERT(length <= 0xffffffffU);
+  if (length == 0) {
+    erase(ft);
+    return;
+  }
+
+  const size_t i = Rank(ft);
+  const bool isSet = IsSet(ft);
+  const size_t oldUnits = isSet ? Units(m_Dir[i].length) : 0;
+  const size_t newUnits = Units(length);
+  Reserve(m_Used + (isSet ? 0 : 1) + newUnits - oldUnits);
+
+  if (!isSet) {
+    // New directory entry at i, pointing where the next field starts
+    const size_t offset = (i < m_Count) ? m_Dir[i].offset : m_Used - m_Count;
+    memmove(m_Dir + i + 1, m_Dir + i, (m_Used - i) * sizeof(Entry));
+    m_Dir[i].offset = static_cast<uint32>(offset);
+    m_Dir[i].length = 0;
+    m_Present[ft / WORDBITS] |= ulong64(1) << (ft % WORDBITS);
+    m_Count++;
+    m_Used++;
+  }
+
+  // Resize the field's blocks, moving those of the fields after it
+  const size_t n = m_Count;
+  Entry *blocks = m_Dir + n;
+  const size_t start = m_Dir[i].offset;
+  if (newUnits != oldUnits) {
+    const size_t tail = m_Used - n - (start + oldUnits);
+    memmove(blocks + start + newUnits, blocks + start + oldUnits, tail * sizeof(Entry));
+    for (size_t j = i + 1; j < n; j++)
+      m_Dir[j].offset = static_cast<uint32>(m_Dir[j].offset + newUnits - oldUnits);
+    m_Used = m_Used + newUnits - oldUnits;
+  }
+  m_Dir[i].length = static_cast<uint32>(length);
+  EncryptField(value, length, reinterpret_cast<unsigned char *>(blocks + start), bf);
+}
+
+void CItemFieldStore::Set(int ft, const StringX &value, const Fish *bf)
+{
+  Set(ft, reinterpret_cast<const unsigned char *>(value.c_str()),
+      value.length() * sizeof(TCHAR), bf);
+}
+
+size_t CItemFieldStore::erase(int ft)
+{
+  if (!IsSet(ft))
+    return 0;
+
+  const size_t n = m_Count;
+  const size_t i = Rank(ft);
+  const size_t units = Units(m_Dir[i].length);
+  const size_t start = m_Dir[i].offset;
+
+  // Drop the field's blocks, then its directory entry
+  Entry *blocks = m_Dir + n;
+  const size_t tail = m_Used - n - (start + units);
+  memmove(blocks + start, blocks + start + units, tail * sizeof(Entry));
+  for (size_t j = i + 1; j < n; j++)
+    m_Dir[j].offset = static_cast<uint32>(m_Dir[j].offset - units);
+  memmove(m_Dir + i, m_Dir + i + 1, (m_Used - units - i - 1) * sizeof(Entry));
+
+  m_Count--;
+  m_Used -= units + 1;
+  m_Present[ft / WORDBITS] &= ~(ulong64(1) << (ft % WORDBITS));
+  return 1;
+}
+
+void CItemFieldStore::clear()
+{
+  delete[] m_Dir;
+  m_Dir = nullptr;
+  m_Capacity = 0;
+  Reset();
+}
+
+//-----------------------------------------------------------------------------
+// CItemFieldView
+
+CItemFieldView::CItemFieldView(const CItemField &field, const Fish *bf)
+  : m_Data(nullptr), m_Length(0), m_Size(0), m_Scratch(false)
+{
+  Decrypt(field.m_Data, field.m_Length, bf);
+}
+
+CItemFieldView::CItemFieldView(const CItemFieldStore::Field &field, const Fish *bf)
+  : m_Data(nullptr), m_Length(0), m_Size(0), m_Scratch(false)
+{
+  Decrypt(field.m_Data, field.m_Length, bf);
+}
+
+void CItemFieldView::Decrypt(const unsigned char *data, size_t length, const Fish *bf)
+{
+  ASSERT(m_Data == nullptr);
+  if (length == 0)
+    return;
+  m_Size = BlockSize(length);
+  m_Data = tls_scratch.Take(m_Size);
+  m_Scratch = m_Data != nullptr;
+  if (!m_Scratch) // too big, or out of turn
+    m_Data = new unsigned char[m_Size];
+  size_t len = m_Size;
+  DecryptField(data, length, m_Data, len, bf);
+  m_Length = len;
+}
+
+CItemFieldView::~CItemFieldView()
+{
+  if (m_Data == nullptr)
+    return;
+  if (m_Scratch) {
+    tls_scratch.Give(m_Data, m_Size);
+  } else {
+    trashMemory(m_Data, m_Size);
+    delete[] m_Data;
+  }
+}
+
+bool CItemFieldView::Find(const StringX &s, bool bCaseSensitive) const
+{
+  if (s.empty())
+    return true;
+  const TCHAR *text = GetText(), *end = text + GetTextLength();
+  if (bCaseSensitive)
+    return std::search(text, end, s.begin(), s.end()) != end;
+  // As FindNoCase(), without lower-casing copies of both
+  return std::search(text, end, s.begin(), s.end(),
+                     [](TCHAR a, TCHAR b) {return _totlower(a) == _totlower(b);}) != end;
 }
@@ -13,6 +13,9 @@
 
 #include "StringX.h"
 
+#include <cstring>
+#include <utility>
+
 //-----------------------------------------------------------------------------
 
 /*
@@ -22,6 +25,7 @@
 */
 
 class Fish;
+class CItemFieldView;
 
 class CItemField
 {
@@ -44,7 +48,12 @@ public:
   bool IsEmpty() const {return m_Length == 0;}
   void Empty();
 
+  // Mixes the field, as stored (i.e., encrypted), into h
+  void Fingerprint(ulong64 &h) const;
+
 private:
+  friend class CItemFieldView;
+
   //Number of 8 byte blocks needed for size
   size_t GetBlockSize(size_t size) const;
 
@@ -53,6 +62,152 @@ private:
   unsigned char *m_Data;
 };
 
+/*
+* CItemFieldStore holds all the fields of an item, encrypted as CItemField
+* would, keyed on their type (0..0xff). Instead of a node and a buffer
+* per field, a bitmap tells which types are set, and a single buffer holds
+* a directory entry per set field, in type order, followed by the fields'
+* blocks, in the same order. A field's directory entry is found by counting
+* the set types below it.
+*
+* The interface is that of a std::map<int, CItemField>, as far as CItem and
+* its subclasses used one: iterators yield {type, Field}, where Field is a
+* read-only view of the field as stored, valid until the store's changed.
+*/
+
+class CItemFieldStore
+{
+public:
+  class Field
+  {
+  public:
+    Field() : m_Type(0), m_Length(0), m_Data(nullptr) {}
+    unsigned char GetType() const {return m_Type;}
+    size_t GetLength() const {return m_Length;}
+    size_t GetSize() const; // as stored, i.e., whole blocks
+    bool IsEmpty() const {return m_Length == 0;}
+
+    // As CItemField's
+    void Get(StringX &value, const Fish *bf) const;
+    void Get(unsigned char *value, size_t &length, const Fish *bf) const;
+    void Fingerprint(ulong64 &h) const;
+
+  private:
+    friend class CItemFieldStore;
+    friend class CItemFieldView;
+    Field(unsigned char type, size_t length, const unsigned char *data)
+      : m_Type(type), m_Length(length), m_Data(data) {}
+
+    unsigned char m_Type;
+    size_t m_Length;
+    const unsigned char *m_Data;
+  };
+
+  typedef std::pair<int, Field> value_type;
+
+  class const_iterator
+  {
+  public:
+    const value_type &operator*() const {return m_value;}
+    const value_type *operator->() const {return &m_value;}
+    const_iterator &operator++() {Seek(m_value.first + 1); return *this;}
+    const_iterator operator++(int) {const_iterator tmp(*this); ++*this; return tmp;}
+    bool operator==(const const_iterator &that) const {return m_value.first == that.m_value.first;}
+    bool operator!=(const const_iterator &that) const {return m_value.first != that.m_value.first;}
+
+  private:
+    friend class CItemFieldStore;
+    const_iterator(const CItemFieldStore *store, int ft) : m_store(store) {Seek(ft);}
+    void Seek(int ft); // to first set type >= ft, or end
+
+    const CItemFieldStore *m_store;
+    value_type m_value;
+  };
+  typedef const_iterator iterator;
+
+  CItemFieldStore() : m_Dir(nullptr), m_Count(0), m_Used(0), m_Capacity(0) {Reset();}
+  CItemFieldStore(const CItemFieldStore &that);
+  ~CItemFieldStore() {delete[] m_Dir;}
+
+  CItemFieldStore &operator=(const CItemFieldStore &that);
+
+  const_iterator begin() const {return const_iterator(this, 0);}
+  const_iterator end() const {return const_iterator(this, NTYPES);}
+  const_iterator find(int ft) const {return IsSet(ft) ? const_iterator(this, ft) : end();}
+  size_t count(int ft) const {return IsSet(ft) ? 1 : 0;}
+  size_t size() const {return m_Count;}
+  bool empty() const {return m_Count == 0;}
+
+  // Encrypts value into field ft, replacing whatever was there.
+  // Setting a field to nothing (length == 0) erases it.
+  void Set(int ft, const unsigned char *value, size_t length, const Fish *bf);
+  void Set(int ft, const StringX &value, const Fish *bf);
+  size_t erase(int ft);
+  void clear();
+
+private:
+  enum {NTYPES = 0x100, WORDBITS = 64};
+  // Directory entries and fields' blocks are both counted in 8 byte units
+  struct Entry {
+    uint32 offset; // from the first field's block, in units
+    uint32 length; // bytes of plaintext
+  };
+  static size_t Units(size_t length) {return (length + sizeof(Entry) - 1) / sizeof(Entry);}
+
+  bool IsSet(int ft) const
+  {return ft >= 0 && ft < NTYPES && (m_Present[ft / WORDBITS] >> (ft % WORDBITS)) & 1;}
+  size_t Rank(int ft) const; // number of set types below ft
+  Field GetField(int ft) const; // ft must be set
+  void Reserve(size_t units);
+  void Reset();
+
+  ulong64 m_Present[NTYPES / WORDBITS];
+  Entry *m_Dir; // m_Used units: m_Count entries, then the fields' blocks
+  size_t m_Count, m_Used, m_Capacity;
+};
+
+/*
+* CItemFieldView decrypts a field for looking at it (comparing, hashing,
+* searching) without making a StringX of it. The plaintext is in scratch
+* memory that's locked and per-thread, or on the heap if the field's large,
+* and is wiped when the view goes. Views are meant to be locals.
+*/
+
+class CItemFieldView
+{
+public:
+  CItemFieldView() : m_Data(nullptr), m_Length(0), m_Size(0), m_Scratch(false) {}
+  CItemFieldView(const CItemField &field, const Fish *bf);
+  CItemFieldView(const CItemFieldStore::Field &field, const Fish *bf);
+  ~CItemFieldView();
+
+  const unsigned char *GetData() const {return m_Data;}
+  size_t GetLength() const {return m_Length;}
+
+  // For fields set from a StringX
+  const TCHAR *GetText() const {return reinterpret_cast<const TCHAR *>(m_Data);}
+  size_t GetTextLength() const {return m_Length / sizeof(TCHAR);}
+
+  bool operator==(const CItemFieldView &that) const
+  {return m_Length == that.m_Length && (m_Length == 0 || memcmp(m_Data, that.m_Data, m_Length) == 0);}
+  bool operator!=(const CItemFieldView &that) const {return !(*this == that);}
+  bool operator==(const StringX &s) const
+  {return GetTextLength() == s.length() && (m_Length == 0 || memcmp(m_Data, s.data(), m_Length) == 0);}
+  bool operator!=(const StringX &s) const {return !(*this == s);}
+
+  // Whether the text contains s, case-insensitively unless bCaseSensitive
+  bool Find(const StringX &s, bool bCaseSensitive) const;
+
+private:
+  CItemFieldView(const CItemFieldView &) = delete;
+  CItemFieldView &operator=(const CItemFieldView &) = delete;
+  void Decrypt(const unsigned char *data, size_t length, const Fish *bf);
+
+  unsigned char *m_Data;
+  size_t m_Length, m_Size;
+  bool m_Scratch; // m_Data's from the scratch memory, rather than the heap
+};
+
 #endif /* __ITEMFIELD_H */
 //-----------------------------------------------------------------------------
 // Local variables:
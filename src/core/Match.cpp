@@ -15,8 +15,62 @@
 
 #include "os/pws_tchar.h"
 
+#include <algorithm>
 #include <time.h>
 
+// Whether n TCHARs at a and b are the same, ignoring case unless bCase
+static bool SameText(const TCHAR *a, const TCHAR *b, size_t n, bool bCase)
+{
+  if (bCase)
+    return n == 0 || memcmp(a, b, n * sizeof(TCHAR)) == 0;
+  for (size_t i = 0; i < n; i++)
+    if (_totlower(a[i]) != _totlower(b[i]))
+      return false;
+  return true;
+}
+
+bool PWSMatch::Match(const TCHAR *value, size_t vlen, const TCHAR *object, size_t olen,
+                     int iFunction)
+{
+  // Negative = Case   Sensitive
+  // Positive = Case INsensitive
+  const bool bCase = iFunction < 0;
+  auto same = [bCase](TCHAR a, TCHAR b) {
+    return bCase ? a == b : _totlower(a) == _totlower(b);
+  };
+
+  // Same results as Match(StringX, StringX, int), down to ENDS needing
+  // the object to be longer than the value
+  switch (iFunction) {
+    case -MR_EQUALS:
+    case  MR_EQUALS:
+      return olen == vlen && SameText(object, value, vlen, bCase);
+    case -MR_NOTEQUAL:
+    case  MR_NOTEQUAL:
+      return olen != vlen || !SameText(object, value, vlen, bCase);
+    case -MR_BEGINS:
+    case  MR_BEGINS:
+      return olen >= vlen && SameText(object, value, vlen, bCase);
+    case -MR_NOTBEGIN:
+    case  MR_NOTBEGIN:
+      return olen < vlen || !SameText(object, value, vlen, bCase);
+    case -MR_ENDS:
+    case  MR_ENDS:
+      return olen > vlen && SameText(object + olen - vlen, value, vlen, bCase);
+    case -MR_NOTEND:
+    case  MR_NOTEND:
+      return olen <= vlen || !SameText(object + olen - vlen, value, vlen, bCase);
+    case -MR_CONTAINS:
+    case  MR_CONTAINS:
+      return vlen == 0 || std::search(object, object + olen, value, value + vlen, same) != object + olen;
+    case -MR_NOTCONTAIN:
+    case  MR_NOTCONTAIN:
+      return vlen != 0 && std::search(object, object + olen, value, value + vlen, same) == object + olen;
+    default:
+      return Match(StringX(value, vlen), StringX(object, olen), iFunction);
+  }
+}
+
 bool PWSMatch::Match(const StringX &stValue, StringX sx_Object,
                      const int &iFunction)
 {
@@ -56,6 +56,10 @@ namespace PWSMatch {
 
   // Generalised checking
   bool Match(const StringX &stValue, StringX sx_Object, const int &iFunction);
+  // Same, with the value and object as TCHAR ranges, e.g., a CItemFieldView's.
+  // The usual rules don't copy either.
+  bool Match(const TCHAR *value, size_t vlen, const TCHAR *object, size_t olen,
+             int iFunction);
 
   template<typename T> bool Match(T v1, T v2, T value, int iFunction)
   {
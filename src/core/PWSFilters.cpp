@@ -666,9 +666,7 @@ std::string PWSFilters::GetFilterXMLHeader(const StringX &currentfile,
       oss << "\"" << endl;
     }
 
-    CUUID huuid(*hdr.m_file_uuid.GetARep(), true); // true to print canonically
-
-    oss << "Database_uuid=\"" << huuid << "\"" << endl;
+    oss << "Database_uuid=\"" << hdr.m_file_uuid.Canonical() << "\"" << endl;
   }
   oss << "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"" << endl;
   oss << "xsi:noNamespaceSchemaLocation=\"pwsafe_filter.xsd\">" << endl;
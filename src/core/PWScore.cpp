@@ -9,6 +9,8 @@
 //-----------------------------------------------------------------------------
 
 #include "PWScore.h"
+#include "PWSjournal.h"
+#include "PWSfileV4.h"
 #include "core.h"
 #include "crypto/TwoFish.h"
 #include "PWSprefs.h"
@@ -38,6 +40,13 @@
 #include <algorithm>
 #include <set>
 #include <iterator>
+#include <memory>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
 
 const TCHAR *PWScore::GROUPTITLEUSERINCHEVRONS = _T("\xab%ls\xbb \xab%ls\xbb \xab%ls\xbb");
 
@@ -134,12 +143,15 @@ PWScore::PWScore() :
                      m_lockFileHandle(INVALID_HANDLE_VALUE),
                      m_lockFileHandle2(INVALID_HANDLE_VALUE),
                      m_ReadFileVersion(PWSfile::UNKNOWN_VERSION),
+                     m_nReadThreads(0), m_nWriteThreads(0),
                      m_bIsReadOnly(false),
                      m_bNotifyDB(false),
                      m_bIsOpen(false),
                      m_nRecordsWithUnknownFields(0),
                      m_DBCurrentState(CLEAN),
                      m_pFileSig(nullptr),
+                     m_pJournal(nullptr),
+                     m_pAsyncSave(nullptr),
                      m_iAppHotKey(0)
 {
   // following should ideally be wrapped in a mutex
@@ -157,6 +169,9 @@ PWScore::PWScore() :
 
 PWScore::~PWScore()
 {
+  if (m_pAsyncSave != nullptr)
+    FinishWriteFile();
+
   // do NOT trash m_session_*, as there may be other cores around
   // relying on it. Trashing the ciphertext encrypted with it is enough
   const unsigned int BS = TwoFish::BLOCKSIZE;
@@ -172,6 +187,7 @@ PWScore::~PWScore()
   m_vModifiedEmptyGroups.clear();
 
   delete m_pFileSig;
+  delete m_pJournal;
 }
 
 void PWScore::SetApplicationNameAndVersion(const stringT &appName,
@@ -257,6 +273,7 @@ void PWScore::DoAddEntry(const CItemData &item, const CItemAtt *att)
   // Also "UndoDeleteEntry" !
   ASSERT(m_pwlist.find(item.GetUUID()) == m_pwlist.end());
   m_pwlist[item.GetUUID()] = item;
+  AddToGTUIndex(item);
 
   if (item.NumberUnknownFields() > 0)
     IncrementNumRecordsWithUnknownFields();
@@ -376,6 +393,7 @@ void PWScore::DoDeleteEntry(const CItemData &item)
     if (iKBShortcut != 0)
       VERIFY(DelKBShortcut(iKBShortcut, item.GetUUID()));
 
+    RemoveFromGTUIndex(pos->second);
     m_pwlist.erase(pos); // at last!
 
     if (item.NumberUnknownFields() > 0)
@@ -399,7 +417,11 @@ void PWScore::DoReplaceEntry(const CItemData &old_ci, const CItemData &new_ci)
 {
   // Assumes that old_uuid == new_uuid
   ASSERT(old_ci.GetUUID() == new_ci.GetUUID());
+  auto pos = m_pwlist.find(old_ci.GetUUID());
+  if (pos != m_pwlist.end())
+    RemoveFromGTUIndex(pos->second);
   m_pwlist[old_ci.GetUUID()] = new_ci;
+  AddToGTUIndex(new_ci);
   if (old_ci.GetEntryType() != new_ci.GetEntryType() || old_ci.GetStatus() != new_ci.GetStatus() ||
       old_ci.IsProtected() != new_ci.IsProtected())
     GUIRefreshEntry(new_ci);
@@ -464,6 +486,9 @@ void PWScore::DoReplaceAttachment(const CItemAtt &old_cia, const CItemAtt &new_c
 
 void PWScore::ClearDBData()
 {
+  if (m_pAsyncSave != nullptr)
+    FinishWriteFile();
+
   const unsigned int BS = TwoFish::BLOCKSIZE;
   if (m_passkey_len > 0) {
     trashMemory(m_passkey, ((m_passkey_len + (BS - 1)) / BS) * BS);
@@ -475,6 +500,7 @@ void PWScore::ClearDBData()
 
   //Composed of ciphertext, so doesn't need to be overwritten
   m_pwlist.clear();
+  m_gtu_index.clear();
   m_attlist.clear();
 
   // Clear out out dependents mappings
@@ -497,6 +523,11 @@ void PWScore::ClearDBData()
   m_vEmptyGroups.clear();
   m_InitialEmptyGroups.clear();
 
+  // Nothing to journal to
+  delete m_pJournal;
+  m_pJournal = nullptr;
+  m_saved = SavedState();
+
   // Reset DB pre-command state to clean
   m_DBCurrentState = CLEAN;
 
@@ -573,6 +604,235 @@ private:
   const PWSfile::VERSION m_version;
 };
 
+/**
+ * For V3 and later, turning a record into fields (decrypting it from
+ * memory, UTF-8 conversion, ...) is independent of the file, so worker
+ * threads do that in batches, while this thread encrypts the batches
+ * and writes them out in order, as RecordWriter would have.
+ */
+static void WriteRecordsConcurrently(PWSfile *out, ItemList &pwlist,
+                                     unsigned nworkers,
+                                     const PWScore::SaveProgress &progress,
+                                     size_t total)
+{
+  enum {BatchSize = 256, MaxAhead = 8};
+
+  std::vector<CItemData *> items;
+  items.reserve(pwlist.size());
+  for (auto &p : pwlist)
+    items.push_back(&p.second);
+
+  const size_t nbatches = (items.size() + BatchSize - 1) / BatchSize;
+  std::vector<std::vector<unsigned char>> fields(nbatches);
+  std::vector<bool> ready(nbatches, false);
+  size_t next = 0, written = 0;
+  bool stop = false;
+  std::exception_ptr error;
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  auto worker = [&]() {
+    for (;;) {
+      size_t b;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] {return stop || next >= nbatches || next < written + MaxAhead;});
+        if (stop || next >= nbatches)
+          return;
+        b = next++;
+      }
+      try {
+        PWSfile::FieldCollector collector(fields[b]);
+        const size_t end = std::min(items.size(), (b + 1) * BatchSize);
+        for (size_t i = b * BatchSize; i < end; i++)
+          out->WriteRecord(*items[i]);
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (!error)
+          error = std::current_exception();
+        stop = true;
+        cv.notify_all();
+        return;
+      }
+      std::lock_guard<std::mutex> guard(mutex);
+      ready[b] = true;
+      cv.notify_all();
+    }
+  };
+
+  auto wipe = [&fields](size_t b) {
+    trashMemory(fields[b].data(), fields[b].size());
+    std::vector<unsigned char>().swap(fields[b]);
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < nworkers && t < nbatches; t++)
+    threads.emplace_back(worker);
+
+  try {
+    for (size_t b = 0; b < nbatches; b++) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] {return ready[b] || stop;});
+        if (!ready[b])
+          break; // a worker failed
+      }
+      out->WriteFields(fields[b]);
+      wipe(b);
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        written = b + 1;
+        cv.notify_all();
+      }
+      if (progress)
+        progress(std::min(items.size(), (b + 1) * BatchSize), total);
+    }
+  } catch (...) {
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      stop = true;
+      cv.notify_all();
+    }
+    for (auto &t : threads)
+      t.join();
+    for (size_t b = 0; b < nbatches; b++)
+      wipe(b);
+    throw;
+  }
+
+  for (auto &t : threads)
+    t.join();
+  if (error) {
+    for (size_t b = 0; b < nbatches; b++)
+      wipe(b);
+    std::rethrow_exception(error);
+  }
+
+  for (auto *item : items)
+    item->ClearStatus();
+}
+
+/**
+ * Attachment content is encrypted with its own keys, apart from the main
+ * CBC chain, so content that WriteFile() only left room for can be
+ * copied there (and verified) in any order. Worker threads each take the
+ * next attachment, largest first, writing through a stream of their own.
+ */
+static void CopyAttContentsConcurrently(PWSfileV4 *out,
+                                        const CItemAtt::ContentOffsets &written,
+                                        const PWScore::SaveProgress &progress,
+                                        size_t done, size_t total, unsigned nThreads)
+{
+  std::vector<std::pair<const CItemAtt *, long>> atts;
+  for (const auto &w : written)
+    if (w.second >= 0)
+      atts.push_back(std::make_pair(w.first, w.second));
+  if (atts.empty())
+    return;
+  std::sort(atts.begin(), atts.end(),
+            [](const std::pair<const CItemAtt *, long> &a,
+               const std::pair<const CItemAtt *, long> &b)
+            {return a.first->GetContentLength() > b.first->GetContentLength();});
+
+  std::atomic<size_t> next(0);
+  std::atomic<int> status(PWSfile::SUCCESS);
+  std::mutex progressMutex;
+  auto worker = [&]() {
+    FILE *fd = out->OpenContentStream();
+    int rc = (fd != nullptr) ? PWSfile::SUCCESS : PWSfile::CANT_OPEN_FILE;
+    try {
+      for (size_t i = next++; rc == PWSfile::SUCCESS && i < atts.size(); i = next++) {
+        if (status != PWSfile::SUCCESS)
+          break; // another worker failed, no point going on
+        rc = atts[i].first->CopyContent(fd, atts[i].second);
+        if (rc == PWSfile::SUCCESS && progress) {
+          std::lock_guard<std::mutex> guard(progressMutex);
+          progress(++done, total);
+        }
+      }
+    } catch (...) {
+      rc = PWSfile::FAILURE;
+    }
+    if (fd != nullptr && pws_os::FClose(fd, false) != 0 && rc == PWSfile::SUCCESS)
+      rc = PWSfile::WRITE_FAIL;
+    if (rc != PWSfile::SUCCESS) {
+      int expected = PWSfile::SUCCESS;
+      status.compare_exchange_strong(expected, rc);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < std::min(size_t(std::max(nThreads, 1u)), atts.size());
+       t++)
+    threads.emplace_back(worker);
+  worker(); // this thread's one of the pool
+  for (auto &t : threads)
+    t.join();
+
+  if (status != PWSfile::SUCCESS)
+    throw(status.load());
+}
+
+void PWScore::WriteRecords(PWSfile *out, PWSfile::VERSION version,
+                           ItemList &pwlist, AttList &attlist,
+                           CItemAtt::ContentOffsets &written, AttPtrs &lost,
+                           const SaveProgress &progress)
+{
+  const size_t total = pwlist.size() + (version >= PWSfile::V40 ? attlist.size() : 0);
+  size_t done = 0;
+
+  const unsigned nThreads = (m_nWriteThreads != 0) ?
+    m_nWriteThreads : std::thread::hardware_concurrency();
+  if (version >= PWSfile::V30 && nThreads > 1) {
+    WriteRecordsConcurrently(out, pwlist, nThreads - 1, progress, total);
+    done = pwlist.size();
+  } else {
+    RecordWriter write_record(out, this, version);
+    for (auto &p : pwlist) {
+      write_record(p);
+      if (progress)
+        progress(++done, total);
+    }
+  }
+
+  // Write attachments (only from V4)
+  if (version >= PWSfile::V40) {
+    // Content that's yet to be loaded is just given room at first
+    for_each(attlist.begin(), attlist.end(),
+             [&](std::pair<CUUID const, CItemAtt> &p)
+             {
+               // Better to save the rest than none at all
+               if (!p.second.IsContentAvailable()) {
+                 lost.push_back(&p.second);
+                 done++;
+                 return;
+               }
+               long offset;
+               if (p.second.Write(out, &offset, true) != PWSfile::SUCCESS)
+                 throw(PWSfile::FAILURE);
+               written[&p.second] = offset;
+               if (offset < 0)
+                 done++; // nothing to copy
+             } );
+    if (progress && done > pwlist.size())
+      progress(done, total);
+    CopyAttContentsConcurrently(dynamic_cast<PWSfileV4 *>(out), written,
+                                progress, done, total, nThreads);
+  }
+}
+
+void PWScore::ReportLostAtts(const AttPtrs &lost) const
+{
+  if (m_pReporter == nullptr)
+    return;
+  for (const auto *att : lost) {
+    stringT cs_msg;
+    Format(cs_msg, IDSC_ATTCONTENTLOST, att->GetTitle().c_str(),
+           att->GetFileName().c_str());
+    (*m_pReporter)(cs_msg);
+  }
+}
+
 int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
                        bool bUpdateSig)
 {
@@ -580,6 +840,10 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
 
   int status;
 
+  // One save at a time, see StartWriteFile()
+  if (m_pAsyncSave != nullptr)
+    FinishWriteFile();
+
   PWSfile *out = PWSfile::MakePWSfile(filename, GetPassKey(), version,
                                       PWSfile::Write, status);
 
@@ -597,6 +861,8 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
 
   // If writing in a prior version format (ie. exporting) - save the header
   const PWSfileHeader saved_hdr = m_hdr;
+  CItemAtt::ContentOffsets written; // see CItemAtt::Replaced()
+  AttPtrs lost;
 
   m_hdr.m_prefString = PWSprefs::GetInstance()->Store();
   m_hdr.m_whatlastsaved = m_AppNameAndVersion.c_str();
@@ -622,16 +888,12 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
       return status;
     }
 
-    RecordWriter write_record(out, this, version);
-    for_each(m_pwlist.begin(), m_pwlist.end(), write_record);
+    WriteRecords(out, version, m_pwlist, m_attlist, written, lost, nullptr);
 
-    // Write attachments (only from V4)
-    if (version >= PWSfile::V40)
-      for_each(m_attlist.begin(), m_attlist.end(),
-               [&](std::pair<CUUID const, CItemAtt> &p)
-               {
-                 p.second.Write(out);
-               } );
+    // Whatever else has content in the file we're about to replace
+    // had better load it now
+    if (version >= PWSfile::V40 && bUpdateSig)
+      CItemAtt::PrepareToReplace(filename.c_str(), written);
 
     // Update header if V30 or later (no headers before V30)
     if (version >= PWSfile::V30) {
@@ -640,6 +902,7 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
   }
 
   catch (...) {
+    out->Abort(); // keep whatever was there before
     out->Close();
     delete out;
 
@@ -649,9 +912,15 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
     return FAILURE;
   }
 
-  out->Close();
+  const int closeStatus = out->Close();
+  unsigned char jkey[SHA256::HASHLEN];
+  const bool bJournalKey = out->GetJournalKey(jkey);
   delete out;
 
+  // Attachments whose content we copied now find it in the new file
+  if (bUpdateSig && version == m_ReadFileVersion && closeStatus == PWSfile::SUCCESS)
+    CItemAtt::Replaced(filename.c_str(), written);
+
   // Update info if we're saving or upgrading.
   if (version >= m_ReadFileVersion) {
     // Set/Reset everything as "unchanged"
@@ -667,41 +936,328 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
     m_pFileSig = new PWSFileSig(filename.c_str());
 
   // If not exporting, set to clean
-  if (version == m_ReadFileVersion) {
-    // Set current state to CLEAN
-    m_DBCurrentState = CLEAN;
-
-    std::vector<DBStates>::iterator iter;
-
-    if (m_redo_DBState_iter != m_vDBState.end()) {
-      // Update command after of this one to be {before = CLEAN, after = DIRTY}
-      m_redo_DBState_iter->before = CLEAN;
-      m_redo_DBState_iter->after = DIRTY;
-
-      // Update all additional commands after of the next one to be
-      // {before = DIRTY, after = DIRTY}
-      iter = m_redo_DBState_iter + 1;
-      for (; iter != m_vDBState.end(); iter++) {
-        iter->before = DIRTY;
-        iter->after = DIRTY;
-      }
+  if (version == m_ReadFileVersion)
+    SetCleanDBState();
+
+  // Everything that was journaled is now in the database proper
+  if (bUpdateSig && version == m_ReadFileVersion) {
+    delete m_pJournal;
+    m_pJournal = nullptr;
+    if (bJournalKey && !m_isAuxCore) {
+      m_pJournal = new PWSjournal(filename, version, jkey);
+      m_pJournal->Remove();
+      RecordSavedState();
     }
+  }
+  trashMemory(jkey, sizeof(jkey));
+  ReportLostAtts(lost);
+  return SUCCESS;
+}
+
+/**
+ * What StartWriteFile() writes is a copy of the core as it was then, so
+ * Commands can change the core meanwhile. The worker thread only ever
+ * touches the copy and the file, which it leaves open: putting the file in
+ * place and updating the core are up to FinishWriteFile(), on the thread
+ * that owns the core.
+ */
+struct PWScore::AsyncSave {
+  static const size_t NOPOS = ~size_t(0);
+
+  StringX filename;
+  PWSfile::VERSION version;
+  PWSfileHeader hdr;
+  ItemList pwlist;
+  AttList attlist;
+  SavedState saved; // as of the above, fingerprints by the worker
+  UUIDList RUEList;
+  size_t statePos;  // of m_vDBState, NOPOS once undone and overwritten
+
+  PWSfile *out;
+  CItemAtt::ContentOffsets written;
+  AttPtrs lost; // in attlist
+  int status;
+  std::thread worker;
+};
 
-    if (m_undo_DBState_iter != m_vDBState.end()) {
-      // Update command before this one to be {before = DIRTY, after = CLEAN}
-      m_undo_DBState_iter->before = DIRTY;
-      m_undo_DBState_iter->after = CLEAN;
+int PWScore::StartWriteFile(const StringX &filename, PWSfile::VERSION version,
+                            const SaveProgress &progress, const SaveDone &done)
+{
+  PWS_LOGIT;
+
+  if (m_pAsyncSave != nullptr)
+    FinishWriteFile();
+
+  if (version < PWSfile::V30 || version < m_ReadFileVersion)
+    return FAILURE; // WriteFile()'s for exporting
+
+  int status;
+  PWSfile *out = PWSfile::MakePWSfile(filename, GetPassKey(), version,
+                                      PWSfile::Write, status);
+  if (status != PWSfile::SUCCESS) {
+    delete out;
+    return status;
+  }
+
+  // As WriteFile() does before writing
+  m_hdr.m_prefString = PWSprefs::GetInstance()->Store();
+  m_hdr.m_whatlastsaved = m_AppNameAndVersion.c_str();
+  m_hdr.m_RUEList = m_RUEList;
 
-      // Update all additional commands before the previous one to be
-      // {before = DIRTY, after = DIRTY}
-      iter = m_undo_DBState_iter;
-      while (iter != m_vDBState.begin()) {
-        iter--;
-        iter->before = DIRTY;
-        iter->after = DIRTY;
+  out->SetHeader(m_hdr);
+  out->SetUnknownHeaderFields(m_UHFL);
+  out->SetNHashIters(GetHashIters());
+  out->SetDBFilters(m_MapDBFilters);
+  out->SetPasswordPolicies(m_MapPSWDPLC);
+  out->SetEmptyGroups(m_vEmptyGroups);
+
+  AsyncSave *save = new AsyncSave;
+  save->filename = filename;
+  save->version = version;
+  save->hdr = m_hdr;
+  save->pwlist = m_pwlist;
+  save->attlist = m_attlist;
+  GetSavedState(save->saved, false);
+  save->RUEList = m_RUEList;
+  save->statePos = GetDBStatePos();
+  save->out = out;
+  save->status = PWSfile::SUCCESS;
+
+  const StringX passkey = GetPassKey();
+  save->worker = std::thread([this, save, passkey, progress, done]() {
+    // Saved as UTF-8, as WriteFile() ensures by clearing PWS_PK_CP_ACP,
+    // but the environment's the owning thread's to change (see
+    // CheckPasskey()), not ours, so this is just for this thread
+    SetThreadPasskeyEncoding(true);
+    int rc = save->out->Open(passkey);
+    if (rc == PWSfile::SUCCESS) {
+      try { // exception thrown on write error
+        WriteRecords(save->out, save->version, save->pwlist, save->attlist,
+                     save->written, save->lost, progress);
+        save->hdr = save->out->GetHeader(); // update time saved, etc.
+        for (const auto &p : save->pwlist)
+          save->saved.entries[p.first] = p.second.GetFingerprint();
+        for (const auto &p : save->attlist)
+          save->saved.atts[p.first] = p.second.GetFingerprint();
+      } catch (...) {
+        save->out->Abort(); // keep whatever was there before
+        save->out->Close();
+        rc = PWSfile::FAILURE;
       }
     }
+    if (rc != PWSfile::SUCCESS) {
+      delete save->out;
+      save->out = nullptr;
+    }
+    save->status = rc;
+    if (done)
+      done(rc);
+  });
+
+  m_pAsyncSave = save;
+  return SUCCESS;
+}
+
+int PWScore::FinishWriteFile()
+{
+  PWS_LOGIT;
+
+  if (m_pAsyncSave == nullptr)
+    return SUCCESS;
+
+  std::unique_ptr<AsyncSave> save(m_pAsyncSave);
+  m_pAsyncSave = nullptr;
+  save->worker.join();
+  if (save->status != PWSfile::SUCCESS)
+    return save->status;
+
+  // Attachments in the core (or kept for Undo) that are copies of those
+  // written find their content in the new file, see WriteFile()
+  const stringT filename(save->filename.c_str());
+  CItemAtt::ContentOffsets &written = save->written;
+  if (save->version >= PWSfile::V40)
+    CItemAtt::PrepareToReplace(filename, written);
+
+  delete m_pFileSig;
+  m_pFileSig = nullptr;
+
+  const int closeStatus = save->out->Close();
+  unsigned char jkey[SHA256::HASHLEN];
+  const bool bJournalKey = save->out->GetJournalKey(jkey);
+  delete save->out;
+  if (closeStatus != PWSfile::SUCCESS) {
+    trashMemory(jkey, sizeof(jkey));
+    return closeStatus;
+  }
+
+  if (save->version == m_ReadFileVersion)
+    CItemAtt::Replaced(filename, written);
+
+  // As SetInitialValues(), but as of the snapshot
+  m_hdr.m_nCurrentMajorVersion = save->hdr.m_nCurrentMajorVersion;
+  m_hdr.m_nCurrentMinorVersion = save->hdr.m_nCurrentMinorVersion;
+  m_hdr.m_file_uuid = save->hdr.m_file_uuid;
+  m_hdr.m_whenlastsaved = save->hdr.m_whenlastsaved;
+  m_hdr.m_lastsavedby = save->hdr.m_lastsavedby;
+  m_hdr.m_lastsavedon = save->hdr.m_lastsavedon;
+  m_InitialDBName = save->hdr.m_DB_Name;
+  m_InitialDBDesc = save->hdr.m_DB_Description;
+  m_InitialDBPreferences = save->hdr.m_prefString;
+  m_InitialEmptyGroups = save->saved.emptyGroups;
+  m_InitialMapPSWDPLC = save->saved.policies;
+  m_InitialMapDBFilters = save->saved.filters;
+  m_InitialDisplayStatus = save->hdr.m_displaystatus;
+  m_InitialRUEList = save->RUEList;
+  m_ReadFileVersion = save->version;
+
+  m_pFileSig = new PWSFileSig(filename);
+
+  // Entries as written are no longer new or changed, and if nothing's
+  // happened since the snapshot, neither's the database
+  for (auto &p : m_pwlist) {
+    auto iter = save->saved.entries.find(p.first);
+    if (iter != save->saved.entries.end() && iter->second == p.second.GetFingerprint())
+      p.second.ClearStatus();
+  }
+  SetCleanDBState(save->statePos);
+  if (m_DBCurrentState == CLEAN) {
+    m_vModifiedNodes.clear();
+    m_vModifiedEmptyGroups.clear();
+  }
+
+  // Everything that was journaled is now in the database proper, and
+  // anything since is yet to be journaled
+  delete m_pJournal;
+  m_pJournal = nullptr;
+  if (bJournalKey && !m_isAuxCore) {
+    m_pJournal = new PWSjournal(save->filename, save->version, jkey);
+    m_pJournal->Remove();
+    m_saved = save->saved;
+  }
+  trashMemory(jkey, sizeof(jkey));
+  ReportLostAtts(save->lost);
+  return SUCCESS;
+}
+
+void PWScore::SetCleanDBState()
+{
+  SetCleanDBState(GetDBStatePos());
+}
+
+void PWScore::SetCleanDBState(size_t pos)
+{
+  // Only the state after the first pos commands is clean, i.e., the command
+  // taking us there (if any) goes from DIRTY to CLEAN, the next one (if
+  // any) from CLEAN to DIRTY and all others from DIRTY to DIRTY.
+  // pos is past the end if that state's no longer reachable.
+  for (size_t i = 0; i < m_vDBState.size(); i++) {
+    m_vDBState[i].before = (i == pos) ? CLEAN : DIRTY;
+    m_vDBState[i].after = (i + 1 == pos) ? CLEAN : DIRTY;
   }
+
+  m_DBCurrentState = (GetDBStatePos() == pos) ? CLEAN : DIRTY;
+}
+
+void PWScore::RecordSavedState()
+{
+  GetSavedState(m_saved);
+}
+
+void PWScore::GetSavedState(SavedState &saved, bool bFingerprints) const
+{
+  saved.entries.clear();
+  saved.atts.clear();
+  if (bFingerprints) {
+    for (const auto &p : m_pwlist)
+      saved.entries[p.first] = p.second.GetFingerprint();
+    for (const auto &p : m_attlist)
+      saved.atts[p.first] = p.second.GetFingerprint();
+  }
+
+  saved.dbName = m_hdr.m_DB_Name;
+  saved.dbDesc = m_hdr.m_DB_Description;
+  saved.prefs = m_hdr.m_prefString;
+  saved.hashIters = m_hashIters;
+  saved.emptyGroups = m_vEmptyGroups;
+  saved.policies = m_MapPSWDPLC;
+  saved.filters = m_MapDBFilters;
+}
+
+bool PWScore::HasJournal() const
+{
+  return m_pJournal != nullptr && m_pJournal->GetSize() > 0;
+}
+
+int PWScore::WriteJournal()
+{
+  PWS_LOGIT;
+
+  // After "Save As", the journal's that of the old file, and while
+  // StartWriteFile()'s writing, it's about to be replaced
+  if (m_pJournal == nullptr || m_bIsReadOnly || m_pAsyncSave != nullptr ||
+      m_pJournal->GetFilename() != PWSjournal::GetName(m_currfile) ||
+      m_pJournal->IsFull())
+    return FAILURE;
+
+  // Only entries and a few header fields are journaled
+  if (m_hashIters != m_saved.hashIters ||
+      m_vEmptyGroups != m_saved.emptyGroups ||
+      m_MapPSWDPLC != m_saved.policies ||
+      m_MapDBFilters != m_saved.filters ||
+      m_attlist.size() != m_saved.atts.size())
+    return FAILURE;
+
+  for (const auto &p : m_attlist) {
+    auto iter = m_saved.atts.find(p.first);
+    if (iter == m_saved.atts.end() || iter->second != p.second.GetFingerprint())
+      return FAILURE;
+  }
+
+  PWSjournal::Changes changes;
+  std::vector<std::pair<CUUID, ulong64>> changed;
+  size_t nSaved = 0; // entries that were there before
+  for (const auto &p : m_pwlist) {
+    const ulong64 fingerprint = p.second.GetFingerprint();
+    auto iter = m_saved.entries.find(p.first);
+    if (iter != m_saved.entries.end()) {
+      nSaved++;
+      if (iter->second == fingerprint)
+        continue;
+    }
+    changes.entries.insert(p);
+    changed.push_back(std::make_pair(p.first, fingerprint));
+  }
+  if (nSaved != m_saved.entries.size()) {
+    for (const auto &p : m_saved.entries)
+      if (m_pwlist.find(p.first) == m_pwlist.end())
+        changes.deleted.insert(p.first);
+  }
+
+  const StringX prefs = PWSprefs::GetInstance()->Store();
+  if (m_hdr.m_DB_Name != m_saved.dbName)
+    changes.header[PWSfile::HDR_DBNAME] = m_hdr.m_DB_Name;
+  if (m_hdr.m_DB_Description != m_saved.dbDesc)
+    changes.header[PWSfile::HDR_DBDESC] = m_hdr.m_DB_Description;
+  if (prefs != m_saved.prefs)
+    changes.header[PWSfile::HDR_NDPREFS] = prefs;
+
+  const int status = m_pJournal->Append(changes);
+  if (status != PWSfile::SUCCESS)
+    return status;
+
+  // As WriteFile() does, having written
+  for (const auto &p : changed) {
+    m_saved.entries[p.first] = p.second;
+    m_pwlist[p.first].ClearStatus();
+  }
+  for (const auto &uuid : changes.deleted)
+    m_saved.entries.erase(uuid);
+  m_hdr.m_prefString = m_saved.prefs = prefs;
+  m_saved.dbName = m_hdr.m_DB_Name;
+  m_saved.dbDesc = m_hdr.m_DB_Description;
+
+  SetInitialValues();
+  SetCleanDBState();
   return SUCCESS;
 }
 
@@ -836,6 +1392,7 @@ int PWScore::WriteExportFile(const StringX &filename, OrderedItemList *pOIL,
 
   }
   catch (...) {
+    out->Abort(); // keep whatever was there before
     out->Close();
     delete out;
     return FAILURE;
@@ -861,6 +1418,8 @@ void PWScore::ClearCommands()
   m_undo_iter = m_redo_iter = m_vpcommands.end();
 
   // Clear DB states
+  if (m_pAsyncSave != nullptr)
+    m_pAsyncSave->statePos = AsyncSave::NOPOS;
   m_vDBState.clear();
   m_undo_DBState_iter = m_redo_DBState_iter = m_vDBState.end();
 }
@@ -916,6 +1475,9 @@ int PWScore::Execute(Command *pcmd)
     // Now remove old commands past this one from vector
     m_vpcommands.erase(m_redo_iter, m_vpcommands.end());
     // Now remove old DB change states past this one from vector
+    // (and with them, perhaps, the state being saved)
+    if (m_pAsyncSave != nullptr && m_pAsyncSave->statePos > GetDBStatePos())
+      m_pAsyncSave->statePos = AsyncSave::NOPOS;
     m_vDBState.erase(m_redo_DBState_iter, m_vDBState.end());
   }
 
@@ -1064,6 +1626,11 @@ int PWScore::CheckPasskey(const StringX &filename, const StringX &passkey)
     delete[] t_passkey;
   }
 
+  // Checking the current file's passkey (unlocking, changing it) isn't
+  // followed by ReadFile, so there's no call for the stretched key(s)
+  if (!filename.empty() && filename == m_currfile)
+    PWSfile::ClearStretchedKeyCache();
+
   return status;
 }
 
@@ -1161,6 +1728,126 @@ void PWScore::ProcessReadEntry(CItemData &ci_temp,
 
   // Finally, add it to the list!
   m_pwlist.insert(std::make_pair(ci_temp.GetUUID(), ci_temp));
+  AddToGTUIndex(ci_temp);
+}
+
+namespace {
+  /**
+   * ReadFile runs as a two stage pipeline: a reader thread decrypts,
+   * authenticates and parses records (PWSfile::ReadRecord), while the
+   * calling thread validates and indexes them (ProcessReadEntry).
+   * Records are passed along in batches, so that locking isn't per record.
+   */
+  struct ReadBatch {
+    enum {MaxSize = 256};
+    struct Entry {
+      int status; // PWSfile::SUCCESS or FAILURE
+      CItemData item;
+    };
+    std::vector<Entry> entries;
+    std::vector<CItemAtt> atts;
+
+    size_t size() const {return entries.size() + atts.size();}
+    void clear() {entries.clear(); atts.clear();}
+  };
+
+  // Bounded hand-off between the stages. At most MaxBatches wait here,
+  // so a reader that outpaces the indexer doesn't buffer the database.
+  class ReadPipe {
+  public:
+    enum {MaxBatches = 8};
+    ReadPipe() : m_closed(false), m_cancelled(false) {}
+
+    // Reader side: false if the consumer has given up
+    bool Push(ReadBatch &batch) {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [this] {return m_q.size() < MaxBatches || m_cancelled;});
+      if (m_cancelled)
+        return false;
+      m_q.push_back(std::move(batch));
+      m_cv.notify_all();
+      return true;
+    }
+
+    void Close(std::exception_ptr error = nullptr) {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      m_closed = true;
+      m_error = error;
+      m_cv.notify_all();
+    }
+
+    // Consumer side: false once the reader's done and all's been taken
+    bool Pop(ReadBatch &batch) {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [this] {return !m_q.empty() || m_closed;});
+      if (m_q.empty())
+        return false;
+      batch = std::move(m_q.front());
+      m_q.pop_front();
+      m_cv.notify_all();
+      return true;
+    }
+
+    void Cancel() {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      m_cancelled = true;
+      m_cv.notify_all();
+    }
+
+    void RethrowError() const {
+      if (m_error)
+        std::rethrow_exception(m_error);
+    }
+
+  private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<ReadBatch> m_q;
+    bool m_closed, m_cancelled;
+    std::exception_ptr m_error;
+  };
+}
+
+// First stage of ReadFile: hands each full batch to sink, which
+// consumes it and returns false to stop reading.
+static void ReadRecords(PWSfile *in, const std::function<bool(ReadBatch &)> &sink)
+{
+  ReadBatch batch;
+  bool go = true;
+
+  do {
+    batch.entries.emplace_back();
+    ReadBatch::Entry &entry = batch.entries.back();
+    entry.status = in->ReadRecord(entry.item);
+    switch (entry.status) {
+      case PWSfile::FAILURE:
+      case PWSfile::SUCCESS:
+        break;
+      case PWSfile::WRONG_RECORD:
+      {
+        // See if this is a V4 attachment:
+        batch.entries.pop_back();
+        batch.atts.emplace_back();
+        if (batch.atts.back().Read(in) != PWSfile::SUCCESS) {
+          // XXX report problem!
+          batch.atts.pop_back();
+        }
+      }
+        break;
+      case PWSfile::END_OF_FILE:
+        go = false;
+        //[[fallthrough]];
+      default:
+        batch.entries.pop_back();
+        break;
+    } // switch
+
+    if (batch.size() >= ReadBatch::MaxSize || (!go && batch.size() > 0)) {
+      if (!sink(batch))
+        return;
+      batch.clear();
+    }
+  } while (go);
 }
 
 static void ReportReadErrors(CReport *pRpt,
@@ -1226,9 +1913,11 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
                                      PWSfile::Read, status, m_pAsker, m_pReporter);
 
   if (status != PWSfile::SUCCESS) {
+    PWSfile::ClearStretchedKeyCache();
     delete in;
     return status;
   }
+  in->SetThreads(m_nReadThreads);
 
   status = in->Open(a_passkey);
   if (status == PWSfile::WRONG_PASSWORD) {
@@ -1237,6 +1926,8 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
     status = in->Open(a_passkey);
     pws_os::setenv("PWS_PK_CP_ACP", ""); // no unsetenv() in Windows...
   }
+  // Any stretched keys from CheckPasskey/ReadVersion/Open have served their purpose
+  PWSfile::ClearStretchedKeyCache();
 
   // in the old times we could open even 1.x files
   // for compatibility reasons, we open them again, to see if this is really a "1.x" file
@@ -1264,8 +1955,35 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
     return UNKNOWN_VERSION;
   }
 
+  // What's been journaled since the database was last written, if anything,
+  // goes on top of what's in it
+  std::unique_ptr<PWSjournal> journal;
+  PWSjournal::Changes journaled;
+  unsigned char jkey[SHA256::HASHLEN];
+  if (in->GetJournalKey(jkey)) {
+    journal.reset(new PWSjournal(a_filename, m_ReadFileVersion, jkey));
+    trashMemory(jkey, sizeof(jkey));
+    journal->Read(journaled);
+  }
+
   m_hdr = in->GetHeader();
 
+  for (const auto &h : journaled.header) {
+    switch (h.first) {
+      case PWSfile::HDR_NDPREFS:
+        m_hdr.m_prefString = h.second;
+        break;
+      case PWSfile::HDR_DBNAME:
+        m_hdr.m_DB_Name = h.second;
+        break;
+      case PWSfile::HDR_DBDESC:
+        m_hdr.m_DB_Description = h.second;
+        break;
+      default:
+        break;
+    }
+  }
+
   m_RUEList = m_hdr.m_RUEList;
 
   if (!m_isAuxCore) { // aux. core does not modify db prefs in pref singleton
@@ -1294,9 +2012,6 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
 
   SetPassKey(a_passkey); // so user won't be prompted for saves
 
-  CItemData ci_temp;
-  bool go = true;
-
   m_hashIters = in->GetNHashIters();
   if (in->GetDBFilters() != nullptr) m_MapDBFilters = *in->GetDBFilters();
   if (in->GetPasswordPolicies() != nullptr) m_MapPSWDPLC = *in->GetPasswordPolicies();
@@ -1312,45 +2027,72 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
     pRpt->StartReport(IDSC_RPTVALIDATE, m_currfile.c_str());
   }
 
-  do {
-    ci_temp.Clear(); // Rather than creating a new one each time.
-    status = in->ReadRecord(ci_temp);
-    switch (status) {
-      case PWSfile::FAILURE:
-      {
+  auto processBatch = [&](ReadBatch &batch) {
+    for (auto &entry : batch.entries) {
+      if (entry.status == PWSfile::FAILURE && m_pReporter != nullptr) {
         // Show a useful(?) error message - better than
         // silently losing data (but not by much)
         // Best if title intact. What to do if not?
-        if (m_pReporter != nullptr) {
-          stringT cs_msg, cs_caption;
-          LoadAString(cs_caption, IDSC_READ_ERROR);
-          Format(cs_msg, IDSC_ENCODING_PROBLEM, ci_temp.GetTitle().c_str());
-          cs_msg = cs_caption + _S(": ") + cs_msg;
-          (*m_pReporter)(cs_msg);
+        stringT cs_msg, cs_caption;
+        LoadAString(cs_caption, IDSC_READ_ERROR);
+        Format(cs_msg, IDSC_ENCODING_PROBLEM, entry.item.GetTitle().c_str());
+        cs_msg = cs_caption + _S(": ") + cs_msg;
+        (*m_pReporter)(cs_msg);
+      }
+      if (!journaled.deleted.empty() &&
+          journaled.deleted.find(entry.item.GetUUID()) != journaled.deleted.end())
+        continue;
+      if (!journaled.entries.empty()) {
+        auto iter = journaled.entries.find(entry.item.GetUUID());
+        if (iter != journaled.entries.end()) {
+          ProcessReadEntry(iter->second, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID, st_vr);
+          journaled.entries.erase(iter);
+          continue;
         }
       }
-      //[[fallthrough]];
-      case PWSfile::SUCCESS:
-        ProcessReadEntry(ci_temp, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID, st_vr);
-        break;
-      case PWSfile::WRONG_RECORD: {
-        // See if this is a V4 attachment:
-        CItemAtt att;
-        status = att.Read(in);
-        if (status == PWSfile::SUCCESS) {
-          m_attlist.insert(std::make_pair(att.GetUUID(), att));
-        } else {
-          // XXX report problem!
+      ProcessReadEntry(entry.item, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID, st_vr);
+    }
+    for (auto &att : batch.atts)
+      m_attlist.insert(std::make_pair(att.GetUUID(), att));
+  };
+
+  const unsigned nThreads = (m_nReadThreads != 0) ?
+    m_nReadThreads : std::thread::hardware_concurrency();
+  try {
+    if (nThreads > 1) {
+      ReadPipe pipe;
+      std::thread reader([in, &pipe] {
+        try {
+          ReadRecords(in, [&pipe](ReadBatch &batch) {return pipe.Push(batch);});
+          pipe.Close();
+        } catch (...) {
+          pipe.Close(std::current_exception());
         }
+      });
+
+      try {
+        ReadBatch batch;
+        while (pipe.Pop(batch))
+          processBatch(batch);
+      } catch (...) {
+        pipe.Cancel();
+        reader.join();
+        throw;
       }
-        break;
-      case PWSfile::END_OF_FILE:
-        go = false;
-        break;
-      default:
-        break;
-    } // switch
-  } while (go);
+      reader.join();
+      pipe.RethrowError();
+    } else {
+      ReadRecords(in, [&processBatch](ReadBatch &batch) {processBatch(batch); return true;});
+    }
+  } catch (...) {
+    delete in; // closes the file, wiping what's been decrypted
+    throw;
+  }
+
+  // Entries added since the database was last written
+  for (auto &p : journaled.entries)
+    ProcessReadEntry(p.second, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID, st_vr);
+  journaled.clear();
 
   ParseDependants();
 
@@ -1361,6 +2103,14 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
 
   ReportReadErrors(pRpt, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID);
 
+  // Further changes can be journaled only if what we have in memory is
+  // what's in the file and its journal, i.e., nothing needed fixing
+  if (journal && !m_isAuxCore && closeStatus == SUCCESS &&
+      vGTU_INVALID_UUID.empty() && vGTU_DUPLICATE_UUID.empty()) {
+    m_pJournal = journal.release();
+    RecordSavedState();
+  }
+
   // Validate rest of things in the database (excluding duplicate UUIDs fixed above
   // as needed for m_pwlist - map uses UUID as its key)
   bool bValidateRC = !vGTU_INVALID_UUID.empty() || !vGTU_DUPLICATE_UUID.empty();
@@ -1476,6 +2226,9 @@ bool PWScore::BackupCurFile(unsigned int maxNumIncBackups, int backupSuffix,
                             const stringT &userBackupPrefix,
                             const stringT &userBackupDir, stringT &bu_fname)
 {
+  if (m_pAsyncSave != nullptr) // that's what it'd back up
+    FinishWriteFile();
+
   stringT cs_temp;
   const stringT path(m_currfile.c_str());
   stringT drv, dir, name, ext;
@@ -1546,7 +2299,17 @@ bool PWScore::BackupCurFile(unsigned int maxNumIncBackups, int backupSuffix,
 
   // Current file becomes backup
   // Directories along the specified backup path are created as needed
-  return pws_os::RenameFile(m_currfile.c_str(), bu_fname);
+  if (!pws_os::RenameFile(m_currfile.c_str(), bu_fname))
+    return false;
+  // Attachment content that's yet to be loaded went with it
+  CItemAtt::ContentMoved(m_currfile.c_str(), bu_fname);
+
+  // The backup's not complete without what's been journaled since. Copied,
+  // not renamed, so that it's still there should the save then fail.
+  if (HasJournal())
+    pws_os::CopyAFile(m_pJournal->GetFilename(),
+                      PWSjournal::GetName(StringX(bu_fname.c_str())));
+  return true;
 }
 
 void PWScore::ChangePasskey(const StringX &newPasskey)
@@ -1556,38 +2319,95 @@ void PWScore::ChangePasskey(const StringX &newPasskey)
   WriteCurFile(); // Save immediately!
 }
 
-// functor object type for find_if:
-struct FieldsMatch {
-  bool operator()(const std::pair<CUUID, CItemData> &p) {
-    const CItemData &item = p.second;
-    return (m_group == item.GetGroup() &&
-            m_title == item.GetTitle() &&
-            m_user  == item.GetUser());
+// FNV-1a over the three fields, with a separator that can't
+// appear in a field so that "ab"/"c" and "a"/"bc" differ
+static const size_t GTU_BASIS = static_cast<size_t>(14695981039346656037ULL);
+
+static void HashGTUField(size_t &h, const TCHAR *field, size_t length)
+{
+  const size_t prime = static_cast<size_t>(1099511628211ULL);
+  for (size_t i = 0; i < length; i++) {
+    h ^= static_cast<size_t>(field[i]);
+    h *= prime;
   }
-  FieldsMatch(const StringX &a_group, const StringX &a_title,
-              const StringX &a_user) :
-  m_group(a_group), m_title(a_title), m_user(a_user) {}
+  h ^= static_cast<size_t>(0xffff);
+  h *= prime;
+}
 
-private:
-  FieldsMatch& operator=(const FieldsMatch&) = delete;
-  const StringX &m_group;
-  const StringX &m_title;
-  const StringX &m_user;
-};
+static size_t HashGTU(const StringX &a_group, const StringX &a_title,
+                      const StringX &a_user)
+{
+  size_t h = GTU_BASIS;
+  const StringX *fields[] = {&a_group, &a_title, &a_user};
+  for (const StringX *pf : fields)
+    HashGTUField(h, pf->data(), pf->length());
+  return h;
+}
+
+// Same as HashGTU(ci.GetGroup(), ci.GetTitle(), ci.GetUser())
+static size_t HashGTU(const CItemData &ci)
+{
+  size_t h = GTU_BASIS;
+  const CItem::FieldType fields[] = {CItem::GROUP, CItem::TITLE, CItem::USER};
+  for (auto ft : fields)
+    ci.ViewField(ft, [&h](const CItemFieldView &view) {
+        HashGTUField(h, view.GetText(), view.GetTextLength());
+      });
+  return h;
+}
+
+// Same as value == item.GetField(ft), without copying the field out
+static bool FieldIs(const CItemData &item, CItem::FieldType ft, const StringX &value)
+{
+  bool retval = false;
+  item.ViewField(ft, [&retval, &value](const CItemFieldView &view) {retval = view == value;});
+  return retval;
+}
+
+void PWScore::AddToGTUIndex(const CItemData &ci)
+{
+  m_gtu_index.insert(GTUIndex::value_type(HashGTU(ci), ci.GetUUID()));
+}
+
+void PWScore::RemoveFromGTUIndex(const CItemData &ci)
+{
+  const CUUID entry_uuid = ci.GetUUID();
+  auto range = m_gtu_index.equal_range(HashGTU(ci));
+  for (auto iter = range.first; iter != range.second; iter++) {
+    if (iter->second == entry_uuid) {
+      m_gtu_index.erase(iter);
+      return;
+    }
+  }
+}
 
 // Finds stuff based on group, title & user fields only
 ItemListIter PWScore::Find(const StringX &a_group,const StringX &a_title,
                            const StringX &a_user)
 {
-  FieldsMatch fields_match(a_group, a_title, a_user);
+  // Hash collisions are possible, so check the candidates' fields.
+  // If the database has duplicate GTUs (only possible before Validate()),
+  // return the first in m_pwlist order, as a linear search would.
+  auto retval(m_pwlist.end());
+  auto range = m_gtu_index.equal_range(HashGTU(a_group, a_title, a_user));
+  for (auto iter = range.first; iter != range.second; iter++) {
+    auto found = m_pwlist.find(iter->second);
+    if (found == m_pwlist.end())
+      continue;
 
-  return find_if(m_pwlist.begin(), m_pwlist.end(), fields_match);
+    const CItemData &item = found->second;
+    if (FieldIs(item, CItem::TITLE, a_title) && FieldIs(item, CItem::GROUP, a_group) &&
+        FieldIs(item, CItem::USER, a_user) &&
+        (retval == m_pwlist.end() || found->first < retval->first))
+      retval = found;
+  }
+  return retval;
 }
 
 struct TitleMatch {
   bool operator()(const std::pair<CUUID, CItemData> &p) {
     const CItemData &item = p.second;
-    return (m_title == item.GetTitle());
+    return FieldIs(item, CItem::TITLE, m_title);
   }
 
   TitleMatch(const StringX &a_title) :
@@ -1630,8 +2450,8 @@ ItemListIter PWScore::GetUniqueBase(const StringX &a_title, bool &bMultiple)
 struct GroupTitle_TitleUserMatch {
   bool operator()(const std::pair<CUUID, CItemData> &p) {
     const CItemData &item = p.second;
-    return ((m_gt == item.GetGroup() && m_tu == item.GetTitle()) ||
-            (m_gt == item.GetTitle() && m_tu == item.GetUser()));
+    return ((FieldIs(item, CItem::GROUP, m_gt) && FieldIs(item, CItem::TITLE, m_tu)) ||
+            (FieldIs(item, CItem::TITLE, m_gt) && FieldIs(item, CItem::USER, m_tu)));
   }
 
   GroupTitle_TitleUserMatch(const StringX &a_grouptitle,
@@ -2247,7 +3067,9 @@ bool PWScore::Validate(const size_t iMAXCHARS, CReport *pRpt, st_ValidateResults
       fixedItem.SetStatus(CItemData::ES_MODIFIED);
       // We assume that this is run during file read. If not, then we
       // need to run using the Command mechanism for Undo/Redo.
+      RemoveFromGTUIndex(ci);
       m_pwlist[fixedItem.GetUUID()] = fixedItem;
+      AddToGTUIndex(fixedItem);
     }
   } // iteration over m_pwlist
 
@@ -2889,6 +3711,7 @@ int PWScore::DoAddDependentEntries(UUIDVector &dependentlist, CReport *pRpt,
             // Invalid - delete!
             if (pmapDeletedItems != nullptr)
               pmapDeletedItems->insert(ItemList_Pair(*paiter, *pci_curitem));
+            RemoveFromGTUIndex(iter->second);
             m_pwlist.erase(iter);
             continue;
           }
@@ -2913,13 +3736,13 @@ int PWScore::DoAddDependentEntries(UUIDVector &dependentlist, CReport *pRpt,
             // Invalid - delete!
             if (pmapDeletedItems != nullptr)
               pmapDeletedItems->insert(ItemList_Pair(*paiter, *pci_curitem));
+            RemoveFromGTUIndex(iter->second);
             m_pwlist.erase(iter);
             continue;
           }
           if (iter->second.IsAlias()) {
             // This is an alias too!  Not allowed!  Make new one point to original base
             // Note: this may be random as who knows the order of reading records?
-            CUUID temp_uuid = iter->second.GetUUID();
             base_uuid = iter->second.GetBaseUUID(); // ??? used here ???
             if (pRpt != nullptr) {
               if (!bwarnings) {
@@ -3021,7 +3844,11 @@ void PWScore::UndoAddDependentEntries(ItemList *pmapDeletedItems,
   for (add_iter = pmapDeletedItems->begin();
        add_iter != pmapDeletedItems->end();
        add_iter++) {
+    iter = m_pwlist.find(add_iter->first);
+    if (iter != m_pwlist.end())
+      RemoveFromGTUIndex(iter->second);
     m_pwlist[add_iter->first] = add_iter->second;
+    AddToGTUIndex(add_iter->second);
   }
 
   for (restore_iter = pmapSaveTypePW->begin();
@@ -3656,9 +4483,8 @@ void PWScore::GetDBProperties(st_DBProperties &st_dbp)
   if(m_hdr.m_file_uuid == CUUID::NullUUID())
     st_dbp.file_uuid = _T("N/A");
   else {
-    CUUID huuid(*m_hdr.m_file_uuid.GetARep(), true); // true for canonical format
     ostringstreamT os;
-    os << std::uppercase << huuid;
+    os << std::uppercase << m_hdr.m_file_uuid.Canonical();
     st_dbp.file_uuid = os.str().c_str();
   }
 
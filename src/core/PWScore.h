@@ -25,6 +25,9 @@
 
 #include "coredefs.h"
 
+#include <functional>
+#include <unordered_map>
+
 // Parameter list for ParseBaseEntryPWD
 struct BaseEntryParms {
   // All fields except "InputType" are 'output'.
@@ -59,6 +62,7 @@ struct st_DBProperties {
 };
 
 struct st_ValidateResults;
+class PWSjournal;
 
 class PWScore : public Observable, public CommandInterface
 {
@@ -136,6 +140,15 @@ public:
                const bool bValidate = false, const size_t iMAXCHARS = 0,
                CReport *pRpt = nullptr);
   PWSfile::VERSION GetReadFileVersion() const {return m_ReadFileVersion;}
+  // Threads ReadFile may use: 0 (default) as many as there are cores,
+  // 1 reads and indexes on the calling thread, more pipelines the two.
+  // The file's told the same (see PWSfile::SetThreads()).
+  void SetReadThreads(unsigned nThreads) {m_nReadThreads = nThreads;}
+  // Threads a save may use: 0 (default) as many as there are cores,
+  // 1 writes everything on the saving thread, more serialize V3/V4
+  // records on workers while the saving thread writes them out, and copy
+  // V4 attachments' content through a stream each.
+  void SetWriteThreads(unsigned nThreads) {m_nWriteThreads = nThreads;}
   bool BackupCurFile(unsigned int maxNumIncBackups, int backupSuffix,
                      const stringT &userBackupPrefix,
                      const stringT &userBackupDir, stringT &bu_fname);
@@ -154,6 +167,32 @@ public:
   int WriteV2File(const StringX &filename)
   {return WriteFile(filename, PWSfile::V20, false);}
 
+  // Saving in the background: StartWriteFile() takes a snapshot of what's
+  // to be saved and writes it out on a worker thread, which calls progress
+  // (entries and attachments written so far, out of total) and then done
+  // with the outcome. Both are called on a worker thread, so the UI should
+  // just post itself a message, upon which it calls FinishWriteFile(), which
+  // puts the file in place and does what WriteFile() does after writing.
+  // Meanwhile Commands can change the core as usual; what changes after the
+  // snapshot is left dirty. Only for saving as V3 or later, never exporting.
+  // WriteFile(), StartWriteFile() and anything that clears the core first
+  // finish a save that's under way, waiting for it if need be.
+  typedef std::function<void(size_t done, size_t total)> SaveProgress;
+  typedef std::function<void(int status)> SaveDone;
+  int StartWriteFile(const StringX &filename, PWSfile::VERSION version,
+                     const SaveProgress &progress = nullptr,
+                     const SaveDone &done = nullptr);
+  bool IsWritingFile() const {return m_pAsyncSave != nullptr;}
+  int FinishWriteFile(); // SUCCESS if nothing's being written
+
+  // For "Save Immediately": appends what's changed since the database was
+  // last read, written or journaled to its journal (see PWSjournal.h)
+  // instead of rewriting it. Returns FAILURE if the changes can't be
+  // journaled (e.g., attachments or policies changed) or it's time to fold
+  // the journal into the database, in which case call WriteCurFile().
+  int WriteJournal();
+  bool HasJournal() const; // i.e., the database needs writing on close
+
   // R/O file status
   void SetReadOnly(bool state) {m_bIsReadOnly = state;}
   bool IsReadOnly() const {return m_bIsReadOnly;}
@@ -506,6 +545,20 @@ private:
   //   This excludes Group Display and RUE List which should not be via 
   //   Commands as no requirement to Undo/Redo and whose save is UI driven.
   void SetInitialValues(); // Called after successful read/write of a database
+  void SetCleanDBState(); // Also called after successful write or WriteJournal()
+  void RecordSavedState(); // What WriteJournal() compares against
+  void SetCleanDBState(size_t pos); // as if saved after pos commands
+  size_t GetDBStatePos() const {return m_redo_DBState_iter - m_vDBState.begin();}
+
+  // Writes the records & attachments to out, which throws on failure.
+  // Attachments whose content can no longer be copied, as the file it was
+  // in has been replaced or removed, are left out and added to lost, for
+  // ReportLostAtts() to tell the user about once the save's done.
+  typedef std::vector<const CItemAtt *> AttPtrs;
+  void WriteRecords(PWSfile *out, PWSfile::VERSION version, ItemList &pwlist,
+                    AttList &attlist, CItemAtt::ContentOffsets &written,
+                    AttPtrs &lost, const SaveProgress &progress);
+  void ReportLostAtts(const AttPtrs &lost) const;
 
   // Update header
   int SetHeaderItem(const StringX &sxNewValue, PWSfile::HeaderType ht);
@@ -563,6 +616,7 @@ private:
 
   stringT m_AppNameAndVersion;
   PWSfile::VERSION m_ReadFileVersion;
+  unsigned m_nReadThreads, m_nWriteThreads;
 
   bool m_bIsReadOnly;
   bool m_bUniqueGTUValidated;
@@ -597,6 +651,15 @@ private:
   void AddChangedNodes(const StringX &path);
   void AddChangedEmptyGroups(const StringX &path);
 
+  // Group/Title/User index of m_pwlist, used by Find(group, title, user)
+  //  Key = hash of entry's group, title & user; Value = entry's uuid
+  // Must be kept in step with every change to m_pwlist that adds or
+  // removes an entry or changes its group, title or user.
+  typedef std::unordered_multimap<size_t, pws_os::CUUID> GTUIndex;
+  GTUIndex m_gtu_index;
+  void AddToGTUIndex(const CItemData &ci);
+  void RemoveFromGTUIndex(const CItemData &ci);
+
   // EmptyGroups
   std::vector<StringX> m_vEmptyGroups;
   std::vector<StringX> m_InitialEmptyGroups;
@@ -638,6 +701,25 @@ private:
   static Asker *m_pAsker;
   PWSFileSig *m_pFileSig;
 
+  // Journal for "Save Immediately", nullptr if changes can't be journaled,
+  // and what the database and its journal hold
+  PWSjournal *m_pJournal;
+  struct SavedState {
+    std::map<pws_os::CUUID, ulong64> entries, atts; // fingerprints
+    StringX dbName, dbDesc, prefs;
+    uint32 hashIters;
+    std::vector<StringX> emptyGroups;
+    PSWDPolicyMap policies;
+    PWSFilters filters;
+  } m_saved;
+  // What RecordSavedState() records, but for the entries' and attachments'
+  // fingerprints unless bFingerprints
+  void GetSavedState(SavedState &saved, bool bFingerprints = true) const;
+
+  // What StartWriteFile() is writing, nullptr when it's not
+  struct AsyncSave;
+  AsyncSave *m_pAsyncSave;
+
   // Entries with an expiry date
   ExpiredList m_ExpireCandidates;
   void AddExpiryEntry(const CItemData &ci)
@@ -9,14 +9,28 @@
 #include "PWSfileV1V2.h"
 #include "PWSfileV3.h"
 #include "PWSfileV4.h"
+#include "ItemAtt.h"
 #include "SysInfo.h"
+#include "UTF8Conv.h"
+#include "Util.h"
 #include "core.h"
 #include "os/file.h"
 
 #include "crypto/sha1.h" // for simple encrypt/decrypt
+#include "crypto/hmac.h"
 #include "PWSrand.h"
+#include "os/mem.h"
+#include "os/debug.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <exception>
+#include <mutex>
+#include <thread>
 
 PWSfile *PWSfile::MakePWSfile(const StringX &a_filename, const StringX &passkey,
                               VERSION &version, RWmode mode, int &status,
@@ -100,13 +114,35 @@ PWSfile::PWSfile(const StringX &filename, RWmode mode, VERSION v)
   : m_filename(filename), m_passkey(_T("")), m_fd(nullptr),
   m_curversion(v), m_rw(mode), m_defusername(_T("")),
   m_fish(nullptr), m_terminal(nullptr), m_status(SUCCESS),
-  m_nRecordsWithUnknownFields(0)
+  m_nRecordsWithUnknownFields(0), m_fileLength(0), m_map(nullptr), m_mapPos(NOPOS),
+  m_headerOnly(false), m_nThreads(0), m_scratch(nullptr), m_scratchSize(0), m_scratchUsed(0),
+  m_plain(nullptr), m_plainSize(0), m_plainWiped(0), m_writeBuf(nullptr), m_hasJournalKey(false)
 {
 }
 
 PWSfile::~PWSfile()
 {
+  if (m_rw == Write && m_fd != nullptr)
+    m_status = FAILURE; // derived class didn't finish the file
   Close(); // idempotent
+  trashMemory(m_journalKey, sizeof(m_journalKey));
+}
+
+void PWSfile::SetJournalKey(const unsigned char *L, size_t len)
+{
+  // Keep the journal's keys independent of the database's
+  static const unsigned char label[] = "PWS journal";
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac(L, static_cast<unsigned long>(len));
+  hmac.Update(label, sizeof(label) - 1);
+  hmac.Final(m_journalKey);
+  m_hasJournalKey = true;
+}
+
+bool PWSfile::GetJournalKey(unsigned char key[SHA256::HASHLEN]) const
+{
+  if (m_hasJournalKey)
+    memcpy(key, m_journalKey, SHA256::HASHLEN);
+  return m_hasJournalKey;
 }
 
 void PWSfile::HashRandom256(unsigned char *p256)
@@ -125,37 +161,679 @@ void PWSfile::HashRandom256(unsigned char *p256)
   salter.Final(p256);
 }
 
+namespace {
+  // See PWSfile::LookupStretchedKey()
+  class StretchedKeyCache
+  {
+  public:
+    static StretchedKeyCache &Instance()
+    {
+      static StretchedKeyCache cache; // thread-safe as per C++11 local statics
+      return cache;
+    }
+
+    bool Lookup(const unsigned char id[SHA256::HASHLEN], unsigned char Ptag[SHA256::HASHLEN])
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      WipeExpired();
+      for (auto &e : m_entries) {
+        if (e.valid && memcmp(e.id, id, SHA256::HASHLEN) == 0) {
+          memcpy(Ptag, e.Ptag, SHA256::HASHLEN);
+          m_hits++;
+          return true;
+        }
+      }
+      m_misses++;
+      return false;
+    }
+
+    void GetStats(unsigned long &hits, unsigned long &misses)
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      hits = m_hits;
+      misses = m_misses;
+    }
+
+    void Store(const unsigned char id[SHA256::HASHLEN], const unsigned char Ptag[SHA256::HASHLEN])
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      WipeExpired();
+      // Replace a free or the oldest entry
+      Entry *victim = &m_entries[0];
+      for (auto &e : m_entries) {
+        if (!e.valid) {
+          victim = &e;
+          break;
+        }
+        if (e.when < victim->when)
+          victim = &e;
+      }
+      memcpy(victim->id, id, SHA256::HASHLEN);
+      memcpy(victim->Ptag, Ptag, SHA256::HASHLEN);
+      victim->when = time(nullptr);
+      victim->valid = true;
+
+      // Nothing may follow to look the key up (e.g., CheckPasskey() when
+      // unlocking), so have the sweeper wipe it once it expires
+      if (!m_sweeping) {
+        if (m_sweeper.joinable())
+          m_sweeper.join(); // it's done, having found nothing left to wipe
+        m_sweeping = true;
+        try {
+          m_sweeper = std::thread(&StretchedKeyCache::Sweep, this);
+        } catch (...) { // no thread, no cache
+          m_sweeping = false;
+          Wipe(*victim);
+        }
+      }
+    }
+
+    void Clear()
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      for (auto &e : m_entries)
+        Wipe(e);
+      m_wakeup.notify_all();
+    }
+
+    // Expired entries are wiped here, when storing, and by the sweeper thread
+    void WipeExpired()
+    {
+      const time_t now = time(nullptr);
+      for (auto &e : m_entries)
+        if (e.valid && (now - e.when >= TTL || now < e.when))
+          Wipe(e);
+    }
+
+    // The id is a keyed hash of everything that goes into the stretch
+    void ComputeId(PWSfile::VERSION v, const unsigned char *salt, unsigned long saltLen,
+                   const StringX &passkey, unsigned int N, unsigned char id[SHA256::HASHLEN])
+    {
+      size_t passLen = 0;
+      unsigned char *pstr = nullptr;
+      ConvertPasskey(passkey, pstr, passLen); // encoding depends on PWS_PK_CP_ACP
+
+      unsigned char vN[1 + sizeof(uint32)];
+      vN[0] = static_cast<unsigned char>(v);
+      putInt32(vN + 1, N);
+
+      SHA256 H;
+      H.Update(m_secret, sizeof(m_secret));
+      H.Update(vN, sizeof(vN));
+      H.Update(salt, saltLen);
+      H.Update(pstr, passLen);
+      H.Final(id);
+
+      trashMemory(pstr, passLen);
+      delete[] pstr;
+    }
+
+  private:
+    static const time_t TTL = 60; // seconds, covers a UI's CheckPasskey + ReadFile
+    struct Entry {
+      unsigned char id[SHA256::HASHLEN];
+      unsigned char Ptag[SHA256::HASHLEN];
+      time_t when;
+      bool valid;
+    };
+
+    StretchedKeyCache()
+    {
+      memset(m_entries, 0, sizeof(m_entries));
+      pws_os::mlock(m_entries, sizeof(m_entries));
+      pws_os::mlock(m_secret, sizeof(m_secret));
+      PWSrand::GetInstance()->GetRandomData(m_secret, sizeof(m_secret));
+    }
+
+    ~StretchedKeyCache()
+    {
+      {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_exiting = true;
+        m_wakeup.notify_all();
+      }
+      if (m_sweeper.joinable())
+        m_sweeper.join();
+      trashMemory(m_entries, sizeof(m_entries));
+      trashMemory(m_secret, sizeof(m_secret));
+      pws_os::munlock(m_entries, sizeof(m_entries));
+      pws_os::munlock(m_secret, sizeof(m_secret));
+    }
+
+    static void Wipe(Entry &e)
+    {
+      trashMemory(&e, sizeof(e));
+      e.valid = false;
+    }
+
+    // Runs while there's something in the cache, waking when the
+    // oldest entry is due to expire
+    void Sweep()
+    {
+      std::unique_lock<std::mutex> guard(m_mutex);
+      while (!m_exiting) {
+        WipeExpired();
+        time_t due = 0;
+        for (const auto &e : m_entries)
+          if (e.valid && (due == 0 || e.when + TTL < due))
+            due = e.when + TTL;
+        if (due == 0)
+          break;
+        m_wakeup.wait_until(guard, std::chrono::system_clock::from_time_t(due));
+      }
+      m_sweeping = false;
+    }
+
+    // A V4 file may have a few key blocks, each tried with
+    // both passkey encodings
+    Entry m_entries[8];
+    unsigned char m_secret[SHA256::HASHLEN];
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::thread m_sweeper;
+    bool m_sweeping = false;
+    bool m_exiting = false;
+    unsigned long m_hits = 0, m_misses = 0;
+  };
+}
+
+bool PWSfile::LookupStretchedKey(VERSION v, const unsigned char *salt, unsigned long saltLen,
+                                 const StringX &passkey, unsigned int N,
+                                 unsigned char Ptag[SHA256::HASHLEN])
+{
+  StretchedKeyCache &cache = StretchedKeyCache::Instance();
+  unsigned char id[SHA256::HASHLEN];
+  cache.ComputeId(v, salt, saltLen, passkey, N, id);
+  return cache.Lookup(id, Ptag);
+}
+
+void PWSfile::StoreStretchedKey(VERSION v, const unsigned char *salt, unsigned long saltLen,
+                                const StringX &passkey, unsigned int N,
+                                const unsigned char Ptag[SHA256::HASHLEN])
+{
+  StretchedKeyCache &cache = StretchedKeyCache::Instance();
+  unsigned char id[SHA256::HASHLEN];
+  cache.ComputeId(v, salt, saltLen, passkey, N, id);
+  cache.Store(id, Ptag);
+}
+
+void PWSfile::ClearStretchedKeyCache()
+{
+  StretchedKeyCache::Instance().Clear();
+}
+
+void PWSfile::GetStretchedKeyCacheStats(unsigned long &hits, unsigned long &misses)
+{
+  StretchedKeyCache::Instance().GetStats(hits, misses);
+}
+
 void PWSfile::FOpen()
 {
   ASSERT(!m_filename.empty());
-  const TCHAR* m = (m_rw == Read) ? _T("rb") : _T("wb");
   if (m_fd != nullptr) {
+    UnmapAndFree();
     fclose(m_fd);
     m_fd = nullptr;
+    DiscardWrite();
+  }
+  if (m_rw == Read) {
+    m_fd = pws_os::FOpen(m_filename.c_str(), _T("rb"));
+  } else {
+    /**
+     * We write to a new, uniquely named file next to the real one, which replaces
+     * it only if all's well when we Close(), so that a failed save never
+     * leaves a torn file behind. The stream's buffer is sized so that the
+     * many small block writes usually become a single write().
+     */
+    ulong64 oldLength = 0;
+    std::FILE *old = pws_os::FOpen(m_filename.c_str(), _T("rb"));
+    if (old != nullptr) {
+      oldLength = pws_os::fileLength(old);
+      fclose(old);
+    }
+    const ulong64 MIN_BUF = 64 * 1024, MAX_BUF = 64 * 1024 * 1024;
+    const size_t bufSize = size_t(std::min(std::max(oldLength + oldLength / 8, MIN_BUF), MAX_BUF));
+
+    stringT tmpname;
+    m_fd = pws_os::CreateTempFile(m_filename.c_str(), tmpname);
+    if (m_fd != nullptr) {
+      m_tmpname = tmpname.c_str();
+      m_writeBuf = new char[bufSize];
+      setvbuf(m_fd, m_writeBuf, _IOFBF, bufSize);
+    }
   }
-  m_fd = pws_os::FOpen(m_filename.c_str(), m);
   if(m_fd) {
     m_fileLength = pws_os::fileLength(m_fd);
+    if (m_rw == Read)
+      m_map = pws_os::MapFile(m_fd, m_fileLength); // nullptr's fine
   }
   else {
     m_fileLength = 0;
   }
 }
 
+FILE *PWSfile::FOpenAnother() const
+{
+  ASSERT(m_rw == Write && !m_tmpname.empty());
+  return m_tmpname.empty() ? nullptr : pws_os::FOpen(m_tmpname.c_str(), _T("r+b"));
+}
+
+void PWSfile::DiscardWrite()
+{
+  if (!m_tmpname.empty()) {
+    pws_os::DeleteAFile(m_tmpname.c_str());
+    m_tmpname.clear();
+  }
+  delete[] m_writeBuf; // only after the stream's closed!
+  m_writeBuf = nullptr;
+}
+
+void PWSfile::UnmapAndFree()
+{
+  if (m_map != nullptr) {
+    pws_os::UnmapFile(m_map, m_fileLength);
+    m_map = nullptr;
+  }
+  m_mapPos = NOPOS;
+  if (m_scratch != nullptr) {
+    trashMemory(m_scratch, m_scratchUsed);
+    pws_os::munlock(m_scratch, m_scratchSize);
+    delete[] m_scratch;
+    m_scratch = nullptr;
+  }
+  m_scratchSize = m_scratchUsed = 0;
+  if (m_plain != nullptr) {
+    trashMemory(m_plain + m_plainWiped, m_plainSize - m_plainWiped); // rest already is
+    pws_os::munlock(m_plain, m_plainSize);
+    delete[] m_plain;
+    m_plain = nullptr;
+  }
+  m_plainSize = m_plainWiped = 0;
+  m_segments.clear();
+}
+
 int PWSfile::Close()
 {
   delete m_fish;
   m_fish = nullptr;
   int rc(SUCCESS);
 
+  UnmapAndFree();
   if (m_fd != nullptr) {
     rc = pws_os::FClose(m_fd, m_rw == Write);
     m_fd = nullptr;
+    if (m_rw == Write) {
+      // Anything that went wrong means we keep the original, see FOpen()
+      if (rc == 0 && m_status == SUCCESS &&
+          pws_os::ReplaceAFile(m_tmpname.c_str(), m_filename.c_str()))
+        m_tmpname.clear();
+      else if (m_status != SUCCESS)
+        rc = m_status;
+      else
+        rc = WRITE_FAIL;
+      DiscardWrite();
+    }
   }
 
   return rc;
 }
 
+size_t PWSfile::MapRead(size_t n, const unsigned char *&p)
+{
+  ASSERT(m_map != nullptr);
+  if (m_mapPos == NOPOS) {
+    const long pos = ftell(m_fd);
+    m_mapPos = (pos < 0) ? 0 : ulong64(pos);
+  }
+  const ulong64 avail = (m_mapPos < m_fileLength) ? m_fileLength - m_mapPos : 0;
+  if (n > avail)
+    n = size_t(avail);
+  p = m_map + m_mapPos;
+  m_mapPos += n;
+  return n;
+}
+
+size_t PWSfile::FRead(void *p, size_t size, size_t n)
+{
+  if (m_map == nullptr)
+    return fread(p, size, n, m_fd);
+  if (size == 0)
+    return 0;
+  const unsigned char *src;
+  const size_t nbytes = MapRead(size * n, src);
+  memcpy(p, src, nbytes);
+  return nbytes / size;
+}
+
+long PWSfile::FTell() const
+{
+  if (m_map == nullptr || m_mapPos == NOPOS)
+    return ftell(m_fd);
+  return long(m_mapPos);
+}
+
+int PWSfile::FSeek(long offset, int whence)
+{
+  if (m_map == nullptr)
+    return fseek(m_fd, offset, whence);
+  long base;
+  switch (whence) {
+  case SEEK_SET: base = 0; break;
+  case SEEK_CUR: base = FTell(); break;
+  case SEEK_END: base = long(m_fileLength); break;
+  default: return -1;
+  }
+  if (base + offset < 0 || ulong64(base + offset) > m_fileLength)
+    return -1;
+  m_mapPos = ulong64(base + offset);
+  return 0;
+}
+
+void PWSfile::DecryptAhead(const Ranges &ranges)
+{
+  /**
+   * CBC decryption of a block only needs that block and the one before it,
+   * so a large body can be cut into pieces and decrypted concurrently,
+   * each piece chained from the ciphertext block preceding it in the file.
+   * Where the file's chain doesn't run through that block (V4 attachment
+   * content sits in the middle of it), DecryptAt() fixes things up.
+   * DecryptAt() wipes plaintext as it's served; what's re-read after a
+   * rewind (as V4 does at an attachment) is decrypted again from the file.
+   */
+  ASSERT(m_map != nullptr && m_fish != nullptr && m_plain == nullptr);
+  const unsigned int BS = m_fish->GetBlockSize();
+
+  size_t total = 0;
+  for (const auto &r : ranges) {
+    ASSERT(r.first >= BS && r.first <= r.second && r.second <= m_fileLength);
+    const ulong64 end = r.first + ((r.second - r.first) / BS) * BS;
+    if (end > r.first) {
+      m_segments.push_back(Segment{r.first, end, total});
+      total += size_t(end - r.first);
+    }
+  }
+  if (total == 0)
+    return;
+
+  const size_t MinPiece = 256 * 1024;
+  const unsigned nthreads = (m_nThreads != 0) ? m_nThreads :
+    std::max(std::thread::hardware_concurrency(), 1u);
+  const size_t pieceLen = std::max(((total / nthreads) / BS + 1) * BS, MinPiece);
+  std::vector<Segment> pieces;
+  for (const auto &seg : m_segments) {
+    for (ulong64 b = seg.begin; b < seg.end; b += pieceLen) {
+      const ulong64 e = std::min(b + pieceLen, seg.end);
+      pieces.push_back(Segment{b, e, seg.off + size_t(b - seg.begin)});
+    }
+  }
+
+  m_plain = new unsigned char[total];
+  m_plainSize = total;
+  m_plainWiped = 0;
+  pws_os::mlock(m_plain, m_plainSize); // best effort, it may exceed the limit
+
+  std::atomic<size_t> next(0);
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto worker = [&]() {
+    unsigned char iv[16];
+    try {
+      for (size_t i = next++; i < pieces.size(); i = next++) {
+        const Segment &p = pieces[i];
+        memcpy(iv, m_map + p.begin - BS, BS);
+        cbcdecrypt(m_map + p.begin, m_plain + p.off, size_t(p.end - p.begin), m_fish, iv);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(error_mutex);
+      if (!error)
+        error = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < std::min(size_t(nthreads), pieces.size()); t++)
+    threads.emplace_back(worker);
+  worker(); // this thread's one of the pool
+  for (auto &t : threads)
+    t.join();
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+int PWSfile::Peek(const StringX &filename, const StringX &passkey,
+                  PeekInfo &info, bool bCount)
+{
+  info = PeekInfo();
+  int status = FAILURE;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    // See if passkey was encoded incorrectly, as CheckPasskey(), but
+    // without changing the environment under other threads' feet
+    SetThreadPasskeyEncoding(attempt == 0);
+
+    // Open() reuses the key CheckPasskey() stretched
+    VERSION version;
+    status = CheckPasskey(filename, passkey, version);
+    PWSfile *in = nullptr;
+    if (status == SUCCESS)
+      in = MakePWSfile(filename, passkey, version, Read, status);
+    if (in != nullptr && status == SUCCESS) {
+      in->m_headerOnly = true;
+      status = in->Open(passkey);
+      if (status == SUCCESS) {
+        info.version = version;
+        info.hdr = in->GetHeader();
+        info.nHashIters = in->GetNHashIters();
+        if (bCount)
+          status = in->CountRecords(info.nEntries, info.nAttachments);
+        in->Abort(); // we've not read it all, so there's nothing to verify
+        in->Close();
+      }
+    }
+    delete in;
+
+    if (status != WRONG_PASSWORD)
+      break;
+  }
+  ClearThreadPasskeyEncoding();
+  // The stretched key's left for an open that may well follow, e.g., of
+  // the database picked from the listing; if none does, it expires
+  return status;
+}
+
+int PWSfile::CountRecords(size_t &nEntries, size_t &nAttachments)
+{
+  nEntries = nAttachments = 0;
+  CItemData item;
+  for (;;) {
+    const int status = ReadRecord(item);
+    switch (status) {
+      case SUCCESS:
+        nEntries++;
+        break;
+      case WRONG_RECORD: // V4 attachment, whose content's not read
+      {
+        CItemAtt att;
+        if (att.Read(this) != SUCCESS)
+          return READ_FAIL;
+        nAttachments++;
+        break;
+      }
+      case END_OF_FILE:
+        return SUCCESS;
+      default:
+        return status;
+    }
+  }
+}
+
+bool PWSfile::SkimFields(ulong64 end, const FieldVisitor &visit)
+{
+  ASSERT(m_map != nullptr && m_fish != nullptr);
+  const unsigned int BS = m_fish->GetBlockSize();
+  ulong64 pos = ulong64(FTell());
+  unsigned char iv[16], block[16];
+  ASSERT(BS <= sizeof(iv));
+  memcpy(iv, m_IV, BS);
+
+  bool retval = true;
+  while (pos < end) {
+    if (end - pos < BS) {
+      retval = false;
+      break;
+    }
+    // The first block holds the field's length and type, the rest we skip,
+    // each field's chained from the last block of the one before
+    m_fish->Decrypt(m_map + pos, block);
+    for (unsigned int i = 0; i < BS; i++)
+      block[i] ^= iv[i];
+    const size_t len = getInt32(block);
+    const unsigned char type = block[sizeof(int32)];
+    const size_t rest = (len > BS - 5) ? len - (BS - 5) : 0;
+    if (len >= m_fileLength || ((rest + BS - 1) / BS) * BS > end - pos - BS) {
+      retval = false;
+      break;
+    }
+    pos += BS + ((rest + BS - 1) / BS) * BS;
+    memcpy(iv, m_map + pos - BS, BS);
+
+    const ulong64 skip = visit(type, len, block);
+    if (skip > end - pos) {
+      retval = false;
+      break;
+    }
+    pos += skip;
+  }
+  trashMemory(block, sizeof(block));
+  return retval;
+}
+
+void PWSfile::DecryptAt(ulong64 pos, const unsigned char *ct, unsigned char *pt, size_t n)
+{
+  // Serve ciphertext ct, read from file offset pos, from DecryptAhead()'s work if we can
+  const Segment *seg = nullptr;
+  if (!m_segments.empty()) {
+    auto it = std::upper_bound(m_segments.begin(), m_segments.end(), pos,
+                               [](ulong64 p, const Segment &s) {return p < s.begin;});
+    if (it != m_segments.begin() && pos + n <= (--it)->end)
+      seg = &*it;
+  }
+  const size_t off = (seg != nullptr) ? seg->off + size_t(pos - seg->begin) : 0;
+  if (seg == nullptr || off < m_plainWiped) { // not decrypted ahead, or re-read
+    cbcdecrypt(ct, pt, n, m_fish, m_IV);
+    return;
+  }
+
+  const unsigned int BS = m_fish->GetBlockSize();
+  const unsigned char *c = m_map + pos;
+  memcpy(pt, m_plain + off, n);
+  // Reads only go forwards (rewinds are handled above), so everything up to
+  // here's been served or skipped
+  trashMemory(m_plain + m_plainWiped, off + n - m_plainWiped);
+  m_plainWiped = off + n;
+  // First block was chained from the preceding file block, not necessarily m_IV
+  for (unsigned int i = 0; i < BS; i++)
+    pt[i] ^= c[int(i) - int(BS)] ^ m_IV[i];
+  memcpy(m_IV, c + n - BS, BS);
+}
+
+static thread_local std::vector<unsigned char> *tls_fields = nullptr;
+
+PWSfile::FieldCollector::FieldCollector(std::vector<unsigned char> &buf)
+  : m_prev(tls_fields)
+{
+  tls_fields = &buf;
+}
+
+PWSfile::FieldCollector::~FieldCollector()
+{
+  tls_fields = m_prev;
+}
+
+size_t PWSfile::WriteField(unsigned char type, const StringX &data)
+{
+  if (tls_fields == nullptr)
+    return WriteCBC(type, data);
+
+  // Collected fields are V3 and later, i.e., UTF-8
+  CUTF8Conv conv;
+  const unsigned char *utf8 = nullptr;
+  size_t utf8Len = 0;
+  if (!conv.ToUTF8(data, utf8, utf8Len))
+    pws_os::Trace(_T("ToUTF8(%ls) failed\n"), data.c_str());
+  return WriteField(type, utf8, utf8Len);
+}
+
+size_t PWSfile::WriteField(unsigned char type, const unsigned char *data,
+                           size_t length)
+{
+  if (tls_fields == nullptr)
+    return WriteCBC(type, data, length);
+
+  // Same layout as a decrypted field: length, type, data
+  std::vector<unsigned char> &buf = *tls_fields;
+  const size_t pos = buf.size();
+  if (buf.capacity() < pos + 5 + length) {
+    // don't leave copies of what we've collected so far lying around
+    std::vector<unsigned char> bigger;
+    bigger.reserve(std::max(2 * buf.capacity(), pos + 5 + length));
+    bigger.assign(buf.begin(), buf.end());
+    trashMemory(buf.data(), buf.size());
+    buf.swap(bigger);
+  }
+  buf.resize(pos + 5 + length);
+  putInt32(&buf[pos], static_cast<int32>(length));
+  buf[pos + 4] = type;
+  if (length > 0)
+    memcpy(&buf[pos + 5], data, length);
+  return 5 + length;
+}
+
+static thread_local PWSfile::FieldSource *tls_source = nullptr;
+
+PWSfile::FieldSource::FieldSource(const std::vector<unsigned char> &buf, size_t &pos)
+  : m_prev(tls_source), m_buf(buf), m_pos(pos)
+{
+  tls_source = this;
+}
+
+PWSfile::FieldSource::~FieldSource()
+{
+  tls_source = m_prev;
+}
+
+size_t PWSfile::ReadField(unsigned char &type, unsigned char* &data,
+                          size_t &length)
+{
+  if (tls_source == nullptr)
+    return ReadCBC(type, data, length);
+
+  // Fields in the FieldCollector layout, see WriteField()
+  const std::vector<unsigned char> &buf = tls_source->m_buf;
+  size_t &pos = tls_source->m_pos;
+  if (pos + 5 > buf.size())
+    return 0;
+  length = static_cast<size_t>(getInt32(&buf[pos]));
+  if (length > buf.size() - pos - 5)
+    return 0;
+  type = buf[pos + 4];
+  data = const_cast<unsigned char *>(buf.data()) + pos + 5;
+  pos += 5 + length;
+  return 5 + length;
+}
+
+void PWSfile::WriteFields(const std::vector<unsigned char> &buf)
+{
+  ASSERT(tls_fields == nullptr);
+  size_t pos = 0;
+  while (pos + 5 <= buf.size()) {
+    const size_t length = static_cast<size_t>(getInt32(&buf[pos]));
+    ASSERT(pos + 5 + length <= buf.size());
+    WriteCBC(buf[pos + 4], buf.data() + pos + 5, length);
+    pos += 5 + length;
+  }
+}
+
 size_t PWSfile::WriteCBC(unsigned char type, const unsigned char *data,
                          size_t length)
 {
@@ -163,34 +841,99 @@ size_t PWSfile::WriteCBC(unsigned char type, const unsigned char *data,
   return _writecbc(m_fd, data, length, type, m_fish, m_IV);
 }
 
+/*
+ * Same format as _readcbc(), but without allocating per field: we decrypt
+ * into m_scratch, straight from the mapping if we have one.
+ */
 size_t PWSfile::ReadCBC(unsigned char &type, unsigned char* &data,
                         size_t &length)
 {
-  unsigned char *buffer = nullptr;
-  size_t buffer_len = 0;
-  size_t retval;
-
   ASSERT(m_fish != nullptr && m_IV != nullptr);
-  retval = _readcbc(m_fd, buffer, buffer_len, type,
-    m_fish, m_IV, m_terminal, m_fileLength);
+  const unsigned int BS = m_fish->GetBlockSize();
+  unsigned char lengthblock[16] = {0};
+  ASSERT(BS <= sizeof(lengthblock));
+  if ((BS > sizeof(lengthblock)) || (BS == 0))
+    return 0;
+
+  trashMemory(m_scratch, m_scratchUsed);
+  m_scratchUsed = 0;
+
+  const ulong64 pos = (m_map != nullptr) ? ulong64(FTell()) : 0;
+  size_t numRead = FRead(lengthblock, 1, BS);
+  if (numRead != BS)
+    return 0;
+
+  if (m_terminal != nullptr &&
+      memcmp(lengthblock, m_terminal, BS) == 0)
+    return static_cast<size_t>(-1);
+
+  if (m_map != nullptr)
+    DecryptAt(pos, lengthblock, lengthblock, BS);
+  else
+    cbcdecrypt(lengthblock, lengthblock, BS, m_fish, m_IV);
 
-  if (buffer_len > 0) {
-    if (buffer_len < length || data == nullptr)
-      length = buffer_len; // set to length read
-    // if buffer_len > length, data is truncated to length
-    // probably an error.
-    if (data != nullptr) {
-      memcpy(data, buffer, length);
-      trashMemory(buffer, buffer_len);
-      delete[] buffer;
-    } else { // nullptr data means pass buffer directly to caller
-      data = buffer; // caller must trash & delete[]!
+  size_t field_len = getInt32(lengthblock);
+  type = lengthblock[sizeof(int32)]; // type is first byte after the length
+
+  if (m_fileLength != 0 && field_len >= m_fileLength) {
+    pws_os::Trace0(_T("PWSfile::ReadCBC: Read size larger than file length - aborting\n"));
+    trashMemory(lengthblock, BS);
+    return 0;
+  }
+
+  const size_t bufsize = (field_len / BS) * BS + 2 * BS; // round upwards
+  if (bufsize > m_scratchSize) {
+    if (m_scratch != nullptr) {
+      pws_os::munlock(m_scratch, m_scratchSize);
+      delete[] m_scratch; // wiped above
     }
-  } else {
-    // no need to delete[] buffer, since _readcbc will not allocate if
-    // buffer_len is zero
+    m_scratchSize = std::max(bufsize, size_t(1024));
+    m_scratch = new unsigned char[m_scratchSize];
+    pws_os::mlock(m_scratch, m_scratchSize);
   }
-  return retval;
+  memset(m_scratch, 0, bufsize);
+  m_scratchUsed = bufsize;
+
+  unsigned char *b = m_scratch;
+  size_t rest = field_len;
+  if (BS == 16) {
+    // length block contains up to 11 (= 16 - 4 - 1) bytes of data
+    const size_t len1 = (rest > 11) ? 11 : rest;
+    memcpy(b, lengthblock + 5, len1);
+    rest -= len1;
+    b += len1;
+  }
+  trashMemory(lengthblock, BS);
+
+  size_t BlockLength = ((rest + (BS - 1)) / BS) * BS;
+  // pre-3.0 formats always have at least one block here, see _readcbc()
+  if (BlockLength == 0 && BS == 8)
+    BlockLength = BS;
+
+  if (BlockLength > 0) {
+    if (m_map != nullptr) {
+      const unsigned char *ct;
+      const size_t n = MapRead(BlockLength, ct);
+      numRead += n;
+      if (n >= BS)
+        DecryptAt(ulong64(ct - m_map), ct, b, (n / BS) * BS);
+    } else {
+      numRead += fread(b, 1, BlockLength, m_fd);
+      cbcdecrypt(b, b, BlockLength, m_fish, m_IV);
+    }
+  }
+
+  if (field_len > 0) {
+    if (field_len < length || data == nullptr)
+      length = field_len; // set to length read
+    // if field_len > length, data is truncated to length
+    // probably an error.
+    if (data != nullptr)
+      memcpy(data, m_scratch, length);
+    else // nullptr data means pass our buffer to caller
+      data = m_scratch;
+  }
+  return numRead;
 }
 
 int PWSfile::CheckPasskey(const StringX &filename, const StringX &passkey, VERSION &version)
@@ -240,7 +983,7 @@ void PWSfile::SetUnknownHeaderFields(UnknownFieldList &UHFL)
 
 long PWSfile::GetOffset() const
 {
-  long retval = ftell(m_fd);
+  long retval = FTell();
   ASSERT(ulong64(retval) <= pws_os::fileLength(m_fd));
   return retval;
 }
@@ -573,14 +1316,29 @@ bool PWSfile::Decrypt(const stringT &fn, const StringX &passwd, stringT &errmess
 // be modified and the digests would be different.
 
 PWSFileSig::PWSFileSig(const stringT &fname)
+{
+  FILE *fp = pws_os::FOpen(fname, _T("rb"));
+  Compute(fp);
+  if (fp != nullptr)
+    fclose(fp);
+}
+
+PWSFileSig::PWSFileSig(std::FILE *fp)
+{
+  const long pos = (fp != nullptr) ? ftell(fp) : -1L;
+  Compute(fp);
+  if (pos >= 0)
+    fseek(fp, pos, SEEK_SET);
+}
+
+void PWSFileSig::Compute(std::FILE *fp)
 {
   const long THRESHOLD = 2048; // if file's longer than this, hash only head & tail
 
   m_length = 0;
   m_iErrorCode = PWSfile::SUCCESS;
   memset(m_digest, 0, sizeof(m_digest));
-  FILE *fp = pws_os::FOpen(fname, _T("rb"));
-  if (fp != nullptr) {
+  if (fp != nullptr && fseek(fp, 0, SEEK_SET) == 0) {
     SHA256 hash;
     m_length = pws_os::fileLength(fp);
     // Not the right place to be worried about min size, as this is format
@@ -604,8 +1362,6 @@ PWSFileSig::PWSFileSig(const stringT &fname)
     } else { // Empty file
       m_iErrorCode = PWSfile::TRUNCATED_FILE;
     }
-
-    fclose(fp);
   } else {
     m_iErrorCode = PWSfile::CANT_OPEN_FILE;
   }
@@ -628,7 +1384,7 @@ PWSFileSig &PWSFileSig::operator=(const PWSFileSig &that)
   return *this;
 }
 
-bool PWSFileSig::operator==(const PWSFileSig &that)
+bool PWSFileSig::operator==(const PWSFileSig &that) const
 {
   // Check this first as digest may otherwise be invalid
   if (m_iErrorCode != 0 || that.m_iErrorCode != 0)
@@ -14,6 +14,7 @@
 //-----------------------------------------------------------------------------
 
 #include <cstdio> // for FILE *
+#include <functional>
 #include <vector>
 
 #include "ItemData.h"
@@ -103,6 +104,28 @@ public:
   static VERSION ReadVersion(const StringX &filename, const StringX &passkey);
   static int CheckPasskey(const StringX &filename, const StringX &passkey,
                           VERSION &version);
+  // Wipes stretched keys remembered while checking passkeys/opening a file,
+  // see LookupStretchedKey()
+  static void ClearStretchedKeyCache();
+  // How many lookups found their stretched key, and how many didn't
+  static void GetStretchedKeyCacheStats(unsigned long &hits, unsigned long &misses);
+
+  // What Peek() finds out about a database without reading it all
+  struct PeekInfo {
+    PeekInfo() : version(UNKNOWN_VERSION), nHashIters(0), nEntries(0), nAttachments(0) {}
+    VERSION version;
+    PWSfileHeader hdr;
+    uint32 nHashIters;
+    size_t nEntries, nAttachments; // only if counted
+  };
+  // For listing recent databases, say: checks passkey and reads just the
+  // header. If bCount, also counts the records, skipping over them by the
+  // lengths of their fields, V3 and V4 without decrypting more than each
+  // field's first block. The rest of the file is neither decrypted nor
+  // verified, that's ReadFile's job, which then reuses the stretched key
+  // (unless it's expired, see LookupStretchedKey()).
+  static int Peek(const StringX &filename, const StringX &passkey,
+                  PeekInfo &info, bool bCount = false);
 
   // Following for 'legacy' use of pwsafe as file encryptor/decryptor
   static bool Encrypt(const stringT &fn, const StringX &passwd, stringT &errmess);
@@ -112,7 +135,11 @@ public:
   virtual ~PWSfile();
 
   virtual int Open(const StringX &passkey) = 0;
+  // In Write mode, the file's only replaced if Close() succeeds
   virtual int Close();
+  // Write mode: have Close() discard what's been written, e.g., after
+  // an exception
+  void Abort() {m_status = FAILURE;}
 
   virtual int WriteRecord(const CItemData &item) = 0;
   virtual int ReadRecord(CItemData &item) = 0;
@@ -128,6 +155,9 @@ public:
   {return m_nRecordsWithUnknownFields;}
 
   long GetOffset() const;
+  // Threads Open() may use to try V4 key blocks and to decrypt the
+  // file ahead of reading it: 0 (default) as many as there are cores
+  void SetThreads(unsigned nThreads) {m_nThreads = nThreads;}
   
   // Following implemented in V3 and later
   virtual uint32 GetNHashIters() const {return 0;}
@@ -145,14 +175,48 @@ public:
   // Following for low-level details that changed between format versions
   virtual size_t timeFieldLen() const {return 4;} // changed in V4
   
-  size_t WriteField(unsigned char type,
-                    const StringX &data) {return WriteCBC(type, data);}
+  size_t WriteField(unsigned char type, const StringX &data);
   size_t WriteField(unsigned char type,
                     const unsigned char *data,
-                    size_t length) {return WriteCBC(type, data, length);}
+                    size_t length);
+
+  // While a FieldCollector's in scope, WriteField() calls made on its
+  // thread append the plaintext field to buf rather than writing it, for
+  // a later WriteFields(buf). This lets V3 and later records be serialized
+  // concurrently, while encrypting and writing them stays in order.
+  class FieldCollector {
+  public:
+    explicit FieldCollector(std::vector<unsigned char> &buf);
+    ~FieldCollector();
+  private:
+    FieldCollector(const FieldCollector &) = delete;
+    FieldCollector &operator=(const FieldCollector &) = delete;
+    std::vector<unsigned char> *m_prev;
+  };
+  void WriteFields(const std::vector<unsigned char> &buf);
+  // Conversely, while a FieldSource's in scope, ReadField() calls made on
+  // its thread take their fields from buf, starting at (and advancing) pos.
+  class FieldSource {
+  public:
+    FieldSource(const std::vector<unsigned char> &buf, size_t &pos);
+    ~FieldSource();
+  private:
+    FieldSource(const FieldSource &) = delete;
+    FieldSource &operator=(const FieldSource &) = delete;
+    FieldSource *m_prev;
+    const std::vector<unsigned char> &m_buf;
+    size_t &m_pos;
+    friend class PWSfile;
+  };
+  // If data is nullptr, it's set to point to a buffer owned by this
+  // object, valid until the next read - don't delete[] it!
   size_t ReadField(unsigned char &type,
                    unsigned char* &data,
-                   size_t &length) {return ReadCBC(type, data, length);}
+                   size_t &length);
+
+  // V3 and later: a key for the database's journal (see PWSjournal.h),
+  // derived from its HMAC key. Available once Open() has succeeded.
+  bool GetJournalKey(unsigned char key[SHA256::HASHLEN]) const;
   
 protected:
   PWSfile(const StringX &filename, RWmode mode, VERSION v = UNKNOWN_VERSION);
@@ -162,8 +226,50 @@ protected:
                           size_t length);
   virtual size_t ReadCBC(unsigned char &type, unsigned char* &data,
                          size_t &length);
-  
+
+  // When reading, FOpen() maps the file into memory if it can, and the
+  // following read from the mapping, picking up where m_fd left off.
+  // Otherwise (e.g., stdin), they're just fread(), ftell() and fseek().
+  size_t FRead(void *p, size_t size, size_t n);
+  long FTell() const;
+  int FSeek(long offset, int whence);
+  // Write mode: another stream on the file being written, e.g., for other
+  // threads to fill in what m_fd skipped over. Caller closes it.
+  FILE *FOpenAnother() const;
+  // Points p at up to n mapped bytes, returns how many. Mapped files only.
+  size_t MapRead(size_t n, const unsigned char *&p);
+
+  // Mapped files only: decrypts the given [first, second) file ranges of
+  // the main CBC chain up front, spread across threads, for ReadCBC() to
+  // serve from. Ranges must be sorted and start past the IV.
+  typedef std::vector<std::pair<ulong64, ulong64>> Ranges;
+  void DecryptAhead(const Ranges &ranges);
+
+  // Following for Peek(). The default counts records by reading them.
+  virtual int CountRecords(size_t &nEntries, size_t &nAttachments);
+  // Mapped files only: walks the CBC fields from here to end, decrypting
+  // just each field's first block, which visit gets with the field's type
+  // and length. visit returns how many bytes that aren't part of the chain
+  // follow the field (V4 attachment content). False if the fields don't
+  // add up to end.
+  typedef std::function<ulong64(unsigned char type, size_t length,
+                                const unsigned char *block)> FieldVisitor;
+  bool SkimFields(ulong64 end, const FieldVisitor &visit);
+
   static void HashRandom256(unsigned char *p256); // when we don't want to expose our RNG
+  void SetJournalKey(const unsigned char *L, size_t len); // L is the HMAC key
+
+  // Stretching the passkey is deliberately slow, and opening a file
+  // typically checks the same passkey against the same salt several times
+  // (ReadVersion, CheckPasskey, Open, retry with other encoding). The read
+  // paths therefore remember the result for a short while, in locked memory,
+  // until ClearStretchedKeyCache() or a thread that wipes each on expiry.
+  static bool LookupStretchedKey(VERSION v, const unsigned char *salt, unsigned long saltLen,
+                                 const StringX &passkey, unsigned int N,
+                                 unsigned char Ptag[SHA256::HASHLEN]);
+  static void StoreStretchedKey(VERSION v, const unsigned char *salt, unsigned long saltLen,
+                                const StringX &passkey, unsigned int N,
+                                const unsigned char Ptag[SHA256::HASHLEN]);
 
   const StringX m_filename;
   StringX m_passkey;
@@ -184,11 +290,39 @@ protected:
   PSWDPolicyMap m_MapPSWDPLC;
   std::vector<StringX> m_vEmptyGroups;
   ulong64 m_fileLength;
+  const unsigned char *m_map; // nullptr if not mapped
+  ulong64 m_mapPos; // NOPOS until the mapping takes over from m_fd
+  static const ulong64 NOPOS = ~ulong64(0);
   Asker *m_pAsker;
   Reporter *m_pReporter;
+  bool m_headerOnly; // Peek()ing, so Open() needn't DecryptAhead()
+  unsigned m_nThreads; // see SetThreads()
 
 private:
   PWSfile& operator=(const PWSfile&) = delete; // Do not implement
+  void UnmapAndFree();
+  void DiscardWrite();
+
+  // ReadCBC() decrypts each field here, in locked memory, wiping the previous one
+  unsigned char *m_scratch;
+  size_t m_scratchSize;
+  size_t m_scratchUsed;
+
+  // What DecryptAhead() decrypted, in locked memory, wiped by DecryptAt()
+  // as it's served (up to m_plainWiped) and the rest when the file's closed
+  void DecryptAt(ulong64 pos, const unsigned char *ct, unsigned char *pt, size_t n);
+  struct Segment {ulong64 begin, end; size_t off;}; // off into m_plain
+  std::vector<Segment> m_segments;
+  unsigned char *m_plain;
+  size_t m_plainSize;
+  size_t m_plainWiped;
+
+  // Write mode: where we're writing, and the stream's buffer
+  StringX m_tmpname;
+  char *m_writeBuf;
+
+  unsigned char m_journalKey[SHA256::HASHLEN];
+  bool m_hasJournalKey;
 };
 
 // A quick way to determine if two files are equal,
@@ -199,16 +333,19 @@ class PWSFileSig
 {
 public:
   PWSFileSig(const stringT &fname);
+  PWSFileSig(std::FILE *fp); // of an open file, leaving its position as is
   PWSFileSig(const PWSFileSig &pfs);
   PWSFileSig &operator=(const PWSFileSig &that);
 
   bool IsValid() {return m_iErrorCode == PWSfile::SUCCESS;}
   int GetErrorCode() {return m_iErrorCode;}
 
-  bool operator==(const PWSFileSig &that);
-  bool operator!=(const PWSFileSig &that) {return !(*this == that);}
+  bool operator==(const PWSFileSig &that) const;
+  bool operator!=(const PWSFileSig &that) const {return !(*this == that);}
 
 private:
+  void Compute(std::FILE *fp);
+
   ulong64 m_length; // -1 if file doesn't exist or zero length
   unsigned char m_digest[SHA256::HASHLEN];
   int m_iErrorCode;
@@ -175,8 +175,10 @@ int PWSfileV1V2::Open(const StringX &passkey)
       status = ReadV2Header();
   } // read mode
  exit:
-  if (status != SUCCESS)
+  if (status != SUCCESS) {
+    m_status = status;
     Close();
+  }
   trashMemory(pstr, pstr_len);
   delete[] pstr;
   return status;
@@ -124,11 +124,13 @@ int PWSfileV3::Close()
     size_t fret;
     fret = fwrite(TERMINAL_BLOCK, sizeof(TERMINAL_BLOCK), 1, m_fd);
     if (fret != 1) {
+      m_status = FAILURE; // s.t. the original file's kept
       PWSfile::Close();
       return FAILURE;
     }
     fret = fwrite(digest, sizeof(digest), 1, m_fd);
     if (fret != 1) {
+      m_status = FAILURE;
       PWSfile::Close();
       return FAILURE;
     }
@@ -137,7 +139,7 @@ int PWSfileV3::Close()
     // We're here *after* TERMINAL_BLOCK has been read
     // and detected (by _readcbc) - just read hmac & verify
     unsigned char d[SHA256::HASHLEN];
-    fread(d, sizeof(d), 1, m_fd);
+    FRead(d, sizeof(d), 1);
     if (memcmp(d, digest, SHA256::HASHLEN) == 0)
       return PWSfile::Close();
     else {
@@ -238,7 +240,10 @@ int PWSfileV3::CheckPasskey(const StringX &filename,
     if (nITER != nullptr)
       *nITER = N;
 
-    StretchKey(salt, sizeof(salt), passkey, N, usedPtag);
+    if (!LookupStretchedKey(V30, salt, sizeof(salt), passkey, N, usedPtag)) {
+      StretchKey(salt, sizeof(salt), passkey, N, usedPtag);
+      StoreStretchedKey(V30, salt, sizeof(salt), passkey, N, usedPtag);
+    }
   }
   unsigned char HPtag[SHA256::HASHLEN];
   H.Update(usedPtag, SHA256::HASHLEN);
@@ -399,6 +404,7 @@ int PWSfileV3::WriteHeader()
     TF.Encrypt(L + 16, B3B4 + 16);
     SAFE_FWRITE(B3B4, 1, sizeof(B3B4), m_fd);
     m_hmac.Init(L, sizeof(L));
+    SetJournalKey(L, sizeof(L));
   }
   {
     // See discussion in HashRandom256 to understand why we hash
@@ -588,6 +594,27 @@ int PWSfileV3::WriteHeader()
   return m_status;
 }
 
+int PWSfileV3::CountRecords(size_t &nEntries, size_t &nAttachments)
+{
+  if (m_map == nullptr)
+    return PWSfile::CountRecords(nEntries, nAttachments);
+
+  // Every record ends with an END field, and all's one CBC chain up to
+  // the EOF block & HMAC
+  nEntries = nAttachments = 0;
+  const ulong64 trailer = sizeof(TERMINAL_BLOCK) + SHA256::HASHLEN;
+  if (m_fileLength < ulong64(FTell()) + trailer)
+    return TRUNCATED_FILE;
+  const bool ok = SkimFields(m_fileLength - trailer,
+                             [&nEntries](unsigned char type, size_t, const unsigned char *)
+                             {
+                               if (type == CItemData::END)
+                                 nEntries++;
+                               return ulong64(0);
+                             });
+  return ok ? SUCCESS : READ_FAIL;
+}
+
 int PWSfileV3::ReadHeader()
 {
   PWS_LOGIT;
@@ -603,7 +630,7 @@ int PWSfileV3::ReadHeader()
 
   unsigned char B1B2[sizeof(m_key)];
   ASSERT(sizeof(B1B2) == 32); // Generalize later
-  fread(B1B2, 1, sizeof(B1B2), m_fd);
+  FRead(B1B2, 1, sizeof(B1B2));
   TwoFish TF(Ptag, sizeof(Ptag));
   TF.Decrypt(B1B2, m_key);
   TF.Decrypt(B1B2 + 16, m_key + 16);
@@ -611,16 +638,25 @@ int PWSfileV3::ReadHeader()
   unsigned char L[32]; // for HMAC
   unsigned char B3B4[sizeof(L)];
   ASSERT(sizeof(B3B4) == 32); // Generalize later
-  fread(B3B4, 1, sizeof(B3B4), m_fd);
+  FRead(B3B4, 1, sizeof(B3B4));
   TF.Decrypt(B3B4, L);
   TF.Decrypt(B3B4 + 16, L + 16);
 
   m_hmac.Init(L, sizeof(L));
+  SetJournalKey(L, sizeof(L));
 
-  fread(m_ipthing, 1, sizeof(m_ipthing), m_fd);
+  FRead(m_ipthing, 1, sizeof(m_ipthing));
 
   m_fish = new TwoFish(m_key, sizeof(m_key));
 
+  if (m_map != nullptr && !m_headerOnly) {
+    // All from here to the EOF block & HMAC is one CBC chain
+    const ulong64 pos = ulong64(FTell());
+    const ulong64 trailer = sizeof(TERMINAL_BLOCK) + SHA256::HASHLEN;
+    if (m_fileLength >= pos + trailer)
+      DecryptAhead(Ranges{{pos, m_fileLength - trailer}});
+  }
+
   unsigned char fieldType;
   StringX text;
   bool utf8status;
@@ -638,14 +674,12 @@ int PWSfileV3::ReadHeader()
       // This hack keeps bwd compatibility.
       if (utf8Len != sizeof(VersionNum) &&
           utf8Len != sizeof(int32)) {
-        delete[] utf8;
         Close();
         return FAILURE;
       }
       if (utf8[1] !=
           static_cast<unsigned char>((VersionNum & 0xff00) >> 8)) {
         //major version mismatch
-        delete[] utf8;
         Close();
         return UNSUPPORTED_VERSION;
       }
@@ -657,7 +691,6 @@ int PWSfileV3::ReadHeader()
 
     case HDR_UUID: /* UUID */
       if (utf8Len != sizeof(uuid_array_t)) {
-        delete[] utf8;
         Close();
         return FAILURE;
       }
@@ -855,7 +888,6 @@ int PWSfileV3::ReadHeader()
 
       case HDR_YUBI_SK:
         if (utf8Len != PWSfileHeader::YUBI_SK_LEN) {
-          delete[] utf8;
           Close();
           return FAILURE;
         }
@@ -966,7 +998,7 @@ int PWSfileV3::ReadHeader()
 #endif
         break;
       }
-      delete[] utf8; utf8 = nullptr; utf8Len = 0;
+      utf8 = nullptr; utf8Len = 0; // ReadCBC() owns it
     } while (fieldType != HDR_END);
 
   // Now sort it for when we compare.
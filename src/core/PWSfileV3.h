@@ -55,6 +55,7 @@ public:
                          size_t &length);
   int WriteHeader();
   int ReadHeader();
+  virtual int CountRecords(size_t &nEntries, size_t &nAttachments);
 
   static int SanityCheck(FILE *stream); // Check for TAG and EOF marker
   static void StretchKey(const unsigned char *salt, unsigned long saltLen,
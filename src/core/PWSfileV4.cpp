@@ -38,6 +38,9 @@
 #include <errno.h>
 #include <iomanip>
 #include <algorithm>
+#include <exception>
+#include <mutex>
+#include <thread>
 #include <type_traits> // for static_assert
 
 using namespace std;
@@ -123,6 +126,7 @@ int PWSfileV4::Open(const StringX &passkey)
     static_assert(int(NONCELEN) == int(SHA256::HASHLEN), "can't call HashRandom256");
     HashRandom256(m_nonce); // Generate nonce
     if (!m_keyblocks.GetKeys(passkey, m_nHashIters, m_key, m_ell)) {
+      m_status = WRONG_PASSWORD; // s.t. the original file's kept
       PWSfile::Close();
       return WRONG_PASSWORD;
     }
@@ -137,10 +141,11 @@ int PWSfileV4::Open(const StringX &passkey)
       status = ReadHeader();
   }
   if (status != SUCCESS) {
+    m_status = status;
     Close();
   } else {
     if (m_rw == Read)
-      m_effectiveFileLength = pws_os::fileLength(m_fd) - SHA256::HASHLEN;
+      m_effectiveFileLength = m_fileLength - SHA256::HASHLEN;
   }
   return status;
 }
@@ -168,6 +173,7 @@ int PWSfileV4::Close()
   if (m_rw == Write) {
     fret = fwrite(digest, sizeof(digest), 1, m_fd);
     if (fret != 1) {
+      m_status = FAILURE; // s.t. the original file's kept
       PWSfile::Close();
       return FAILURE;
     }
@@ -177,7 +183,7 @@ int PWSfileV4::Close()
     m_keyblocks.m_kbs.clear();
     // read hmac & verify
     unsigned char d[SHA256::HASHLEN];
-    fret = fread(d, sizeof(d), 1, m_fd);
+    fret = FRead(d, sizeof(d), 1);
     if (fret != 1) {
       PWSfile::Close();
       return TRUNCATED_FILE;
@@ -286,15 +292,7 @@ size_t PWSfileV4::WriteContentFields(unsigned char *content, size_t len)
   PWSrand::GetInstance()->GetRandomData(EK, sizeof(EK));
   PWSrand::GetInstance()->GetRandomData(AK, sizeof(AK));
 
-  WriteField(CItemAtt::ATTIV, IV, sizeof(IV));
-  WriteField(CItemAtt::ATTEK, EK, sizeof(EK));
-  WriteField(CItemAtt::ATTAK, AK, sizeof(AK));
-
-  // Write content length as the "value" of the content field
-  int32 len32 = static_cast<int>(len);
-  unsigned char buf[4];
-  putInt32(buf, len32);
-  WriteField(CItemAtt::CONTENT, buf, sizeof(buf));
+  StartContent(IV, EK, AK, len);
 
   // Create fish with EK
   TwoFish fish(EK, sizeof(EK));
@@ -314,21 +312,65 @@ size_t PWSfileV4::WriteContentFields(unsigned char *content, size_t len)
   // write content's HMAC
   unsigned char digest[SHA256::HASHLEN];
   hmac.Final(digest);
-  WriteField(CItemAtt::CONTENTHMAC, digest, sizeof(digest));
+  EndContent(digest);
 
   return len;
 }
 
-size_t PWSfileV4::ReadContent(Fish *fish,  unsigned char *cbcbuffer,
-                              unsigned char *&content, size_t clen)
+long PWSfileV4::StartContent(const unsigned char IV[TwoFish::BLOCKSIZE],
+                             const unsigned char EK[KLEN],
+                             const unsigned char AK[KLEN], size_t len)
 {
-  ASSERT(clen > 0 && fish != nullptr && cbcbuffer != nullptr);
-  // round up clen to nearest BS:
-  const unsigned int BS = fish->GetBlockSize();
-  size_t blen = (clen/BS + 1)*BS;
+  WriteField(CItemAtt::ATTIV, IV, TwoFish::BLOCKSIZE);
+  WriteField(CItemAtt::ATTEK, EK, KLEN);
+  WriteField(CItemAtt::ATTAK, AK, KLEN);
 
-  content = new unsigned char[blen]; // caller's responsible for delete[]
-  return _readcbc(m_fd, content, blen, fish, cbcbuffer);
+  // Write content length as the "value" of the content field
+  int32 len32 = static_cast<int>(len);
+  unsigned char buf[4];
+  putInt32(buf, len32);
+  WriteField(CItemAtt::CONTENT, buf, sizeof(buf));
+  return ftell(m_fd);
+}
+
+void PWSfileV4::WriteContentBlocks(const unsigned char *data, size_t len)
+{
+  ASSERT(len % TwoFish::BLOCKSIZE == 0);
+  if (len > 0 && fwrite(data, len, 1, m_fd) != 1)
+    throw(EIO);
+}
+
+void PWSfileV4::ReserveContent(size_t len)
+{
+  const unsigned int BS = TwoFish::BLOCKSIZE;
+  const long blen = long(((len + BS - 1) / BS) * BS);
+  if (fseek(m_fd, blen, SEEK_CUR) != 0)
+    throw(EIO);
+}
+
+void PWSfileV4::EndContent(const unsigned char digest[SHA256::HASHLEN])
+{
+  WriteField(CItemAtt::CONTENTHMAC, digest, SHA256::HASHLEN);
+}
+
+long PWSfileV4::SkipContent(size_t clen)
+{
+  // Content's written in whole blocks, nothing more (see _writecbcRest())
+  const unsigned int BS = TwoFish::BLOCKSIZE;
+  const ulong64 blen = ((ulong64(clen) + BS - 1) / BS) * BS;
+  const long offset = FTell();
+  if (offset < 0 || ulong64(offset) + blen > m_effectiveFileLength ||
+      FSeek(long(blen), SEEK_CUR) != 0)
+    return -1L;
+  return offset;
+}
+
+const CItemAtt::ContentSourcePtr &PWSfileV4::GetContentSource()
+{
+  if (m_contentSource == nullptr)
+    m_contentSource = std::make_shared<CItemAtt::ContentSource>(m_filename.c_str(),
+                                                                PWSFileSig(m_fd));
+  return m_contentSource;
 }
 
 size_t PWSfileV4::ReadCBC(unsigned char &type, unsigned char* &data,
@@ -351,14 +393,14 @@ size_t PWSfileV4::ReadCBC(unsigned char &type, unsigned char* &data,
 
 void PWSfileV4::SaveState()
 {
-  m_savepos = ftell(m_fd);
+  m_savepos = FTell();
   memcpy(m_saveIV, m_IV, m_fish->GetBlockSize());
   m_savehmac = m_hmac;
 }
 
 void PWSfileV4::RestoreState()
 {
-  int seekstat = fseek(m_fd, m_savepos, SEEK_SET);
+  int seekstat = FSeek(m_savepos, SEEK_SET);
   if (seekstat != 0)
     ASSERT(0);
   memcpy(m_IV, m_saveIV, m_fish->GetBlockSize());
@@ -371,7 +413,7 @@ int PWSfileV4::ReadRecord(CItemData &item)
   ASSERT(m_fd != nullptr);
   ASSERT(m_curversion == V40);
   SaveState();
-  unsigned fpos = unsigned(ftell(m_fd));
+  unsigned fpos = unsigned(FTell());
   if (fpos < m_effectiveFileLength) {
     status = item.Read(this);
     if (status < 0) { // detected an inappropriate field
@@ -397,7 +439,8 @@ int PWSfileV4::ReadRecord(CItemAtt &att)
 
 void PWSfileV4::StretchKey(const unsigned char *salt, unsigned long saltLen,
                            const StringX &passkey,
-                           unsigned int N, unsigned char *Ptag, unsigned long PtagLen)
+                           unsigned int N, unsigned char *Ptag, unsigned long PtagLen,
+                           const std::atomic<bool> *cancel)
 {
   /*
   * P' is the "stretched key" of the user's passphrase and the SALT, as defined
@@ -410,7 +453,8 @@ void PWSfileV4::StretchKey(const unsigned char *salt, unsigned long saltLen,
 
   HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
   ConvertPasskey(passkey, pstr, passLen);
-  pbkdf2(pstr, static_cast<unsigned long>(passLen), salt, saltLen, N, &hmac, Ptag, &PtagLen);
+  pbkdf2(pstr, static_cast<unsigned long>(passLen), salt, saltLen, N, &hmac, Ptag, &PtagLen,
+         cancel);
 
 #ifdef UNICODE
   trashMemory(pstr, passLen);
@@ -424,19 +468,11 @@ struct PWSfileV4::CKeyBlocks::KeyBlockFinder {
   KeyBlockFinder(const StringX &passkey) : passkey(passkey) {}
 
   bool operator()(const KeyBlock &kb) {
-    unsigned char Ptag[SHA256::HASHLEN];
     unsigned char K[PWSfileV4::KLEN];
-    PWSfileV4::StretchKey(kb.m_salt, sizeof(kb.m_salt), passkey, kb.m_nHashIters,
-                          Ptag, sizeof(Ptag));
-    // Try to unwrap K
-    TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
-    KeyWrap kwK(&Fish);
-    
-    bool retval = kwK.Unwrap(kb.m_kw_k, K, sizeof(kb.m_kw_k));
-    if (retval) {
-      trashMemory(Ptag, sizeof(Ptag));
-      trashMemory(K, sizeof(K));
-    }
+    unsigned char L[PWSfileV4::KLEN];
+    bool retval = PWSfileV4::UnwrapKeyBlock(kb, passkey, K, L, false);
+    trashMemory(K, sizeof(K));
+    trashMemory(L, sizeof(L));
     return retval;
   }
 private:
@@ -444,6 +480,69 @@ private:
   const StringX &passkey;
 };
 
+int PWSfileV4::CKeyBlocks::FindKeyBlock(const StringX &passkey,
+                                        unsigned char K[KLEN], unsigned char L[KLEN],
+                                        bool useCache, unsigned nThreads) const
+{
+  /**
+   * Trying a key block costs a full key stretch, and a shared database
+   * has one per user. So that the last user in the list doesn't wait for
+   * everyone else's stretch, we try them concurrently, on up to one thread
+   * per core. The first key block that unwraps cancels the others.
+   */
+  const unsigned nkbs = size();
+  const unsigned nthreads = std::min((nThreads != 0) ? nThreads :
+                                     std::max(std::thread::hardware_concurrency(), 1u),
+                                     nkbs);
+
+  if (nthreads <= 1) {
+    for (unsigned i = 0; i < nkbs; i++)
+      if (UnwrapKeyBlock(m_kbs[i], passkey, K, L, useCache))
+        return static_cast<int>(i);
+    return -1;
+  }
+
+  std::atomic<unsigned> next(0);
+  std::atomic<bool> found(false);
+  std::mutex result_mutex;
+  int result = -1;
+  std::exception_ptr error;
+
+  auto worker = [&]() {
+    unsigned char k[KLEN], l[KLEN];
+    try {
+      for (unsigned i = next++; i < nkbs && !found; i = next++) {
+        if (UnwrapKeyBlock(m_kbs[i], passkey, k, l, useCache, &found)) {
+          std::lock_guard<std::mutex> guard(result_mutex);
+          if (result == -1) {
+            memcpy(K, k, KLEN);
+            memcpy(L, l, KLEN);
+            result = static_cast<int>(i);
+            found = true;
+          }
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(result_mutex);
+      if (!error)
+        error = std::current_exception();
+    }
+    trashMemory(k, sizeof(k));
+    trashMemory(l, sizeof(l));
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < nthreads; t++)
+    threads.emplace_back(worker);
+  worker(); // this thread's one of the pool
+  for (auto &t : threads)
+    t.join();
+
+  if (result == -1 && error)
+    std::rethrow_exception(error);
+  return result;
+}
+
 bool PWSfileV4::CKeyBlocks::GetKeys(const StringX &passkey, uint32 nHashIters,
                                      unsigned char K[KLEN], unsigned char L[KLEN])
 {
@@ -454,23 +553,7 @@ bool PWSfileV4::CKeyBlocks::GetKeys(const StringX &passkey, uint32 nHashIters,
   if (m_kbs.empty())
     AddKeyBlock(passkey, passkey, nHashIters);
 
-  KeyBlockFinder find_kb(passkey);
-  auto kb_iter = find_if(m_kbs.begin(), m_kbs.end(), find_kb);
-  if (kb_iter == m_kbs.end())
-    return false;
-
-  unsigned char Ptag[SHA256::HASHLEN];
-  PWSfileV4::StretchKey(kb_iter->m_salt, sizeof(kb_iter->m_salt),
-                        passkey, kb_iter->m_nHashIters,
-                        Ptag, sizeof(Ptag));
-  TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
-  KeyWrap kwK(&Fish);
-  if (!kwK.Unwrap(kb_iter->m_kw_k, K, sizeof(kb_iter->m_kw_k)))
-    ASSERT(0);
-  KeyWrap kwL(&Fish);
-  if (!kwL.Unwrap(kb_iter->m_kw_l, L, sizeof(kb_iter->m_kw_l)))
-    ASSERT(0);
-  return true;
+  return FindKeyBlock(passkey, K, L) >= 0;
 }
 
 void PWSfileV4::ComputeEndKB(const unsigned char hnonce[SHA256::HASHLEN],
@@ -562,6 +645,7 @@ int PWSfileV4::WriteHeader()
   int status = SUCCESS;
   size_t numWritten = 0;
   m_hmac.Init(m_ell, sizeof(m_ell)); // re-init for header & data integrity
+  SetJournalKey(m_ell, sizeof(m_ell));
   {
     // See discussion in HashRandom256 to understand why we hash
     // random data instead of writing it directly
@@ -778,8 +862,10 @@ int PWSfileV4::WriteHeader()
   numWritten = WriteCBC(HDR_END, nullptr, 0);
   if (numWritten <= 0) { status = FAILURE; goto end; }
  end:
-  if (status != SUCCESS)
+  if (status != SUCCESS) {
+    m_status = status;
     Close();
+  }
   return status;
 }
 
@@ -792,18 +878,18 @@ int PWSfileV4::ReadKeyBlock()
    */
   CKeyBlocks::KeyBlock kb;
   size_t nRead;
-  nRead = fread(kb.m_salt, sizeof(kb.m_salt), 1, m_fd);
+  nRead = FRead(kb.m_salt, sizeof(kb.m_salt), 1);
   if (nRead == 0) return END_OF_FILE;
   unsigned char Nb[sizeof(uint32)];
 
-  nRead = fread(Nb, sizeof(Nb), 1, m_fd);
+  nRead = FRead(Nb, sizeof(Nb), 1);
   if (nRead == 0) return END_OF_FILE;
   kb.m_nHashIters = getInt32(Nb);
 
-  nRead = fread(kb.m_kw_k, CKeyBlocks::KWLEN, 1, m_fd);
+  nRead = FRead(kb.m_kw_k, CKeyBlocks::KWLEN, 1);
   if (nRead == 0) return END_OF_FILE;
 
-  nRead = fread(kb.m_kw_l, CKeyBlocks::KWLEN, 1, m_fd);
+  nRead = FRead(kb.m_kw_l, CKeyBlocks::KWLEN, 1);
   if (nRead == 0) return END_OF_FILE;
 
   m_keyblocks.m_kbs.push_back(kb);
@@ -811,29 +897,38 @@ int PWSfileV4::ReadKeyBlock()
   return SUCCESS;
 }
 
-int PWSfileV4::TryKeyBlock(unsigned index, const StringX &passkey,
-                           unsigned char K[KLEN], unsigned char L[KLEN],
-                           uint32 &nHashIters)
+bool PWSfileV4::UnwrapKeyBlock(const CKeyBlocks::KeyBlock &kb, const StringX &passkey,
+                               unsigned char K[KLEN], unsigned char L[KLEN],
+                               bool useCache, const std::atomic<bool> *cancel)
 {
-  CKeyBlocks::KeyBlock &kb = m_keyblocks.at(index);
   unsigned char Ptag[SHA256::HASHLEN];
 
-  StretchKey(kb.m_salt, sizeof(kb.m_salt), passkey, kb.m_nHashIters,
-             Ptag, sizeof(Ptag));
+  if (!useCache || !LookupStretchedKey(V40, kb.m_salt, sizeof(kb.m_salt), passkey,
+                                       kb.m_nHashIters, Ptag)) {
+    StretchKey(kb.m_salt, sizeof(kb.m_salt), passkey, kb.m_nHashIters,
+               Ptag, sizeof(Ptag), cancel);
+    if (cancel != nullptr && *cancel) { // Ptag's junk
+      trashMemory(Ptag, sizeof(Ptag));
+      return false;
+    }
+    if (useCache)
+      StoreStretchedKey(V40, kb.m_salt, sizeof(kb.m_salt), passkey,
+                        kb.m_nHashIters, Ptag);
+  }
   // Try to unwrap K
   TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
+  trashMemory(Ptag, sizeof(Ptag));
   KeyWrap kwK(&Fish);
 
   if (!kwK.Unwrap(kb.m_kw_k, K, sizeof(kb.m_kw_k)))
-    return WRONG_PASSWORD;
+    return false;
       
   KeyWrap kwL(&Fish);
   if (!kwL.Unwrap(kb.m_kw_l, L, sizeof(kb.m_kw_l))) {
     ASSERT(0); // Shouln't happen if K unwrapped OK
-    return WRONG_PASSWORD;
+    return false;
   }
-  nHashIters = kb.m_nHashIters;
-  return SUCCESS;
+  return true;
 }
 
 bool PWSfileV4::VerifyKeyBlocks()
@@ -842,10 +937,10 @@ bool PWSfileV4::VerifyKeyBlocks()
   unsigned char ReadEndKB[SHA256::HASHLEN];
   unsigned char CalcEndKB[SHA256::HASHLEN];
 
-  size_t nRead = fread(hnonce, sizeof(hnonce), 1, m_fd);
+  size_t nRead = FRead(hnonce, sizeof(hnonce), 1);
   if (nRead != 1)
     return false;
-  nRead = fread(ReadEndKB, sizeof(ReadEndKB), 1, m_fd);
+  nRead = FRead(ReadEndKB, sizeof(ReadEndKB), 1);
   if (nRead != 1)
     return false;
 
@@ -856,11 +951,11 @@ bool PWSfileV4::VerifyKeyBlocks()
 bool PWSfileV4::EndKeyBlocks(const unsigned char calc_hnonce[SHA256::HASHLEN])
 {
   unsigned char read_hnonce[SHA256::HASHLEN];
-  size_t nr = fread(read_hnonce, sizeof(read_hnonce), 1, m_fd);
+  size_t nr = FRead(read_hnonce, sizeof(read_hnonce), 1);
   if (nr != 1)
     return false; // EOF will be hit again and reported later
   // go back regardless of success/failure
-  fseek(m_fd, -long(sizeof(read_hnonce)), SEEK_CUR);
+  FSeek(-long(sizeof(read_hnonce)), SEEK_CUR);
   return (memcmp(calc_hnonce, read_hnonce, SHA256::HASHLEN) == 0);
 }
 
@@ -872,7 +967,7 @@ int PWSfileV4::ParseKeyBlocks(const StringX &passkey)
    * and find one that works.
    * "All" means running until Hash(m_nonce) detected
    * or EOF.
-   * "works" means TryKeyBlock returns true.
+   * "works" means UnwrapKeyBlock returns true.
    * Once we have a working keyblock, we can verify the integrity
    * of all keyblocks.
    * Consider that we'll hit EOF if file's wrong type/corrupt
@@ -882,7 +977,7 @@ int PWSfileV4::ParseKeyBlocks(const StringX &passkey)
   SHA256 noncehasher;
 
   // Start by reading in nonce
-  size_t nr = fread(m_nonce, NONCELEN, 1, m_fd);
+  size_t nr = FRead(m_nonce, NONCELEN, 1);
   if (nr != 1)
     return READ_FAIL;
 
@@ -897,15 +992,11 @@ int PWSfileV4::ParseKeyBlocks(const StringX &passkey)
     }
   } while (!EndKeyBlocks(calc_hnonce));
 
-  for (unsigned i = 0; i < m_keyblocks.size(); i++) {
-    status = TryKeyBlock(i, passkey, m_key, m_ell, m_nHashIters);
-    if (status == SUCCESS) {
-      if (!VerifyKeyBlocks())
-        status = BAD_DIGEST;
-      break;
-    }
-  }
-  return status;
+  const int index = m_keyblocks.FindKeyBlock(passkey, m_key, m_ell, true, m_nThreads);
+  if (index < 0)
+    return WRONG_PASSWORD;
+  m_nHashIters = m_keyblocks[index].m_nHashIters;
+  return VerifyKeyBlocks() ? SUCCESS : BAD_DIGEST;
 }
 
 bool PWSfileV4::CKeyBlocks::AddKeyBlock(const StringX &current_passkey,
@@ -926,18 +1017,8 @@ bool PWSfileV4::CKeyBlocks::AddKeyBlock(const StringX &current_passkey,
     StretchKey(kb.m_salt, sizeof(kb.m_salt), current_passkey, kb.m_nHashIters,
                Ptag, sizeof(Ptag));
   } else { // we need to get K & L from current
-    KeyBlockFinder find_kb(current_passkey);
-    auto kb_iter = find_if(m_kbs.begin(), m_kbs.end(), find_kb);
-    if (kb_iter == m_kbs.end())
+    if (FindKeyBlock(current_passkey, K, L) < 0)
       return false;
-    PWSfileV4::StretchKey(kb_iter->m_salt, sizeof(kb_iter->m_salt),
-                          current_passkey, kb_iter->m_nHashIters,
-                          Ptag, sizeof(Ptag));
-    TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
-    KeyWrap kwK(&Fish);
-    kwK.Unwrap(kb_iter->m_kw_k, K, sizeof(kb_iter->m_kw_k));
-    KeyWrap kwL(&Fish);
-    kwL.Unwrap(kb_iter->m_kw_l, L, sizeof(kb_iter->m_kw_l));
 
     StretchKey(kb.m_salt, sizeof(kb.m_salt), new_passkey, kb.m_nHashIters,
                Ptag, sizeof(Ptag));
@@ -973,10 +1054,83 @@ bool PWSfileV4::CKeyBlocks::RemoveKeyBlock(const StringX &passkey)
   return (m_kbs.size() != old_size);
 }
 
+PWSfile::Ranges PWSfileV4::ChainRanges() const
+{
+  /**
+   * The main CBC chain runs from here to the HMAC, except for attachment
+   * content, which is encrypted with its own key. Walk the fields, peeking
+   * at each one's length block, to find the stretches in between. Only a
+   * hint for DecryptAhead(): ReadCBC() is right whatever we return.
+   */
+  const unsigned int BS = TwoFish::BLOCKSIZE;
+  ulong64 pos = ulong64(FTell()), begin = pos;
+  const ulong64 end = std::max(m_fileLength, pos + SHA256::HASHLEN) - SHA256::HASHLEN;
+  const unsigned char *prev = m_ipthing;
+  unsigned char lb[BS];
+  Ranges retval;
+
+  while (pos + BS <= end) {
+    m_fish->Decrypt(m_map + pos, lb);
+    for (unsigned int i = 0; i < BS; i++)
+      lb[i] ^= prev[i];
+    const size_t len = getInt32(lb);
+    const unsigned char type = lb[sizeof(int32)];
+    const size_t rest = (len > BS - 5) ? len - (BS - 5) : 0;
+    const ulong64 next = pos + BS + ((rest + BS - 1) / BS) * BS;
+    if (len >= m_fileLength || next > end)
+      break;
+    pos = next;
+    prev = m_map + pos - BS;
+    if (type == CItemAtt::CONTENT && len == sizeof(uint32)) {
+      const ulong64 clen = ulong64(getInt32(lb + 5));
+      const ulong64 skip = ((clen + BS - 1) / BS) * BS; // see SkipContent()
+      if (skip > end - pos)
+        break;
+      retval.push_back(std::make_pair(begin, pos));
+      pos += skip;
+      begin = pos;
+    }
+  }
+  trashMemory(lb, sizeof(lb));
+  retval.push_back(std::make_pair(begin, std::max(begin, std::min(pos, end))));
+  return retval;
+}
+
+int PWSfileV4::CountRecords(size_t &nEntries, size_t &nAttachments)
+{
+  if (m_map == nullptr)
+    return PWSfile::CountRecords(nEntries, nAttachments);
+
+  // A record's an attachment if it starts with its ATTUUID, and
+  // attachment content follows its CONTENT field, outside the chain
+  nEntries = nAttachments = 0;
+  const unsigned int BS = TwoFish::BLOCKSIZE;
+  bool inRecord = false, isAtt = false;
+  const bool ok = SkimFields(m_effectiveFileLength,
+                             [&](unsigned char type, size_t len, const unsigned char *block)
+                             {
+                               if (!inRecord) {
+                                 isAtt = (type == CItemAtt::ATTUUID);
+                                 inRecord = true;
+                               }
+                               if (type == CItemData::END) {
+                                 (isAtt ? nAttachments : nEntries)++;
+                                 inRecord = false;
+                               } else if (isAtt && type == CItemAtt::CONTENT &&
+                                          len == sizeof(uint32)) {
+                                 const ulong64 clen = ulong64(getInt32(block + 5));
+                                 return ((clen + BS - 1) / BS) * BS; // see SkipContent()
+                               }
+                               return ulong64(0);
+                             });
+  return ok ? SUCCESS : READ_FAIL;
+}
+
 int PWSfileV4::ReadHeader()
 {
   m_hmac.Init(m_ell, sizeof(m_ell));
-  size_t nIPread = fread(m_ipthing, sizeof(m_ipthing), 1, m_fd);
+  SetJournalKey(m_ell, sizeof(m_ell));
+  size_t nIPread = FRead(m_ipthing, sizeof(m_ipthing), 1);
   if (nIPread != 1) {
     Close();
     return TRUNCATED_FILE;
@@ -984,6 +1138,9 @@ int PWSfileV4::ReadHeader()
 
   m_fish = new TwoFish(m_key, sizeof(m_key));
 
+  if (m_map != nullptr && !m_headerOnly)
+    DecryptAhead(ChainRanges());
+
   unsigned char fieldType;
   StringX text;
   bool utf8status;
@@ -1001,14 +1158,12 @@ int PWSfileV4::ReadHeader()
       // This hack keeps bwd compatibility.
       if (utf8Len != sizeof(VersionNum) &&
           utf8Len != sizeof(int32)) {
-        delete[] utf8;
         Close();
         return FAILURE;
       }
       if (utf8[1] !=
           static_cast<unsigned char>((VersionNum & 0xff00) >> 8)) {
         //major version mismatch
-        delete[] utf8;
         Close();
         return UNSUPPORTED_VERSION;
       }
@@ -1020,7 +1175,6 @@ int PWSfileV4::ReadHeader()
 
     case HDR_UUID: /* UUID */
       if (utf8Len != sizeof(uuid_array_t)) {
-        delete[] utf8;
         Close();
         return FAILURE;
       }
@@ -1179,7 +1333,6 @@ int PWSfileV4::ReadHeader()
 
     case HDR_YUBI_SK:
       if (utf8Len != PWSfileHeader::YUBI_SK_LEN) {
-        delete[] utf8;
         Close();
         return FAILURE;
       }
@@ -1270,7 +1423,7 @@ int PWSfileV4::ReadHeader()
 #endif
       break;
     }
-    delete[] utf8; utf8 = nullptr; utf8Len = 0;
+    utf8 = nullptr; utf8Len = 0; // ReadCBC() owns it
   } while (fieldType != HDR_END);
 
   // Now sort it for when we compare.
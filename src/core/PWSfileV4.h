@@ -17,8 +17,10 @@
 #include "crypto/sha256.h"
 #include "crypto/hmac.h"
 #include "UTF8Conv.h"
+#include "ItemAtt.h"
 
 #include <vector>
+#include <atomic>
 
 class PWSfileV4 : public PWSfile
 {
@@ -48,9 +50,25 @@ public:
   // and AttContentHMAC per format spec.
   // All except the content are generated internally.
   size_t WriteContentFields(unsigned char *content, size_t len);
-  // Following allocates content, caller responsible for deallocating
-  size_t ReadContent(Fish *fish, unsigned char *cbcbuffer,
-                     unsigned char *&content, size_t clen);
+  // Following do the same in steps, for content that's already encrypted
+  // (e.g., copied from another file): StartContent() writes all up to the
+  // content and returns where that'll be, WriteContentBlocks() writes
+  // (whole blocks of) content as is, EndContent() writes the HMAC.
+  long StartContent(const unsigned char IV[TwoFish::BLOCKSIZE],
+                    const unsigned char EK[KLEN], const unsigned char AK[KLEN],
+                    size_t len);
+  void WriteContentBlocks(const unsigned char *data, size_t len);
+  void EndContent(const unsigned char digest[SHA256::HASHLEN]);
+  // Instead of WriteContentBlocks(), leaves room for content of length len
+  // (as given to StartContent()), to be written via another stream
+  void ReserveContent(size_t len);
+  FILE *OpenContentStream() const {return FOpenAnother();}
+
+  // Following skips content of length clen (as read from the AttContent
+  // field), returning where it starts, -1 if it's not all there
+  long SkipContent(size_t clen);
+  // Shared by the attachments read from this file, see CItemAtt
+  const CItemAtt::ContentSourcePtr &GetContentSource();
 
   uint32 GetNHashIters() const {return m_nHashIters;}
   void SetNHashIters(uint32 N) {m_nHashIters = N;}
@@ -87,7 +105,12 @@ public:
       unsigned char m_kw_l[KWLEN];
     };
     std::vector<KeyBlock> m_kbs;
-    
+
+    // Returns the index of a key block that passkey unwraps (and K, L), or -1.
+    // Tries them on up to nThreads threads, 0 meaning one per core.
+    int FindKeyBlock(const StringX &passkey,
+                     unsigned char K[KLEN], unsigned char L[KLEN],
+                     bool useCache = false, unsigned nThreads = 0) const;
     bool GetKeys(const StringX &passkey, uint32 nHashIters,
                  unsigned char K[KLEN], unsigned char L[KLEN]); // not const
 
@@ -111,6 +134,7 @@ public:
   unsigned char m_ell[KLEN]; // L
   unsigned char m_nonce[NONCELEN]; // 256 bit nonce
   ulong64 m_effectiveFileLength; // for read = fileLength - |HMAC|
+  CItemAtt::ContentSourcePtr m_contentSource; // see GetContentSource()
   Cipher m_cipher;
   uint32 m_nHashIters; // mainly for single-user compatibility.
   unsigned char m_ipthing[TwoFish::BLOCKSIZE]; // for CBC
@@ -120,9 +144,9 @@ public:
   struct KeyBlockWriter;
   int ParseKeyBlocks(const StringX &passkey);
   int ReadKeyBlock(); // can return SUCCESS or END_OF_FILE
-  int TryKeyBlock(unsigned index, const StringX &passkey,
-                  unsigned char K[KLEN], unsigned char L[KLEN],
-                  uint32 &nHashIters);
+  static bool UnwrapKeyBlock(const CKeyBlocks::KeyBlock &kb, const StringX &passkey,
+                             unsigned char K[KLEN], unsigned char L[KLEN],
+                             bool useCache, const std::atomic<bool> *cancel = nullptr);
   void ComputeEndKB(const unsigned char hnonce[SHA256::HASHLEN],
                     unsigned char digest[SHA256::HASHLEN]);
   bool EndKeyBlocks(const unsigned char calc_hnonce[SHA256::HASHLEN]);
@@ -138,6 +162,8 @@ public:
   bool WriteKeyBlocks();
   int WriteHeader();
   int ReadHeader();
+  Ranges ChainRanges() const;
+  virtual int CountRecords(size_t &nEntries, size_t &nAttachments);
 
   // Following to allow rollback when reverting an ItemAtt read
   // as an ItemData
@@ -151,6 +177,7 @@ public:
   static int SanityCheck(FILE *stream); // Check for TAG and EOF marker
   static void StretchKey(const unsigned char *salt, unsigned long saltLen,
                          const StringX &passkey, uint32 N,
-                         unsigned char *Ptag, unsigned long PtagLen);
+                         unsigned char *Ptag, unsigned long PtagLen,
+                         const std::atomic<bool> *cancel = nullptr);
 };
 #endif /* __PWSFILEV4_H */
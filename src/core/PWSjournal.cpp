@@ -0,0 +1,314 @@
+/*
+* Copyright (c) 2003-2021 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+
+// PWSjournal.cpp
+// See PWSjournal.h for what, why and how
+//-----------------------------------------------------------------------------
+
+#include "PWSjournal.h"
+#include "PWSfileV3.h"
+#include "PWSfileV4.h"
+#include "PWSrand.h"
+#include "UTF8Conv.h"
+#include "Util.h"
+
+#include "crypto/hmac.h"
+#include "crypto/TwoFish.h"
+#include "os/file.h"
+#include "os/debug.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+  typedef HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> HMAC_SHA256;
+
+  const unsigned char TAG[] = {'P', 'W', 'S', 'J'};
+
+  // A journal's folded into its database once it's grown past this, or
+  // past a quarter of the database's size, whichever is larger
+  const ulong64 MIN_FULL_SIZE = 64 * 1024;
+
+  // Field types within a transaction. Each ENTRY field is followed by the
+  // entry's record, up to and including its END field.
+  enum {CHANGES = 0x00, // the transaction's one encrypted field
+        ENTRY = 0xe0, DELETED = 0xe1, HEADER = 0xe2};
+
+  void Mac(const unsigned char *key, const unsigned char *prev,
+           const unsigned char *data, size_t len,
+           unsigned char mac[SHA256::HASHLEN])
+  {
+    HMAC_SHA256 hmac(key, SHA256::HASHLEN);
+    if (prev != nullptr)
+      hmac.Update(prev, SHA256::HASHLEN);
+    hmac.Update(data, static_cast<unsigned long>(len));
+    hmac.Final(mac);
+  }
+}
+
+stringT PWSjournal::GetName(const StringX &dbname)
+{
+  return stringT(dbname.c_str()) + _T(".jnl");
+}
+
+PWSjournal::PWSjournal(const StringX &dbname, PWSfile::VERSION version,
+                       const unsigned char key[SHA256::HASHLEN])
+  : m_filename(GetName(dbname)), m_version(version), m_valid(false),
+    m_dbSize(0), m_size(0)
+{
+  ASSERT(version == PWSfile::V30 || version == PWSfile::V40);
+
+  // The database's length and last bytes (its HMAC) tell one save from
+  // another, even for V4, whose HMAC key is the same across saves.
+  unsigned char tail[sizeof(ulong64) + SHA256::HASHLEN] = {0};
+  FILE *fd = pws_os::FOpen(stringT(dbname.c_str()), _T("rb"));
+  if (fd != nullptr) {
+    m_dbSize = pws_os::fileLength(fd);
+    putInt64(tail, static_cast<int64>(m_dbSize));
+    m_valid = m_dbSize >= SHA256::HASHLEN &&
+              fseek(fd, -long(SHA256::HASHLEN), SEEK_END) == 0 &&
+              fread(tail + sizeof(ulong64), SHA256::HASHLEN, 1, fd) == 1;
+    fclose(fd);
+  }
+
+  const unsigned char K = 'K', L = 'L';
+  HMAC_SHA256 hk(key, SHA256::HASHLEN);
+  hk.Update(tail, sizeof(tail));
+  hk.Update(&K, 1);
+  hk.Final(m_key);
+  HMAC_SHA256 hl(key, SHA256::HASHLEN);
+  hl.Update(tail, sizeof(tail));
+  hl.Update(&L, 1);
+  hl.Final(m_ell);
+  memset(m_mac, 0, sizeof(m_mac));
+}
+
+PWSjournal::~PWSjournal()
+{
+  trashMemory(m_key, sizeof(m_key));
+  trashMemory(m_ell, sizeof(m_ell));
+}
+
+int PWSjournal::Read(Changes &changes)
+{
+  m_size = 0;
+  if (!m_valid)
+    return PWSfile::FAILURE;
+
+  FILE *fd = pws_os::FOpen(m_filename, _T("rb"));
+  if (fd == nullptr)
+    return PWSfile::SUCCESS; // nothing journaled
+
+  const ulong64 flen = pws_os::fileLength(fd);
+  unsigned char tag[sizeof(TAG)], mac[SHA256::HASHLEN], expected[SHA256::HASHLEN];
+  Mac(m_ell, nullptr, TAG, sizeof(TAG), expected);
+  if (fread(tag, sizeof(tag), 1, fd) != 1 || memcmp(tag, TAG, sizeof(TAG)) != 0 ||
+      fread(mac, sizeof(mac), 1, fd) != 1 || memcmp(mac, expected, sizeof(mac)) != 0) {
+    // Not ours, or not for this version of the database: ignore it
+    fclose(fd);
+    return PWSfile::SUCCESS;
+  }
+  memcpy(m_mac, mac, sizeof(mac));
+  m_size = sizeof(TAG) + sizeof(mac);
+
+  TwoFish fish(m_key, sizeof(m_key));
+  for (;;) {
+    unsigned char iv[TwoFish::BLOCKSIZE];
+    if (fread(iv, sizeof(iv), 1, fd) != 1)
+      break;
+
+    unsigned char *buf = nullptr;
+    size_t len = 0;
+    unsigned char type;
+    if (_readcbc(fd, buf, len, type, &fish, iv, nullptr, flen) == 0 || len == 0)
+      break;
+    const size_t bufsize = (len / TwoFish::BLOCKSIZE) * TwoFish::BLOCKSIZE + 2 * TwoFish::BLOCKSIZE;
+    std::vector<unsigned char> fields(buf, buf + len);
+    trashMemory(buf, bufsize);
+    delete[] buf;
+
+    bool ok = type == CHANGES && fread(mac, sizeof(mac), 1, fd) == 1;
+    if (ok) {
+      Mac(m_ell, m_mac, fields.data(), fields.size(), expected);
+      ok = memcmp(mac, expected, sizeof(mac)) == 0 && Deserialize(fields, changes);
+    }
+    trashMemory(fields.data(), fields.size());
+    if (!ok)
+      break; // e.g., torn write: ignore the rest
+
+    memcpy(m_mac, mac, sizeof(mac));
+    m_size = static_cast<ulong64>(ftell(fd));
+  }
+
+  fclose(fd);
+  return PWSfile::SUCCESS;
+}
+
+int PWSjournal::Append(const Changes &changes)
+{
+  if (!m_valid)
+    return PWSfile::FAILURE;
+  if (changes.empty())
+    return PWSfile::SUCCESS;
+
+  std::vector<unsigned char> fields;
+  Serialize(changes, fields);
+
+  // A new journal replaces whatever's there (stale, if anything), otherwise
+  // we write over anything past the last intact transaction
+  FILE *fd = pws_os::FOpen(m_filename, m_size == 0 ? _T("wb") : _T("r+b"));
+  if (fd == nullptr) {
+    trashMemory(fields.data(), fields.size());
+    return PWSfile::CANT_OPEN_FILE;
+  }
+
+  int status = PWSfile::SUCCESS;
+  ulong64 size = m_size;
+  unsigned char prev[SHA256::HASHLEN], mac[SHA256::HASHLEN];
+  memcpy(prev, m_mac, sizeof(prev));
+  try { // _writecbc throws on write error
+    if (size == 0) {
+      Mac(m_ell, nullptr, TAG, sizeof(TAG), prev);
+      if (fwrite(TAG, sizeof(TAG), 1, fd) != 1 || fwrite(prev, sizeof(prev), 1, fd) != 1)
+        throw EIO;
+      size = sizeof(TAG) + sizeof(prev);
+    } else if (fseek(fd, long(size), SEEK_SET) != 0) {
+      throw EIO;
+    }
+
+    unsigned char iv[TwoFish::BLOCKSIZE];
+    PWSrand::GetInstance()->GetRandomData(iv, sizeof(iv));
+    if (fwrite(iv, sizeof(iv), 1, fd) != 1)
+      throw EIO;
+    TwoFish fish(m_key, sizeof(m_key));
+    size += sizeof(iv) + _writecbc(fd, fields.data(), fields.size(), CHANGES, &fish, iv);
+
+    Mac(m_ell, prev, fields.data(), fields.size(), mac);
+    if (fwrite(mac, sizeof(mac), 1, fd) != 1)
+      throw EIO;
+    size += sizeof(mac);
+  } catch (...) {
+    status = PWSfile::WRITE_FAIL;
+  }
+  trashMemory(fields.data(), fields.size());
+
+  if (pws_os::FClose(fd, true) != 0) // syncs
+    status = PWSfile::WRITE_FAIL;
+
+  if (status == PWSfile::SUCCESS) {
+    memcpy(m_mac, mac, sizeof(mac));
+    m_size = size;
+  }
+  return status;
+}
+
+bool PWSjournal::IsFull() const
+{
+  return m_size > std::max(MIN_FULL_SIZE, m_dbSize / 4);
+}
+
+void PWSjournal::Remove()
+{
+  if (pws_os::FileExists(m_filename))
+    pws_os::DeleteAFile(m_filename);
+  m_size = 0;
+}
+
+void PWSjournal::Serialize(const Changes &changes, std::vector<unsigned char> &buf) const
+{
+  // Records are laid out just as the database would lay them out,
+  // so we collect what a (never opened) file of its version writes
+  PWSfile::FieldCollector collector(buf);
+  PWSfileV3 v3(m_filename.c_str(), PWSfile::Write, PWSfile::V30);
+  PWSfileV4 v4(m_filename.c_str(), PWSfile::Write, PWSfile::V40);
+  PWSfile *out = (m_version == PWSfile::V40) ? static_cast<PWSfile *>(&v4) : &v3;
+
+  for (const auto &uuid : changes.deleted) {
+    uuid_array_t ua;
+    uuid.GetARep(ua);
+    out->WriteField(DELETED, ua, sizeof(ua));
+  }
+
+  for (const auto &h : changes.header) {
+    CUTF8Conv conv;
+    const unsigned char *utf8 = nullptr;
+    size_t utf8Len = 0;
+    if (!conv.ToUTF8(h.second, utf8, utf8Len))
+      pws_os::Trace(_T("ToUTF8(%ls) failed\n"), h.second.c_str());
+    std::vector<unsigned char> field(1 + utf8Len);
+    field[0] = static_cast<unsigned char>(h.first);
+    if (utf8Len > 0)
+      memcpy(&field[1], utf8, utf8Len);
+    out->WriteField(HEADER, field.data(), field.size());
+    trashMemory(field.data(), field.size());
+  }
+
+  for (const auto &p : changes.entries) {
+    out->WriteField(ENTRY, nullptr, 0);
+    if (m_version == PWSfile::V40)
+      p.second.Write(&v4);
+    else
+      p.second.Write(&v3);
+  }
+}
+
+bool PWSjournal::Deserialize(const std::vector<unsigned char> &buf, Changes &changes) const
+{
+  size_t pos = 0;
+  PWSfile::FieldSource source(buf, pos);
+  PWSfileV3 v3(m_filename.c_str(), PWSfile::Read, PWSfile::V30);
+  PWSfileV4 v4(m_filename.c_str(), PWSfile::Read, PWSfile::V40);
+  PWSfile *in = (m_version == PWSfile::V40) ? static_cast<PWSfile *>(&v4) : &v3;
+
+  while (pos < buf.size()) {
+    unsigned char type;
+    unsigned char *data = nullptr;
+    size_t len = 0;
+    if (in->ReadField(type, data, len) == 0)
+      return false;
+
+    switch (type) {
+      case ENTRY:
+      {
+        CItemData ci;
+        if (ci.Read(in) != PWSfile::SUCCESS)
+          return false;
+        const pws_os::CUUID uuid = ci.GetUUID();
+        changes.deleted.erase(uuid);
+        changes.entries[uuid] = ci;
+        break;
+      }
+      case DELETED:
+      {
+        if (len != sizeof(uuid_array_t))
+          return false;
+        uuid_array_t ua;
+        memcpy(ua, data, sizeof(ua));
+        const pws_os::CUUID uuid(ua);
+        changes.entries.erase(uuid);
+        changes.deleted.insert(uuid);
+        break;
+      }
+      case HEADER:
+      {
+        if (len == 0)
+          return false;
+        CUTF8Conv conv;
+        StringX value;
+        if (!conv.FromUTF8(data + 1, len - 1, value))
+          return false;
+        changes.header[static_cast<PWSfile::HeaderType>(data[0])] = value;
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+  return true;
+}
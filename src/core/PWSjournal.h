@@ -0,0 +1,85 @@
+/*
+* Copyright (c) 2003-2021 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+
+#ifndef __PWSJOURNAL_H
+#define __PWSJOURNAL_H
+
+// PWSjournal.h
+// An append-only journal of changes to a V3 or V4 database, kept next to
+// it, so that "Save Immediately" needn't rewrite the whole database after
+// every change. PWScore replays the journal when it reads the database,
+// and WriteFile() folds it in (deletes it), having written everything.
+//
+// Layout: "PWSJ", then a 32 byte HMAC of that tag, then transactions, each
+// one being a random 16 byte IV, a single CBC-encrypted field (as in V3)
+// holding the changes, and an HMAC of the previous HMAC and the changes.
+// The changes are fields laid out as PWSfile::FieldCollector does, namely
+// records as the database would hold them, header fields and deletions.
+//
+// The keys are derived from PWSfile::GetJournalKey() and from the tail of
+// the database file as written, so a journal that doesn't belong to the
+// database as it is, e.g., as saved by another application since, is
+// simply ignored. Anything after the last intact transaction (say, a
+// partial write) is ignored as well.
+//-----------------------------------------------------------------------------
+
+#include <map>
+#include <vector>
+
+#include "PWSfile.h"
+#include "coredefs.h"
+#include "crypto/sha256.h"
+
+class PWSjournal
+{
+public:
+  // What transactions add up to: entries added or changed, entries
+  // deleted, and header fields changed (values are as in PWSfileHeader)
+  struct Changes {
+    ItemList entries;
+    UUIDSet deleted;
+    std::map<PWSfile::HeaderType, StringX> header;
+
+    bool empty() const {return entries.empty() && deleted.empty() && header.empty();}
+    void clear() {entries.clear(); deleted.clear(); header.clear();}
+  };
+
+  static stringT GetName(const StringX &dbname); // the journal's filename
+
+  // dbname must already have been written, see file comment
+  PWSjournal(const StringX &dbname, PWSfile::VERSION version,
+             const unsigned char key[SHA256::HASHLEN]);
+  ~PWSjournal();
+
+  // Adds what's in this database's journal to changes
+  int Read(Changes &changes);
+  int Append(const Changes &changes);
+  ulong64 GetSize() const {return m_size;} // 0 if nothing's been journaled
+  // True once the journal's big enough, relative to the database, that
+  // it's time to fold it in
+  bool IsFull() const;
+  void Remove(); // e.g., once folded into the database
+  const stringT &GetFilename() const {return m_filename;}
+
+private:
+  PWSjournal(const PWSjournal &) = delete;
+  PWSjournal &operator=(const PWSjournal &) = delete;
+
+  void Serialize(const Changes &changes, std::vector<unsigned char> &buf) const;
+  bool Deserialize(const std::vector<unsigned char> &buf, Changes &changes) const;
+
+  const stringT m_filename;
+  const PWSfile::VERSION m_version;
+  bool m_valid; // false if we couldn't derive the keys
+  ulong64 m_dbSize;
+  unsigned char m_key[SHA256::HASHLEN];  // K, for the TwoFish
+  unsigned char m_ell[SHA256::HASHLEN];  // L, for the HMACs
+  unsigned char m_mac[SHA256::HASHLEN];  // last transaction's HMAC
+  ulong64 m_size; // of the valid part of the file, where we append
+};
+#endif /* __PWSJOURNAL_H */
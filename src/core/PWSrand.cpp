@@ -6,30 +6,38 @@
 * http://www.opensource.org/licenses/artistic-license-2.0.php
 */
 #include <limits.h>
+#include <cstring>
+#include <mutex>
 #include "os/rand.h"
+#include "os/mem.h"
 
 #include "PwsPlatform.h"
 #include "PWSrand.h"
+#include "Util.h"
+#include "crypto/AES.h"
 
-PWSrand *PWSrand::self = nullptr;
+thread_local std::unique_ptr<PWSrand> PWSrand::self;
 
 PWSrand *PWSrand::GetInstance()
 {
-  if (self == nullptr) {
-    self = new PWSrand;
+  if (!self) {
+    self.reset(new PWSrand);
   }
-  return self;
+  return self.get();
 }
 
 void PWSrand::DeleteInstance()
 {
-  delete self;
-  self = nullptr;
+  self.reset();
 }
 
 PWSrand::PWSrand()
-  : R{}, rgbRandomData{}, ibRandomData(SHA256::HASHLEN)
+  : m_buf{}, m_pos(BUFSIZE)
 {
+  // GetRandomSeed keeps state between its two calls
+  static std::mutex seedMutex;
+  std::lock_guard<std::mutex> guard(seedMutex);
+
   m_IsInternalPRNG = !pws_os::InitRandomDataFunction();
 
   SHA256 s;
@@ -40,12 +48,19 @@ PWSrand::PWSrand()
   p = new unsigned char[slen];
   pws_os::GetRandomSeed(p, slen);
   s.Update(p, slen);
+  trashMemory(p, slen);
   delete[] p;
   s.Final(K);
+
+  // Buffered output is as sensitive as the data it becomes
+  pws_os::mlock(this, sizeof(*this));
 }
 
 PWSrand::~PWSrand()
 {
+  trashMemory(K, sizeof(K));
+  trashMemory(m_buf, sizeof(m_buf));
+  pws_os::munlock(this, sizeof(*this));
 }
 
 void PWSrand::AddEntropy(unsigned char *bytes, unsigned int numBytes)
@@ -57,72 +72,68 @@ void PWSrand::AddEntropy(unsigned char *bytes, unsigned int numBytes)
   s.Update(K, sizeof(K));
   s.Update(bytes, numBytes);
   s.Final(K);
-}
-
-void PWSrand::NextRandBlock()
-{
-  SHA256 s;
-  s.Update(K, sizeof(K));
-  s.Final(R);
-  unsigned int *Kp = reinterpret_cast<unsigned int *>(K);
-  unsigned int *Rp = reinterpret_cast<unsigned int *>(R);
-  const int N = SHA256::HASHLEN / sizeof(uint32);
 
-  Kp[0]++;
-
-  for (int32 i = 0; i < N; i++)
-    Kp[i] += Rp[i];
+  // Drop what was generated under the old key
+  trashMemory(m_buf + m_pos, BUFSIZE - m_pos);
+  m_pos = BUFSIZE;
 }
 
-void PWSrand::GetRandomData( void * const buffer, unsigned long length )
+void PWSrand::Refill()
 {
-  if (!m_IsInternalPRNG) {
-    bool status;
-    status = pws_os::GetRandomData(buffer, length);
-    ASSERT(status);
-    UNREFERENCED_PARAMETER(status); // used only in assert
+  // Counter blocks 0, 1 encrypt to the next key, the rest to the buffer.
+  const unsigned int BS = AES::BLOCKSIZE;
+  const unsigned int nblocks = (sizeof(K) + BUFSIZE) / BS;
+  unsigned char ks[sizeof(K) + BUFSIZE] = {0};
+  for (unsigned int i = 0; i < nblocks; i++)
+    putInt32(ks + i * BS, i);
+
+  {
+    AES aes(K, sizeof(K));
+    aes.EncryptBlocks(ks, ks, nblocks);
   }
+  std::memcpy(K, ks, sizeof(K));
+  std::memcpy(m_buf, ks + sizeof(K), BUFSIZE);
+  trashMemory(ks, sizeof(ks));
 
   // If we have an external random source, we'll
   // xor it in with ours. This helps protect against
   // poor or subverted external PRNGs.
   // Otherwise, we'll rely on our lonesome.
-
-  unsigned char *pb = static_cast<unsigned char *>(buffer);
-  while (length > SHA256::HASHLEN) {
-    NextRandBlock();
-    for (unsigned int j = 0; j < SHA256::HASHLEN; j++)
-      pb[j] = (m_IsInternalPRNG) ? R[j] : pb[j] ^ R[j];
-    length -= SHA256::HASHLEN;
-    pb += SHA256::HASHLEN;
-  }
-
-  ASSERT(length <= SHA256::HASHLEN);
-  if (length > 0) {
-    unsigned long i = 0;
-    NextRandBlock();
-    while (i < length) {
-      pb[i] = (m_IsInternalPRNG) ? R[i] : pb[i] ^ R[i];
-      i++;
+  if (!m_IsInternalPRNG) {
+    unsigned char ext[BUFSIZE];
+    bool status;
+    status = pws_os::GetRandomData(ext, BUFSIZE);
+    ASSERT(status);
+    if (status) {
+      for (unsigned int j = 0; j < BUFSIZE; j++)
+        m_buf[j] ^= ext[j];
     }
+    trashMemory(ext, sizeof(ext));
   }
+  m_pos = 0;
 }
 
-// generate random numbers from a buffer filled in by GetRandomData()
-unsigned int PWSrand::RandUInt()
+void PWSrand::GetRandomData( void * const buffer, unsigned long length )
 {
-  // we don't want to keep filling the random buffer for each number we
-  // want, so fill the buffer with random data and use it up
-
-  if (ibRandomData > (SHA256::HASHLEN - sizeof(uint32))) {
-    // no data left, refill the buffer
-    GetRandomData(rgbRandomData, SHA256::HASHLEN);
-    ibRandomData = 0;
+  unsigned char *pb = static_cast<unsigned char *>(buffer);
+  while (length > 0) {
+    if (m_pos == BUFSIZE)
+      Refill();
+    const unsigned int n = (length < BUFSIZE - m_pos) ?
+      static_cast<unsigned int>(length) : BUFSIZE - m_pos;
+    std::memcpy(pb, m_buf + m_pos, n);
+    // Don't keep anything that's been handed out
+    std::memset(m_buf + m_pos, 0, n);
+    m_pos += n;
+    pb += n;
+    length -= n;
   }
+}
 
-  const unsigned int u =
-    *(reinterpret_cast<uint32 *>(rgbRandomData + ibRandomData));
-  ibRandomData += sizeof(uint32);
+unsigned int PWSrand::RandUInt()
+{
+  uint32 u;
+  GetRandomData(&u, sizeof(u));
   return u;
 }
 
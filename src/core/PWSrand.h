@@ -13,11 +13,19 @@
 
 #include "crypto/sha256.h"
 
+#include <memory>
+
+// Random bytes come from a buffered AES-256-CTR generator with fast key
+// erasure: each refill of the buffer also produces the next key. When the
+// OS has a usable random source, one call to it per refill is xor-ed in.
+//
+// Each thread gets its own instance, so callers need no locking.
+
 class PWSrand
 {
 public:
-  static PWSrand *GetInstance();
-  static void DeleteInstance();
+  static PWSrand *GetInstance(); // calling thread's instance
+  static void DeleteInstance(); // ditto
 
   void AddEntropy(unsigned char *bytes, unsigned int numBytes);
   //  fill this buffer with random data
@@ -30,14 +38,15 @@ public:
 private:
   PWSrand(); // start with some minimal entropy
   ~PWSrand();
+  friend struct std::default_delete<PWSrand>;
 
-  void NextRandBlock();
-  static PWSrand *self;
+  void Refill();
+  static thread_local std::unique_ptr<PWSrand> self;
   bool m_IsInternalPRNG;
-  unsigned char K[SHA256::HASHLEN];
-  unsigned char R[SHA256::HASHLEN];
+  unsigned char K[SHA256::HASHLEN]; // key for next Refill()
 
-  char rgbRandomData[SHA256::HASHLEN];
-  unsigned int ibRandomData;
+  enum {BUFSIZE = 4096};
+  unsigned char m_buf[BUFSIZE]; // unused output is m_buf[m_pos..BUFSIZE)
+  unsigned int m_pos;
 };
 #endif /*  __PWSRAND_H */
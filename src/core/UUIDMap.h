@@ -0,0 +1,213 @@
+/*
+* Copyright (c) 2003-2021 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// UUIDMap.h
+// A std::map keyed by UUID, as ItemList and AttList have always been, with
+// a flat, open addressing hash index on the side, so that finding an item
+// by its UUID costs a probe or two of the index and no UUID comparisons
+// down a tree. The map's nodes stay put, so iterators to and pointers into
+// items remain valid as before (the UIs rely on this), as does the order
+// of iteration (by UUID).
+//
+// Only what the map's users need of std::map's interface is provided.
+//-----------------------------------------------------------------------------
+
+#ifndef __UUIDMAP_H
+#define __UUIDMAP_H
+
+#include "os/UUID.h"
+
+#include <map>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class UUIDMap
+{
+  typedef std::map<pws_os::CUUID, T> Map;
+
+public:
+  typedef typename Map::key_type key_type;
+  typedef typename Map::mapped_type mapped_type;
+  typedef typename Map::value_type value_type;
+  typedef typename Map::size_type size_type;
+  typedef typename Map::iterator iterator;
+  typedef typename Map::const_iterator const_iterator;
+
+  UUIDMap() : m_used(0) {}
+  UUIDMap(const UUIDMap &that) : m_map(that.m_map), m_used(0) {Reindex();}
+  UUIDMap(UUIDMap &&that) : m_used(0) {swap(that);}
+  UUIDMap &operator=(const UUIDMap &that)
+  {
+    if (this != &that) {
+      UUIDMap tmp(that);
+      swap(tmp);
+    }
+    return *this;
+  }
+  UUIDMap &operator=(UUIDMap &&that) {swap(that); return *this;}
+
+  // std::map's swap keeps iterators valid, and hence the index
+  void swap(UUIDMap &that)
+  {
+    m_map.swap(that.m_map);
+    m_index.swap(that.m_index);
+    std::swap(m_used, that.m_used);
+  }
+
+  iterator begin() {return m_map.begin();}
+  const_iterator begin() const {return m_map.begin();}
+  iterator end() {return m_map.end();}
+  const_iterator end() const {return m_map.end();}
+  bool empty() const {return m_map.empty();}
+  size_type size() const {return m_map.size();}
+
+  void clear()
+  {
+    m_map.clear();
+    std::vector<Slot>().swap(m_index);
+    m_used = 0;
+  }
+
+  iterator find(const key_type &key)
+  {
+    const size_t i = Lookup(key, Hash(key));
+    return (i == NOSLOT) ? m_map.end() : m_index[i].it;
+  }
+
+  const_iterator find(const key_type &key) const
+  {
+    const size_t i = Lookup(key, Hash(key));
+    return (i == NOSLOT) ? m_map.end() : const_iterator(m_index[i].it);
+  }
+
+  size_type count(const key_type &key) const {return find(key) != end() ? 1 : 0;}
+
+  std::pair<iterator, bool> insert(const value_type &value)
+  {
+    const size_t h = Hash(value.first);
+    const size_t i = Lookup(value.first, h);
+    if (i != NOSLOT)
+      return std::make_pair(m_index[i].it, false);
+    Reserve(m_used + 1); // first, so a failure leaves us as we were
+    const iterator it = m_map.insert(value).first;
+    Add(h, it);
+    return std::make_pair(it, true);
+  }
+
+  mapped_type &operator[](const key_type &key)
+  {
+    const size_t i = Lookup(key, Hash(key));
+    if (i != NOSLOT)
+      return m_index[i].it->second;
+    return insert(value_type(key, mapped_type())).first->second;
+  }
+
+  iterator erase(iterator pos)
+  {
+    Remove(Lookup(pos->first, Hash(pos->first)));
+    return m_map.erase(pos);
+  }
+
+  size_type erase(const key_type &key)
+  {
+    const size_t i = Lookup(key, Hash(key));
+    if (i == NOSLOT)
+      return 0;
+    const iterator it = m_index[i].it;
+    Remove(i);
+    m_map.erase(it);
+    return 1;
+  }
+
+  bool operator==(const UUIDMap &that) const {return m_map == that.m_map;}
+  bool operator!=(const UUIDMap &that) const {return m_map != that.m_map;}
+
+private:
+  // Slots hold a map iterator and its key's hash, 0 if the slot's free.
+  // Linear probing, at most half full, with backward shift on removal, so
+  // no tombstones.
+  struct Slot {
+    size_t hash;
+    iterator it;
+  };
+  static const size_t NOSLOT = ~size_t(0);
+  enum {MIN_SLOTS = 16};
+
+  static size_t Hash(const key_type &key)
+  {
+    const size_t h = key.Hash();
+    return (h == 0) ? 1 : h;
+  }
+
+  size_t Lookup(const key_type &key, size_t h) const
+  {
+    if (m_index.empty())
+      return NOSLOT;
+    const size_t mask = m_index.size() - 1;
+    for (size_t i = h & mask; m_index[i].hash != 0; i = (i + 1) & mask)
+      if (m_index[i].hash == h && m_index[i].it->first == key)
+        return i;
+    return NOSLOT;
+  }
+
+  void Add(size_t h, iterator it)
+  {
+    const size_t mask = m_index.size() - 1;
+    size_t i = h & mask;
+    while (m_index[i].hash != 0)
+      i = (i + 1) & mask;
+    m_index[i].hash = h;
+    m_index[i].it = it;
+    m_used++;
+  }
+
+  void Remove(size_t i)
+  {
+    const size_t mask = m_index.size() - 1;
+    // Move back whatever would no longer be found past the hole
+    for (size_t j = (i + 1) & mask; m_index[j].hash != 0; j = (j + 1) & mask) {
+      const size_t home = m_index[j].hash & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        m_index[i] = m_index[j];
+        i = j;
+      }
+    }
+    m_index[i].hash = 0;
+    m_used--;
+  }
+
+  void Reserve(size_t n)
+  {
+    if (2 * n <= m_index.size())
+      return;
+    size_t slots = MIN_SLOTS;
+    while (slots < 2 * n)
+      slots *= 2;
+    std::vector<Slot> index(slots, Slot{0, m_map.end()});
+    m_index.swap(index);
+    m_used = 0;
+    for (const Slot &s : index)
+      if (s.hash != 0)
+        Add(s.hash, s.it);
+  }
+
+  void Reindex()
+  {
+    m_index.clear();
+    m_used = 0;
+    Reserve(m_map.size());
+    for (iterator it = m_map.begin(); it != m_map.end(); ++it)
+      Add(Hash(it->first), it);
+  }
+
+  Map m_map;
+  std::vector<Slot> m_index;
+  size_t m_used;
+};
+
+#endif /* __UUIDMAP_H */
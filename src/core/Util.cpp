@@ -35,6 +35,7 @@
 #endif
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
 
 #include <errno.h>
 
@@ -47,6 +48,52 @@ static void xormem(unsigned char *mem1, const unsigned char *mem2, int length)
     mem1[x] ^= mem2[x];
 }
 
+/*
+ * CBC-decrypts length bytes (a whole number of blocks) from in to out,
+ * which may be the same buffer.
+ * Unlike encryption, CBC decryption of a block doesn't depend on the
+ * previous plaintext, so we decrypt batches of blocks with a single
+ * DecryptBlocks() call, and then xor in the preceding ciphertext.
+ */
+void cbcdecrypt(const unsigned char *in, unsigned char *out, size_t length,
+                Fish *Algorithm, unsigned char *cbcbuffer)
+{
+  const unsigned int BS = Algorithm->GetBlockSize();
+  unsigned char pt[1024];
+  const size_t used = std::min(length, sizeof(pt)); // all that needs wiping
+  ASSERT((length % BS) == 0);
+
+  while (length >= BS) {
+    const size_t nblocks = std::min(length / BS, sizeof(pt) / BS);
+    const size_t n = nblocks * BS;
+    Algorithm->DecryptBlocks(in, pt, nblocks);
+    xormem(pt, cbcbuffer, BS);
+    for (size_t x = BS; x < n; x += BS)
+      xormem(pt + x, in + x - BS, BS);
+    memcpy(cbcbuffer, in + n - BS, BS);
+    memcpy(out, pt, n);
+    in += n;
+    out += n;
+    length -= n;
+  }
+  trashMemory(pt, used);
+}
+
+void cbcencrypt(const unsigned char *in, unsigned char *out, size_t length,
+                Fish *Algorithm, unsigned char *cbcbuffer)
+{
+  const unsigned int BS = Algorithm->GetBlockSize();
+  ASSERT((length % BS) == 0);
+
+  // Each block's chained from the last, so one at a time
+  for (size_t x = 0; x < length; x += BS) {
+    for (unsigned int i = 0; i < BS; i++)
+      out[x + i] = in[x + i] ^ cbcbuffer[i];
+    Algorithm->Encrypt(out + x, out + x);
+    memcpy(cbcbuffer, out + x, BS);
+  }
+}
+
 //-----------------------------------------------------------------------------
 //Overwrite the memory
 // used to be a loop here, but this was deemed (1) overly paranoid
@@ -92,11 +139,24 @@ void burnStack(unsigned long len)
     burnStack(len - sizeof(buf));
 }
 
+static thread_local int tls_passkeyUTF8 = -1; // -1: as PWS_PK_CP_ACP says
+
+void SetThreadPasskeyEncoding(bool isUTF8)
+{
+  tls_passkeyUTF8 = isUTF8 ? 1 : 0;
+}
+
+void ClearThreadPasskeyEncoding()
+{
+  tls_passkeyUTF8 = -1;
+}
+
 void ConvertPasskey(const StringX &text,
                    unsigned char *&txt,
                    size_t &txtlen)
 {
-  bool isUTF8 = pws_os::getenv("PWS_PK_CP_ACP", false).empty();
+  bool isUTF8 = (tls_passkeyUTF8 >= 0) ? tls_passkeyUTF8 == 1 :
+    pws_os::getenv("PWS_PK_CP_ACP", false).empty();
   LPCTSTR txtstr = text.c_str();
   txtlen = text.length();
 
@@ -339,7 +399,6 @@ size_t _readcbc(FILE *fp,
  // Initialize memory.  (Lockheed Martin) Secure Coding  11-14-2007
   unsigned char block1[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
   unsigned char block2[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-  unsigned char block3[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
   unsigned char *lengthblock = nullptr;
 
   ASSERT(BS <= sizeof(block1)); // if needed we can be more sophisticated here...
@@ -408,14 +467,8 @@ size_t _readcbc(FILE *fp,
 
   if (length > 0 ||
       (BS == 8 && length == 0)) { // pre-3 pain
-    unsigned char *tempcbc = block3;
     numRead += fread(b, 1, BlockLength, fp);
-    for (unsigned int x = 0; x < BlockLength; x += BS) {
-      memcpy(tempcbc, b + x, BS);
-      Algorithm->Decrypt(b + x, b + x);
-      xormem(b + x, cbcbuffer, BS);
-      memcpy(cbcbuffer, tempcbc, BS);
-    }
+    cbcdecrypt(b, b, BlockLength, Algorithm, cbcbuffer);
   }
 
   if (buffer_len == 0) {
@@ -432,25 +485,10 @@ size_t _readcbc(FILE *fp, unsigned char *buffer,
 {
   const unsigned int BS = Algorithm->GetBlockSize();
   ASSERT((buffer_len % BS) == 0);
-  size_t nread = 0;
-  unsigned char *p = buffer;
-  auto *tmpcbc = new unsigned char[BS];
-
-  do {
-    size_t nr = fread(p, 1, BS, fp);
-    nread += nr;
-    if (nr != BS)
-      break;
-
-    memcpy(tmpcbc, p, BS);
-    Algorithm->Decrypt(p, p);
-    xormem(p, cbcbuffer, BS);
-    memcpy(cbcbuffer, tmpcbc, BS);
-
-    p += nr;
-  } while (nread < buffer_len);
 
-  delete[] tmpcbc;
+  const size_t nread = fread(buffer, 1, buffer_len, fp);
+  // a trailing partial block is counted but left as is, as before
+  cbcdecrypt(buffer, buffer, (nread / BS) * BS, Algorithm, cbcbuffer);
   return nread;
 }
 
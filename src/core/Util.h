@@ -45,8 +45,14 @@ extern void trashMemory(void *buffer, size_t length);
 extern void trashMemory(LPTSTR buffer, size_t length);
 extern void burnStack(unsigned long len); // borrowed from libtomcrypt
 
+// Passkeys are converted to UTF-8, or to the ANSI code page if the
+// PWS_PK_CP_ACP environment variable's set (see PWScore::CheckPasskey()).
+// A worker thread, which mustn't read an environment that its owner may be
+// changing, can fix the encoding for itself instead.
 extern void ConvertPasskey(const StringX &text,
                           unsigned char *&txt, size_t &txtlen);
+extern void SetThreadPasskeyEncoding(bool isUTF8);
+extern void ClearThreadPasskeyEncoding(); // back to as PWS_PK_CP_ACP says
 
 extern void GenRandhash(const StringX &passkey,
                         const unsigned char *m_randstuff,
@@ -67,6 +73,13 @@ extern size_t _readcbc(FILE *fp, unsigned char *buffer,
                        const size_t buffer_len, Fish *Algorithm,
                        unsigned char *cbcbuffer);
 
+// CBC-decrypts length bytes (a whole number of blocks), in may equal out
+extern void cbcdecrypt(const unsigned char *in, unsigned char *out, size_t length,
+                       Fish *Algorithm, unsigned char *cbcbuffer);
+// ...and the reverse, e.g., to encrypt content a chunk at a time
+extern void cbcencrypt(const unsigned char *in, unsigned char *out, size_t length,
+                       Fish *Algorithm, unsigned char *cbcbuffer);
+
 // _writecbc* will throw(EIO) iff a write fail occurs!
 // version used to write records:
 extern size_t _writecbc(FILE* fp, const unsigned char* buffer, size_t length,
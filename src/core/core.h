@@ -287,6 +287,7 @@
 #define IDSC_FILTERSEXPORTEDTODB        3460
 #define IDSC_FOUNDENTRIESFILTER         3461
 #define IDSC_IMPORTINVALIDDELIMITER     3462
+#define IDSC_ATTCONTENTLOST             3463
 
 // Keep DCA together
 #define IDSC_CURRENTDEFAULTDCA          4000
@@ -16,6 +16,7 @@
 #include "os/UUID.h"
 #include "ItemData.h"
 #include "ItemAtt.h"
+#include "UUIDMap.h"
 
 struct st_SaveTypePW {
   CItemData::EntryType et;
@@ -78,12 +79,12 @@ struct st_PWH_status {
   CItemData::EntryStatus es;
 };
 
-typedef std::map<pws_os::CUUID, CItemData, std::less<pws_os::CUUID> > ItemList;
+typedef UUIDMap<CItemData> ItemList;
 typedef ItemList::iterator ItemListIter;
 typedef ItemList::const_iterator ItemListConstIter;
 typedef std::pair<pws_os::CUUID, CItemData> ItemList_Pair;
 
-typedef std::map<pws_os::CUUID, CItemAtt, std::less<pws_os::CUUID> > AttList;
+typedef UUIDMap<CItemAtt> AttList;
 typedef AttList::iterator AttListIter;
 typedef AttList::const_iterator AttListConstIter;
 typedef std::pair<pws_os::CUUID, CItemAtt> AttList_Pair;
@@ -12,8 +12,13 @@
 
 #include "AES.h"
 #include "bitops.h"
+#include "cpu_features.h"
 #include "../Util.h"
 
+#ifdef PWS_CPU_X86
+#include <immintrin.h>
+#endif
+
 #define LTC_CLEAN_STACK
 
 enum class CryptStatus {
@@ -589,13 +594,162 @@ static CryptStatus rijndael_ecb_decrypt(const unsigned char *ct, unsigned char *
 #endif
 #endif /* ENCRYPT_ONLY */
 
+#ifdef PWS_CPU_X86
+/*
+ * AES-NI versions of the above. These use the key schedule computed by
+ * rijndael_setup(), with the words of eK and dK converted to byte order
+ * (see aesni_convert_key). dK is already in the form AESDEC wants, i.e.,
+ * reversed and with InvMixColumns applied to the inner round keys.
+ */
+static void aesni_convert_key(rijndael_key *skey)
+{
+  const int nwords = 4 * (skey->Nr + 1);
+  for (int i = 0; i < nwords; i++) {
+    unsigned char tmp[4];
+    STORE32H(skey->eK[i], tmp);
+    memcpy(&skey->eK[i], tmp, 4);
+    STORE32H(skey->dK[i], tmp);
+    memcpy(&skey->dK[i], tmp, 4);
+  }
+}
+
+PWS_TARGET("aes,sse2")
+static void aesni_ecb_encrypt(const unsigned char *pt, unsigned char *ct,
+                              const rijndael_key *skey)
+{
+  const __m128i *rk = reinterpret_cast<const __m128i *>(skey->eK);
+  const int Nr = skey->Nr;
+
+  __m128i s = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pt)),
+                            _mm_loadu_si128(rk));
+  for (int r = 1; r < Nr; r++)
+    s = _mm_aesenc_si128(s, _mm_loadu_si128(rk + r));
+  s = _mm_aesenclast_si128(s, _mm_loadu_si128(rk + Nr));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(ct), s);
+}
+
+PWS_TARGET("aes,sse2")
+static void aesni_ecb_decrypt(const unsigned char *ct, unsigned char *pt,
+                              const rijndael_key *skey)
+{
+  const __m128i *rk = reinterpret_cast<const __m128i *>(skey->dK);
+  const int Nr = skey->Nr;
+
+  __m128i s = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ct)),
+                            _mm_loadu_si128(rk));
+  for (int r = 1; r < Nr; r++)
+    s = _mm_aesdec_si128(s, _mm_loadu_si128(rk + r));
+  s = _mm_aesdeclast_si128(s, _mm_loadu_si128(rk + Nr));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(pt), s);
+}
+
+/*
+ * Same as above for 4 independent blocks. The AES instructions have a
+ * latency of several cycles but can issue every cycle, so interleaving
+ * blocks keeps the unit busy.
+ */
+#define AESNI_X4(OP) do { s0 = OP(s0, k); s1 = OP(s1, k); s2 = OP(s2, k); s3 = OP(s3, k); } while (0)
+
+PWS_TARGET("aes,sse2")
+static void aesni_ecb_encrypt_x4(const unsigned char *pt, unsigned char *ct,
+                                 const rijndael_key *skey)
+{
+  const __m128i *rk = reinterpret_cast<const __m128i *>(skey->eK);
+  const __m128i *in = reinterpret_cast<const __m128i *>(pt);
+  __m128i *out = reinterpret_cast<__m128i *>(ct);
+  const int Nr = skey->Nr;
+
+  __m128i k = _mm_loadu_si128(rk);
+  __m128i s0 = _mm_loadu_si128(in), s1 = _mm_loadu_si128(in + 1);
+  __m128i s2 = _mm_loadu_si128(in + 2), s3 = _mm_loadu_si128(in + 3);
+  AESNI_X4(_mm_xor_si128);
+  for (int r = 1; r < Nr; r++) {
+    k = _mm_loadu_si128(rk + r);
+    AESNI_X4(_mm_aesenc_si128);
+  }
+  k = _mm_loadu_si128(rk + Nr);
+  AESNI_X4(_mm_aesenclast_si128);
+  _mm_storeu_si128(out, s0); _mm_storeu_si128(out + 1, s1);
+  _mm_storeu_si128(out + 2, s2); _mm_storeu_si128(out + 3, s3);
+}
+
+PWS_TARGET("aes,sse2")
+static void aesni_ecb_decrypt_x4(const unsigned char *ct, unsigned char *pt,
+                                 const rijndael_key *skey)
+{
+  const __m128i *rk = reinterpret_cast<const __m128i *>(skey->dK);
+  const __m128i *in = reinterpret_cast<const __m128i *>(ct);
+  __m128i *out = reinterpret_cast<__m128i *>(pt);
+  const int Nr = skey->Nr;
+
+  __m128i k = _mm_loadu_si128(rk);
+  __m128i s0 = _mm_loadu_si128(in), s1 = _mm_loadu_si128(in + 1);
+  __m128i s2 = _mm_loadu_si128(in + 2), s3 = _mm_loadu_si128(in + 3);
+  AESNI_X4(_mm_xor_si128);
+  for (int r = 1; r < Nr; r++) {
+    k = _mm_loadu_si128(rk + r);
+    AESNI_X4(_mm_aesdec_si128);
+  }
+  k = _mm_loadu_si128(rk + Nr);
+  AESNI_X4(_mm_aesdeclast_si128);
+  _mm_storeu_si128(out, s0); _mm_storeu_si128(out + 1, s1);
+  _mm_storeu_si128(out + 2, s2); _mm_storeu_si128(out + 3, s3);
+}
+
+#undef AESNI_X4
+#endif /* PWS_CPU_X86 */
+
+static bool is_supported(AES::Impl impl)
+{
+  switch (impl) {
+  case AES::PORTABLE:
+    return true;
+#ifdef PWS_CPU_X86
+  case AES::X86_AES_NI:
+    return pws_cpu::get_x86_features().aesni;
+#endif
+  default:
+    return false;
+  }
+}
+
+// Selected on first use - thread-safe as per C++11 local statics
+static AES::Impl &current_impl()
+{
+  static AES::Impl impl = is_supported(AES::X86_AES_NI) ? AES::X86_AES_NI : AES::PORTABLE;
+  return impl;
+}
+
+AES::Impl AES::GetImpl()
+{
+  return current_impl();
+}
+
+bool AES::IsImplSupported(Impl impl)
+{
+  return is_supported(impl);
+}
+
+bool AES::SetImpl(Impl impl)
+{
+  if (!is_supported(impl))
+    return false;
+  current_impl() = impl;
+  return true;
+}
+
 AES::AES(const unsigned char* key, int keylen)
+  : impl(current_impl())
 {
   CryptStatus status = rijndael_setup(key, keylen, 0, &key_schedule);
 
   ASSERT(status == CryptStatus::OK);
   if (status != CryptStatus::OK)
     throw status;
+#ifdef PWS_CPU_X86
+  if (impl == X86_AES_NI)
+    aesni_convert_key(&key_schedule);
+#endif
 }
 
 AES::~AES()
@@ -605,10 +759,54 @@ AES::~AES()
 
 void AES::Encrypt(const unsigned char *in, unsigned char *out) const
 {
+#ifdef PWS_CPU_X86
+  if (impl == X86_AES_NI) {
+    aesni_ecb_encrypt(in, out, &key_schedule);
+    return;
+  }
+#endif
   rijndael_ecb_encrypt(in, out, &key_schedule);
 }
 
 void AES::Decrypt(const unsigned char *in, unsigned char *out) const
 {
+#ifdef PWS_CPU_X86
+  if (impl == X86_AES_NI) {
+    aesni_ecb_decrypt(in, out, &key_schedule);
+    return;
+  }
+#endif
   rijndael_ecb_decrypt(in, out, &key_schedule);
 }
+
+void AES::EncryptBlocks(const unsigned char *in, unsigned char *out,
+                        size_t nblocks) const
+{
+#ifdef PWS_CPU_X86
+  if (impl == X86_AES_NI) {
+    for (; nblocks >= 4; nblocks -= 4, in += 4 * BLOCKSIZE, out += 4 * BLOCKSIZE)
+      aesni_ecb_encrypt_x4(in, out, &key_schedule);
+    for (; nblocks > 0; nblocks--, in += BLOCKSIZE, out += BLOCKSIZE)
+      aesni_ecb_encrypt(in, out, &key_schedule);
+    return;
+  }
+#endif
+  for (; nblocks > 0; nblocks--, in += BLOCKSIZE, out += BLOCKSIZE)
+    rijndael_ecb_encrypt(in, out, &key_schedule);
+}
+
+void AES::DecryptBlocks(const unsigned char *in, unsigned char *out,
+                        size_t nblocks) const
+{
+#ifdef PWS_CPU_X86
+  if (impl == X86_AES_NI) {
+    for (; nblocks >= 4; nblocks -= 4, in += 4 * BLOCKSIZE, out += 4 * BLOCKSIZE)
+      aesni_ecb_decrypt_x4(in, out, &key_schedule);
+    for (; nblocks > 0; nblocks--, in += BLOCKSIZE, out += BLOCKSIZE)
+      aesni_ecb_decrypt(in, out, &key_schedule);
+    return;
+  }
+#endif
+  for (; nblocks > 0; nblocks--, in += BLOCKSIZE, out += BLOCKSIZE)
+    rijndael_ecb_decrypt(in, out, &key_schedule);
+}
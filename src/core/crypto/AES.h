@@ -24,14 +24,26 @@ class AES : public Fish
 {
 public:
   static const unsigned int BLOCKSIZE = 16;
+
+  // Block function implementations. The best one supported by the CPU
+  // is selected by default; SetImpl() is mainly for testing, and only
+  // affects AES objects constructed afterwards.
+  enum Impl {PORTABLE, X86_AES_NI};
+  static Impl GetImpl();
+  static bool IsImplSupported(Impl impl);
+  static bool SetImpl(Impl impl); // false if not supported, no change made
+
   AES(const unsigned char* key, int keylen);
   ~AES();
   void Encrypt(const unsigned char *in, unsigned char *out) const;
   void Decrypt(const unsigned char *in, unsigned char *out) const;
+  void EncryptBlocks(const unsigned char *in, unsigned char *out, size_t nblocks) const;
+  void DecryptBlocks(const unsigned char *in, unsigned char *out, size_t nblocks) const;
   unsigned int GetBlockSize() const {return BLOCKSIZE;}
 
 private:
-  rijndael_key key_schedule;
+  rijndael_key key_schedule; // round keys stored as bytes if impl is X86_AES_NI
+  Impl impl;
 };
 #endif /* __AES_H */
 //-----------------------------------------------------------------------------
@@ -474,4 +474,19 @@ void BlowFish::Decrypt(const unsigned char *in, unsigned char *out) const
 
 }
 
+// Same as the base class versions, minus the virtual call per block
+void BlowFish::EncryptBlocks(const unsigned char *in, unsigned char *out,
+                             size_t nblocks) const
+{
+  for (size_t i = 0; i < nblocks; i++)
+    BlowFish::Encrypt(in + i * BLOCKSIZE, out + i * BLOCKSIZE);
+}
+
+void BlowFish::DecryptBlocks(const unsigned char *in, unsigned char *out,
+                             size_t nblocks) const
+{
+  for (size_t i = 0; i < nblocks; i++)
+    BlowFish::Decrypt(in + i * BLOCKSIZE, out + i * BLOCKSIZE);
+}
+
 //-----------------------------------------------------------------------------
@@ -28,6 +28,23 @@ public:
   // (blocksize dependent on cipher)
   virtual void Encrypt(const unsigned char *pt, unsigned char *ct) const = 0;
   virtual void Decrypt(const unsigned char *ct, unsigned char *pt) const = 0;
+  // Following encrypt/decrypt nblocks consecutive blocks independently
+  // (i.e., ECB), in place allowed. Ciphers that can do better than one
+  // block at a time, e.g., by interleaving blocks, override these.
+  virtual void EncryptBlocks(const unsigned char *pt, unsigned char *ct,
+                             size_t nblocks) const
+  {
+    const unsigned int BS = GetBlockSize();
+    for (size_t i = 0; i < nblocks; i++)
+      Encrypt(pt + i * BS, ct + i * BS);
+  }
+  virtual void DecryptBlocks(const unsigned char *ct, unsigned char *pt,
+                             size_t nblocks) const
+  {
+    const unsigned int BS = GetBlockSize();
+    for (size_t i = 0; i < nblocks; i++)
+      Decrypt(ct + i * BS, pt + i * BS);
+  }
 };
 
 
@@ -621,6 +621,139 @@ static void twofish_ecb_decrypt(const unsigned char *ct, unsigned char *pt, cons
 }
 #endif
 
+/*
+  Encrypt/decrypt 4 independent blocks at once. The rounds are the same as
+  above, but interleaving 4 blocks lets the CPU overlap the S-box lookups
+  of one block with those of the others, instead of waiting on each one.
+  @param in  4 input blocks (64 bytes)
+  @param out 4 output blocks (64 bytes), may be the same as in
+  @param skey The key as scheduled
+*/
+#define TF_ENC_HALF(a, b, c, d, k0, k1) do {      \
+    uint32 t2_ = g1_func(b, skey);                \
+    uint32 t1_ = g_func(a, skey) + t2_;           \
+    c = RORc(c ^ (t1_ + (k0)), 1);                \
+    d = ROLc(d, 1) ^ (t2_ + t1_ + (k1));          \
+  } while (0)
+
+#define TF_DEC_HALF(a, b, c, d, k0, k1) do {      \
+    uint32 t2_ = g1_func(b, skey);                \
+    uint32 t1_ = g_func(a, skey) + t2_;           \
+    c = ROLc(c, 1) ^ (t1_ + (k0));                \
+    d = RORc(d ^ (t2_ + t1_ + (k1)), 1);          \
+  } while (0)
+
+#define TF_X4(OP) do { OP(0); OP(1); OP(2); OP(3); } while (0)
+
+#ifdef LTC_CLEAN_STACK
+static void _twofish_ecb_encrypt_x4(const unsigned char *in, unsigned char *out, const twofish_key *skey)
+#else
+static void twofish_ecb_encrypt_x4(const unsigned char *in, unsigned char *out, const twofish_key *skey)
+#endif
+{
+  uint32 a[4], b[4], c[4], d[4];
+  uint32 const *k;
+  int r;
+#if !defined(TWOFISH_SMALL) && !defined(__GNUC__)
+  const uint32 *S1 = skey->S[0], *S2 = skey->S[1], *S3 = skey->S[2], *S4 = skey->S[3];
+#endif
+
+#define TF_LOAD(i) do {                                                    \
+    LOAD32L(a[i], &in[16*i + 0]); LOAD32L(b[i], &in[16*i + 4]);            \
+    LOAD32L(c[i], &in[16*i + 8]); LOAD32L(d[i], &in[16*i + 12]);           \
+    a[i] ^= skey->K[0]; b[i] ^= skey->K[1];                                \
+    c[i] ^= skey->K[2]; d[i] ^= skey->K[3];                                \
+  } while (0)
+  TF_X4(TF_LOAD);
+#undef TF_LOAD
+
+  k = skey->K + 8;
+  for (r = 8; r != 0; --r) {
+#define TF_R1(i) TF_ENC_HALF(a[i], b[i], c[i], d[i], k[0], k[1])
+#define TF_R2(i) TF_ENC_HALF(c[i], d[i], a[i], b[i], k[2], k[3])
+    TF_X4(TF_R1);
+    TF_X4(TF_R2);
+#undef TF_R1
+#undef TF_R2
+    k += 4;
+  }
+
+  /* output with "undo last swap" */
+#define TF_STORE(i) do {                                                   \
+    STORE32L(c[i] ^ skey->K[4], &out[16*i + 0]);                           \
+    STORE32L(d[i] ^ skey->K[5], &out[16*i + 4]);                           \
+    STORE32L(a[i] ^ skey->K[6], &out[16*i + 8]);                           \
+    STORE32L(b[i] ^ skey->K[7], &out[16*i + 12]);                          \
+  } while (0)
+  TF_X4(TF_STORE);
+#undef TF_STORE
+}
+
+#ifdef LTC_CLEAN_STACK
+static void twofish_ecb_encrypt_x4(const unsigned char *in, unsigned char *out, const twofish_key *skey)
+{
+  _twofish_ecb_encrypt_x4(in, out, skey);
+  burnStack(sizeof(uint32) * 24 + sizeof(uint32));
+}
+#endif
+
+#ifdef LTC_CLEAN_STACK
+static void _twofish_ecb_decrypt_x4(const unsigned char *in, unsigned char *out, const twofish_key *skey)
+#else
+static void twofish_ecb_decrypt_x4(const unsigned char *in, unsigned char *out, const twofish_key *skey)
+#endif
+{
+  uint32 a[4], b[4], c[4], d[4];
+  uint32 const *k;
+  int r;
+#if !defined(TWOFISH_SMALL) && !defined(__GNUC__)
+  const uint32 *S1 = skey->S[0], *S2 = skey->S[1], *S3 = skey->S[2], *S4 = skey->S[3];
+#endif
+
+  /* load input, undo undo final swap */
+#define TF_LOAD(i) do {                                                    \
+    LOAD32L(c[i], &in[16*i + 0]); LOAD32L(d[i], &in[16*i + 4]);            \
+    LOAD32L(a[i], &in[16*i + 8]); LOAD32L(b[i], &in[16*i + 12]);           \
+    a[i] ^= skey->K[6]; b[i] ^= skey->K[7];                                \
+    c[i] ^= skey->K[4]; d[i] ^= skey->K[5];                                \
+  } while (0)
+  TF_X4(TF_LOAD);
+#undef TF_LOAD
+
+  k = skey->K + 36;
+  for (r = 8; r != 0; --r) {
+#define TF_R1(i) TF_DEC_HALF(c[i], d[i], a[i], b[i], k[2], k[3])
+#define TF_R2(i) TF_DEC_HALF(a[i], b[i], c[i], d[i], k[0], k[1])
+    TF_X4(TF_R1);
+    TF_X4(TF_R2);
+#undef TF_R1
+#undef TF_R2
+    k -= 4;
+  }
+
+  /* pre-white and store */
+#define TF_STORE(i) do {                                                   \
+    STORE32L(a[i] ^ skey->K[0], &out[16*i + 0]);                           \
+    STORE32L(b[i] ^ skey->K[1], &out[16*i + 4]);                           \
+    STORE32L(c[i] ^ skey->K[2], &out[16*i + 8]);                           \
+    STORE32L(d[i] ^ skey->K[3], &out[16*i + 12]);                          \
+  } while (0)
+  TF_X4(TF_STORE);
+#undef TF_STORE
+}
+
+#ifdef LTC_CLEAN_STACK
+static void twofish_ecb_decrypt_x4(const unsigned char *in, unsigned char *out, const twofish_key *skey)
+{
+  _twofish_ecb_decrypt_x4(in, out, skey);
+  burnStack(sizeof(uint32) * 24 + sizeof(uint32));
+}
+#endif
+
+#undef TF_X4
+#undef TF_ENC_HALF
+#undef TF_DEC_HALF
+
 TwoFish::TwoFish(const unsigned char* key, int keylen)
 {
   CryptStatus status = twofish_setup(key, keylen, 0, &key_schedule);
@@ -644,3 +777,21 @@ void TwoFish::Decrypt(const unsigned char *in, unsigned char *out) const
 {
   twofish_ecb_decrypt(in, out, &key_schedule);
 }
+
+void TwoFish::EncryptBlocks(const unsigned char *in, unsigned char *out,
+                            size_t nblocks) const
+{
+  for (; nblocks >= 4; nblocks -= 4, in += 4 * BLOCKSIZE, out += 4 * BLOCKSIZE)
+    twofish_ecb_encrypt_x4(in, out, &key_schedule);
+  for (; nblocks > 0; nblocks--, in += BLOCKSIZE, out += BLOCKSIZE)
+    twofish_ecb_encrypt(in, out, &key_schedule);
+}
+
+void TwoFish::DecryptBlocks(const unsigned char *in, unsigned char *out,
+                            size_t nblocks) const
+{
+  for (; nblocks >= 4; nblocks -= 4, in += 4 * BLOCKSIZE, out += 4 * BLOCKSIZE)
+    twofish_ecb_decrypt_x4(in, out, &key_schedule);
+  for (; nblocks > 0; nblocks--, in += BLOCKSIZE, out += BLOCKSIZE)
+    twofish_ecb_decrypt(in, out, &key_schedule);
+}
@@ -0,0 +1,93 @@
+/*
+* Copyright (c) 2003-2021 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// cpu_features.h
+// Runtime detection of the CPU instruction set extensions used by the
+// hardware accelerated crypto code paths.
+//-----------------------------------------------------------------------------
+#ifndef __CPU_FEATURES_H
+#define __CPU_FEATURES_H
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define PWS_CPU_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PWS_TARGET(x)
+#else
+#include <cpuid.h>
+#define PWS_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+// ARMv8 only if the compiler's been told it may use the crypto extensions
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define PWS_CPU_ARMV8_CE
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+namespace pws_cpu {
+#ifdef PWS_CPU_X86
+  struct x86_features {
+    bool ssse3, sse41, aesni, sha;
+  };
+
+  inline x86_features get_x86_features()
+  {
+    x86_features f = {false, false, false, false};
+    unsigned int ecx1, ebx7 = 0;
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 0);
+    const int max_leaf = regs[0];
+    __cpuid(regs, 1);
+    ecx1 = static_cast<unsigned int>(regs[2]);
+    if (max_leaf >= 7) {
+      __cpuidex(regs, 7, 0);
+      ebx7 = static_cast<unsigned int>(regs[1]);
+    }
+#else
+    unsigned int eax, ebx, ecx, edx;
+    const unsigned int max_leaf = __get_cpuid_max(0, nullptr);
+    if (max_leaf < 1)
+      return f;
+    __cpuid(1, eax, ebx, ecx, edx);
+    ecx1 = ecx;
+    if (max_leaf >= 7) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+      ebx7 = ebx;
+    }
+#endif
+    f.ssse3 = (ecx1 & (1u << 9)) != 0;   // CPUID.1:ECX.SSSE3
+    f.sse41 = (ecx1 & (1u << 19)) != 0;  // CPUID.1:ECX.SSE4_1
+    f.aesni = (ecx1 & (1u << 25)) != 0;  // CPUID.1:ECX.AESNI
+    f.sha = (ebx7 & (1u << 29)) != 0;    // CPUID.(7,0):EBX.SHA
+    return f;
+  }
+#endif /* PWS_CPU_X86 */
+
+#ifdef PWS_CPU_ARMV8_CE
+  inline bool has_armv8_sha2()
+  {
+#if defined(__APPLE__)
+    return true; // all Apple ARM64 CPUs have them
+#elif defined(__linux__) && defined(HWCAP_SHA2)
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#else
+    return false;
+#endif
+  }
+#endif /* PWS_CPU_ARMV8_CE */
+} // namespace pws_cpu
+
+#endif /* __CPU_FEATURES_H */
+//-----------------------------------------------------------------------------
+// Local variables:
+// mode: c++
+// End:
@@ -28,6 +28,9 @@ public:
   virtual void Init(const unsigned char *key, unsigned long keylen) = 0;
   virtual void Update(const unsigned char *in, unsigned long inlen) = 0;
   virtual void Final(unsigned char digest[]) = 0;
+  // Same as Final(), but keeps the key, ready for the next message.
+  // Saves re-hashing the padded key, e.g., for each PBKDF2 iteration.
+  virtual void FinalAndRestart(unsigned char digest[]) = 0;
 
   void Doit(const unsigned char *key, unsigned long keylen,
             const unsigned char *in, unsigned long inlen,
@@ -35,52 +38,55 @@ public:
   {Init(key, keylen); Update(in, inlen); Final(digest);}
 };
 
+/*
+ * Init() hashes the key XOR ipad and key XOR opad blocks once, and keeps
+ * the resulting hash states (the "midstates"). Each message then only
+ * costs hashing the message itself plus one outer block, and no heap
+ * allocation is needed.
+ * The midstates are as sensitive as the key, and are trashed by Final()
+ * and by the d'tor.
+ */
 template<class H, unsigned int HASHLEN, unsigned int BLOCKSIZE>
 class HMAC : public HMAC_BASE
 {
 public:
   HMAC(const unsigned char *key, unsigned long keylen)
-    : HMAC_BASE(), Hash(nullptr)
+    : HMAC_BASE(), m_inited(false)
   {
     ASSERT(key != nullptr);
-    
-    memset(K, 0, sizeof(K));
     Init(key, keylen);
   }
 
-  HMAC() : HMAC_BASE(), Hash(nullptr)
+  HMAC() : HMAC_BASE(), m_inited(false)
   { // Init needs to be called separately
-    memset(K, 0, sizeof(K));
   }
 
-  HMAC(const HMAC &hmac) {
-    delete Hash;
-    Hash = new H;
-    *Hash = *hmac.Hash;
-    memcpy(K, hmac.K, BLOCKSIZE);
-  }
+  HMAC(const HMAC &that)
+    : HMAC_BASE(), m_inner(that.m_inner), m_outer(that.m_outer),
+      m_hash(that.m_hash), m_inited(that.m_inited)
+  {}
 
   HMAC &operator=(const HMAC &that) {
     if (this != &that) {
-      delete Hash;
-      Hash = new H;
-      *Hash = *that.Hash;
-      memcpy(K, that.K, BLOCKSIZE);
+      m_inner = that.m_inner;
+      m_outer = that.m_outer;
+      m_hash = that.m_hash;
+      m_inited = that.m_inited;
     }
     return *this;
   }
 
-  ~HMAC(){delete Hash;}
+  ~HMAC() {Clear();}
 
   unsigned int GetBlockSize() const {return BLOCKSIZE;}
   unsigned int GetHashLen() const {return HASHLEN;}
-  bool IsInited() const {return Hash != nullptr;}
+  bool IsInited() const {return m_inited;}
 
   void Init(const unsigned char *key, unsigned long keylen)
   {
     ASSERT(key != nullptr);
-    ASSERT(Hash == nullptr);
-    Hash = new H; // to ensure state's cleared.
+    unsigned char K[BLOCKSIZE];
+    memset(K, 0, sizeof(K));
 
     if (keylen > BLOCKSIZE) {
       H H0;
@@ -91,44 +97,62 @@ public:
       memcpy(K, key, keylen);
     }
 
-    unsigned char k_ipad[BLOCKSIZE];
+    unsigned char k_pad[BLOCKSIZE];
     for (unsigned int i = 0; i < BLOCKSIZE; i++)
-      k_ipad[i] = K[i] ^ 0x36;
-    Hash->Update(k_ipad, BLOCKSIZE);
-    memset(k_ipad, 0, BLOCKSIZE);
+      k_pad[i] = K[i] ^ 0x36;
+    m_inner = H();
+    m_inner.Update(k_pad, BLOCKSIZE);
+
+    for (unsigned int i = 0; i < BLOCKSIZE; i++)
+      k_pad[i] = K[i] ^ 0x5c;
+    m_outer = H();
+    m_outer.Update(k_pad, BLOCKSIZE);
+
+    memset(k_pad, 0, BLOCKSIZE);
+    memset(K, 0, BLOCKSIZE);
+
+    m_hash = m_inner;
+    m_inited = true;
   }
 
   void Update(const unsigned char *in, unsigned long inlen)
   {
-    ASSERT(Hash != nullptr);
-    Hash->Update(in, inlen);
+    ASSERT(m_inited);
+    m_hash.Update(in, inlen);
   }
 
   void Final(unsigned char digest[HASHLEN])
   {
-    unsigned char d[HASHLEN];
-    ASSERT(Hash != nullptr);
-
-    Hash->Final(d);
-    delete(Hash);
-    Hash = nullptr;
-    unsigned char k_opad[BLOCKSIZE];
-    for (unsigned int i = 0; i < BLOCKSIZE; i++)
-      k_opad[i] = K[i] ^ 0x5c;
+    FinalAndRestart(digest);
+    Clear();
+  }
 
-    memset(K, 0, BLOCKSIZE);
+  void FinalAndRestart(unsigned char digest[HASHLEN])
+  {
+    unsigned char d[HASHLEN];
+    ASSERT(m_inited);
 
-    H H1;
-    H1.Update(k_opad, BLOCKSIZE);
-    memset(k_opad, 0, BLOCKSIZE);
+    m_hash.Final(d);
+    H H1(m_outer);
     H1.Update(d, HASHLEN);
     memset(d, 0, HASHLEN);
     H1.Final(digest);
+    m_hash = m_inner;
   }
 
 private:
-  H *Hash;
-  unsigned char K[BLOCKSIZE];
+  void Clear()
+  {
+    trashMemory(&m_inner, sizeof(m_inner));
+    trashMemory(&m_outer, sizeof(m_outer));
+    trashMemory(&m_hash, sizeof(m_hash));
+    m_inited = false;
+  }
+
+  H m_inner; // state after hashing K XOR ipad
+  H m_outer; // state after hashing K XOR opad
+  H m_hash;  // current message's inner hash
+  bool m_inited;
 };
 
 #endif /* __HMAC_H */
@@ -11,6 +11,7 @@
 
 #include "bitops.h"
 #include "hmac.h"
+#include "pbkdf2.h"
 
 #include <cstring>
 
@@ -24,17 +25,21 @@
                             (see hmac.h for details)
    @param out               [out] The destination for this algorithm
    @param outlen            [in/out] The max size and resulting size of the algorithm output
+   @param cancel            If not null, checked periodically; once set, pbkdf2 returns
+                            early and the output is meaningless
 */
 void pbkdf2(const unsigned char *password, unsigned long password_len, 
             const unsigned char *salt,     unsigned long salt_len,
             int iteration_count,           HMAC_BASE *hmac,
-            unsigned char *out,            unsigned long *outlen)
+            unsigned char *out,            unsigned long *outlen,
+            const std::atomic<bool> *cancel)
 {
   int itts;
   ulong32  blkno;
   unsigned long stored, left, x, y;
-  unsigned char *buf[2];
-  const unsigned int BlockSize = hmac->GetBlockSize();
+  // Large enough for the hash functions we support (see hmac.h)
+  const unsigned int MaxHashLen = 64;
+  unsigned char buf[2][MaxHashLen];
 
   ASSERT(password != nullptr);
   ASSERT(salt     != nullptr);
@@ -42,37 +47,38 @@ void pbkdf2(const unsigned char *password, unsigned long password_len,
   ASSERT(hmac     != nullptr);
   ASSERT(outlen   != nullptr);
 
-  buf[0] = new unsigned char[BlockSize * 2];
-  if (buf[0] == nullptr) {
-    ASSERT(0);
-    return;
-  }
-  /* buf[1] points to the second block of MAXBLOCKSIZE bytes */
-  buf[1] = buf[0] + BlockSize;
-
   left   = *outlen;
   blkno  = 1;
   stored = 0;
   x = hmac->GetHashLen();
+  ASSERT(x <= MaxHashLen);
+
+  // Key's the same for all iterations, so hash the padded key once
+  hmac->Init(password, password_len);
 
   while (left != 0) {
     /* process block number blkno */
-    memset(buf[0], 0, BlockSize * 2);
+    memset(buf, 0, sizeof(buf));
        
     /* store current block number and increment for next pass */
     STORE32H(blkno, buf[1]);
     ++blkno;
 
     /* get PRF(P, S||int(blkno)) */
-    hmac->Init(password, password_len);
     hmac->Update(salt, salt_len);
     hmac->Update(buf[1], 4);
-    hmac->Final(buf[0]);
+    hmac->FinalAndRestart(buf[0]);
 
     /* now compute repeated and XOR it in buf[1] */
     memcpy(buf[1], buf[0], x);
     for (itts = 1; itts < iteration_count; ++itts) {
-      hmac->Doit(password, password_len, buf[0], x, buf[0]);
+      if ((itts & 0x3ff) == 0 && cancel != nullptr &&
+          cancel->load(std::memory_order_relaxed)) {
+        left = 0;
+        break;
+      }
+      hmac->Update(buf[0], x);
+      hmac->FinalAndRestart(buf[0]);
       for (y = 0; y < x; y++) {
         buf[1][y] ^= buf[0][y];
       }
@@ -86,7 +92,7 @@ void pbkdf2(const unsigned char *password, unsigned long password_len,
   }
   *outlen = stored;
 
-  std::memset(buf[0], 0, BlockSize * 2);
-
-  delete[] buf[0];
+  // Trashes the key state held by hmac
+  hmac->Final(buf[0]);
+  std::memset(buf, 0, sizeof(buf));
 }
@@ -15,6 +15,15 @@
 
 #include <algorithm>
 
+#include "cpu_features.h"
+
+#ifdef PWS_CPU_X86
+#include <immintrin.h>
+#endif
+#ifdef PWS_CPU_ARMV8_CE
+#include <arm_neon.h>
+#endif
+
 #define LTC_CLEAN_STACK
 
 /* hashsize = 32, blocksize = 64 */
@@ -179,6 +188,175 @@ static void sha256_compress(ulong32 state[8], const unsigned char *buf)
 }
 #endif
 
+/*
+ * Hardware compression functions.
+ * These keep the working state in vector registers, so there's no stack
+ * to burn. They need the round constants as an array of 32 bit words.
+ */
+#if defined(PWS_CPU_X86) || defined(PWS_CPU_ARMV8_CE)
+static const ulong32 K256[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+#endif
+
+#ifdef PWS_CPU_X86
+static bool cpu_has_sha_ni()
+{
+  const pws_cpu::x86_features f = pws_cpu::get_x86_features();
+  return f.sha && f.sse41 && f.ssse3;
+}
+
+/*
+ * Intel SHA extensions. The state's kept as ABEF/CDGH register pairs,
+ * and the message schedule in four registers of four words each.
+ */
+PWS_TARGET("sha,sse4.1,ssse3")
+static void sha256_compress_shani(ulong32 state[8], const unsigned char *buf)
+{
+  const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i STATE0, STATE1, MSG, TMP, M[4];
+
+  TMP = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0]));
+  STATE1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4]));
+  TMP = _mm_shuffle_epi32(TMP, 0xB1);          // CDAB
+  STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);    // EFGH
+  STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);    // ABEF
+  STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0); // CDGH
+
+  const __m128i ABEF_SAVE = STATE0;
+  const __m128i CDGH_SAVE = STATE1;
+
+  // 16 groups of 4 rounds. Group g uses W[4g..4g+3], which is in M[g % 4],
+  // and meanwhile computes the words for group g + 4.
+  for (int g = 0; g < 16; g++) {
+    if (g < 4)
+      M[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 16 * g)), MASK);
+    MSG = _mm_add_epi32(M[g & 3], _mm_loadu_si128(reinterpret_cast<const __m128i *>(&K256[4 * g])));
+    STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+    if (g >= 3 && g <= 14) {
+      TMP = _mm_alignr_epi8(M[g & 3], M[(g + 3) & 3], 4);
+      M[(g + 1) & 3] = _mm_add_epi32(M[(g + 1) & 3], TMP);
+      M[(g + 1) & 3] = _mm_sha256msg2_epu32(M[(g + 1) & 3], M[g & 3]);
+    }
+    MSG = _mm_shuffle_epi32(MSG, 0x0E);
+    STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+    if (g >= 1 && g <= 12)
+      M[(g + 3) & 3] = _mm_sha256msg1_epu32(M[(g + 3) & 3], M[g & 3]);
+  }
+
+  STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+  STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+
+  TMP = _mm_shuffle_epi32(STATE0, 0x1B);       // FEBA
+  STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);    // DCHG
+  STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0); // DCBA
+  STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);    // ABEF
+
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), STATE0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), STATE1);
+}
+#endif /* PWS_CPU_X86 */
+
+#ifdef PWS_CPU_ARMV8_CE
+// ARMv8 Cryptography Extensions. The state's kept as ABCD/EFGH.
+static void sha256_compress_armv8(ulong32 state[8], const unsigned char *buf)
+{
+  uint32x4_t STATE0, STATE1, W, TMP, M[4];
+
+  STATE0 = vld1q_u32(reinterpret_cast<const uint32_t *>(&state[0]));
+  STATE1 = vld1q_u32(reinterpret_cast<const uint32_t *>(&state[4]));
+  const uint32x4_t ABCD_SAVE = STATE0;
+  const uint32x4_t EFGH_SAVE = STATE1;
+
+  for (int i = 0; i < 4; i++)
+    M[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buf + 16 * i)));
+
+  // 16 groups of 4 rounds, see sha256_compress_shani
+  for (int g = 0; g < 16; g++) {
+    W = vaddq_u32(M[g & 3], vld1q_u32(reinterpret_cast<const uint32_t *>(&K256[4 * g])));
+    if (g < 12)
+      M[g & 3] = vsha256su0q_u32(M[g & 3], M[(g + 1) & 3]);
+    TMP = STATE0;
+    STATE0 = vsha256hq_u32(STATE0, STATE1, W);
+    STATE1 = vsha256h2q_u32(STATE1, TMP, W);
+    if (g < 12)
+      M[g & 3] = vsha256su1q_u32(M[g & 3], M[(g + 2) & 3], M[(g + 3) & 3]);
+  }
+
+  vst1q_u32(reinterpret_cast<uint32_t *>(&state[0]), vaddq_u32(STATE0, ABCD_SAVE));
+  vst1q_u32(reinterpret_cast<uint32_t *>(&state[4]), vaddq_u32(STATE1, EFGH_SAVE));
+}
+#endif /* PWS_CPU_ARMV8_CE */
+
+typedef void (*sha256_compress_fn)(ulong32 state[8], const unsigned char *buf);
+
+static sha256_compress_fn get_compress_fn(SHA256::Impl impl)
+{
+  switch (impl) {
+#ifdef PWS_CPU_X86
+  case SHA256::X86_SHA_NI:
+    return cpu_has_sha_ni() ? sha256_compress_shani : nullptr;
+#endif
+#ifdef PWS_CPU_ARMV8_CE
+  case SHA256::ARMV8_CE:
+    return pws_cpu::has_armv8_sha2() ? sha256_compress_armv8 : nullptr;
+#endif
+  case SHA256::PORTABLE:
+    return sha256_compress;
+  default:
+    return nullptr;
+  }
+}
+
+static SHA256::Impl best_impl()
+{
+  if (get_compress_fn(SHA256::X86_SHA_NI) != nullptr)
+    return SHA256::X86_SHA_NI;
+  if (get_compress_fn(SHA256::ARMV8_CE) != nullptr)
+    return SHA256::ARMV8_CE;
+  return SHA256::PORTABLE;
+}
+
+// Selected on first use - thread-safe as per C++11 local statics
+static SHA256::Impl &current_impl()
+{
+  static SHA256::Impl impl = best_impl();
+  return impl;
+}
+
+static sha256_compress_fn &current_compress()
+{
+  static sha256_compress_fn fn = get_compress_fn(current_impl());
+  return fn;
+}
+
+SHA256::Impl SHA256::GetImpl()
+{
+  return current_impl();
+}
+
+bool SHA256::IsImplSupported(Impl impl)
+{
+  return get_compress_fn(impl) != nullptr;
+}
+
+bool SHA256::SetImpl(Impl impl)
+{
+  sha256_compress_fn fn = get_compress_fn(impl);
+  if (fn == nullptr)
+    return false;
+  current_impl() = impl;
+  current_compress() = fn;
+  return true;
+}
+
 /*
   Initialize the hash state
 */
@@ -210,11 +388,12 @@ void SHA256::Update(const unsigned char *in, size_t inlen)
 {
   const size_t block_size = 64;
   size_t n;
+  const sha256_compress_fn compress = current_compress();
   ASSERT(in != nullptr || inlen == 0);
   ASSERT(curlen <= sizeof(buf));
   while (inlen > 0) {
     if (curlen == 0 && inlen >= block_size) {
-      sha256_compress(state, in);
+      compress(state, in);
       length += block_size * 8;
       in             += block_size;
       inlen          -= block_size;
@@ -225,7 +404,7 @@ void SHA256::Update(const unsigned char *in, size_t inlen)
       in             += n;
       inlen          -= n;
       if (curlen == block_size) {
-        sha256_compress(state, buf);
+        compress(state, buf);
         length += 8*block_size;
         curlen = 0;
       }
@@ -240,6 +419,7 @@ void SHA256::Update(const unsigned char *in, size_t inlen)
 void SHA256::Final(unsigned char digest[HASHLEN])
 {
   int i;
+  const sha256_compress_fn compress = current_compress();
 
   ASSERT(digest != nullptr);
 
@@ -259,7 +439,7 @@ void SHA256::Final(unsigned char digest[HASHLEN])
     while (curlen < 64) {
       buf[curlen++] = 0;
     }
-    sha256_compress(state, buf);
+    compress(state, buf);
     curlen = 0;
   }
 
@@ -270,7 +450,7 @@ void SHA256::Final(unsigned char digest[HASHLEN])
 
   /* store length */
   STORE64H(length, buf+56);
-  sha256_compress(state, buf);
+  compress(state, buf);
 
   /* copy output */
   for (i = 0; i < 8; i++) {
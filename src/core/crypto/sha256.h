@@ -20,6 +20,14 @@ class SHA256
 public:
   static const unsigned int HASHLEN = 32;
   static const unsigned int BLOCKSIZE = 64;
+
+  // Compression function implementations. The best one supported by the
+  // CPU is selected at first use; SetImpl() is mainly for testing.
+  enum Impl {PORTABLE, X86_SHA_NI, ARMV8_CE};
+  static Impl GetImpl();
+  static bool IsImplSupported(Impl impl);
+  static bool SetImpl(Impl impl); // false if not supported, no change made
+
   SHA256();
   ~SHA256();
   void Update(const unsigned char *in, size_t inlen);
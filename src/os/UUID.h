@@ -24,7 +24,8 @@ typedef uuid_t uuid_array_t;
 typedef uuid_t UUID;
 #endif
 
-#include <memory> // for memcmp
+#include <cstring> // for memcpy
+#include <functional> // for std::hash
 #include <iostream>
 #include "typedefs.h"
 #include "../core/StringX.h"
@@ -32,39 +33,73 @@ typedef uuid_t UUID;
 #include <vector>
 
 namespace pws_os {
+// A CUUID is just its 16 bytes, in the order of their array representation
+// (network byte order, as in the database), on all platforms, so copying,
+// comparing and destroying one are as cheap as for any other 16 bytes.
 class CUUID
 {
 public:
   CUUID(); // UUID generated at creation time
-  CUUID(const CUUID &uuid);
-  CUUID(const uuid_array_t &ua, bool canonic = false); // for storing an existing UUID
-  CUUID(const StringX &s); // s is a hex string as returned by cast to StringX
+  constexpr CUUID(const uuid_array_t &ua) // for storing an existing UUID
+    : m_ua{ua[0], ua[1], ua[2], ua[3], ua[4], ua[5], ua[6], ua[7],
+           ua[8], ua[9], ua[10], ua[11], ua[12], ua[13], ua[14], ua[15]} {}
+  CUUID(const StringX &s); // s is a hex string as returned by cast to StringX,
+                           // anything else yields NullUUID()
   static const CUUID &NullUUID(); // singleton all-zero
-  ~CUUID();
 
   // Following get Array Representation of the uuid:
-  void GetARep(uuid_array_t &ua) const;
-  const uuid_array_t *GetARep() const; // internally allocated, deleted in d'tor
-  
-  CUUID &operator=(const CUUID &that);
+  void GetARep(uuid_array_t &ua) const {std::memcpy(ua, m_ua, sizeof(m_ua));}
+  const uuid_array_t *GetARep() const {return &m_ua;} // valid while this is
+
   operator StringX() const; // GetHexStr, e.g., "204012e6600f4e01a5eb515267cb0d50"
-  bool operator==(const CUUID &that) const;
-  bool operator!=(const CUUID &that) const { return !(*this == that); }
-  bool operator<(const CUUID &that) const;
+  constexpr bool operator==(const CUUID &that) const {return Compare(that) == 0;}
+  constexpr bool operator!=(const CUUID &that) const {return Compare(that) != 0;}
+  constexpr bool operator<(const CUUID &that) const {return Compare(that) < 0;}
+
+  // UUIDs being mostly random bits, mixing their two halves hashes them well
+  size_t Hash() const
+  {
+    ulong64 lo, hi;
+    std::memcpy(&lo, m_ua, sizeof(lo));
+    std::memcpy(&hi, m_ua + sizeof(lo), sizeof(hi));
+    ulong64 h = (lo ^ ((hi << 29) | (hi >> 35))) * 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>(h ^ (h >> 32));
+  }
+
+  // For streaming in canonical form, e.g., "204012e6-600f-4e01-a5eb-515267cb0d50":
+  //   os << uuid.Canonical();
+  struct CanonicalForm {const CUUID &uuid;};
+  CanonicalForm Canonical() const {return CanonicalForm{*this};}
 
   friend std::ostream &operator<<(std::ostream &os, const pws_os::CUUID &uuid);
   friend std::wostream &operator<<(std::wostream &os, const pws_os::CUUID &uuid);
+  friend std::ostream &operator<<(std::ostream &os, const CanonicalForm &cf);
+  friend std::wostream &operator<<(std::wostream &os, const CanonicalForm &cf);
 
 private:
-  UUID m_uuid;
-  mutable uuid_array_t *m_ua; // for GetUUID();
-  mutable bool m_canonic;
+  // Byte by byte from i on, as uuid_compare() and memcmp() would
+  constexpr int Compare(const CUUID &that, size_t i = 0) const
+  {
+    return (i == sizeof(m_ua)) ? 0 :
+      (m_ua[i] != that.m_ua[i]) ? (m_ua[i] < that.m_ua[i] ? -1 : 1) :
+      Compare(that, i + 1);
+  }
+
+  uuid_array_t m_ua;
 };
 
 std::ostream &operator<<(std::ostream &os, const CUUID &uuid);
 std::wostream &operator<<(std::wostream &os, const CUUID &uuid);
+std::ostream &operator<<(std::ostream &os, const CUUID::CanonicalForm &cf);
+std::wostream &operator<<(std::wostream &os, const CUUID::CanonicalForm &cf);
 } // end of pws_os namespace
 
+namespace std {
+template <> struct hash<pws_os::CUUID> {
+  size_t operator()(const pws_os::CUUID &uuid) const {return uuid.Hash();}
+};
+}
+
 typedef std::vector<pws_os::CUUID> UUIDVector;
 typedef UUIDVector::iterator UUIDVectorIter;
 
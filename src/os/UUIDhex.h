@@ -0,0 +1,112 @@
+/*
+* Copyright (c) 2003-2021 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// UUIDhex.h
+// The parts of CUUID that don't depend on the platform: the null UUID and
+// converting to/from hex. A CUUID is its bytes in the same order everywhere,
+// so only generating one differs (see {unix,mac,windows}/UUID.cpp).
+// Definitions, not declarations: include from the platform's UUID.cpp only.
+//
+
+#ifndef __UUIDHEX_H
+#define __UUIDHEX_H
+
+#include "UUID.h"
+
+static const uuid_array_t zua = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+static const pws_os::CUUID nullUUID(zua);
+
+static const char lowerHex[] = "0123456789abcdef";
+static const char upperHex[] = "0123456789ABCDEF";
+
+// Value of each ASCII hex digit, -1 for anything else
+static const signed char hexValue[128] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+static int HexValue(wchar_t c)
+{
+  return (static_cast<unsigned long>(c) < sizeof(hexValue)) ? hexValue[c] : -1;
+}
+
+// Writes ua's 32 hex digits (36 characters if canonic) to buf, returns
+// the number of characters written
+template <typename CharT>
+static size_t ToHex(const uuid_array_t &ua, bool canonic, bool upper, CharT *buf)
+{
+  const char *digits = upper ? upperHex : lowerHex;
+  CharT *p = buf;
+  for (size_t i = 0; i < sizeof(uuid_array_t); i++) {
+    *p++ = CharT(digits[ua[i] >> 4]);
+    *p++ = CharT(digits[ua[i] & 0x0f]);
+    if (canonic && (i == 3 || i == 5 || i == 7 || i == 9))
+      *p++ = CharT('-');
+  }
+  return p - buf;
+}
+
+const pws_os::CUUID &pws_os::CUUID::NullUUID()
+{
+  return nullUUID;
+}
+
+pws_os::CUUID::CUUID(const StringX &s)
+{
+  // s is a hex string as returned by cast to StringX; if it's not,
+  // whatever its length, we've nothing to go on
+  if (s.length() == 2 * sizeof(m_ua)) {
+    const wchar_t *p = s.c_str();
+    int bad = 0;
+    for (size_t i = 0; i < sizeof(m_ua); i++, p += 2) {
+      const int hi = HexValue(p[0]), lo = HexValue(p[1]);
+      bad |= hi | lo; // negative iff either is
+      m_ua[i] = static_cast<unsigned char>(((hi & 0x0f) << 4) | (lo & 0x0f));
+    }
+    if (bad >= 0)
+      return;
+  }
+  std::memcpy(m_ua, zua, sizeof(m_ua));
+}
+
+std::ostream &pws_os::operator<<(std::ostream &os, const pws_os::CUUID &uuid)
+{
+  char buf[36];
+  return os.write(buf, ToHex(uuid.m_ua, false, (os.flags() & std::ios_base::uppercase) != 0, buf));
+}
+
+std::wostream &pws_os::operator<<(std::wostream &os, const pws_os::CUUID &uuid)
+{
+  wchar_t buf[36];
+  return os.write(buf, ToHex(uuid.m_ua, false, (os.flags() & std::ios_base::uppercase) != 0, buf));
+}
+
+std::ostream &pws_os::operator<<(std::ostream &os, const pws_os::CUUID::CanonicalForm &cf)
+{
+  char buf[36];
+  return os.write(buf, ToHex(cf.uuid.m_ua, true, (os.flags() & std::ios_base::uppercase) != 0, buf));
+}
+
+std::wostream &pws_os::operator<<(std::wostream &os, const pws_os::CUUID::CanonicalForm &cf)
+{
+  wchar_t buf[36];
+  return os.write(buf, ToHex(cf.uuid.m_ua, true, (os.flags() & std::ios_base::uppercase) != 0, buf));
+}
+
+pws_os::CUUID::operator StringX() const
+{
+  wchar_t buf[36];
+  return StringX(buf, ToHex(m_ua, false, false, buf));
+}
+
+#endif /* __UUIDHEX_H */
@@ -24,6 +24,20 @@ namespace pws_os {
   extern bool RenameFile(const stringT &oldname, const stringT &newname);
   extern bool CopyAFile(const stringT &from, const stringT &to); // creates dirs as needed!
   extern bool DeleteAFile(const stringT &filename);
+  // Moves from over to atomically where the OS allows, so that to is
+  // either the old or the new file, even after a crash. Keeps to's
+  // permissions and (best effort) owner, and if to is a symbolic link,
+  // replaces what it points to. Fails if to is read-only. Where to has
+  // other hard links, or its directory's read-only, from's content is
+  // copied into to instead, which isn't atomic.
+  // The move itself is synced to disk, as is the file by FClose().
+  extern bool ReplaceAFile(const stringT &from, const stringT &to);
+  // Creates and opens ("w+b") a new file with a unique name next to
+  // filename (or what it links to), or in the temporary directory if that
+  // one's read-only, for ReplaceAFile() to move over it later. Returns
+  // nullptr if it can't or filename's read-only, else sets tmpname to the
+  // new file's.
+  extern std::FILE *CreateTempFile(const stringT &filename, stringT &tmpname);
   extern void FindFiles(const stringT &filter, std::vector<stringT> &res);
   extern bool LockFile(const stringT &filename, stringT &locker,
                        HANDLE &lockFileHandle);
@@ -34,6 +48,12 @@ namespace pws_os {
   extern std::FILE *FOpen(const stringT &filename, const TCHAR *mode);
   extern int FClose(std::FILE *fd, const bool &bIsWrite);
   extern ulong64 fileLength(std::FILE *fp);
+  // Read-only view of the first length bytes of an open file, or nullptr if
+  // it can't or shouldn't be mapped (e.g., a pipe, an empty file, or one on
+  // a network or FUSE filesystem), in which case the caller should just
+  // use stdio.
+  extern const unsigned char *MapFile(std::FILE *fp, ulong64 length);
+  extern void UnmapFile(const unsigned char *p, ulong64 length);
   extern bool GetFileTimes(const stringT &filename,
       time_t &ctime, time_t &mtime, time_t &atime);
   extern bool SetFileTimes(const stringT &filename,
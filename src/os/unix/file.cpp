@@ -11,6 +11,7 @@
  */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -24,6 +25,10 @@
 #include <fnmatch.h>
 #ifndef __FreeBSD__
 #include <malloc.h> // for free
+#include <sys/vfs.h> // for fstatfs
+#else
+#include <sys/param.h>
+#include <sys/mount.h> // for fstatfs
 #endif
 
 #include "../file.h"
@@ -79,6 +84,144 @@ bool pws_os::RenameFile(const stringT &oldname, const stringT &newname)
   return (status == 0);
 }
 
+static string to_mb(const stringT &s)
+{
+  const size_t N = wcstombs(nullptr, s.c_str(), 0) + 1;
+  vector<char> buf(N);
+  wcstombs(buf.data(), s.c_str(), N);
+  return string(buf.data());
+}
+
+static stringT from_mb(const string &s)
+{
+  const size_t N = mbstowcs(nullptr, s.c_str(), 0) + 1;
+  vector<wchar_t> buf(N);
+  mbstowcs(buf.data(), s.c_str(), N);
+  return stringT(buf.data());
+}
+
+// What ReplaceAFile() actually replaces: the file itself, not a link to it
+static string real_path(const string &path)
+{
+  string retval(path);
+  char *real = ::realpath(path.c_str(), nullptr);
+  if (real != nullptr) {
+    retval = real;
+    free(real);
+  }
+  return retval;
+}
+
+static string dir_of(const string &path)
+{
+  const string::size_type slash = path.find_last_of('/');
+  return (slash == string::npos) ? string(".") :
+    (slash == 0) ? string("/") : path.substr(0, slash);
+}
+
+// Makes a rename into or out of path's directory durable. Best effort,
+// as not every filesystem can sync a directory.
+static void sync_dir(const string &path)
+{
+  const int fd = ::open(dir_of(path).c_str(), O_RDONLY);
+  if (fd != -1) {
+    ::fsync(fd);
+    ::close(fd);
+  }
+}
+
+/**
+ * Renaming a new file over path would break its hard links, and needs a
+ * writable directory; in either case, ReplaceAFile() copies the new
+ * content into path instead, and CreateTempFile() puts the new file in
+ * the temporary directory if it can't go next to path.
+ */
+static bool replace_in_place(const string &path, const struct stat &st)
+{
+  return st.st_nlink > 1 || ::access(dir_of(path).c_str(), W_OK | X_OK) != 0;
+}
+
+// Overwrites to with from's content, flushed to disk before returning
+static bool copy_in_place(const string &from, const string &to)
+{
+  const int in = ::open(from.c_str(), O_RDONLY);
+  if (in == -1)
+    return false;
+  const int out = ::open(to.c_str(), O_WRONLY | O_TRUNC);
+  bool retval = (out != -1);
+  char buf[64 * 1024];
+  ssize_t n;
+  while (retval && (n = ::read(in, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      retval = (errno == EINTR);
+      continue;
+    }
+    for (ssize_t done = 0, w; retval && done < n; done += (w > 0) ? w : 0) {
+      w = ::write(out, buf + done, size_t(n - done));
+      retval = (w >= 0 || errno == EINTR);
+    }
+  }
+  if (out != -1)
+    retval = (::fsync(out) == 0) && retval && (::close(out) == 0);
+  ::close(in);
+  return retval;
+}
+
+bool pws_os::ReplaceAFile(const stringT &from, const stringT &to)
+{
+  const string cfrom = to_mb(from);
+  string cto = to_mb(to);
+
+  struct stat st;
+  if (::stat(cto.c_str(), &st) == 0) {
+    cto = real_path(cto); // follow symlinks
+    if (::access(cto.c_str(), W_OK) != 0)
+      return false; // read-only stays that way
+    if (replace_in_place(cto, st))
+      return copy_in_place(cfrom, cto) && ::unlink(cfrom.c_str()) == 0;
+    // Best effort: only root, or an owner in the group, may do this
+    if (::chown(cfrom.c_str(), st.st_uid, st.st_gid) != 0 && errno == EPERM)
+      ::chown(cfrom.c_str(), uid_t(-1), st.st_gid);
+    ::chmod(cfrom.c_str(), st.st_mode & 07777); // after chown, which may clear setuid bits
+  }
+  // The new file's next to to (see CreateTempFile()), so this is atomic
+  if (::rename(cfrom.c_str(), cto.c_str()) != 0)
+    return false;
+  sync_dir(cto);
+  return true;
+}
+
+std::FILE *pws_os::CreateTempFile(const stringT &filename, stringT &tmpname)
+{
+  // Same directory as the file it'll replace, so the rename's atomic
+  const string target = real_path(to_mb(filename));
+  string templ = target + ".XXXXXX";
+  struct stat st;
+  if (::stat(target.c_str(), &st) == 0) {
+    if (::access(target.c_str(), W_OK) != 0) {
+      errno = EACCES;
+      return nullptr; // don't pretend to save what ReplaceAFile() won't
+    }
+    if (::access(dir_of(target).c_str(), W_OK | X_OK) != 0) {
+      stringT tmpdir = pws_os::getenv("TMPDIR", true);
+      if (tmpdir.empty())
+        tmpdir = _T("/tmp/");
+      templ = to_mb(tmpdir) + "pwsafe.XXXXXX";
+    }
+  }
+  const int fd = ::mkstemp(&templ[0]); // mode 0600, till ReplaceAFile()
+  if (fd == -1)
+    return nullptr;
+  std::FILE *retval = ::fdopen(fd, "w+b");
+  if (retval == nullptr) {
+    ::close(fd);
+    ::unlink(templ.c_str());
+    return nullptr;
+  }
+  tmpname = from_mb(templ);
+  return retval;
+}
+
 bool pws_os::CopyAFile(const stringT &from, const stringT &to)
 {
   const char *szfrom = nullptr;
@@ -377,12 +520,16 @@ std::FILE *pws_os::FOpen(const stringT &filename, const TCHAR *mode)
 int pws_os::FClose(std::FILE *fd, const bool &bIsWrite)
 {
   if (fd != nullptr) {
+    int rc = 0;
     if (bIsWrite) {
-      // Flush the data buffers
-      fflush(fd);
+      // Flush the data buffers, and make sure they reach the disk
+      rc = fflush(fd);
+      if (rc == 0 && fsync(fileno(fd)) != 0 && errno != EINVAL) // EINVAL: pipe etc.
+        rc = EOF;
     }
     // Now close file
-    return fclose(fd);
+    const int crc = fclose(fd);
+    return (rc != 0) ? rc : crc;
   }
   return 0;
 }
@@ -400,6 +547,57 @@ ulong64 pws_os::fileLength(std::FILE *fp)
   return ulong64(st.st_size);
 }
 
+/*
+ * Reading a mapping past the end of a file that's since been truncated, or
+ * whose server's gone away, raises SIGBUS rather than returning an error.
+ * That's only a risk worth taking on a local disk, so network and FUSE
+ * filesystems (NFS, SMB, sshfs, sync clients...) are left to stdio.
+ */
+static bool IsLocalFileSystem(int fd)
+{
+  struct statfs sfs;
+  if (fstatfs(fd, &sfs) != 0)
+    return false;
+#ifdef __FreeBSD__
+  return (sfs.f_flags & MNT_LOCAL) != 0;
+#else
+  switch (static_cast<unsigned long>(sfs.f_type)) {
+  case 0xEF53UL:     // ext2/3/4
+  case 0x58465342UL: // XFS
+  case 0x9123683EUL: // Btrfs
+  case 0xF2F52010UL: // F2FS
+  case 0x2FC12FC1UL: // ZFS
+  case 0x01021994UL: // tmpfs
+  case 0x794C7630UL: // overlayfs (containers)
+  case 0x3153464AUL: // JFS
+  case 0x52654973UL: // ReiserFS
+    return true;
+  default:
+    return false;
+  }
+#endif
+}
+
+const unsigned char *pws_os::MapFile(std::FILE *fp, ulong64 length)
+{
+  if (fp == nullptr || length == 0 || length != ulong64(size_t(length)))
+    return nullptr;
+  int fd = fileno(fp);
+  if (fd == -1 || !IsLocalFileSystem(fd))
+    return nullptr;
+  void *p = mmap(nullptr, size_t(length), PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    return nullptr;
+  madvise(p, size_t(length), MADV_SEQUENTIAL);
+  return static_cast<const unsigned char *>(p);
+}
+
+void pws_os::UnmapFile(const unsigned char *p, ulong64 length)
+{
+  if (p != nullptr)
+    munmap(const_cast<unsigned char *>(p), size_t(length));
+}
+
 bool pws_os::GetFileTimes(const stringT &filename,
 			time_t &ctime, time_t &mtime, time_t &atime)
 {
@@ -12,25 +12,59 @@
 #include "../rand.h"
 #include <fstream>
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 #include <sys/time.h>
 
+#if defined(__has_include)
+#if __has_include(<sys/random.h>)
+#include <sys/random.h>
+#define PWS_HAVE_GETRANDOM
+#endif
+#endif
+
 using namespace std;
 
+#ifdef PWS_HAVE_GETRANDOM
+static bool get_random(void *p, size_t len, unsigned int flags)
+{
+  char *pc = static_cast<char *>(p);
+  while (len > 0) {
+    ssize_t n = getrandom(pc, len, flags);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    pc += n;
+    len -= size_t(n);
+  }
+  return true;
+}
+#endif
+
 bool pws_os::InitRandomDataFunction()
 {
-  // For starters, we won't rely on /dev/urandom, only on /dev/random for
-  // the seed. Returning false indicates this decision.
-  // Perhaps we can check for a hardware rng in future versions, and change
-  // the returned value accordingly?
+  // We only rely on the kernel for bulk random data if getrandom()
+  // works without blocking, i.e., the pool has been initialized.
+  // Otherwise we use only /dev/random for the seed, and returning false
+  // indicates this decision.
+#ifdef PWS_HAVE_GETRANDOM
+  unsigned char probe;
+  return get_random(&probe, sizeof(probe), GRND_NONBLOCK);
+#else
   return false;
+#endif
 }
 
 bool pws_os::GetRandomData(void *p, unsigned long len)
 {
-  // Return data from /dev/urandom
-  // Will not be used by PasswordSafe when InitRandomDataFunction()
+  // Not used by PasswordSafe when InitRandomDataFunction()
   // returns false!
+#ifdef PWS_HAVE_GETRANDOM
+  if (get_random(p, len, 0))
+    return true;
+#endif
 
   ifstream is("/dev/urandom");
   if (!is)
@@ -13,26 +13,11 @@
 // ASCII string.
 //
 
-#include "../UUID.h"
-#include "../../core/Util.h" /* for trashMemory() */
-#include "../../core/StringXStream.h"
-#include <iomanip>
+#include "../UUIDhex.h" // all but generating them
 #include <assert.h>
 
 using namespace std;
 
-static void array2UUUID(const uuid_array_t &ua, UUID &uuid)
-{
-  unsigned long *p0 = (unsigned long *)ua;
-  uuid.Data1 = htonl(*p0);
-  unsigned short *p1 = (unsigned short *)&ua[4];
-  uuid.Data2 = htons(*p1);
-  unsigned short *p2 = (unsigned short *)&ua[6];
-  uuid.Data3 = htons(*p2);
-  for (int i = 0; i < 8; i++)
-    uuid.Data4[i] = ua[i + 8];
-}
-
 static void UUID2array(const UUID &uuid, uuid_array_t &ua)
 {
   unsigned long *p0 = (unsigned long *)ua;
@@ -45,127 +30,11 @@ static void UUID2array(const UUID &uuid, uuid_array_t &ua)
     ua[i + 8] = uuid.Data4[i];
 }
 
-static const uuid_array_t zua = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-static pws_os::CUUID nullUUID(zua);
-
-const pws_os::CUUID &pws_os::CUUID::NullUUID()
-{
-  return nullUUID;
-}
-
 pws_os::CUUID::CUUID()
-  : m_ua(NULL), m_canonic(false)
-{
-  UuidCreate(&m_uuid);
-}
-
-pws_os::CUUID::CUUID(const CUUID &uuid)
-  : m_ua(NULL), m_canonic(uuid.m_canonic)
-{
-  std::memcpy(&m_uuid, &uuid.m_uuid, sizeof(m_uuid));
-}
-
-pws_os::CUUID::CUUID(const uuid_array_t &ua, bool canonic)
-  : m_ua(NULL), m_canonic(canonic)
-{
-  array2UUUID(ua, m_uuid);
-}
-
-pws_os::CUUID::CUUID(const StringX &s)
-  : m_ua(NULL), m_canonic(false)
-{
-  // s is a hex string as returned by cast to StringX
-  ASSERT(s.length() == 32);
-  uuid_array_t ua;
-
-  unsigned int x(0);
-  for (size_t i = 0; i < 16; i++) {
-    iStringXStream is(s.substr(i * 2, 2));
-    is >> hex >> x;
-    ua[i] = static_cast<unsigned char>(x);
-  }
-  array2UUUID(ua, m_uuid);
-}
-
-pws_os::CUUID::~CUUID()
-{
-  trashMemory(reinterpret_cast<unsigned char *>(&m_uuid), sizeof(m_uuid));
-  if (m_ua) {
-    trashMemory(m_ua, sizeof(uuid_array_t));
-    delete[] m_ua;
-  }
-}
-
-pws_os::CUUID &pws_os::CUUID::operator=(const CUUID &that)
-{
-  if (this != &that) {
-    std::memcpy(&m_uuid, &that.m_uuid, sizeof(m_uuid));
-    if (m_ua) {
-      trashMemory(m_ua, sizeof(uuid_array_t));
-      delete[] m_ua;
-      m_ua = NULL;
-    }
-    m_canonic = that.m_canonic;
-  }
-  return *this;
-}
-
-void pws_os::CUUID::GetARep(uuid_array_t &ua) const
-{
-  UUID2array(m_uuid, ua);
-}
-
-const uuid_array_t *pws_os::CUUID::GetARep() const
-{
-  if (m_ua == NULL) {
-    m_ua = (uuid_array_t *)(new uuid_array_t);
-    GetARep(*m_ua);
-  }
-  return m_ua;
-}
-
-bool pws_os::CUUID::operator==(const pws_os::CUUID &that) const
-{
-  return std::memcmp(&this->m_uuid, &that.m_uuid, sizeof(m_uuid)) == 0;
-}
-
-bool pws_os::CUUID::operator<(const pws_os::CUUID &that) const
-{
-  return std::memcmp(&this->m_uuid, &that.m_uuid, sizeof(m_uuid)) < 0;
-}
-
-std::ostream &pws_os::operator<<(std::ostream &os, const pws_os::CUUID &uuid)
-{
-  uuid_array_t ua;
-  uuid.GetARep(ua);
-  for (size_t i = 0; i < sizeof(uuid_array_t); i++) {
-    os << setw(2) << setfill('0') << hex << int(ua[i]);
-    if (uuid.m_canonic && (i == 3 || i == 5 || i == 7 || i == 9))
-      os << "-";
-  }
-  return os;
-}
-
-std::wostream &pws_os::operator<<(std::wostream &os, const pws_os::CUUID &uuid)
-{
-  uuid_array_t ua;
-  uuid.GetARep(ua);
-  for (size_t i = 0; i < sizeof(uuid_array_t); i++) {
-    os << setw(2) << setfill(wchar_t('0')) << hex << int(ua[i]);
-    if (uuid.m_canonic && (i == 3 || i == 5 || i == 7 || i == 9))
-      os << L"-";
-  }
-  return os;
-}
-
-pws_os::CUUID::operator StringX() const
 {
-  oStringXStream os;
-  bool sc = m_canonic;
-  m_canonic = false;
-  os << *this;
-  m_canonic = sc;
-  return os.str();
+  UUID uuid;
+  UuidCreate(&uuid);
+  UUID2array(uuid, m_ua);
 }
 
 #ifdef TEST
@@ -119,6 +119,50 @@ bool pws_os::RenameFile(const stringT &oldname, const stringT &newname)
   return FileOP(oldname, newname, FO_MOVE);
 }
 
+// What ReplaceAFile() actually replaces: the file itself, not a link to it
+static stringT RealPath(const stringT &path)
+{
+  stringT retval(path);
+  HANDLE hPath = CreateFile(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+  if (hPath != INVALID_HANDLE_VALUE) {
+    TCHAR real[MAX_PATH];
+    DWORD n = GetFinalPathNameByHandle(hPath, real, MAX_PATH, FILE_NAME_NORMALIZED);
+    if (n > 0 && n < MAX_PATH)
+      retval = real;
+    CloseHandle(hPath);
+  }
+  return retval;
+}
+
+bool pws_os::ReplaceAFile(const stringT &from, const stringT &to)
+{
+  // MoveFileEx replaces the file in one step, and with
+  // MOVEFILE_WRITE_THROUGH only returns once that's on disk
+  return MoveFileEx(from.c_str(), RealPath(to).c_str(),
+                    MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED |
+                    MOVEFILE_WRITE_THROUGH) == TRUE;
+}
+
+std::FILE *pws_os::CreateTempFile(const stringT &filename, stringT &tmpname)
+{
+  // Same directory as the file it'll replace, so the move's atomic
+  const stringT target = RealPath(filename);
+  const stringT::size_type sep = target.find_last_of(_T("\\/"));
+  const stringT dir = (sep == stringT::npos) ? stringT(_T(".")) : target.substr(0, sep + 1);
+
+  TCHAR name[MAX_PATH];
+  if (GetTempFileName(dir.c_str(), _T("pws"), 0, name) == 0) // creates it
+    return nullptr;
+  std::FILE *retval = FOpen(name, _T("w+b"));
+  if (retval == nullptr) {
+    DeleteFile(name);
+    return nullptr;
+  }
+  tmpname = name;
+  return retval;
+}
+
 extern bool pws_os::CopyAFile(const stringT &from, const stringT &to)
 {
   return FileOP(from, to, FO_COPY);
@@ -442,6 +486,34 @@ ulong64 pws_os::fileLength(std::FILE *fp) {
     return 0;
 }
 
+const unsigned char *pws_os::MapFile(std::FILE *fp, ulong64 length)
+{
+  if (fp == nullptr || length == 0 || length != ulong64(SIZE_T(length)))
+    return nullptr;
+  HANDLE hFile = HANDLE(_get_osfhandle(_fileno(fp)));
+  if (hFile == INVALID_HANDLE_VALUE)
+    return nullptr;
+  // A view of a file on a share raises EXCEPTION_IN_PAGE_ERROR, rather than
+  // failing a read, if the server goes away or the file's truncated under
+  // us, so only local files are mapped. The remote protocol's only there
+  // for remote ones.
+  FILE_REMOTE_PROTOCOL_INFO rpi;
+  if (GetFileInformationByHandleEx(hFile, FileRemoteProtocolInfo, &rpi, sizeof(rpi)))
+    return nullptr;
+  HANDLE hMap = CreateFileMapping(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (hMap == nullptr)
+    return nullptr;
+  void *p = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, SIZE_T(length));
+  CloseHandle(hMap); // the view keeps the mapping alive
+  return static_cast<const unsigned char *>(p);
+}
+
+void pws_os::UnmapFile(const unsigned char *p, ulong64 )
+{
+  if (p != nullptr)
+    UnmapViewOfFile(p);
+}
+
 bool pws_os::GetFileTimes(const stringT &filename,
       time_t &atime, time_t &ctime, time_t &mtime)
 {
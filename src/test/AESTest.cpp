@@ -15,7 +15,7 @@
 #include "core/crypto/AES.h"
 #include "gtest/gtest.h"
 
-TEST(AESTest, aes_test)
+static void aes_kat(const char *impl_name)
 {
   static const struct { 
     int keylen;
@@ -63,16 +63,83 @@ TEST(AESTest, aes_test)
     tf->Decrypt(tmp[0], tmp[1]);
     if (memcmp(tmp[0], tests[i].ct, 16) != 0 || memcmp(tmp[1], tests[i].pt, 16) != 0) {
       delete tf;
-      FAIL() << "Test vector " << i;
+      FAIL() << impl_name << " test vector " << i;
     }
 
     /* now see if we can encrypt all zero bytes 1000 times, decrypt and come back where we started */
     for (y = 0; y < 16; y++) tmp[0][y] = 0;
     for (y = 0; y < 1000; y++) tf->Encrypt(tmp[0], tmp[0]);
     for (y = 0; y < 1000; y++) tf->Decrypt(tmp[0], tmp[0]);
-    for (y = 0; y < 16; y++) if (tmp[0][y] != 0) {delete tf; FAIL() << "Encrypt/Decrypt zeros failed";}
+    for (y = 0; y < 16; y++) if (tmp[0][y] != 0) {delete tf; FAIL() << impl_name << " Encrypt/Decrypt zeros failed";}
 
     delete tf;
   }
+}
+
+TEST(AESTest, aes_test)
+{
+  aes_kat("default");
   SUCCEED();
 }
+
+// Run the vectors through every implementation this CPU has, and check
+// that they agree with the portable one for all key sizes.
+TEST(AESTest, aes_impl_test)
+{
+  static const struct {
+    AES::Impl impl;
+    const char *name;
+  } impls[] = {
+    {AES::PORTABLE, "portable"},
+    {AES::X86_AES_NI, "x86 AES-NI"},
+  };
+
+  const AES::Impl saved = AES::GetImpl();
+  EXPECT_TRUE(AES::IsImplSupported(AES::PORTABLE));
+
+  unsigned char key[32], pt[64], expected[3][64];
+  for (int i = 0; i < 32; i++)
+    key[i] = static_cast<unsigned char>(i * 13 + 1);
+  for (int i = 0; i < 64; i++)
+    pt[i] = static_cast<unsigned char>(i * 29 + 5);
+
+  ASSERT_TRUE(AES::SetImpl(AES::PORTABLE));
+  for (int k = 0; k < 3; k++) {
+    AES aes(key, 16 + 8 * k);
+    for (int b = 0; b < 64; b += 16)
+      aes.Encrypt(pt + b, expected[k] + b);
+  }
+
+  for (size_t i = 0; i < (sizeof(impls) / sizeof(impls[0])); i++) {
+    if (!AES::IsImplSupported(impls[i].impl)) {
+      EXPECT_FALSE(AES::SetImpl(impls[i].impl));
+      continue;
+    }
+    ASSERT_TRUE(AES::SetImpl(impls[i].impl));
+    EXPECT_EQ(impls[i].impl, AES::GetImpl());
+    aes_kat(impls[i].name);
+    for (int k = 0; k < 3; k++) {
+      unsigned char ct[64], dt[64];
+      AES aes(key, 16 + 8 * k);
+      for (int b = 0; b < 64; b += 16) {
+        aes.Encrypt(pt + b, ct + b);
+        aes.Decrypt(ct + b, dt + b);
+      }
+      EXPECT_TRUE(memcmp(ct, expected[k], 64) == 0) << impls[i].name << " keylen " << 16 + 8 * k;
+      EXPECT_TRUE(memcmp(dt, pt, 64) == 0) << impls[i].name << " keylen " << 16 + 8 * k;
+
+      // and the same via the multi-block calls, in place, for 4 + 1 blocks
+      unsigned char bt[80];
+      memcpy(bt, pt, 64);
+      memcpy(bt + 64, pt, 16);
+      aes.EncryptBlocks(bt, bt, 5);
+      EXPECT_TRUE(memcmp(bt, expected[k], 64) == 0) << impls[i].name << " EncryptBlocks keylen " << 16 + 8 * k;
+      EXPECT_TRUE(memcmp(bt + 64, expected[k], 16) == 0) << impls[i].name << " EncryptBlocks keylen " << 16 + 8 * k;
+      aes.DecryptBlocks(bt, bt, 5);
+      EXPECT_TRUE(memcmp(bt, pt, 64) == 0) << impls[i].name << " DecryptBlocks keylen " << 16 + 8 * k;
+      EXPECT_TRUE(memcmp(bt + 64, pt, 16) == 0) << impls[i].name << " DecryptBlocks keylen " << 16 + 8 * k;
+    }
+  }
+
+  EXPECT_TRUE(AES::SetImpl(saved));
+}
@@ -196,3 +196,19 @@ c=05044B62FA52D080 k[24]=F0E1D2C3B4A5968778695A4B3C2D1E0F0011223344556677
       EXPECT_TRUE(memcmp(tmp, plaintext_vk[i], 8) == 0) << "Test vector " << i;
     }
   }
+
+  TEST(BlowFishTest, BlocksTest) {
+    unsigned char pt[8 * NUM_VARIABLE_KEY_TESTS], tmp[8 * NUM_VARIABLE_KEY_TESTS];
+    for (int i = 0; i < NUM_VARIABLE_KEY_TESTS; i++)
+      memcpy(pt + 8 * i, plaintext_vk[i], 8);
+
+    BlowFish bf(variable_key[0], 8);
+    bf.EncryptBlocks(pt, tmp, NUM_VARIABLE_KEY_TESTS);
+    for (int i = 0; i < NUM_VARIABLE_KEY_TESTS; i++) {
+      unsigned char ct[8];
+      bf.Encrypt(plaintext_vk[i], ct);
+      EXPECT_TRUE(memcmp(tmp + 8 * i, ct, 8) == 0) << "Block " << i;
+    }
+    bf.DecryptBlocks(tmp, tmp, NUM_VARIABLE_KEY_TESTS);
+    EXPECT_TRUE(memcmp(tmp, pt, sizeof(pt)) == 0);
+  }
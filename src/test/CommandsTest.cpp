@@ -144,14 +144,18 @@ TEST_F(CommandsTest, EditEntry)
 
   iter = core.Find(it.GetUUID());
   EXPECT_EQ(core.GetEntry(iter).GetTitle(), it2.GetTitle());
+  EXPECT_EQ(iter, core.Find(L"", L"NoDramamine", L""));
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"", L"NoDrama", L""));
   core.Undo();
   EXPECT_TRUE(core.HasDBChanged());
 
   iter = core.Find(it.GetUUID());
   EXPECT_EQ(core.GetEntry(iter).GetTitle(), it.GetTitle());
+  EXPECT_EQ(iter, core.Find(L"", L"NoDrama", L""));
   core.Undo();
   EXPECT_EQ(0U, core.GetNumEntries());
   EXPECT_FALSE(core.HasDBChanged());
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"", L"NoDrama", L""));
 
   core.Redo();
   EXPECT_TRUE(core.HasDBChanged());
@@ -185,11 +189,15 @@ TEST_F(CommandsTest, RenameGroup)
   iter = core.Find(uuid);
   ASSERT_NE(core.GetEntryEndIter(), iter);
   EXPECT_EQ(core.GetEntry(iter).GetGroup(), L"Group0.Beta");
+  EXPECT_EQ(iter, core.Find(L"Group0.Beta", L"b title", L""));
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"Group0.Alpha", L"b title", L""));
   core.Undo();
 
   iter = core.Find(uuid);
   ASSERT_NE(core.GetEntryEndIter(), iter);
   EXPECT_EQ(core.GetEntry(iter).GetGroup(), L"Group0.Alpha");
+  EXPECT_EQ(iter, core.Find(L"Group0.Alpha", L"b title", L""));
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"Group0.Beta", L"b title", L""));
 
   // Get core to delete any existing commands
   core.ClearCommands();
@@ -204,7 +212,6 @@ TEST_F(CommandsTest, CountGroups)
   di.CreateUUID();
   di.SetTitle(L"b title");
   di.SetPassword(L"b password");
-  const pws_os::CUUID uuid = di.GetUUID();
 
   Command *pcmd = AddEntryCommand::Create(&core, di);  
   core.Execute(pcmd);
@@ -367,11 +374,14 @@ TEST_F(CommandsTest, UpdateEntry)
 
   iter = core.Find(it.GetUUID());
   EXPECT_EQ(core.GetEntry(iter).GetTitle(), newTitle);
+  EXPECT_EQ(iter, core.Find(L"", newTitle, L""));
   core.Undo();
   EXPECT_TRUE(core.HasDBChanged());
 
   iter = core.Find(it.GetUUID());
   EXPECT_EQ(core.GetEntry(iter).GetTitle(), it.GetTitle());
+  EXPECT_EQ(iter, core.Find(L"", it.GetTitle(), L""));
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"", newTitle, L""));
 
   // Get core to delete any existing commands
   core.ClearCommands();
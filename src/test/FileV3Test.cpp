@@ -12,10 +12,21 @@
 #endif
 
 #include "core/PWSfileV3.h"
+#include "core/PWScore.h"
 #include "os/file.h"
 
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#ifndef WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // A fixture for factoring common code across tests
 class FileV3Test : public ::testing::Test
 {
@@ -105,6 +116,68 @@ TEST_F(FileV3Test, EmptyFile)
   EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
 }
 
+// Checking and then opening reuses the stretched key; make sure that
+// neither a wrong passkey nor a cleared cache changes any outcome.
+TEST_F(FileV3Test, CheckThenOpen)
+{
+  PWSfileV3 fw(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWSfile::VERSION v;
+  EXPECT_EQ(PWSfile::WRONG_PASSWORD, PWSfile::CheckPasskey(fname.c_str(), _T("x"), v));
+  ASSERT_EQ(PWSfile::SUCCESS, PWSfile::CheckPasskey(fname.c_str(), passphrase, v));
+  EXPECT_EQ(PWSfile::V30, v);
+
+  PWSfileV3 fr(fname.c_str(), PWSfile::Read, PWSfile::V30);
+  EXPECT_EQ(PWSfile::WRONG_PASSWORD, fr.Open(_T("x")));
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+
+  PWSfile::ClearStretchedKeyCache();
+  EXPECT_EQ(PWSfile::WRONG_PASSWORD, fr.Open(_T("x")));
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+}
+
+TEST_F(FileV3Test, PeekTest)
+{
+  PWSfileHeader hdr;
+  hdr.m_DB_Name = _T("Peeked");
+  PWSfileV3 fw(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  fw.SetHeader(hdr);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(fullItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWSfile::PeekInfo info;
+  EXPECT_EQ(PWSfile::WRONG_PASSWORD, PWSfile::Peek(fname.c_str(), _T("x"), info));
+  ASSERT_EQ(PWSfile::SUCCESS, PWSfile::Peek(fname.c_str(), passphrase, info));
+  EXPECT_EQ(PWSfile::V30, info.version);
+  EXPECT_EQ(hdr.m_DB_Name, info.hdr.m_DB_Name);
+  EXPECT_EQ(0U, info.nEntries); // not counted
+
+  ASSERT_EQ(PWSfile::SUCCESS, PWSfile::Peek(fname.c_str(), passphrase, info, true));
+  EXPECT_EQ(3U, info.nEntries);
+  EXPECT_EQ(0U, info.nAttachments);
+
+  // Opening what was peeked at doesn't stretch the passkey again
+  unsigned long hits, misses, hitsAfter, missesAfter;
+  PWSfile::GetStretchedKeyCacheStats(hits, misses);
+  PWScore core;
+  const int status = core.ReadFile(fname.c_str(), passphrase, false);
+  ASSERT_TRUE(status == PWScore::SUCCESS ||
+              status == PWScore::OK_WITH_VALIDATION_ERRORS); // smallItem's there twice
+  PWSfile::GetStretchedKeyCacheStats(hitsAfter, missesAfter);
+  EXPECT_EQ(misses, missesAfter);
+  EXPECT_LT(hits, hitsAfter);
+  core.ClearDBData();
+}
+
 TEST_F(FileV3Test, HeaderTest)
 {
   // header is written when file's opened for write.
@@ -177,3 +250,390 @@ TEST_F(FileV3Test, UnknownPersistencyTest)
   EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
   EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
 }
+
+// Saving goes through a temporary file that only replaces the target
+// on a clean Close(); an aborted save must leave the old file alone.
+TEST_F(FileV3Test, AbortedWriteKeepsOriginal)
+{
+  PWSfileV3 fw(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWSfileV3 fa(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fa.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fa.WriteRecord(fullItem));
+  fa.Abort();
+  EXPECT_NE(PWSfile::SUCCESS, fa.Close());
+  std::vector<stringT> files;
+  pws_os::FindFiles(fname + _T("*"), files);
+  EXPECT_EQ(1U, files.size()); // no temporary file left behind
+
+  PWSfileV3 fr(fname.c_str(), PWSfile::Read, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item));
+  EXPECT_EQ(smallItem, item);
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+}
+
+// PWScore::WriteFile may serialize records on several threads; what's
+// read back must match what was written, in full.
+TEST_F(FileV3Test, CoreWriteManyTest)
+{
+  const unsigned N = 1000;
+  PWSfileV3 fw(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  for (unsigned i = 0; i < N; i++) {
+    CItemData ci;
+    ci.CreateUUID();
+    ci.SetTitle(StringX(_T("title")) + std::to_wstring(i).c_str());
+    ci.SetPassword(password);
+    ci.SetNotes(notes);
+    EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(ci));
+  }
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWScore core1;
+  ASSERT_EQ(PWSfile::SUCCESS, core1.ReadFile(fname.c_str(), passphrase, false));
+  ASSERT_EQ(N, core1.GetNumEntries());
+  core1.SetPassKey(passphrase);
+
+  // Serially, then concurrently, whatever the machine
+  for (unsigned nThreads : {1U, 2U}) {
+    SCOPED_TRACE(nThreads);
+    core1.SetWriteThreads(nThreads);
+    ASSERT_EQ(PWSfile::SUCCESS, core1.WriteFile(fname.c_str(), PWSfile::V30, false));
+
+    PWScore core2;
+    ASSERT_EQ(PWSfile::SUCCESS, core2.ReadFile(fname.c_str(), passphrase, false));
+    ASSERT_EQ(N, core2.GetNumEntries());
+    for (auto iter = core1.GetEntryIter(); iter != core1.GetEntryEndIter(); iter++) {
+      auto found = core2.Find(iter->first);
+      ASSERT_TRUE(found != core2.GetEntryEndIter());
+      EXPECT_EQ(iter->second, found->second);
+    }
+  }
+}
+
+// Open() decrypts a large enough file in pieces, concurrently; records
+// spanning pieces must read back as written, however many threads there are.
+TEST_F(FileV3Test, DecryptAheadTest)
+{
+  const unsigned N = 1000;
+  const StringX longNotes(1000, _T('n')); // ~1MB in all, several pieces' worth
+  PWSfileV3 fw(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  for (unsigned i = 0; i < N; i++) {
+    CItemData ci;
+    ci.CreateUUID();
+    ci.SetTitle(StringX(_T("title")) + std::to_wstring(i).c_str());
+    ci.SetNotes(longNotes);
+    EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(ci));
+  }
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  for (unsigned nThreads : {1U, 4U}) {
+    SCOPED_TRACE(nThreads);
+    PWSfileV3 fr(fname.c_str(), PWSfile::Read, PWSfile::V30);
+    fr.SetThreads(nThreads);
+    ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+    for (unsigned i = 0; i < N; i++) {
+      CItemData ci;
+      ASSERT_EQ(PWSfile::SUCCESS, fr.ReadRecord(ci));
+      EXPECT_EQ(StringX(_T("title")) + std::to_wstring(i).c_str(), ci.GetTitle());
+      EXPECT_EQ(longNotes, ci.GetNotes());
+    }
+    CItemData ci;
+    EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(ci));
+    EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+  }
+}
+
+// Times saving with the serial writer against the concurrent one.
+// Run with --gtest_also_run_disabled_tests.
+TEST_F(FileV3Test, DISABLED_CoreWriteBenchmark)
+{
+  using namespace std::chrono;
+  const unsigned N = 50000, R = 3;
+  PWSfileV3 fw(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  for (unsigned i = 0; i < N; i++) {
+    CItemData ci;
+    ci.CreateUUID();
+    ci.SetTitle(StringX(_T("title")) + std::to_wstring(i).c_str());
+    ci.SetUser(user);
+    ci.SetPassword(password);
+    ci.SetNotes(notes);
+    ci.SetGroup(group);
+    ci.SetURL(url);
+    ASSERT_EQ(PWSfile::SUCCESS, fw.WriteRecord(ci));
+  }
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWScore core;
+  ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passphrase, false));
+  core.SetPassKey(passphrase);
+  const unsigned ncores = std::max(std::thread::hardware_concurrency(), 2u);
+  for (unsigned nThreads : {1U, ncores}) {
+    core.SetWriteThreads(nThreads);
+    double best = 1e9;
+    for (unsigned r = 0; r < R; r++) {
+      auto t0 = steady_clock::now();
+      ASSERT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V30, false));
+      best = std::min(best, duration<double>(steady_clock::now() - t0).count());
+    }
+    std::cout << N << " entries, " << nThreads << " thread(s): " << best << " s" << std::endl;
+  }
+  core.ClearDBData();
+}
+
+// With "Save Immediately", PWScore appends changes to a journal next to
+// the database, which is replayed when the database is read, and which a
+// full save folds in. What doesn't check out (a torn write, or a journal
+// older than the database) is ignored.
+TEST_F(FileV3Test, CoreJournalTest)
+{
+  const stringT jname = fname + _T(".jnl");
+  CItemData bigItem; // but with no KB shortcut, which needn't round-trip
+  bigItem.CreateUUID();
+  bigItem.SetTitle(title);
+  bigItem.SetPassword(password);
+  bigItem.SetUser(user);
+  bigItem.SetNotes(notes);
+  bigItem.SetGroup(group);
+  bigItem.SetURL(url);
+  bigItem.SetXTime(xTime);
+  PWSfileV3 fw(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(bigItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWScore core1;
+  core1.SetCurFile(fname.c_str());
+  ASSERT_EQ(PWSfile::SUCCESS, core1.ReadCurFile(passphrase));
+  EXPECT_FALSE(core1.HasJournal());
+
+  const CItemData old_ci = core1.GetEntry(core1.Find(bigItem.GetUUID()));
+  CItemData new_ci(old_ci);
+  new_ci.SetTitle(_T("edited"));
+  core1.Execute(EditEntryCommand::Create(&core1, old_ci, new_ci));
+  core1.Execute(DeleteEntryCommand::Create(&core1,
+                                           core1.GetEntry(core1.Find(smallItem.GetUUID()))));
+  CItemData added;
+  added.CreateUUID();
+  added.SetTitle(_T("added"));
+  added.SetPassword(password);
+  core1.Execute(AddEntryCommand::Create(&core1, added));
+  core1.Execute(ChangeDBHeaderCommand::Create(&core1, _T("journaled"), PWSfile::HDR_DBNAME));
+  EXPECT_TRUE(core1.HasDBChanged());
+
+  ASSERT_EQ(PWSfile::SUCCESS, core1.WriteJournal());
+  EXPECT_FALSE(core1.HasDBChanged());
+  EXPECT_TRUE(core1.HasJournal());
+  EXPECT_TRUE(pws_os::FileExists(jname));
+
+  auto sameEntries = [](PWScore &a, PWScore &b) {
+    ASSERT_EQ(a.GetNumEntries(), b.GetNumEntries());
+    for (auto iter = a.GetEntryIter(); iter != a.GetEntryEndIter(); iter++) {
+      auto found = b.Find(iter->first);
+      ASSERT_TRUE(found != b.GetEntryEndIter());
+      EXPECT_EQ(iter->second, found->second);
+    }
+  };
+
+  PWScore core2;
+  core2.SetCurFile(fname.c_str());
+  ASSERT_EQ(PWSfile::SUCCESS, core2.ReadCurFile(passphrase));
+  EXPECT_EQ(2U, core2.GetNumEntries());
+  EXPECT_EQ(_T("edited"), core2.GetEntry(core2.Find(bigItem.GetUUID())).GetTitle());
+  EXPECT_TRUE(core2.Find(smallItem.GetUUID()) == core2.GetEntryEndIter());
+  EXPECT_EQ(_T("journaled"), core2.GetHeader().m_DB_Name);
+  sameEntries(core1, core2);
+
+  // A partial transaction at the end is ignored, and written over
+  FILE *fd = pws_os::FOpen(jname, _T("ab"));
+  ASSERT_TRUE(fd != nullptr);
+  const unsigned char junk[21] = {0x42};
+  EXPECT_EQ(1U, fwrite(junk, sizeof(junk), 1, fd));
+  fclose(fd);
+
+  PWScore core3;
+  core3.SetCurFile(fname.c_str());
+  ASSERT_EQ(PWSfile::SUCCESS, core3.ReadCurFile(passphrase));
+  sameEntries(core1, core3);
+  const CItemData old_added = core3.GetEntry(core3.Find(added.GetUUID()));
+  CItemData new_added(old_added);
+  new_added.SetNotes(notes);
+  core3.Execute(EditEntryCommand::Create(&core3, old_added, new_added));
+  ASSERT_EQ(PWSfile::SUCCESS, core3.WriteJournal());
+
+  PWScore core4;
+  core4.SetCurFile(fname.c_str());
+  ASSERT_EQ(PWSfile::SUCCESS, core4.ReadCurFile(passphrase));
+  EXPECT_EQ(notes, core4.GetEntry(core4.Find(added.GetUUID())).GetNotes());
+  EXPECT_EQ(_T("journaled"), core4.GetHeader().m_DB_Name);
+  sameEntries(core3, core4);
+
+  // A full save folds the journal in; one left over from before is stale
+  ASSERT_TRUE(pws_os::CopyAFile(jname, jname + _T(".old")));
+  const CItemData old_ci4 = core4.GetEntry(core4.Find(bigItem.GetUUID()));
+  new_ci = old_ci4;
+  new_ci.SetTitle(_T("again"));
+  core4.Execute(EditEntryCommand::Create(&core4, old_ci4, new_ci));
+  ASSERT_EQ(PWSfile::SUCCESS, core4.WriteCurFile());
+  EXPECT_FALSE(core4.HasJournal());
+  EXPECT_FALSE(pws_os::FileExists(jname));
+  ASSERT_TRUE(pws_os::RenameFile(jname + _T(".old"), jname));
+
+  PWScore core5;
+  core5.SetCurFile(fname.c_str());
+  ASSERT_EQ(PWSfile::SUCCESS, core5.ReadCurFile(passphrase));
+  EXPECT_EQ(_T("again"), core5.GetEntry(core5.Find(bigItem.GetUUID())).GetTitle());
+  sameEntries(core4, core5);
+
+  core1.ClearCommands();
+  core3.ClearCommands();
+  core4.ClearCommands();
+  EXPECT_TRUE(pws_os::DeleteAFile(jname));
+}
+
+// StartWriteFile() writes a snapshot in the background while the core
+// carries on changing; what's changed since is left dirty.
+TEST_F(FileV3Test, CoreAsyncSaveTest)
+{
+  PWSfileV3 fw(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(fullItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWScore core1;
+  core1.SetCurFile(fname.c_str());
+  ASSERT_EQ(PWSfile::SUCCESS, core1.ReadCurFile(passphrase));
+  auto retitle = [&core1](const pws_os::CUUID &uuid, const StringX &newTitle) {
+    const CItemData old_ci = core1.GetEntry(core1.Find(uuid));
+    CItemData new_ci(old_ci);
+    new_ci.SetTitle(newTitle);
+    core1.Execute(EditEntryCommand::Create(&core1, old_ci, new_ci));
+  };
+
+  retitle(smallItem.GetUUID(), _T("saved"));
+  size_t progressed = 0, total = 0;
+  int doneStatus = -1;
+  ASSERT_EQ(PWSfile::SUCCESS,
+            core1.StartWriteFile(fname.c_str(), PWSfile::V30,
+                                 [&](size_t d, size_t t) {progressed = d; total = t;},
+                                 [&](int status) {doneStatus = status;}));
+  EXPECT_TRUE(core1.IsWritingFile());
+  retitle(smallItem.GetUUID(), _T("after"));
+  ASSERT_EQ(PWSfile::SUCCESS, core1.FinishWriteFile());
+  EXPECT_FALSE(core1.IsWritingFile());
+  EXPECT_EQ(PWSfile::SUCCESS, doneStatus);
+  EXPECT_EQ(2U, total);
+  EXPECT_EQ(total, progressed);
+  EXPECT_TRUE(core1.HasDBChanged());
+  core1.Undo(); // back to what was saved
+  EXPECT_FALSE(core1.HasDBChanged());
+  core1.Undo();
+  EXPECT_TRUE(core1.HasDBChanged());
+  core1.Redo();
+  EXPECT_FALSE(core1.HasDBChanged());
+
+  PWScore core2;
+  ASSERT_EQ(PWSfile::SUCCESS, core2.ReadFile(fname.c_str(), passphrase));
+  EXPECT_EQ(_T("saved"), core2.GetEntry(core2.Find(smallItem.GetUUID())).GetTitle());
+
+  // Once what's being saved is undone and replaced, nothing's clean
+  ASSERT_EQ(PWSfile::SUCCESS, core1.StartWriteFile(fname.c_str(), PWSfile::V30));
+  core1.Undo();
+  retitle(smallItem.GetUUID(), _T("instead"));
+  ASSERT_EQ(PWSfile::SUCCESS, core1.FinishWriteFile());
+  EXPECT_TRUE(core1.HasDBChanged());
+  core1.Undo();
+  EXPECT_TRUE(core1.HasDBChanged());
+
+  core1.ClearCommands();
+}
+
+// The temporary file's name is unique: it mustn't clobber a user's file,
+// nor another save's temporary file.
+TEST_F(FileV3Test, TempFileIsUnique)
+{
+  const stringT userFile = fname + _T(".tmp");
+  std::FILE *f = pws_os::FOpen(userFile, _T("wb"));
+  ASSERT_TRUE(f != nullptr);
+  fputs("not a database", f);
+  fclose(f);
+
+  PWSfileV3 fw1(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  PWSfileV3 fw2(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw1.Open(passphrase));
+  ASSERT_EQ(PWSfile::SUCCESS, fw2.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw1.WriteRecord(smallItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw2.WriteRecord(fullItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw1.Close());
+  EXPECT_EQ(PWSfile::SUCCESS, fw2.Close());
+
+  PWSfileV3 fr(fname.c_str(), PWSfile::Read, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item));
+  EXPECT_EQ(fullItem, item); // last one closed wins
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+
+  f = pws_os::FOpen(userFile, _T("rb"));
+  ASSERT_TRUE(f != nullptr);
+  char buf[32] = {0};
+  EXPECT_TRUE(fgets(buf, sizeof(buf), f) != nullptr);
+  fclose(f);
+  EXPECT_STREQ("not a database", buf);
+  pws_os::DeleteAFile(userFile);
+
+  std::vector<stringT> files;
+  pws_os::FindFiles(fname + _T("*"), files);
+  EXPECT_EQ(1U, files.size());
+}
+
+#ifndef WIN32
+// Renaming the new file over one with other hard links would break them,
+// so it's written into instead; a read-only file isn't saved over at all.
+TEST_F(FileV3Test, SaveKeepsLinksAndReadOnly)
+{
+  const char *cname = "V3test.psafe3", *clink = "V3test-link.psafe3";
+  PWSfileV3 fw1(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw1.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw1.WriteRecord(smallItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw1.Close());
+  ASSERT_EQ(0, ::link(cname, clink));
+
+  PWSfileV3 fw2(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw2.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw2.WriteRecord(fullItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw2.Close());
+  struct stat st1, st2;
+  ASSERT_EQ(0, ::stat(cname, &st1));
+  ASSERT_EQ(0, ::stat(clink, &st2));
+  EXPECT_EQ(st1.st_ino, st2.st_ino);
+  EXPECT_EQ(2U, st1.st_nlink);
+  PWSfileV3 fr(_T("V3test-link.psafe3"), PWSfile::Read, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item));
+  EXPECT_EQ(fullItem, item);
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+  ASSERT_EQ(0, ::unlink(clink));
+
+  if (::geteuid() != 0) { // root may write to anything
+    ASSERT_EQ(0, ::chmod(cname, 0400));
+    PWSfileV3 fw3(fname.c_str(), PWSfile::Write, PWSfile::V30);
+    EXPECT_NE(PWSfile::SUCCESS, fw3.Open(passphrase));
+    ASSERT_EQ(0, ::chmod(cname, 0600));
+  }
+
+  std::vector<stringT> files;
+  pws_os::FindFiles(fname + _T("*"), files);
+  EXPECT_EQ(1U, files.size());
+}
+#endif
@@ -18,6 +18,10 @@
 
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
 // A fixture for factoring common code across tests
 class FileV4Test : public ::testing::Test
 {
@@ -120,6 +124,32 @@ TEST_F(FileV4Test, EmptyFile)
   EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
 }
 
+// Checking and then opening reuses the stretched key; make sure that
+// neither a wrong passkey nor a cleared cache changes any outcome.
+TEST_F(FileV4Test, CheckThenOpen)
+{
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWSfile::VERSION v;
+  EXPECT_EQ(PWSfile::WRONG_PASSWORD, PWSfile::CheckPasskey(fname.c_str(), _T("x"), v));
+  ASSERT_EQ(PWSfile::SUCCESS, PWSfile::CheckPasskey(fname.c_str(), passphrase, v));
+  EXPECT_EQ(PWSfile::V40, v);
+
+  PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+  EXPECT_EQ(PWSfile::WRONG_PASSWORD, fr.Open(_T("x")));
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+
+  PWSfile::ClearStretchedKeyCache();
+  EXPECT_EQ(PWSfile::WRONG_PASSWORD, fr.Open(_T("x")));
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+}
+
 TEST_F(FileV4Test, HeaderTest)
 {
   // header is written when file's opened for write.
@@ -204,6 +234,45 @@ TEST_F(FileV4Test, MulitKeysTest)
   EXPECT_FALSE(kbs.RemoveKeyBlock(passphrase));
 }
 
+// Key blocks are tried concurrently - each one must still be found,
+// regardless of its position, and a wrong passkey must match none.
+TEST_F(FileV4Test, ManyKeysTest)
+{
+  const StringX pws[] = {passphrase, _T("one"), _T("two"), _T("three"),
+                         _T("four"), _T("five")};
+
+  PWSfileV4::CKeyBlocks kbs;
+  for (const auto &pw : pws)
+    ASSERT_TRUE(kbs.AddKeyBlock(passphrase, pw));
+
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  fw.SetKeyBlocks(kbs);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(pws[3]));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(fullItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  // Whatever the machine: one at a time, then concurrently, with those
+  // that are still stretching cancelled once one's found
+  for (unsigned nThreads : {1U, 2U, 4U}) {
+    SCOPED_TRACE(nThreads);
+    for (const auto &pw : pws) {
+      PWSfile::ClearStretchedKeyCache(); // so each one's really tried
+      PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+      fr.SetThreads(nThreads);
+      ASSERT_EQ(PWSfile::SUCCESS, fr.Open(pw));
+      EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item));
+      EXPECT_EQ(fullItem, item);
+      EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+      EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+    }
+
+    PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+    fr.SetThreads(nThreads);
+    EXPECT_EQ(PWSfile::WRONG_PASSWORD, fr.Open(_T("six")));
+  }
+  PWSfile::ClearStretchedKeyCache();
+}
+
 TEST_F(FileV4Test, AttTest)
 {
   PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
@@ -219,7 +288,32 @@ TEST_F(FileV4Test, AttTest)
   EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
   EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
   attItem.SetOffset(readAtt.GetOffset());
-  EXPECT_EQ(attItem, readAtt);
+  EXPECT_EQ(attItem, readAtt); // same keys & HMAC, neither loaded
+}
+
+// Content's written in whole blocks, nothing more
+TEST_F(FileV4Test, AttBlockSizedContentTest)
+{
+  const unsigned char content[2 * TwoFish::BLOCKSIZE] = {'0', '1', '2', '3'};
+  CItemAtt att;
+  att.CreateUUID();
+  att.SetContent(content, sizeof(content));
+
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(att));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  CItemAtt readAtt;
+  PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(readAtt));
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+  EXPECT_NE(att, readAtt); // content's yet to be loaded
+  EXPECT_EQ(PWSfile::SUCCESS, readAtt.LoadContent());
+  att.SetOffset(readAtt.GetOffset());
+  EXPECT_EQ(att, readAtt);
 }
 
 TEST_F(FileV4Test, HdrItemAttTest)
@@ -252,6 +346,103 @@ TEST_F(FileV4Test, HdrItemAttTest)
   EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
 }
 
+// PWScore::ReadFile hands records from a reader thread to the indexing
+// one in batches; make sure none are lost or reordered across batches.
+TEST_F(FileV4Test, CoreReadManyTest)
+{
+  const StringX passkey(L"3rdMambo");
+  const unsigned N = 3000;
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passkey));
+  CItemData first;
+  for (unsigned i = 0; i < N; i++) {
+    CItemData ci;
+    ci.CreateUUID();
+    ci.SetTitle(StringX(L"title") + std::to_wstring(i).c_str());
+    ci.SetPassword(L"pw");
+    ci.SetNotes(L"Long enough for the file to be decrypted in more than one piece.");
+    if (i == 0)
+      first = ci;
+    EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(ci));
+    if (i == N / 2) {
+      EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(attItem));
+    }
+  }
+  // Last record reuses the first one's UUID - the first read must keep it
+  CItemData dup(first);
+  dup.SetTitle(L"duplicate");
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(dup));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  // Both on this thread and pipelined, whatever the machine
+  for (unsigned nThreads : {1U, 2U}) {
+    SCOPED_TRACE(nThreads);
+    PWScore core;
+    core.SetReadThreads(nThreads);
+    EXPECT_EQ(PWScore::OK_WITH_VALIDATION_ERRORS,
+              core.ReadFile(fname.c_str(), passkey, false));
+    EXPECT_EQ(N + 1, core.GetNumEntries());
+    EXPECT_EQ(1U, core.GetNumAtts());
+    EXPECT_TRUE(core.HasAtt(attItem.GetUUID()));
+    ASSERT_TRUE(core.Find(first.GetUUID()) != core.GetEntryEndIter());
+    EXPECT_EQ(first.GetTitle(), core.GetEntry(core.Find(first.GetUUID())).GetTitle());
+  }
+}
+
+namespace {
+  struct ThrowingReporter : public Reporter {
+    void operator()(const stringT &, const stringT &) override {throw std::runtime_error("reported");}
+    void operator()(const stringT &) override {throw std::runtime_error("reported");}
+  };
+}
+
+// If indexing throws (here, reporting a bad record), the reader must be
+// cancelled and joined, even when blocked on a full pipe, and the
+// exception passed on to ReadFile's caller.
+TEST_F(FileV4Test, CoreReadThrowsTest)
+{
+  const StringX passkey(L"3rdMambo");
+  const unsigned N = 4000; // more than the pipe holds
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passkey));
+  for (unsigned i = 0; i < N; i++) {
+    if (i == 10) { // a record whose creation time can't be read
+      CItemData bad;
+      bad.CreateUUID();
+      uuid_array_t ua;
+      bad.GetUUID(ua);
+      const unsigned char ctime[3] = {1, 2, 3};
+      fw.WriteField(CItemData::UUID, ua, sizeof(ua));
+      fw.WriteField(CItemData::CTIME, ctime, sizeof(ctime));
+      fw.WriteField(CItemData::END, _T(""));
+    }
+    CItemData ci;
+    ci.CreateUUID();
+    ci.SetTitle(StringX(L"title") + std::to_wstring(i).c_str());
+    EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(ci));
+  }
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  ThrowingReporter reporter;
+  PWScore::SetReporter(&reporter);
+  for (unsigned nThreads : {1U, 2U}) {
+    SCOPED_TRACE(nThreads);
+    PWScore core;
+    core.SetReadThreads(nThreads);
+    EXPECT_THROW(core.ReadFile(fname.c_str(), passkey, false), std::runtime_error);
+  }
+  PWScore::SetReporter(nullptr);
+
+  // Nothing's left locked or open, and unreported, the bad record's no obstacle
+  for (unsigned nThreads : {1U, 2U}) {
+    SCOPED_TRACE(nThreads);
+    PWScore core;
+    core.SetReadThreads(nThreads);
+    core.ReadFile(fname.c_str(), passkey, false);
+    EXPECT_LE(N, core.GetNumEntries());
+  }
+}
+
 TEST_F(FileV4Test, CoreRWTest)
 {
   PWScore core;
@@ -287,3 +478,290 @@ TEST_F(FileV4Test, CoreRWTest)
   // Get core to delete any existing commands
   core.ClearCommands();
 }
+
+// Attachment content's left in the file until it's needed, and still
+// there when the file's been replaced, e.g., for Undo
+TEST_F(FileV4Test, CoreLazyAttTest)
+{
+  PWScore core;
+  const StringX passkey(L"3rdMambo");
+  const pws_os::CUUID att_uuid = attItem.GetUUID();
+  const size_t csize = attItem.GetContentSize();
+  std::vector<unsigned char> expected(csize), content(csize);
+  ASSERT_TRUE(attItem.GetContent(expected.data(), csize));
+
+  fullItem.SetAttUUID(att_uuid);
+  core.SetPassKey(passkey);
+  core.Execute(AddEntryCommand::Create(&core, fullItem, pws_os::CUUID::NullUUID(), &attItem));
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.ClearCommands();
+  core.ClearDBData();
+
+  ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passkey, true));
+  ASSERT_TRUE(core.HasAtt(att_uuid));
+  const CItemAtt &readAtt = core.GetAtt(att_uuid);
+  EXPECT_TRUE(readAtt.HasContent());
+  EXPECT_EQ(attItem.GetContentLength(), readAtt.GetContentLength());
+  ASSERT_EQ(csize, readAtt.GetContentSize());
+  EXPECT_TRUE(readAtt.GetContent(content.data(), csize));
+  EXPECT_EQ(expected, content);
+
+  // Saving copies the content over
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  std::fill(content.begin(), content.end(), 0);
+  EXPECT_TRUE(core.GetAtt(att_uuid).GetContent(content.data(), csize));
+  EXPECT_EQ(expected, content);
+
+  // Deleted, then saved without it: Undo has to have kept its content
+  const CItemData readFullItem = core.GetEntry(core.Find(fullItem.GetUUID()));
+  core.Execute(DeleteEntryCommand::Create(&core, readFullItem));
+  ASSERT_EQ(0U, core.GetNumAtts());
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.Undo();
+  ASSERT_TRUE(core.HasAtt(att_uuid));
+  std::fill(content.begin(), content.end(), 0);
+  EXPECT_TRUE(core.GetAtt(att_uuid).GetContent(content.data(), csize));
+  EXPECT_EQ(expected, content);
+
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.ClearCommands();
+  core.ClearDBData();
+  ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passkey, true));
+  ASSERT_TRUE(core.HasAtt(att_uuid));
+  std::fill(content.begin(), content.end(), 0);
+  EXPECT_TRUE(core.GetAtt(att_uuid).GetContent(content.data(), csize));
+  EXPECT_EQ(expected, content);
+  core.ClearDBData();
+}
+
+namespace {
+  struct RecordingReporter : public Reporter {
+    void operator()(const stringT &, const stringT &message) override {messages.push_back(message);}
+    void operator()(const stringT &message) override {messages.push_back(message);}
+    std::vector<stringT> messages;
+  };
+}
+
+// If the file's replaced behind the core's back (e.g., by a sync client),
+// content that's yet to be loaded can't be read from what's there now:
+// the attachment's reported and left out, but the rest still gets saved
+TEST_F(FileV4Test, CoreLazyAttReplacedTest)
+{
+  PWScore core;
+  const StringX passkey(L"3rdMambo");
+  const stringT fname2(L"V4test2.psafe4");
+  const pws_os::CUUID att_uuid = attItem.GetUUID();
+
+  fullItem.SetAttUUID(att_uuid);
+  core.SetPassKey(passkey);
+  core.Execute(AddEntryCommand::Create(&core, fullItem, pws_os::CUUID::NullUUID(), &attItem));
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.ClearCommands();
+  core.ClearDBData();
+  ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passkey, true));
+  ASSERT_TRUE(core.GetAtt(att_uuid).IsContentAvailable());
+
+  // Not by a core in this process, as that'd have the attachment load
+  // its content first (see CItemAtt::PrepareToReplace())
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passkey));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  RecordingReporter reporter;
+  PWScore::SetReporter(&reporter);
+  EXPECT_FALSE(core.GetAtt(att_uuid).IsContentAvailable());
+  CItemAtt lost(core.GetAtt(att_uuid));
+  EXPECT_NE(PWSfile::SUCCESS, lost.LoadContent());
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname2.c_str(), PWSfile::V40));
+  EXPECT_EQ(1U, reporter.messages.size());
+  ASSERT_EQ(PWSfile::SUCCESS, core.StartWriteFile(fname2.c_str(), PWSfile::V40));
+  EXPECT_EQ(PWSfile::SUCCESS, core.FinishWriteFile());
+  EXPECT_EQ(2U, reporter.messages.size());
+  PWScore::SetReporter(nullptr);
+
+  PWScore saved;
+  ASSERT_EQ(PWSfile::SUCCESS, saved.ReadFile(fname2.c_str(), passkey, false));
+  EXPECT_EQ(1U, saved.GetNumEntries());
+  EXPECT_TRUE(saved.Find(fullItem.GetUUID()) != saved.GetEntryEndIter());
+  EXPECT_EQ(0U, saved.GetNumAtts());
+  saved.ClearDBData();
+
+  // Nor did the replacement get touched
+  ASSERT_EQ(PWSfile::SUCCESS, saved.ReadFile(fname.c_str(), passkey, false));
+  EXPECT_EQ(1U, saved.GetNumEntries());
+  EXPECT_TRUE(saved.Find(smallItem.GetUUID()) != saved.GetEntryEndIter());
+  saved.ClearDBData();
+
+  core.ClearCommands();
+  core.ClearDBData();
+  ASSERT_TRUE(pws_os::DeleteAFile(fname2));
+}
+
+// Attachments' content is copied concurrently on save, and verified as it
+// is: one that doesn't check out fails the save
+TEST_F(FileV4Test, CoreAttContentCopyTest)
+{
+  PWScore core;
+  const StringX passkey(L"3rdMambo");
+  const stringT fname2(L"V4test2.psafe4");
+  CItemData items[3];
+  CItemAtt atts[3];
+  std::vector<unsigned char> content(3 * TwoFish::BLOCKSIZE + 1);
+  auto sameContent = [](const CItemAtt &a, const CItemAtt &b) {
+    std::vector<unsigned char> ca(a.GetContentSize()), cb(b.GetContentSize());
+    return a.GetContentLength() == b.GetContentLength() &&
+      a.GetContent(ca.data(), ca.size()) && b.GetContent(cb.data(), cb.size()) &&
+      ca == cb;
+  };
+
+  core.SetPassKey(passkey);
+  for (int i = 0; i < 3; i++) {
+    std::fill(content.begin(), content.end(), static_cast<unsigned char>('a' + i));
+    atts[i].CreateUUID();
+    atts[i].SetContent(content.data(), content.size() - i);
+    items[i].CreateUUID();
+    items[i].SetTitle(StringX(L"item") + StringX(1, wchar_t(L'0' + i)));
+    items[i].SetPassword(password);
+    items[i].SetAttUUID(atts[i].GetUUID());
+    core.Execute(AddEntryCommand::Create(&core, items[i], pws_os::CUUID::NullUUID(), &atts[i]));
+  }
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.ClearCommands();
+  core.ClearDBData();
+
+  // Copied over as is, by the saving thread alone or by one per attachment
+  long offset = 0;
+  for (unsigned nThreads : {1U, 3U}) {
+    SCOPED_TRACE(nThreads);
+    core.SetWriteThreads(nThreads);
+    ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passkey, true));
+    EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname2.c_str(), PWSfile::V40));
+    core.ClearDBData();
+    ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname2.c_str(), passkey, true));
+    ASSERT_EQ(3U, core.GetNumAtts());
+    for (int i = 0; i < 3; i++) {
+      ASSERT_TRUE(core.HasAtt(atts[i].GetUUID()));
+      EXPECT_TRUE(sameContent(atts[i], core.GetAtt(atts[i].GetUUID())));
+    }
+    offset = core.GetAtt(atts[1].GetUUID()).GetOffset();
+    core.ClearDBData();
+    ASSERT_TRUE(pws_os::DeleteAFile(fname2));
+  }
+
+  // Corrupt the middle one's content on file: the file still opens,
+  // but can't be saved from
+  FILE *f = pws_os::FOpen(fname, L"r+b");
+  ASSERT_TRUE(f != nullptr);
+  unsigned char c;
+  ASSERT_EQ(0, fseek(f, offset, SEEK_SET));
+  ASSERT_EQ(1U, fread(&c, 1, 1, f));
+  c ^= 0x01;
+  ASSERT_EQ(0, fseek(f, offset, SEEK_SET));
+  ASSERT_EQ(1U, fwrite(&c, 1, 1, f));
+  fclose(f);
+
+  for (unsigned nThreads : {1U, 3U}) {
+    SCOPED_TRACE(nThreads);
+    core.SetWriteThreads(nThreads);
+    ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passkey, true));
+    EXPECT_NE(PWSfile::SUCCESS, core.WriteFile(fname2.c_str(), PWSfile::V40));
+    EXPECT_FALSE(pws_os::FileExists(fname2));
+    EXPECT_TRUE(sameContent(atts[0], core.GetAtt(atts[0].GetUUID())));
+    EXPECT_FALSE(sameContent(atts[1], core.GetAtt(atts[1].GetUUID())));
+    core.ClearDBData();
+  }
+}
+
+TEST_F(FileV4Test, PeekTest)
+{
+  CItemAtt atts[3];
+  std::vector<unsigned char> content(2 * TwoFish::BLOCKSIZE);
+  std::fill(content.begin(), content.end(), static_cast<unsigned char>('x'));
+
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  fw.SetHeader(hdr);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(fullItem));
+  const size_t sizes[3] = {content.size(), content.size() - 5, 1};
+  for (int i = 0; i < 3; i++) {
+    atts[i].CreateUUID();
+    atts[i].SetContent(content.data(), sizes[i]);
+    EXPECT_EQ(PWSfile::SUCCESS, atts[i].Write(&fw));
+  }
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWSfile::PeekInfo info;
+  EXPECT_EQ(PWSfile::WRONG_PASSWORD, PWSfile::Peek(fname.c_str(), _T("x"), info, true));
+  ASSERT_EQ(PWSfile::SUCCESS, PWSfile::Peek(fname.c_str(), passphrase, info, true));
+  EXPECT_EQ(PWSfile::V40, info.version);
+  EXPECT_EQ(hdr.m_DB_Name, info.hdr.m_DB_Name);
+  EXPECT_EQ(3U, info.nEntries);
+  EXPECT_EQ(3U, info.nAttachments);
+
+  // Opening what was peeked at doesn't stretch the passkey again
+  unsigned long hits, misses, hitsAfter, missesAfter;
+  PWSfile::GetStretchedKeyCacheStats(hits, misses);
+  PWScore core;
+  const int status = core.ReadFile(fname.c_str(), passphrase, false);
+  ASSERT_TRUE(status == PWScore::SUCCESS ||
+              status == PWScore::OK_WITH_VALIDATION_ERRORS); // smallItem's there twice
+  PWSfile::GetStretchedKeyCacheStats(hitsAfter, missesAfter);
+  EXPECT_EQ(misses, missesAfter);
+  EXPECT_LT(hits, hitsAfter);
+  core.ClearDBData();
+}
+
+// Attachments still as they were when StartWriteFile() took its snapshot
+// find their content in the new file once it's in place.
+TEST_F(FileV4Test, CoreAsyncSaveAttTest)
+{
+  PWScore core;
+  const StringX passkey(L"3rdMambo");
+  const pws_os::CUUID att_uuid = attItem.GetUUID();
+  const size_t csize = attItem.GetContentSize();
+  std::vector<unsigned char> expected(csize), content(csize);
+  ASSERT_TRUE(attItem.GetContent(expected.data(), csize));
+
+  fullItem.SetAttUUID(att_uuid);
+  core.SetPassKey(passkey);
+  core.Execute(AddEntryCommand::Create(&core, fullItem, pws_os::CUUID::NullUUID(), &attItem));
+  core.Execute(AddEntryCommand::Create(&core, smallItem));
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.ClearCommands();
+  core.ClearDBData();
+  ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passkey, true));
+
+  // Removing the small item moves the attachment's content in the file
+  core.Execute(DeleteEntryCommand::Create(&core, core.GetEntry(core.Find(smallItem.GetUUID()))));
+  size_t total = 0;
+  ASSERT_EQ(PWSfile::SUCCESS,
+            core.StartWriteFile(fname.c_str(), PWSfile::V40,
+                                [&total](size_t, size_t t) {total = t;}));
+  const CItemData readFullItem = core.GetEntry(core.Find(fullItem.GetUUID()));
+  core.Execute(DeleteEntryCommand::Create(&core, readFullItem));
+  ASSERT_EQ(PWSfile::SUCCESS, core.FinishWriteFile());
+  EXPECT_EQ(2U, total);
+  EXPECT_TRUE(core.HasDBChanged());
+  core.Undo();
+  EXPECT_FALSE(core.HasDBChanged());
+  ASSERT_TRUE(core.HasAtt(att_uuid));
+  EXPECT_TRUE(core.GetAtt(att_uuid).GetContent(content.data(), csize));
+  EXPECT_EQ(expected, content);
+  const long offset = core.GetAtt(att_uuid).GetOffset();
+
+  PWScore core2;
+  ASSERT_EQ(PWSfile::SUCCESS, core2.ReadFile(fname.c_str(), passkey, true));
+  EXPECT_EQ(1U, core2.GetNumEntries());
+  ASSERT_TRUE(core2.HasAtt(att_uuid));
+  EXPECT_EQ(offset, core2.GetAtt(att_uuid).GetOffset());
+  std::fill(content.begin(), content.end(), 0);
+  EXPECT_TRUE(core2.GetAtt(att_uuid).GetContent(content.data(), csize));
+  EXPECT_EQ(expected, content);
+
+  core.ClearCommands();
+  core.ClearDBData();
+  core2.ClearDBData();
+}
@@ -7,6 +7,7 @@
 */
 // HMAC_SHA256Test.cpp: Unit test for HMAC implementation with SHA256
 // Test vectors from RFC4231
+// PBKDF2-HMAC-SHA256 vectors are the RFC6070 inputs with SHA256
 
 #ifdef WIN32
 #include "../ui/Windows/stdafx.h"
@@ -14,6 +15,7 @@
 
 #include "core/crypto/hmac.h"
 #include "core/crypto/sha256.h"
+#include "core/crypto/pbkdf2.h"
 #include "gtest/gtest.h"
 
 TEST(HMAC_SHA256Test, hmac_sha256_test)
@@ -183,3 +185,89 @@ TEST(HMAC_SHA256Test, hmac_sha256_test)
     EXPECT_TRUE(memcmp(tmp, tests[i].hash, 32) == 0) << "Test vector " << i;
   }
 }
+
+TEST(HMAC_SHA256Test, hmac_restart_test)
+{
+  // FinalAndRestart() must give the same MAC as a freshly keyed HMAC
+  static const unsigned char key[] = {0x4a, 0x65, 0x66, 0x65};
+  static const unsigned char data[] = {0x01, 0x02, 0x03, 0x04, 0x05};
+  unsigned char expected[32], tmp[32];
+
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> md(key, sizeof(key));
+  md.Update(data, sizeof(data));
+  md.Final(expected);
+  EXPECT_FALSE(md.IsInited());
+
+  md.Init(key, sizeof(key));
+  for (int i = 0; i < 3; i++) {
+    md.Update(data, sizeof(data));
+    md.FinalAndRestart(tmp);
+    EXPECT_TRUE(memcmp(tmp, expected, sizeof(tmp)) == 0) << "Iteration " << i;
+    EXPECT_TRUE(md.IsInited());
+  }
+}
+
+TEST(HMAC_SHA256Test, pbkdf2_sha256_test)
+{
+  static const struct {
+    const char *password;
+    const char *salt;
+    int iterations;
+    unsigned long dklen;
+    unsigned char dk[40];
+  } tests[] = {
+    {"password", "salt", 1, 32,
+     {0x12, 0x0f, 0xb6, 0xcf, 0xfc, 0xf8, 0xb3, 0x2c,
+      0x43, 0xe7, 0x22, 0x52, 0x56, 0xc4, 0xf8, 0x37,
+      0xa8, 0x65, 0x48, 0xc9, 0x2c, 0xcc, 0x35, 0x48,
+      0x08, 0x05, 0x98, 0x7c, 0xb7, 0x0b, 0xe1, 0x7b}},
+    {"password", "salt", 2, 32,
+     {0xae, 0x4d, 0x0c, 0x95, 0xaf, 0x6b, 0x46, 0xd3,
+      0x2d, 0x0a, 0xdf, 0xf9, 0x28, 0xf0, 0x6d, 0xd0,
+      0x2a, 0x30, 0x3f, 0x8e, 0xf3, 0xc2, 0x51, 0xdf,
+      0xd6, 0xe2, 0xd8, 0x5a, 0x95, 0x47, 0x4c, 0x43}},
+    {"password", "salt", 4096, 32,
+     {0xc5, 0xe4, 0x78, 0xd5, 0x92, 0x88, 0xc8, 0x41,
+      0xaa, 0x53, 0x0d, 0xb6, 0x84, 0x5c, 0x4c, 0x8d,
+      0x96, 0x28, 0x93, 0xa0, 0x01, 0xce, 0x4e, 0x11,
+      0xa4, 0x96, 0x38, 0x73, 0xaa, 0x98, 0x13, 0x4a}},
+    // Output longer than one hash block
+    {"passwordPASSWORDpassword", "saltSALTsaltSALTsaltSALTsaltSALTsalt", 4096, 40,
+     {0x34, 0x8c, 0x89, 0xdb, 0xcb, 0xd3, 0x2b, 0x2f,
+      0x32, 0xd8, 0x14, 0xb8, 0x11, 0x6e, 0x84, 0xcf,
+      0x2b, 0x17, 0x34, 0x7e, 0xbc, 0x18, 0x00, 0x18,
+      0x1c, 0x4e, 0x2a, 0x1f, 0xb8, 0xdd, 0x53, 0xe1,
+      0xc6, 0x35, 0x51, 0x8c, 0x7d, 0xac, 0x47, 0xe9}},
+  };
+
+  for (size_t i = 0; i < (sizeof(tests) / sizeof(tests[0])); i++) {
+    HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+    unsigned char dk[40];
+    unsigned long dklen = tests[i].dklen;
+    pbkdf2(reinterpret_cast<const unsigned char *>(tests[i].password),
+           static_cast<unsigned long>(strlen(tests[i].password)),
+           reinterpret_cast<const unsigned char *>(tests[i].salt),
+           static_cast<unsigned long>(strlen(tests[i].salt)),
+           tests[i].iterations, &hmac, dk, &dklen);
+    EXPECT_EQ(tests[i].dklen, dklen);
+    EXPECT_TRUE(memcmp(dk, tests[i].dk, tests[i].dklen) == 0) << "Test vector " << i;
+  }
+
+  // A cancelled derivation produces no output, an uncancelled one's unaffected
+  std::atomic<bool> cancel(true);
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+  unsigned char dk[32];
+  unsigned long dklen = sizeof(dk);
+  pbkdf2(reinterpret_cast<const unsigned char *>("password"), 8,
+         reinterpret_cast<const unsigned char *>("salt"), 4,
+         4096, &hmac, dk, &dklen, &cancel);
+  EXPECT_EQ(0UL, dklen);
+
+  cancel = false;
+  dklen = sizeof(dk);
+  pbkdf2(reinterpret_cast<const unsigned char *>("password"), 8,
+         reinterpret_cast<const unsigned char *>("salt"), 4,
+         4096, &hmac, dk, &dklen, &cancel);
+  EXPECT_EQ(32UL, dklen);
+  EXPECT_TRUE(memcmp(dk, tests[2].dk, 32) == 0);
+}
@@ -121,6 +121,44 @@ TEST_F(ItemAttTest, ImpExp)
   pws_os::DeleteAFile(testExpFile);
 }
 
+// Import and Export work through the content a chunk at a time
+TEST_F(ItemAttTest, ImpExpChunked)
+{
+  const stringT testImpFile(L"input.tmp");
+  const stringT testExpFile(L"output.tmp");
+  const size_t sizes[] = {64 * 1024, 3 * 64 * 1024 + 5}; // chunk's 64K
+
+  for (size_t flen : sizes) {
+    vector<unsigned char> m1(flen), m2(flen);
+    for (size_t i = 0; i < flen; i++)
+      m1[i] = static_cast<unsigned char>((i * 7) ^ (i >> 8));
+
+    FILE *f = pws_os::FOpen(testImpFile, L"wb");
+    ASSERT_TRUE(f != nullptr);
+    ASSERT_EQ(1U, fwrite(m1.data(), flen, 1, f));
+    fclose(f);
+
+    CItemAtt ai;
+    EXPECT_EQ(PWScore::SUCCESS, ai.Import(testImpFile));
+    EXPECT_EQ(flen, ai.GetContentLength());
+
+    CItemAtt copy(ai);
+    EXPECT_EQ(PWScore::SUCCESS, copy.Export(testExpFile));
+    f = pws_os::FOpen(testExpFile, L"rb");
+    ASSERT_TRUE(f != nullptr);
+    EXPECT_EQ(flen, pws_os::fileLength(f));
+    ASSERT_EQ(1U, fread(m2.data(), flen, 1, f));
+    fclose(f);
+    EXPECT_TRUE(m1 == m2);
+
+    vector<unsigned char> content(ai.GetContentSize());
+    ASSERT_TRUE(ai.GetContent(content.data(), content.size()));
+    EXPECT_EQ(0, memcmp(m1.data(), content.data(), flen));
+  }
+  pws_os::DeleteAFile(testImpFile);
+  pws_os::DeleteAFile(testExpFile);
+}
+
 TEST_F(ItemAttTest, CopyCtor)
 {
   const stringT testImpFile(fullfileName);
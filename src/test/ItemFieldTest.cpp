@@ -15,6 +15,8 @@
 #include "crypto/sha1.h"
 #include "gtest/gtest.h"
 
+#include <vector>
+
 class NullFish : public Fish
 {
 public:
@@ -78,3 +80,105 @@ TEST_F(ItemFieldTest, testMe)
   EXPECT_EQ(sizeof(v1), lenV2);
   EXPECT_TRUE(memcmp(v1, v2, sizeof(v1)) == 0);
 }
+
+TEST_F(ItemFieldTest, store)
+{
+  const unsigned char v1[3] = {0x01, 0x02, 0x03};
+  const unsigned char v2[20] = {0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9,
+                                0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf, 0xc0, 0xc1, 0xc2, 0xc3};
+  unsigned char v[24];
+  size_t len;
+
+  CItemFieldStore store;
+  EXPECT_TRUE(store.empty());
+  EXPECT_TRUE(store.find(5) == store.end());
+
+  // Out of order, one beyond the first word of the bitmap
+  store.Set(0x60, v2, sizeof(v2), m_bf);
+  store.Set(5, v1, sizeof(v1), m_bf);
+  store.Set(3, v2, 9, m_bf);
+  store.Set(0xff, v1, 1, m_bf);
+  EXPECT_EQ(4U, store.size());
+  EXPECT_EQ(1U, store.count(3));
+  EXPECT_EQ(0U, store.count(4));
+
+  const int types[] = {3, 5, 0x60, 0xff};
+  const size_t lengths[] = {9, sizeof(v1), sizeof(v2), 1};
+  int i = 0;
+  for (const auto &p : store) {
+    ASSERT_LT(i, 4);
+    EXPECT_EQ(types[i], p.first);
+    EXPECT_EQ(types[i], p.second.GetType());
+    EXPECT_EQ(lengths[i], p.second.GetLength());
+    i++;
+  }
+  EXPECT_EQ(4, i);
+
+  // Grow, shrink and erase fields in the middle, check the others survive
+  store.Set(5, v2, sizeof(v2), m_bf);
+  store.Set(0x60, v1, sizeof(v1), m_bf);
+  EXPECT_EQ(1U, store.erase(3));
+  EXPECT_EQ(0U, store.erase(3));
+  store.Set(0xff, nullptr, 0, m_bf); // same as erase
+  EXPECT_EQ(2U, store.size());
+
+  const CItemFieldStore copy(store);
+  CItemFieldStore assigned;
+  assigned.Set(1, v1, sizeof(v1), m_bf);
+  assigned = copy;
+  store.clear();
+  EXPECT_TRUE(store.empty());
+
+  const CItemFieldStore *stores[] = {&copy, &assigned};
+  for (const CItemFieldStore *s : stores) {
+    ASSERT_EQ(2U, s->size());
+    EXPECT_EQ(0U, s->count(1));
+    len = sizeof(v);
+    s->find(5)->second.Get(v, len, m_bf);
+    EXPECT_EQ(sizeof(v2), len);
+    EXPECT_EQ(0, memcmp(v, v2, sizeof(v2)));
+    len = sizeof(v);
+    s->find(0x60)->second.Get(v, len, m_bf);
+    EXPECT_EQ(sizeof(v1), len);
+    EXPECT_EQ(0, memcmp(v, v1, sizeof(v1)));
+  }
+
+  StringX sv;
+  store.Set(2, StringX(L"a string"), m_bf);
+  store.find(2)->second.Get(sv, m_bf);
+  EXPECT_EQ(StringX(L"a string"), sv);
+}
+
+TEST_F(ItemFieldTest, view)
+{
+  const StringX s1(L"a title"), s2(L"another title");
+  CItemField f1(3), f2(3), f3(3);
+  f1.Set(s1, m_bf);
+  f2.Set(s2, m_bf);
+  f3.Set(s1, m_bf);
+
+  {
+    const CItemFieldView v1(f1, m_bf), v2(f2, m_bf), v3(f3, m_bf);
+    EXPECT_EQ(s1.length(), v1.GetTextLength());
+    EXPECT_EQ(s1, StringX(v1.GetText(), v1.GetTextLength()));
+    EXPECT_EQ(s2, StringX(v2.GetText(), v2.GetTextLength()));
+    EXPECT_TRUE(v1 == v3);
+    EXPECT_TRUE(v1 != v2);
+  }
+
+  // Too big for the scratch memory, and an empty field
+  std::vector<unsigned char> big(100000);
+  for (size_t i = 0; i < big.size(); i++)
+    big[i] = static_cast<unsigned char>(i * 7);
+  CItemField fbig(5), fempty(6);
+  fbig.Set(big.data(), big.size(), m_bf);
+  const CItemFieldView vbig(fbig, m_bf), vempty(fempty, m_bf);
+  ASSERT_EQ(big.size(), vbig.GetLength());
+  EXPECT_EQ(0, memcmp(big.data(), vbig.GetData(), big.size()));
+  EXPECT_EQ(0U, vempty.GetLength());
+
+  CItemFieldStore store;
+  store.Set(3, s2, m_bf);
+  const CItemFieldView vs(store.find(3)->second, m_bf);
+  EXPECT_EQ(s2, StringX(vs.GetText(), vs.GetTextLength()));
+}
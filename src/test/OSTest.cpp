@@ -9,8 +9,15 @@
 
 #include "os/media.h"
 #include "os/dir.h"
+#include "os/file.h"
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
 TEST(OSTest, testMedia)
 {
   EXPECT_EQ(_S("unknown"), pws_os::GetMediaType(_S("nosuchfile")));
@@ -44,4 +51,73 @@ TEST(OSTest, testPath)
 
   out_path = pws_os::makepath(in_drive, in_dir, in_file, in_ext);
   EXPECT_EQ(in_path, out_path);
-}
\ No newline at end of file
+}
+
+TEST(OSTest, testMapFile)
+{
+  const stringT fname(_S("data/text1.txt"));
+  std::FILE *fp = pws_os::FOpen(fname, _S("rb"));
+  ASSERT_TRUE(fp != nullptr);
+  const ulong64 len = pws_os::fileLength(fp);
+  ASSERT_GT(len, 0U);
+
+  std::vector<unsigned char> contents(static_cast<size_t>(len));
+  ASSERT_EQ(contents.size(), std::fread(contents.data(), 1, contents.size(), fp));
+
+  const unsigned char *p = pws_os::MapFile(fp, len);
+  ASSERT_TRUE(p != nullptr);
+  EXPECT_TRUE(std::equal(contents.begin(), contents.end(), p));
+  pws_os::UnmapFile(p, len);
+
+  EXPECT_TRUE(pws_os::MapFile(fp, 0) == nullptr);
+  EXPECT_TRUE(pws_os::MapFile(nullptr, len) == nullptr);
+  pws_os::FClose(fp, false);
+}
+
+// Reading a database is mostly a walk through it a field (a block or two)
+// at a time, which this times through stdio and through a mapping.
+// Run with --gtest_also_run_disabled_tests.
+TEST(OSTest, DISABLED_MapFileBenchmark)
+{
+  using namespace std::chrono;
+  const stringT fname(_S("mapbench.dat"));
+  const size_t LEN = 64 * 1024 * 1024, BS = 16 * 2, R = 5;
+  {
+    std::vector<unsigned char> block(1024 * 1024, 0x5a);
+    std::FILE *fp = pws_os::FOpen(fname, _S("wb"));
+    ASSERT_TRUE(fp != nullptr);
+    for (size_t n = 0; n < LEN; n += block.size())
+      ASSERT_EQ(block.size(), std::fwrite(block.data(), 1, block.size(), fp));
+    pws_os::FClose(fp, false);
+  }
+
+  unsigned char buf[BS];
+  unsigned sum = 0;
+  double best_stdio = 1e9, best_map = 1e9;
+  for (size_t r = 0; r < R; r++) {
+    std::FILE *fp = pws_os::FOpen(fname, _S("rb"));
+    ASSERT_TRUE(fp != nullptr);
+    auto t0 = steady_clock::now();
+    while (std::fread(buf, BS, 1, fp) == 1)
+      sum += buf[0];
+    auto t1 = steady_clock::now();
+    best_stdio = std::min(best_stdio, duration<double>(t1 - t0).count());
+
+    const unsigned char *p = pws_os::MapFile(fp, LEN);
+    ASSERT_TRUE(p != nullptr);
+    t0 = steady_clock::now();
+    for (size_t pos = 0; pos + BS <= LEN; pos += BS) {
+      std::memcpy(buf, p + pos, BS);
+      sum += buf[0];
+    }
+    t1 = steady_clock::now();
+    best_map = std::min(best_map, duration<double>(t1 - t0).count());
+    pws_os::UnmapFile(p, LEN);
+    pws_os::FClose(fp, false);
+  }
+  pws_os::DeleteAFile(fname);
+
+  const double MB = LEN / (1024.0 * 1024.0);
+  std::cout << BS << "-byte reads: stdio " << MB / best_stdio << " MB/s, mapped "
+            << MB / best_map << " MB/s (" << sum << ")" << std::endl;
+}
@@ -0,0 +1,106 @@
+/*
+* Copyright (c) 2003-2021 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// PWSrandTest.cpp: Unit test for PWSrand
+
+#ifdef WIN32
+#include "../ui/Windows/stdafx.h"
+#endif
+
+#include "core/PWSrand.h"
+#include "os/rand.h"
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+TEST(PWSrandTest, GetRandomData)
+{
+  PWSrand *r = PWSrand::GetInstance();
+  // Sizes chosen so requests straddle internal buffer refills
+  const unsigned long lens[] = {1, 16, 33, 1000, 4095, 4096, 4097, 10000};
+  for (auto len : lens) {
+    std::vector<unsigned char> a(len), b(len);
+    r->GetRandomData(a.data(), len);
+    r->GetRandomData(b.data(), len);
+    if (len >= 16) {
+      EXPECT_NE(0, std::memcmp(a.data(), b.data(), len)) << len;
+    }
+    unsigned zeros = 0;
+    for (auto c : a)
+      if (c == 0) zeros++;
+    EXPECT_LT(zeros, len / 32 + 3) << len;
+  }
+}
+
+TEST(PWSrandTest, RangeRand)
+{
+  PWSrand *r = PWSrand::GetInstance();
+  bool seen[10] = {false};
+  for (int i = 0; i < 1000; i++) {
+    unsigned int v = r->RangeRand(10);
+    ASSERT_LT(v, 10U);
+    seen[v] = true;
+  }
+  for (auto s : seen)
+    EXPECT_TRUE(s);
+  EXPECT_EQ(0U, r->RangeRand(0));
+}
+
+TEST(PWSrandTest, PerThread)
+{
+  PWSrand *mine = PWSrand::GetInstance();
+  EXPECT_EQ(mine, PWSrand::GetInstance());
+
+  PWSrand *theirs = nullptr;
+  unsigned char a[32], b[32];
+  std::thread t([&theirs, &b]() {
+      theirs = PWSrand::GetInstance();
+      theirs->GetRandomData(b, sizeof(b));
+    });
+  mine->GetRandomData(a, sizeof(a));
+  t.join();
+  EXPECT_NE(mine, theirs);
+  EXPECT_NE(0, std::memcmp(a, b, sizeof(a)));
+}
+
+// What the randomness in a saved record costs: each field written takes
+// a block for its length and, usually, one to pad its last block. Times
+// that from PWSrand's buffer against asking the OS for each block.
+// Run with --gtest_also_run_disabled_tests.
+TEST(PWSrandTest, DISABLED_Benchmark)
+{
+  using namespace std::chrono;
+  const int N = 20000, FIELDS = 10, DRAWS = 2 * FIELDS;
+  PWSrand *r = PWSrand::GetInstance();
+  unsigned char block[16];
+  unsigned n = 0;
+  const bool haveOS = pws_os::InitRandomDataFunction();
+
+  auto t0 = steady_clock::now();
+  for (int i = 0; i < N * DRAWS; i++) {
+    r->GetRandomData(block, sizeof(block));
+    n += block[0] & 1;
+  }
+  auto t1 = steady_clock::now();
+  for (int i = 0; haveOS && i < N * DRAWS; i++) {
+    pws_os::GetRandomData(block, sizeof(block));
+    n += block[0] & 1;
+  }
+  auto t2 = steady_clock::now();
+
+  auto ns = [](steady_clock::time_point a, steady_clock::time_point b, double count) {
+    return duration_cast<nanoseconds>(b - a).count() / count;
+  };
+  std::cout << "PWSrand " << ns(t0, t1, N) << " ns per record";
+  if (haveOS)
+    std::cout << ", OS " << ns(t1, t2, N) << " ns per record";
+  std::cout << " (" << n << ")" << std::endl;
+}
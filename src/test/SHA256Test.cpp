@@ -13,7 +13,9 @@
 #include "core/crypto/sha256.h"
 #include "gtest/gtest.h"
 
-TEST(SHA256Test, sha256_test)
+#include <algorithm>
+
+static void sha256_kat(const char *impl_name)
 {
   static const struct {
     const char *msg;
@@ -40,6 +42,79 @@ TEST(SHA256Test, sha256_test)
     md.Update( (unsigned char*)tests[i].msg,
                (unsigned long)strlen(tests[i].msg));
     md.Final(tmp);
-    EXPECT_TRUE(memcmp(tmp, tests[i].hash, 32) == 0) << "test vector " << i;
+    EXPECT_TRUE(memcmp(tmp, tests[i].hash, 32) == 0) << impl_name << " test vector " << i;
+  }
+
+  // One million 'a's, fed in uneven chunks to exercise the buffering
+  static const unsigned char million_a[32] = {
+    0xcd, 0xc7, 0x6e, 0x5c, 0x99, 0x14, 0xfb, 0x92,
+    0x81, 0xa1, 0xc7, 0xe2, 0x84, 0xd7, 0x3e, 0x67,
+    0xf1, 0x80, 0x9a, 0x48, 0xa4, 0x97, 0x20, 0x0e,
+    0x04, 0x6d, 0x39, 0xcc, 0xc7, 0x11, 0x2c, 0xd0
+  };
+  unsigned char chunk[1000];
+  memset(chunk, 'a', sizeof(chunk));
+  SHA256 md;
+  size_t left = 1000000;
+  for (size_t n = 1; left > 0; n = (n * 7 + 3) % sizeof(chunk) + 1) {
+    const size_t len = std::min(n, left);
+    md.Update(chunk, len);
+    left -= len;
+  }
+  md.Final(tmp);
+  EXPECT_TRUE(memcmp(tmp, million_a, 32) == 0) << impl_name << " million a";
+}
+
+TEST(SHA256Test, sha256_test)
+{
+  sha256_kat("default");
+}
+
+// Run the same vectors through every compression function this CPU has,
+// and check that they all agree with the portable one for messages that
+// end in every possible position within a block.
+TEST(SHA256Test, sha256_impl_test)
+{
+  static const struct {
+    SHA256::Impl impl;
+    const char *name;
+  } impls[] = {
+    {SHA256::PORTABLE, "portable"},
+    {SHA256::X86_SHA_NI, "x86 SHA-NI"},
+    {SHA256::ARMV8_CE, "ARMv8 CE"},
+  };
+
+  const SHA256::Impl saved = SHA256::GetImpl();
+  EXPECT_TRUE(SHA256::IsImplSupported(SHA256::PORTABLE));
+
+  unsigned char msg[200];
+  for (size_t i = 0; i < sizeof(msg); i++)
+    msg[i] = static_cast<unsigned char>(i * 31 + 7);
+
+  unsigned char expected[sizeof(msg) + 1][32];
+  ASSERT_TRUE(SHA256::SetImpl(SHA256::PORTABLE));
+  for (size_t len = 0; len <= sizeof(msg); len++) {
+    SHA256 md;
+    md.Update(msg, len);
+    md.Final(expected[len]);
   }
+
+  for (size_t i = 0; i < (sizeof(impls) / sizeof(impls[0])); i++) {
+    if (!SHA256::IsImplSupported(impls[i].impl)) {
+      EXPECT_FALSE(SHA256::SetImpl(impls[i].impl));
+      continue;
+    }
+    ASSERT_TRUE(SHA256::SetImpl(impls[i].impl));
+    EXPECT_EQ(impls[i].impl, SHA256::GetImpl());
+    sha256_kat(impls[i].name);
+    for (size_t len = 0; len <= sizeof(msg); len++) {
+      unsigned char tmp[32];
+      SHA256 md;
+      md.Update(msg, len);
+      md.Final(tmp);
+      EXPECT_TRUE(memcmp(tmp, expected[len], 32) == 0) << impls[i].name << " length " << len;
+    }
+  }
+
+  EXPECT_TRUE(SHA256::SetImpl(saved));
 }
@@ -12,8 +12,14 @@
 #endif
 
 #include "core/crypto/TwoFish.h"
+#include "core/Util.h"
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
 TEST(TwoFishTest, twofish_test)
 {
   static const struct { 
@@ -225,3 +231,61 @@ TEST(TwoFishTest, ECB_VK)
     EXPECT_TRUE(memcmp(res, vectors[i].CT, 16) == 0) << "Test vector " << i;
   }
 }
+
+// The multi-block calls must match block-at-a-time, in and out of place,
+// for counts that do and don't fill the interleaved kernel.
+TEST(TwoFishTest, blocks_test)
+{
+  unsigned char key[32], pt[9 * 16], ct[9 * 16], tmp[9 * 16];
+  for (int i = 0; i < 32; i++)
+    key[i] = static_cast<unsigned char>(i * 7 + 3);
+  for (int i = 0; i < 9 * 16; i++)
+    pt[i] = static_cast<unsigned char>(i * 11 + 1);
+
+  TwoFish tf(key, sizeof(key));
+  for (int b = 0; b < 9; b++)
+    tf.Encrypt(pt + 16 * b, ct + 16 * b);
+
+  for (size_t n = 0; n <= 9; n++) {
+    memset(tmp, 0, sizeof(tmp));
+    tf.EncryptBlocks(pt, tmp, n);
+    EXPECT_TRUE(memcmp(tmp, ct, 16 * n) == 0) << "EncryptBlocks " << n;
+    tf.DecryptBlocks(tmp, tmp, n);
+    EXPECT_TRUE(memcmp(tmp, pt, 16 * n) == 0) << "DecryptBlocks in place " << n;
+    tf.DecryptBlocks(ct, tmp, n);
+    EXPECT_TRUE(memcmp(tmp, pt, 16 * n) == 0) << "DecryptBlocks " << n;
+  }
+}
+
+// Decryption throughput a block at a time, with the interleaved kernel,
+// and in CBC mode as files are read (best of R runs).
+// Run with --gtest_also_run_disabled_tests.
+TEST(TwoFishTest, DISABLED_Benchmark)
+{
+  using namespace std::chrono;
+  const size_t N = 16 * 1024 * 1024;
+  const int R = 5;
+  unsigned char key[32] = {0}, iv[16] = {0};
+  std::vector<unsigned char> in(N, 0x5a), out(N);
+  TwoFish tf(key, sizeof(key));
+  double best[3] = {1e9, 1e9, 1e9};
+
+  for (int r = 0; r < R; r++) {
+    auto t0 = steady_clock::now();
+    for (size_t i = 0; i < N; i += 16)
+      tf.Decrypt(in.data() + i, out.data() + i);
+    auto t1 = steady_clock::now();
+    tf.DecryptBlocks(in.data(), out.data(), N / 16);
+    auto t2 = steady_clock::now();
+    cbcdecrypt(in.data(), out.data(), N, &tf, iv);
+    auto t3 = steady_clock::now();
+    best[0] = std::min(best[0], duration<double>(t1 - t0).count());
+    best[1] = std::min(best[1], duration<double>(t2 - t1).count());
+    best[2] = std::min(best[2], duration<double>(t3 - t2).count());
+  }
+
+  const double MB = N / (1024.0 * 1024.0);
+  std::cout << "Decrypt " << MB / best[0] << " MB/s, DecryptBlocks "
+            << MB / best[1] << " MB/s, cbcdecrypt " << MB / best[2]
+            << " MB/s (" << int(out[N - 1]) << ")" << std::endl;
+}
@@ -0,0 +1,85 @@
+/*
+* Copyright (c) 2003-2021 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// UUIDMapTest.cpp: Unit test for UUIDMap, checked against a std::map
+
+#include "core/UUIDMap.h"
+#include "gtest/gtest.h"
+
+#include <map>
+#include <vector>
+
+namespace {
+  typedef UUIDMap<int> TestMap;
+  typedef std::map<pws_os::CUUID, int> RefMap;
+
+  void ExpectSame(const TestMap &m, const RefMap &ref, const std::vector<pws_os::CUUID> &all)
+  {
+    ASSERT_EQ(ref.size(), m.size());
+    auto iter = m.begin();
+    for (const auto &p : ref) { // same order
+      ASSERT_TRUE(iter != m.end());
+      EXPECT_EQ(p.first, iter->first);
+      EXPECT_EQ(p.second, iter->second);
+      ++iter;
+    }
+    for (const auto &uuid : all) {
+      auto found = m.find(uuid);
+      if (ref.find(uuid) == ref.end()) {
+        EXPECT_TRUE(found == m.end());
+      } else {
+        ASSERT_TRUE(found != m.end());
+        EXPECT_EQ(uuid, found->first);
+      }
+    }
+  }
+}
+
+TEST(UUIDMapTest, InsertFindErase)
+{
+  const int N = 1000;
+  std::vector<pws_os::CUUID> uuids(N);
+  TestMap m;
+  RefMap ref;
+
+  for (int i = 0; i < N; i++) {
+    EXPECT_TRUE(m.insert(TestMap::value_type(uuids[i], i)).second);
+    ref[uuids[i]] = i;
+  }
+  EXPECT_FALSE(m.insert(TestMap::value_type(uuids[0], -1)).second);
+  EXPECT_EQ(0, m[uuids[0]]);
+  ExpectSame(m, ref, uuids);
+
+  // Removing from the middle of probe sequences mustn't lose anything
+  for (int i = 0; i < N; i += 3) {
+    EXPECT_EQ(1U, m.erase(uuids[i]));
+    ref.erase(uuids[i]);
+  }
+  EXPECT_EQ(0U, m.erase(uuids[0]));
+  for (int i = 1; i < N; i += 3) {
+    m.erase(m.find(uuids[i]));
+    ref.erase(uuids[i]);
+  }
+  ExpectSame(m, ref, uuids);
+
+  m[uuids[0]] = 42;
+  ref[uuids[0]] = 42;
+  ExpectSame(m, ref, uuids);
+
+  TestMap copy(m);
+  ExpectSame(copy, ref, uuids);
+  EXPECT_TRUE(copy == m);
+  TestMap moved(std::move(copy));
+  ExpectSame(moved, ref, uuids);
+  copy = moved; // copy's been moved from, but is usable
+  ExpectSame(copy, ref, uuids);
+
+  m.clear();
+  EXPECT_TRUE(m.empty());
+  EXPECT_TRUE(m.find(uuids[0]) == m.end());
+  ExpectSame(moved, ref, uuids);
+}
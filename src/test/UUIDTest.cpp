@@ -0,0 +1,113 @@
+/*
+* Copyright (c) 2003-2021 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// UUIDTest.cpp: Unit test for pws_os::CUUID
+
+#include "os/UUID.h"
+#include "core/StringXStream.h"
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <type_traits>
+#include <vector>
+
+using pws_os::CUUID;
+
+namespace {
+  constexpr uuid_array_t ua1 = {0x20, 0x40, 0x12, 0xe6, 0x60, 0x0f, 0x4e, 0x01,
+                                0xa5, 0xeb, 0x51, 0x52, 0x67, 0xcb, 0x0d, 0x50};
+  constexpr uuid_array_t ua2 = {0x20, 0x40, 0x12, 0xe6, 0x60, 0x0f, 0x4e, 0x01,
+                                0xa5, 0xeb, 0x51, 0x52, 0x67, 0xcb, 0x0d, 0x51};
+  constexpr uuid_array_t ua3 = {0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+}
+
+static_assert(std::is_trivially_copyable<CUUID>::value, "CUUID should be plain bytes");
+static_assert(sizeof(CUUID) == sizeof(uuid_array_t), "CUUID should be plain bytes");
+static_assert(CUUID(ua1) == CUUID(ua1) && CUUID(ua1) != CUUID(ua2), "constexpr ==");
+static_assert(CUUID(ua1) < CUUID(ua2) && CUUID(ua2) < CUUID(ua3) &&
+              !(CUUID(ua3) < CUUID(ua1)), "constexpr <");
+
+TEST(UUIDTest, ArrayRep)
+{
+  const CUUID uuid(ua1);
+  uuid_array_t ua;
+  uuid.GetARep(ua);
+  EXPECT_EQ(0, memcmp(ua, ua1, sizeof(ua)));
+  EXPECT_EQ(0, memcmp(*uuid.GetARep(), ua1, sizeof(ua)));
+  EXPECT_NE(CUUID(), CUUID());
+}
+
+TEST(UUIDTest, HexRoundTrip)
+{
+  const CUUID uuid(ua1);
+  const StringX hex = uuid;
+  EXPECT_EQ(StringX(L"204012e6600f4e01a5eb515267cb0d50"), hex);
+  EXPECT_EQ(uuid, CUUID(hex));
+  EXPECT_EQ(uuid, CUUID(StringX(L"204012E6600F4E01A5EB515267CB0D50")));
+
+  for (int i = 0; i < 100; i++) {
+    const CUUID random;
+    EXPECT_EQ(random, CUUID(StringX(random)));
+  }
+
+  // Not hex: nothing to go on
+  EXPECT_EQ(CUUID::NullUUID(), CUUID(StringX(L"204012e6600f4e01a5eb515267cb0d5g")));
+  EXPECT_EQ(CUUID::NullUUID(), CUUID(StringX(L"204012e6600f4e01a5eb515267cb0d5\x0130")));
+
+  // Nor is any other length, even if it starts or ends with a good one
+  EXPECT_EQ(CUUID::NullUUID(), CUUID(StringX()));
+  EXPECT_EQ(CUUID::NullUUID(), CUUID(StringX(L"204012e6600f4e01a5eb515267cb0d5")));
+  EXPECT_EQ(CUUID::NullUUID(), CUUID(StringX(L"204012e6600f4e01a5eb515267cb0d500")));
+  EXPECT_EQ(CUUID::NullUUID(), CUUID(StringX(L"204012e6-600f-4e01-a5eb-515267cb0d50")));
+}
+
+TEST(UUIDTest, Streaming)
+{
+  const CUUID uuid(ua1);
+  std::ostringstream os;
+  os << uuid << ' ' << uuid.Canonical() << ' ' << std::uppercase << uuid.Canonical();
+  EXPECT_EQ("204012e6600f4e01a5eb515267cb0d50 204012e6-600f-4e01-a5eb-515267cb0d50 "
+            "204012E6-600F-4E01-A5EB-515267CB0D50", os.str());
+
+  std::wostringstream wos;
+  wos << uuid << L' ' << uuid.Canonical();
+  EXPECT_EQ(L"204012e6600f4e01a5eb515267cb0d50 204012e6-600f-4e01-a5eb-515267cb0d50",
+            wos.str());
+}
+
+// Microbenchmarks, run with --gtest_also_run_disabled_tests
+TEST(UUIDTest, DISABLED_Benchmark)
+{
+  using namespace std::chrono;
+  const int N = 200000, R = 20;
+  const std::vector<CUUID> uuids(N);
+  std::vector<StringX> hexes;
+  hexes.reserve(N);
+  size_t n = 0;
+
+  auto t0 = steady_clock::now();
+  for (const auto &uuid : uuids)
+    hexes.push_back(uuid);
+  auto t1 = steady_clock::now();
+  for (const auto &hex : hexes)
+    n += CUUID(hex).Hash() & 1;
+  auto t2 = steady_clock::now();
+  for (int r = 0; r < R; r++)
+    for (int i = 1; i < N; i++)
+      n += (uuids[i] < uuids[i - 1]) + (uuids[i] == uuids[i - 1]);
+  auto t3 = steady_clock::now();
+
+  auto ns = [](steady_clock::time_point a, steady_clock::time_point b, double count) {
+    return duration_cast<nanoseconds>(b - a).count() / count;
+  };
+  std::cout << "format " << ns(t0, t1, N) << " ns, parse " << ns(t1, t2, N)
+            << " ns, compare " << ns(t2, t3, 2.0 * R * (N - 1)) << " ns ("
+            << n << ")" << std::endl;
+}
@@ -8,8 +8,11 @@
 // UtilTest.cpp: Unit test for selected functions in Util.cpp
 
 #include "core/Util.h"
+#include "os/env.h"
 #include "gtest/gtest.h"
 
+#include <thread>
+
 TEST(UtilTest1, convert_test_ascii)
 {
   StringX src(L"abc");
@@ -32,3 +35,23 @@ TEST(UtilTest2, convert_test_nonascii)
   EXPECT_STREQ("אבג", reinterpret_cast<const char *>(dst));
   delete[] dst;
 }
+
+// A thread can fix the encoding for itself, without touching the
+// environment that other threads read
+TEST(UtilTest3, convert_test_thread_encoding)
+{
+  wchar_t src_wchar[] = {0x05d0, 0x05d1, 0x05d2, 0}; // aleph bet gimel unicode
+  const StringX src(src_wchar);
+  size_t dst_size = 0;
+  pws_os::setenv("PWS_PK_CP_ACP", "1");
+  std::thread worker([&src, &dst_size]() {
+    SetThreadPasskeyEncoding(true);
+    unsigned char *dst = nullptr;
+    ConvertPasskey(src, dst, dst_size);
+    delete[] dst;
+  });
+  worker.join();
+  EXPECT_EQ(stringT(_T("1")), pws_os::getenv("PWS_PK_CP_ACP", false));
+  pws_os::setenv("PWS_PK_CP_ACP", "");
+  EXPECT_EQ(6U, dst_size);
+}
@@ -304,8 +304,7 @@ void CAddEdit_DateTimes::UpdateStats()
   CString cs_uuid(MAKEINTRESOURCE(IDS_NA));
   if (M_entry_uuid() != pws_os::CUUID::NullUUID()) {
     ostringstreamT os;
-    pws_os::CUUID huuid(*M_entry_uuid().GetARep(), true); // true for canonical format
-    os << std::uppercase << huuid;
+    os << std::uppercase << M_entry_uuid().Canonical();
     cs_uuid = os.str().c_str();
   }
   GetDlgItem(IDC_UUID)->SetWindowText(cs_uuid);
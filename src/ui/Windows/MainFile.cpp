@@ -1131,6 +1131,20 @@ int DboxMain::Save(const SaveType savetype)
   if (sxCurrFile.empty())
     return SaveAs();
 
+  // Journal the change rather than rewrite the database, unless it can't
+  // be journaled or the journal's due to be folded in
+  if (savetype == ST_SAVEIMMEDIATELY && m_core.WriteJournal() == PWScore::SUCCESS) {
+    BlockLogoffShutdown(false);
+    ChangeOkUpdate();
+
+    if (m_bUnsavedDisplayed)
+      OnShowUnsavedEntries();
+
+    RefreshViews();
+    UpdateStatusBar();
+    return PWScore::SUCCESS;
+  }
+
   switch (current_version) {
     case PWSfile::V30:
     case PWSfile::V40:
@@ -1350,6 +1364,12 @@ int DboxMain::SaveIfChanged()
         return PWScore::USER_DECLINED_SAVE;
     }
   }
+
+  // Fold whatever's been journaled into the database, as it's being closed
+  if (!m_core.HasDBChanged() && m_core.HasJournal()) {
+    if (Save() != PWScore::SUCCESS)
+      return PWScore::CANT_OPEN_FILE;
+  }
   return PWScore::SUCCESS;
 }
 
@@ -339,6 +339,14 @@ int PasswordSafeFrame::Save(SaveType savetype /* = SaveType::INVALID*/)
   if (!m_core.IsDbOpen())
     return SaveAs();
 
+  // Journal the change rather than rewrite the database, unless it can't
+  // be journaled or the journal's due to be folded in
+  if (savetype == SaveType::IMMEDIATELY && m_core.WriteJournal() == PWScore::SUCCESS) {
+    UpdateStatusBar();
+    RefreshViews();
+    return PWScore::SUCCESS;
+  }
+
   switch (m_core.GetReadFileVersion()) {
     case PWSfile::VCURRENT:
     case PWSfile::V40:
@@ -605,6 +613,13 @@ int PasswordSafeFrame::SaveIfChanged()
         ASSERT(0);
     }
   }
+
+  // Fold whatever's been journaled into the database, as it's being closed
+  if (!m_core.HasDBChanged() && m_core.HasJournal()) {
+    const int rc = Save();
+    if (rc != PWScore::SUCCESS)
+      return PWScore::CANT_OPEN_FILE;
+  }
   return PWScore::SUCCESS;
 }
 
@@ -216,8 +216,7 @@ void PropertiesDlg::Init()
   }
   else {
     ostringstreamT os;
-    pws_os::CUUID huuid(*file_uuid.GetARep(), true); // true for canonical format
-    os << huuid;
+    os << file_uuid.Canonical();
     m_file_uuid = os.str().c_str();
   }
 
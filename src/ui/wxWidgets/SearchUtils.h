@@ -32,21 +32,14 @@ void FindMatches(const StringX& searchText, bool fCaseSensitive,
   if (searchText.empty())
     return;
 
-  typedef StringX (CItemData::*ItemDataFuncT)() const;
-
-  struct {
-    CItemData::FieldType type;
-    ItemDataFuncT        func;
-  } ItemDataFields[] = {  {CItemData::GROUP,     &CItemData::GetGroup},
-    {CItemData::TITLE,     &CItemData::GetTitle},
-    {CItemData::USER,      &CItemData::GetUser},
-    {CItemData::PASSWORD,  &CItemData::GetPassword},
-    //                        {CItemData::NOTES,     &CItemData::GetNotes},
-    {CItemData::URL,       &CItemData::GetURL},
-    {CItemData::EMAIL,     &CItemData::GetEmail},
-    {CItemData::RUNCMD,    &CItemData::GetRunCommand},
-    {CItemData::AUTOTYPE,  &CItemData::GetAutoType},
-    {CItemData::XTIME_INT, &CItemData::GetXTimeInt},
+  // Text fields are searched where they're decrypted, see CItem::ViewField()
+  const CItemData::FieldType TextFields[] = {
+    CItemData::GROUP, CItemData::TITLE, CItemData::USER, CItemData::PASSWORD,
+    CItemData::URL, CItemData::EMAIL, CItemData::RUNCMD, CItemData::AUTOTYPE,
+  };
+  bool found = false;
+  auto search = [&found, &searchText, fCaseSensitive](const CItemFieldView &view) {
+    found = view.Find(searchText, fCaseSensitive);
   };
 
   bool keep_going = true;
@@ -55,19 +48,20 @@ void FindMatches(const StringX& searchText, bool fCaseSensitive,
     if (fUseSubgroups && !afn(itr).Matches(stringT(subgroupText.c_str()), subgroupObject, fn))
       continue;
 
-    bool found = false;
-    for (size_t idx = 0; idx < NumberOf(ItemDataFields) && !found; ++idx) {
-      if (bsFields.test(ItemDataFields[idx].type)) {
-        const StringX str = (afn(itr).*ItemDataFields[idx].func)();
-        found = fCaseSensitive? str.find(searchText) != StringX::npos: FindNoCase(searchText, str);
-      }
+    found = false;
+    for (size_t idx = 0; idx < NumberOf(TextFields) && !found; ++idx) {
+      if (bsFields.test(TextFields[idx]))
+        afn(itr).ViewField(TextFields[idx], search);
     }
 
-    if (!found && bsFields.test(CItemData::NOTES)) {
-      StringX str = afn(itr).GetNotes();
+    if (!found && bsFields.test(CItemData::XTIME_INT)) {
+      const StringX str = afn(itr).GetXTimeInt();
       found = fCaseSensitive? str.find(searchText) != StringX::npos: FindNoCase(searchText, str);
     }
 
+    if (!found && bsFields.test(CItemData::NOTES))
+      afn(itr).ViewField(CItemData::NOTES, search);
+
     if (!found && bsFields.test(CItemData::PWHIST)) {
       size_t pwh_max, err_num;
       PWHistList pwhistlist;